@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "admin.h"
+#include "metrics.h"
+#include "room.h"
+#include "util.h"
+
+/*========================================= ROOMS ==========================================*/
+
+// the oldest backlog among the members, in ms
+static double max_behind_ms(RoomStats* stats, struct _RoomCount* room) {
+	uint64_t max = 0;
+	for (int i = room->first_member; i < room->first_member + room->members; i++) {
+		if (stats->members[i].behind_ns > max) {
+			max = stats->members[i].behind_ns;
+		}
+	}
+	return max / 1e6;
+}
+
+static void print_snapshot_line(FILE* out, RoomStats* stats) {
+	fprintf(out, "snapshot %.1fs old: %d rooms, %d members, %d detached\n",
+	(metrics_now() - stats->taken_at) / 1e9, stats->num_rooms, stats->num_members, stats->detached);
+}
+
+static void print_rooms(FILE* out, RoomStats* stats) {
+	print_snapshot_line(out, stats);
+	fprintf(out, "%8s %8s %9s %10s %12s %12s\n", "room", "members", "detached", "queued", "queued_bytes", "behind_ms");
+	for (int r = 0; r < stats->num_rooms; r++) {
+		struct _RoomCount* room = &stats->rooms[r];
+		int detached = 0;
+		size_t frames = 0;
+		size_t bytes = 0;
+		for (int i = room->first_member; i < room->first_member + room->members; i++) {
+			detached += stats->members[i].fd < 0;
+			frames += stats->members[i].queued_frames;
+			bytes += stats->members[i].queued_bytes;
+		}
+		fprintf(out, "%8d %8d %9d %10zu %12zu %12.1f\n", room->room_number, room->members, detached, frames, bytes,
+		max_behind_ms(stats, room));
+	}
+}
+
+static void print_member(FILE* out, MemberStats* member) {
+	fprintf(out, "%-20s %-15s %6d %8zu %12zu %10.1f %10llu %6u\n", member->username, member->ip, member->fd,
+	member->queued_frames, member->queued_bytes, member->behind_ns / 1e6, (unsigned long long) member->messages,
+	member->recent_messages);
+}
+
+static void print_members(FILE* out, RoomStats* stats, int room_number) {
+	for (int r = 0; r < stats->num_rooms; r++) {
+		struct _RoomCount* room = &stats->rooms[r];
+		if (room->room_number != room_number) {
+			continue;
+		}
+		print_snapshot_line(out, stats);
+		fprintf(out, "%-20s %-15s %6s %8s %12s %10s %10s %6s\n", "username", "ip", "fd", "queued", "queued_bytes",
+		"behind_ms", "messages", "last_s");
+		for (int i = room->first_member; i < room->first_member + room->members; i++) {
+			print_member(out, &stats->members[i]);
+		}
+		return;
+	}
+	fprintf(out, "no room %d\n", room_number);
+}
+
+// most chat lines in the last second first, then most ever
+static int compare_talkers(const void* a, const void* b) {
+	const MemberStats* ma = *(const MemberStats* const*) a;
+	const MemberStats* mb = *(const MemberStats* const*) b;
+	if (ma->recent_messages != mb->recent_messages) {
+		return ma->recent_messages < mb->recent_messages ? 1 : -1;
+	}
+	return (ma->messages < mb->messages) - (ma->messages > mb->messages);
+}
+
+static void print_talkers(FILE* out, RoomStats* stats, int shown) {
+	MemberStats** sorted = (MemberStats**) malloc((stats->num_members + 1) * sizeof(MemberStats*));
+	int* rooms = (int*) malloc((stats->num_members + 1) * sizeof(int));
+	if (sorted == NULL || rooms == NULL) error("ERROR allocating talkers");
+	for (int i = 0; i < stats->num_members; i++) {
+		sorted[i] = &stats->members[i];
+	}
+	for (int r = 0; r < stats->num_rooms; r++) {
+		for (int i = 0; i < stats->rooms[r].members; i++) {
+			rooms[stats->rooms[r].first_member + i] = stats->rooms[r].room_number;
+		}
+	}
+	qsort(sorted, stats->num_members, sizeof(MemberStats*), compare_talkers);
+
+	print_snapshot_line(out, stats);
+	fprintf(out, "%-20s %8s %8s %10s %12s\n", "username", "room", "last_s", "messages", "bytes");
+	for (int i = 0; i < stats->num_members && i < shown; i++) {
+		MemberStats* member = sorted[i];
+		fprintf(out, "%-20s %8d %8u %10llu %12llu\n", member->username, rooms[member - stats->members],
+		member->recent_messages, (unsigned long long) member->messages, (unsigned long long) member->message_bytes);
+	}
+	free(sorted);
+	free(rooms);
+}
+
+/*========================================= THREADS ==========================================*/
+
+typedef struct _ThreadSample {
+	int tid;
+	char name[16];
+	char state;
+	uint64_t cpu_ns; // user + system
+	uint64_t wait_ns; // runnable but waiting for a cpu, when the kernel keeps schedstat
+	double cpu; // percent over the sample
+	double wait;
+} ThreadSample;
+
+static int compare_tids(const void* a, const void* b) {
+	return ((const ThreadSample*) a)->tid - ((const ThreadSample*) b)->tid;
+}
+
+static int compare_load(const void* a, const void* b) {
+	double ca = ((const ThreadSample*) a)->cpu;
+	double cb = ((const ThreadSample*) b)->cpu;
+	return (ca < cb) - (ca > cb);
+}
+
+// every thread of the server, sorted by tid. returns how many, *samples is the caller's to free
+static int sample_threads(ThreadSample** samples) {
+	int count = 0;
+	int max = 64;
+	*samples = (ThreadSample*) malloc(max * sizeof(ThreadSample));
+	if (*samples == NULL) error("ERROR allocating thread samples");
+
+	DIR* dir = opendir("/proc/self/task");
+	if (dir == NULL) {
+		return 0;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		char path[64];
+		snprintf(path, sizeof(path), "/proc/self/task/%.20s/stat", entry->d_name);
+		FILE* file = fopen(path, "r");
+		if (file == NULL) {
+			continue; // exited meanwhile
+		}
+		char line[1024];
+		int ok = fgets(line, sizeof(line), file) != NULL;
+		fclose(file);
+		// tid (comm) state ... utime and stime are the 14th and 15th fields, comm may hold anything
+		char* name_start = strchr(line, '(');
+		char* name_end = strrchr(line, ')');
+		if (!ok || name_start == NULL || name_end == NULL || name_end < name_start) {
+			continue;
+		}
+		if (count == max) {
+			max *= 2;
+			*samples = (ThreadSample*) realloc(*samples, max * sizeof(ThreadSample));
+			if (*samples == NULL) error("ERROR allocating thread samples");
+		}
+		ThreadSample* sample = &(*samples)[count];
+		memset(sample, 0, sizeof(ThreadSample));
+		sample->tid = atoi(line);
+		size_t name_len = name_end - name_start - 1;
+		if (name_len > sizeof(sample->name) - 1) {
+			name_len = sizeof(sample->name) - 1;
+		}
+		memcpy(sample->name, name_start + 1, name_len);
+		unsigned long long utime, stime;
+		if (sscanf(name_end + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &sample->state, &utime,
+		&stime) != 3) {
+			continue;
+		}
+		sample->cpu_ns = (utime + stime) * (1000000000ULL / sysconf(_SC_CLK_TCK));
+		// the same in ns instead of clock ticks, and the time spent waiting to run
+		snprintf(path, sizeof(path), "/proc/self/task/%.20s/schedstat", entry->d_name);
+		file = fopen(path, "r");
+		if (file != NULL) {
+			unsigned long long run, wait;
+			if (fscanf(file, "%llu %llu", &run, &wait) == 2) {
+				sample->cpu_ns = run;
+				sample->wait_ns = wait;
+			}
+			fclose(file);
+		}
+		count++;
+	}
+	closedir(dir);
+	qsort(*samples, count, sizeof(ThreadSample), compare_tids);
+	return count;
+}
+
+// the role a thread's name says it has, for the totals
+static int thread_role(const char* name) {
+	if (strncmp(name, "s:", 2) == 0) return 0;
+	if (strncmp(name, "w:", 2) == 0) return 1;
+	return 2;
+}
+
+// two samples ADMIN_LOAD_SAMPLE_MS apart, a thread's load is what it used in between
+static void print_threads(FILE* out, int shown) {
+	ThreadSample* before;
+	int num_before = sample_threads(&before);
+	struct timespec nap = { ADMIN_LOAD_SAMPLE_MS / 1000, (ADMIN_LOAD_SAMPLE_MS % 1000) * 1000000L };
+	nanosleep(&nap, NULL);
+	ThreadSample* after;
+	int num_after = sample_threads(&after);
+
+	double sample_ns = ADMIN_LOAD_SAMPLE_MS * 1e6;
+	double roles[3] = { 0, 0, 0 };
+	int role_threads[3] = { 0, 0, 0 };
+	double total = 0;
+	for (int i = 0; i < num_after; i++) {
+		ThreadSample* earlier = (ThreadSample*) bsearch(&after[i], before, num_before, sizeof(ThreadSample), compare_tids);
+		if (earlier != NULL && earlier->cpu_ns <= after[i].cpu_ns && earlier->wait_ns <= after[i].wait_ns) {
+			after[i].cpu = 100.0 * (after[i].cpu_ns - earlier->cpu_ns) / sample_ns;
+			after[i].wait = 100.0 * (after[i].wait_ns - earlier->wait_ns) / sample_ns;
+		}
+		total += after[i].cpu;
+		roles[thread_role(after[i].name)] += after[i].cpu;
+		role_threads[thread_role(after[i].name)]++;
+	}
+	qsort(after, num_after, sizeof(ThreadSample), compare_load);
+
+	fprintf(out, "%d threads, %.1f%% cpu over %d ms: %d sessions %.1f%%, %d writers %.1f%%, %d others %.1f%%\n",
+	num_after, total, ADMIN_LOAD_SAMPLE_MS, role_threads[0], roles[0], role_threads[1], roles[1], role_threads[2],
+	roles[2]);
+	fprintf(out, "%8s %-16s %5s %7s %7s %10s\n", "tid", "name", "state", "cpu%", "wait%", "cpu_s");
+	for (int i = 0; i < num_after && i < shown; i++) {
+		fprintf(out, "%8d %-16s %5c %7.1f %7.1f %10.3f\n", after[i].tid, after[i].name, after[i].state, after[i].cpu,
+		after[i].wait, after[i].cpu_ns / 1e9);
+	}
+	free(before);
+	free(after);
+}
+
+/*========================================= COMMANDS ==========================================*/
+
+static void print_help(FILE* out) {
+	fprintf(out, "rooms          rooms with their members and queues\n"
+	"room <n>       a room's members with their queues and lag\n"
+	"threads [n]    the busiest threads right now\n"
+	"talkers [n]    the members sending the most chat lines\n");
+}
+
+static void run_command(FILE* out, char* command) {
+	char* name = strtok(command, " \t\r\n");
+	char* arg = strtok(NULL, " \t\r\n");
+	if (name == NULL || strcmp(name, "help") == 0) {
+		print_help(out);
+		return;
+	}
+	if (strcmp(name, "threads") == 0) {
+		print_threads(out, arg != NULL ? atoi(arg) : ADMIN_THREADS_SHOWN);
+		return;
+	}
+	if (strcmp(name, "rooms") != 0 && strcmp(name, "room") != 0 && strcmp(name, "talkers") != 0) {
+		fprintf(out, "unknown command %s\n", name);
+		print_help(out);
+		return;
+	}
+
+	RoomStats* stats = room_stats_acquire();
+	if (stats == NULL) {
+		fprintf(out, "no snapshot yet, try again in a second\n");
+		return;
+	}
+	if (strcmp(name, "rooms") == 0) {
+		print_rooms(out, stats);
+	} else if (strcmp(name, "room") == 0) {
+		if (arg == NULL || !is_number(arg)) {
+			fprintf(out, "usage: room <n>\n");
+		} else {
+			print_members(out, stats, atoi(arg));
+		}
+	} else {
+		print_talkers(out, stats, arg != NULL ? atoi(arg) : ADMIN_TALKERS_SHOWN);
+	}
+	room_stats_release(stats);
+}
+
+// reads the command line, answers it and that's it for the connection
+static void serve(int fd) {
+	char command[ADMIN_COMMAND_MAX];
+	size_t len = 0;
+	while (len < sizeof(command) - 1) {
+		ssize_t n = recv(fd, command + len, sizeof(command) - 1 - len, 0);
+		if (n <= 0) {
+			break;
+		}
+		len += n;
+		command[len] = '\0';
+		if (strchr(command, '\n') != NULL) {
+			break;
+		}
+	}
+	command[len] = '\0';
+
+	char* answer = NULL;
+	size_t answer_len = 0;
+	FILE* out = open_memstream(&answer, &answer_len);
+	if (out == NULL) error("ERROR opening admin buffer");
+	run_command(out, command);
+	fclose(out);
+
+	size_t sent = 0;
+	while (sent < answer_len) {
+		ssize_t n = send(fd, answer + sent, answer_len - sent, MSG_NOSIGNAL);
+		if (n <= 0) {
+			break;
+		}
+		sent += n;
+	}
+	free(answer);
+}
+
+static void* admin_main(void* args) {
+	int listenfd = *(int*) args;
+	free(args);
+	name_thread("admin");
+
+	while (1) {
+		int fd = accept(listenfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EMFILE || errno == ENFILE) {
+				usleep(100000);
+			}
+			continue;
+		}
+		struct timeval timeout = { ADMIN_TIMEOUT_MS / 1000, (ADMIN_TIMEOUT_MS % 1000) * 1000 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+void admin_start(const char* path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "admin socket path too long: %s\n", path);
+		exit(1);
+	}
+	strcpy(addr.sun_path, path);
+
+	int* listenfd = (int*) malloc(sizeof(int));
+	if (listenfd == NULL) error("ERROR allocating admin arguments");
+	*listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (*listenfd < 0) error("ERROR opening admin socket");
+	// a socket left by an earlier run that didn't clean up
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+	mode_t mask = umask(077);
+	int status = bind(*listenfd, (struct sockaddr*) &addr, sizeof(addr));
+	umask(mask);
+	if (status < 0) error("ERROR binding admin socket");
+	if (listen(*listenfd, 16) < 0) error("ERROR on listen for admin");
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, admin_main, listenfd) != 0) {
+		error("ERROR creating admin thread");
+	}
+	pthread_detach(tid);
+}
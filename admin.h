@@ -0,0 +1,31 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+/* main_server -A <path>: a Unix-domain socket for looking into the running
+ * server. A connection sends one command line and gets a text answer:
+ *   rooms          every room with its members, detached ones and queued frames
+ *   room <n>       the room's members: address, socket, queued frames and bytes,
+ *                  how long they have been behind, chat lines sent
+ *   threads [n]    the n (default ADMIN_THREADS_SHOWN) busiest threads over
+ *                  ADMIN_LOAD_SAMPLE_MS, from /proc: the cpu they used and the
+ *                  time they were runnable but waiting for one. session threads
+ *                  are named s:<username>, writers w:<socket>
+ *   talkers [n]    the n (default ADMIN_TALKERS_SHOWN) members that sent the most
+ *                  chat lines in the last second
+ * e.g. echo rooms | nc -U <path>, or socat - UNIX-CONNECT:<path>
+ *
+ * Room and member answers come from the copy the reaper thread makes every
+ * second (room.h), so each answer is one consistent moment and a query never
+ * takes rooms_mutex or waits on a chat thread. The socket is only for the
+ * server's user (mode 0600).
+ */
+
+#define ADMIN_TIMEOUT_MS 1000 // a client that doesn't send its command in this long is dropped
+#define ADMIN_COMMAND_MAX 256
+#define ADMIN_LOAD_SAMPLE_MS 250
+#define ADMIN_THREADS_SHOWN 20
+#define ADMIN_TALKERS_SHOWN 10
+
+void admin_start(const char* path);
+
+#endif
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include "capture.h"
+#include "transport.h"
+#include "util.h"
+#include "logger.h"
+
+typedef struct _CaptureBuffer {
+	size_t len;
+	struct _CaptureBuffer* next;
+	unsigned char data[CAPTURE_BUFFER_SIZE];
+} CaptureBuffer;
+
+typedef struct _CaptureState {
+	int active;
+	int fd;
+	const Transport* inner; // the transport being captured
+	struct timespec start;
+	uint32_t* conn_ids; // by descriptor, 0 for none. written by the accept loop before the connection's threads exist
+	rlim_t max_fds;
+	uint32_t last_conn;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	CaptureBuffer* current; // being filled
+	CaptureBuffer* free_list;
+	CaptureBuffer* full_head; // waiting for the writer
+	CaptureBuffer* full_tail;
+	uint64_t dropped;
+} CaptureState;
+
+static CaptureState capture;
+static Transport capture_transport;
+
+/*========================================= RECORDING ==========================================*/
+
+static uint64_t capture_time() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) (now.tv_sec - capture.start.tv_sec) * 1000000000ULL + now.tv_nsec - capture.start.tv_nsec;
+}
+
+// hands the buffer being filled to the writer. called with capture.mutex held
+static void queue_current() {
+	if (capture.full_tail == NULL) {
+		capture.full_head = capture.current;
+	} else {
+		capture.full_tail->next = capture.current;
+	}
+	capture.full_tail = capture.current;
+	capture.current->next = NULL;
+	capture.current = NULL;
+	pthread_cond_signal(&capture.cond);
+}
+
+// appends a record, split over several if it doesn't fit one buffer. never blocks on the disk
+static void record(CaptureType type, uint32_t conn, const void* data, size_t len) {
+	CaptureRecord header = { (uint8_t) type, conn, capture_time(), 0 };
+	const unsigned char* cur = (const unsigned char*) data;
+
+	pthread_mutex_lock(&capture.mutex);
+	while (1) {
+		if (capture.current == NULL) {
+			capture.current = capture.free_list;
+			if (capture.current == NULL) {
+				// the writer is CAPTURE_BUFFERS behind
+				capture.dropped++;
+				break;
+			}
+			capture.free_list = capture.current->next;
+			capture.current->len = 0;
+		}
+		size_t take = len < CAPTURE_BUFFER_SIZE - sizeof(header) ? len : CAPTURE_BUFFER_SIZE - sizeof(header);
+		if (capture.current->len + sizeof(header) + take > CAPTURE_BUFFER_SIZE) {
+			queue_current();
+			continue;
+		}
+		header.len = take;
+		memcpy(capture.current->data + capture.current->len, &header, sizeof(header));
+		memcpy(capture.current->data + capture.current->len + sizeof(header), cur, take);
+		capture.current->len += sizeof(header) + take;
+		cur += take;
+		len -= take;
+		if (len == 0) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&capture.mutex);
+}
+
+static uint32_t conn_id(int fd) {
+	return (fd >= 0 && (rlim_t) fd < capture.max_fds) ? capture.conn_ids[fd] : 0;
+}
+
+/*========================================= TRANSPORT ==========================================*/
+
+static int capture_accept(int listenfd, struct sockaddr* addr, socklen_t* addrlen) {
+	struct sockaddr_in peer;
+	socklen_t peerlen = sizeof(peer);
+	memset(&peer, 0, sizeof(peer));
+	int fd = capture.inner->accept(listenfd, (struct sockaddr*) &peer, &peerlen);
+	if (fd < 0) {
+		return fd;
+	}
+	if (addr != NULL && addrlen != NULL) {
+		memcpy(addr, &peer, *addrlen < peerlen ? *addrlen : peerlen);
+		*addrlen = peerlen;
+	}
+	if ((rlim_t) fd < capture.max_fds) {
+		capture.conn_ids[fd] = ++capture.last_conn;
+		record(CAPTURE_OPEN, capture.last_conn, &peer, sizeof(peer));
+	}
+	return fd;
+}
+
+static ssize_t capture_recv(int fd, void* buf, size_t len, int flags) {
+	ssize_t n = capture.inner->recv(fd, buf, len, flags);
+	uint32_t conn = conn_id(fd);
+	if (n > 0 && conn != 0) {
+		record(CAPTURE_DATA, conn, buf, n);
+	}
+	return n;
+}
+
+static int capture_close(int fd) {
+	// forgotten first, the descriptor can be handed out again as soon as it is closed
+	uint32_t conn = conn_id(fd);
+	if (conn != 0) {
+		capture.conn_ids[fd] = 0;
+	}
+	int status = capture.inner->close(fd);
+	if (conn != 0) {
+		record(CAPTURE_CLOSE, conn, NULL, 0);
+	}
+	return status;
+}
+
+void capture_room(int fd, int32_t room_number) {
+	uint32_t conn = capture.active ? conn_id(fd) : 0;
+	if (conn != 0) {
+		record(CAPTURE_ROOM, conn, &room_number, sizeof(room_number));
+	}
+}
+
+/*========================================= WRITER ==========================================*/
+
+static void write_buffer(CaptureBuffer* buffer) {
+	size_t written = 0;
+	while (written < buffer->len) {
+		ssize_t n = write(capture.fd, buffer->data + written, buffer->len - written);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			perror("ERROR writing capture");
+			return;
+		}
+		written += n;
+	}
+}
+
+static void* capture_writer(void* args) {
+	(void) args;
+	name_thread("capture");
+	uint64_t reported = 0;
+
+	pthread_mutex_lock(&capture.mutex);
+	while (1) {
+		if (capture.full_head == NULL) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_nsec += CAPTURE_FLUSH_MS * 1000000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+			if (pthread_cond_timedwait(&capture.cond, &capture.mutex, &deadline) == ETIMEDOUT &&
+			capture.full_head == NULL && capture.current != NULL && capture.current->len > 0) {
+				// quiet for a while, write out what there is
+				queue_current();
+			}
+			continue;
+		}
+
+		CaptureBuffer* buffer = capture.full_head;
+		capture.full_head = buffer->next;
+		if (capture.full_head == NULL) {
+			capture.full_tail = NULL;
+		}
+		uint64_t dropped = capture.dropped;
+		pthread_mutex_unlock(&capture.mutex);
+
+		write_buffer(buffer);
+		if (dropped > reported) {
+			LOG_WARN("Capture: %llu records dropped, the disk is behind", (unsigned long long) dropped);
+			reported = dropped;
+		}
+
+		pthread_mutex_lock(&capture.mutex);
+		buffer->next = capture.free_list;
+		capture.free_list = buffer;
+	}
+
+	return NULL;
+}
+
+void capture_start(const char* path) {
+	capture.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (capture.fd < 0) error("ERROR opening capture file");
+	if (write(capture.fd, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != CAPTURE_MAGIC_LEN) error("ERROR writing capture");
+
+	// connections on descriptors past the limit (or past CAPTURE_MAX_FDS, if there is no limit) aren't captured
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) < 0) error("ERROR getting the descriptor limit");
+	capture.max_fds = limit.rlim_cur < CAPTURE_MAX_FDS ? limit.rlim_cur : CAPTURE_MAX_FDS;
+	capture.conn_ids = (uint32_t*) calloc(capture.max_fds, sizeof(uint32_t));
+	if (capture.conn_ids == NULL) error("ERROR allocating capture connection ids");
+
+	for (int i = 0; i < CAPTURE_BUFFERS; i++) {
+		CaptureBuffer* buffer = (CaptureBuffer*) malloc(sizeof(CaptureBuffer));
+		if (buffer == NULL) error("ERROR allocating capture buffer");
+		buffer->next = capture.free_list;
+		capture.free_list = buffer;
+	}
+
+	pthread_mutex_init(&capture.mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&capture.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	clock_gettime(CLOCK_MONOTONIC, &capture.start);
+
+	capture.inner = transport;
+	capture_transport = *transport;
+	capture_transport.accept = capture_accept;
+	capture_transport.recv = capture_recv;
+	capture_transport.close = capture_close;
+	transport = &capture_transport;
+	capture.active = 1;
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, capture_writer, NULL) != 0) {
+		error("ERROR creating capture writer thread");
+	}
+	pthread_detach(tid);
+}
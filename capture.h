@@ -0,0 +1,54 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+/* Traffic capture (main_server -C <file>): every byte the server reads from a
+ * client, with the connection it came on and when, so chat_replay can play the
+ * traffic back at another server.
+ *
+ * It sits in front of whatever transport the server uses (transport.h), so it
+ * sees each recv() as it returns. Recording is a copy into a shared buffer under
+ * a mutex; a background thread writes the full buffers out. When the disk falls
+ * CAPTURE_BUFFERS buffers behind, records are dropped (and counted) rather than
+ * holding up the server.
+ *
+ * The file is CAPTURE_MAGIC followed by records, each a CaptureRecord header and
+ * len bytes:
+ *   CAPTURE_OPEN   a connection was accepted, the bytes are its sockaddr_in
+ *   CAPTURE_DATA   bytes read from it
+ *   CAPTURE_ROOM   its handshake ended in a room, the bytes are the room number (int32_t)
+ *   CAPTURE_CLOSE  the server closed it
+ * Times are nanoseconds since the capture started, connection ids count up from 1.
+ */
+
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_BUFFER_SIZE (1024 * 1024)
+#define CAPTURE_BUFFERS 8 // in memory at once, filling or waiting for the disk
+#define CAPTURE_FLUSH_MS 100 // a buffer that is not full is written out after this long
+#define CAPTURE_MAX_FDS (1024 * 1024)
+
+typedef enum _CaptureType {
+	CAPTURE_OPEN,
+	CAPTURE_DATA,
+	CAPTURE_ROOM,
+	CAPTURE_CLOSE
+} CaptureType;
+
+#pragma pack(push, 1)
+typedef struct _CaptureRecord {
+	uint8_t type;
+	uint32_t conn;
+	uint64_t time_ns;
+	uint32_t len;
+} CaptureRecord;
+#pragma pack(pop)
+
+// starts capturing into path, wrapping the current transport. call before the first accept()
+void capture_start(const char* path);
+
+// records the room a connection's handshake put it in, no-op when not capturing
+void capture_room(int fd, int32_t room_number);
+
+#endif
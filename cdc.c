@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cdc.h"
+#include "sha256.h"
+
+// a cut needs the top bits of the gear hash to be zero. more of them before the average size
+// and fewer after pulls chunk sizes in towards it (FastCDC's normalized chunking)
+#define CDC_MASK_SMALL 0xffffc00000000000ULL // 18 bits
+#define CDC_MASK_LARGE 0xfffc000000000000ULL // 14 bits
+
+// one random 64 bit value per byte value. every client has to cut the same way, so they
+// come from a fixed seed (splitmix64) rather than the process's random state
+static void gear_table(uint64_t gear[256]) {
+	uint64_t seed = 0x6368617463686174ULL;
+	for (int i = 0; i < 256; i++) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+// length of the chunk starting at data
+static uint64_t cdc_cut(const uint64_t gear[256], const unsigned char* data, uint64_t len) {
+	if (len <= CDC_MIN_CHUNK) {
+		return len;
+	}
+	uint64_t end = len < CDC_MAX_CHUNK ? len : CDC_MAX_CHUNK;
+	uint64_t normal = end < CDC_AVG_CHUNK ? end : CDC_AVG_CHUNK;
+	uint64_t hash = 0;
+	uint64_t i = CDC_MIN_CHUNK;
+	for (; i < normal; i++) {
+		hash = (hash << 1) + gear[data[i]];
+		if ((hash & CDC_MASK_SMALL) == 0) {
+			return i + 1;
+		}
+	}
+	for (; i < end; i++) {
+		hash = (hash << 1) + gear[data[i]];
+		if ((hash & CDC_MASK_LARGE) == 0) {
+			return i + 1;
+		}
+	}
+	return end;
+}
+
+// cuts size bytes of a (mapped) file into chunks and hashes them. returns -1 if out of memory
+int cdc_chunk(const unsigned char* data, uint64_t size, ChunkList* chunks) {
+	memset(chunks, 0, sizeof(ChunkList));
+
+	uint64_t gear[256];
+	gear_table(gear);
+
+	// room for the worst case, every chunk the minimum size
+	uint64_t max_chunks = size / CDC_MIN_CHUNK + 1;
+	chunks->offsets = (uint64_t*) malloc((max_chunks + 1) * sizeof(uint64_t));
+	chunks->hashes = (unsigned char*) malloc(max_chunks * CHUNK_HASH_LEN);
+	if (chunks->offsets == NULL || chunks->hashes == NULL) {
+		cdc_free(chunks);
+		return -1;
+	}
+
+	uint64_t offset = 0;
+	while (offset < size) {
+		uint64_t len = cdc_cut(gear, data + offset, size - offset);
+		chunks->offsets[chunks->count] = offset;
+		sha256(data + offset, len, chunks->hashes + (size_t) chunks->count * CHUNK_HASH_LEN);
+		chunks->count++;
+		offset += len;
+	}
+	chunks->offsets[chunks->count] = size;
+	return 0;
+}
+
+void cdc_free(ChunkList* chunks) {
+	free(chunks->offsets);
+	free(chunks->hashes);
+	memset(chunks, 0, sizeof(ChunkList));
+}
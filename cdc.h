@@ -0,0 +1,27 @@
+#ifndef CDC_H
+#define CDC_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+/* Content-defined chunking. A file is cut where a rolling hash of the last bytes
+ * hits a pattern, not at fixed offsets, so an edit only changes the chunks
+ * around it and the rest of the file still cuts into the same chunks. Each chunk
+ * is named by its SHA-256, which is what the server's chunk store dedups on.
+ */
+
+#define CDC_MIN_CHUNK (16 * 1024)
+#define CDC_AVG_CHUNK (64 * 1024)
+#define CDC_MAX_CHUNK (256 * 1024)
+
+typedef struct _ChunkList {
+	uint32_t count;
+	uint64_t* offsets; // file offset of each chunk, count + 1 entries (the last is the file size)
+	unsigned char* hashes; // count * CHUNK_HASH_LEN bytes
+} ChunkList;
+
+int cdc_chunk(const unsigned char* data, uint64_t size, ChunkList* chunks);
+void cdc_free(ChunkList* chunks);
+
+#endif
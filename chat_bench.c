@@ -0,0 +1,761 @@
+#define _GNU_SOURCE // for memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#include "chatclient.h"
+#include "socket_setup.h"
+#include "histogram.h"
+
+/* Load generator for sizing the server: N clients spread over M rooms, each a
+ * libchatclient session that does the real handshake, chatting at a set rate
+ * with messages of a set size. Every message carries its sender and the time it
+ * was queued, and every client that receives it records how long the fanout
+ * took. Sender and receivers are in this process, so the clocks agree even when
+ * the server is on another machine.
+ *
+ * The first client of each room creates it, the others join. Once everyone is
+ * in, the clients chat for warmup + duration seconds, then stop and wait
+ * BENCH_DRAIN_MS for the last messages before leaving. Only messages sent after
+ * the warmup count. The report is one JSON object on stdout, latencies in
+ * microseconds. A p99 in the tens of milliseconds on loopback is not the
+ * server being slow, it is frames sitting behind Nagle and a delayed ACK:
+ * check that TCP_NODELAY is still set on both ends (conn_create, open_connection).
+ *
+ * With -c it measures reconnect storms instead: each thread starts connect,
+ * handshake, leave cycles at its share of the set rate, without waiting for the
+ * ones in flight. The handshakes take turns asking for JOIN_ROOM, CREATE_NEW_ROOM
+ * and SELECT_ROOM, which is answered with the room list (PENDING) and then a
+ * JOIN_ROOM. It reports the handshakes completed a second, how long the TCP
+ * connect took (a SYN the server's full accept queue dropped shows up as a
+ * retransmit a second or more later), how long the server took to answer the
+ * handshake, and the kernel's listen queue overflow and SYN retransmit counters.
+ *
+ * usage: ./chat_bench [-n clients] [-m rooms] [-r messages/s per client] [-s payload bytes]
+ *        [-d seconds] [-w warmup seconds] [-t threads] <ip-address>
+ *        ./chat_bench -c <handshakes/s> [-k jns] [-d seconds] [-w warmup seconds] [-t threads] <ip-address>
+ */
+
+#define BENCH_MARKER "~bench " // starts every payload: "~bench <sender> <monotonic ns> " and padding
+#define BENCH_MAX_PAYLOAD 255 // the server keeps this much of a chat line and drops the rest
+#define BENCH_CONNECTING 64 // handshakes in flight while setting up
+#define BENCH_SETUP_TIMEOUT_MS 30000 // for a handshake to finish
+#define BENCH_DRAIN_MS 1000
+#define BENCH_EVENTS 64
+#define BENCH_CHURN_IN_FLIGHT 1024 // cycles one thread runs at once, starts beyond that are counted as missed
+#define BENCH_CHURN_TIMEOUT_MS 10000 // for a whole cycle, SYN retransmits included
+
+typedef struct _BenchConfig {
+	int clients;
+	int rooms;
+	int threads;
+	double rate;
+	int payload;
+	double duration;
+	double warmup;
+	double churn; // -c: handshakes a second, 0 for the chat benchmark
+	const char* kinds; // -k: j, n and s for the handshakes churn cycles through
+	// phases, CLOCK_MONOTONIC ns
+	uint64_t measure_from;
+	uint64_t stop_at;
+	uint64_t drain_until;
+} BenchConfig;
+
+struct _Worker;
+
+typedef enum _ChurnKind {
+	CHURN_JOIN, // JOIN_ROOM into the room the bench keeps open
+	CHURN_NEW, // CREATE_NEW_ROOM
+	CHURN_SELECT, // SELECT_ROOM, then JOIN_ROOM into the kept room from the list
+	CHURN_KINDS
+} ChurnKind;
+
+static const char* churn_kind_names[CHURN_KINDS] = { "join_room", "create_new_room", "select_room" };
+
+// one connect, handshake, leave of the churn benchmark. times are CLOCK_MONOTONIC ns, 0 until it happened
+typedef struct _ChurnCycle {
+	ChatSession* session;
+	ChurnKind kind;
+	int measured; // started after the warmup
+	uint64_t started;
+	uint64_t connected;
+	uint64_t joined;
+	uint64_t closed;
+	struct _ChurnCycle* next;
+} ChurnCycle;
+
+typedef struct _BenchClient {
+	int id;
+	int room; // index into room_numbers
+	ChatSession* session;
+	struct _Worker* worker; // NULL during setup
+	uint64_t next_send;
+	int joined;
+	int leaving; // asked to, at the end of the run
+	int closed;
+} BenchClient;
+
+// a thread and the clients it runs, counters are only touched by that thread
+typedef struct _Worker {
+	pthread_t thread;
+	int epfd;
+	BenchClient** clients;
+	int nclients;
+	Histogram latency; // ns, of the measured messages
+	uint64_t sent; // in the measured window
+	uint64_t expected; // deliveries owed for them, one per other member of the room
+	uint64_t delivered;
+	uint64_t delivered_bytes;
+	uint64_t disconnects;
+	// churn, counting the cycles started after the warmup
+	ChurnCycle* cycles; // in flight
+	int in_flight;
+	uint64_t seq;
+	uint64_t started;
+	uint64_t completed;
+	uint64_t failed;
+	uint64_t missed;
+	Histogram connect; // connect() until the socket is up
+	Histogram handshake[CHURN_KINDS]; // first request sent until in the room
+	Histogram cycle; // connect() until the server closed the connection after we left
+} Worker;
+
+BenchConfig config = { 10, 1, 1, 1, 64, 10, 1, 0, "jns", 0, 0, 0 };
+BenchClient* clients = NULL;
+int* room_numbers = NULL; // the server's number for each room
+int* room_members = NULL; // joined clients per room, fixed once the run starts
+Worker* workers = NULL;
+int workers_running = 0;
+struct sockaddr_in serv_addr;
+int churn_in_flight = BENCH_CHURN_IN_FLIGHT; // per thread, lower if we'd run out of descriptors
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// epoll timeout until deadline, rounded up so we don't spin through the last millisecond
+static int ms_until_ns(uint64_t deadline) {
+	uint64_t now = now_ns();
+	return deadline > now ? (int) ((deadline - now + 999999) / 1000000) : 0;
+}
+
+/*========================================= CALLBACKS ==========================================*/
+
+static void on_joined(ChatSession* session, ConnectionConfirmation* cc, void* context) {
+	(void) session;
+	(void) cc;
+	BenchClient* client = (BenchClient*) context;
+	client->joined = 1;
+	room_members[client->room]++;
+}
+
+// the server rendered it as "<color>[user (ip)]:<payload><reset>", the marker is in the payload
+static void on_message(ChatSession* session, const char* text, size_t len, void* context) {
+	(void) session;
+	BenchClient* client = (BenchClient*) context;
+	Worker* worker = client->worker;
+	const char* marker = (const char*) memmem(text, len, BENCH_MARKER, strlen(BENCH_MARKER));
+	if (worker == NULL || marker == NULL) {
+		// join and leave announcements, or chat from before the run
+		return;
+	}
+	uint64_t now = now_ns();
+	char fields[64];
+	size_t n = len - (marker - text) - strlen(BENCH_MARKER);
+	if (n > sizeof(fields) - 1) n = sizeof(fields) - 1;
+	memcpy(fields, marker + strlen(BENCH_MARKER), n);
+	fields[n] = '\0';
+	int sender;
+	unsigned long long sent_at;
+	if (sscanf(fields, "%d %llu", &sender, &sent_at) != 2) {
+		return;
+	}
+	if (sent_at < config.measure_from || sent_at >= config.stop_at) {
+		return;
+	}
+	worker->delivered++;
+	worker->delivered_bytes += len;
+	hist_record(&worker->latency, now > sent_at ? now - sent_at : 0);
+}
+
+static void on_disconnected(ChatSession* session, ChatState state, void* context) {
+	(void) session;
+	(void) state;
+	BenchClient* client = (BenchClient*) context;
+	client->closed = 1;
+	if (client->worker != NULL && !client->leaving) {
+		// the server dropped a client in the middle of the run, it isn't resumed
+		client->worker->disconnects++;
+	}
+}
+
+static const ChatCallbacks bench_callbacks = { NULL, on_joined, on_message, NULL, on_disconnected };
+
+/*========================================= SETUP ==========================================*/
+
+// connects clients [first, last) into their rooms, at most BENCH_CONNECTING at a time. returns the number that got in
+static int connect_clients(struct sockaddr_in* serv_addr, int first, int last) {
+	int epfd = epoll_create1(0);
+	if (epfd < 0) error("ERROR on epoll_create1");
+	int next = first;
+	int in_flight = 0;
+	int joined = 0;
+	uint64_t deadline = now_ns() + BENCH_SETUP_TIMEOUT_MS * 1000000ULL;
+
+	while (next < last || in_flight > 0) {
+		while (next < last && in_flight < BENCH_CONNECTING) {
+			BenchClient* client = &clients[next++];
+			char room[16];
+			if (client->id < config.rooms) {
+				strcpy(room, CREATE_NEW_ROOM_COMMAND);
+			} else {
+				snprintf(room, sizeof(room), "%d", room_numbers[client->room]);
+			}
+			struct epoll_event ev = { EPOLLIN, { .ptr = client } };
+			if (chat_session_connect(client->session, serv_addr, room) < 0 ||
+			epoll_ctl(epfd, EPOLL_CTL_ADD, chat_session_fd(client->session), &ev) < 0) {
+				client->closed = 1;
+				continue;
+			}
+			in_flight++;
+			deadline = now_ns() + BENCH_SETUP_TIMEOUT_MS * 1000000ULL;
+		}
+
+		struct epoll_event events[BENCH_EVENTS];
+		int n = epoll_wait(epfd, events, BENCH_EVENTS, ms_until_ns(deadline));
+		if (n < 0 && errno != EINTR) error("ERROR on epoll_wait");
+		if (n == 0) {
+			fprintf(stderr, "handshakes timed out, %d clients still connecting\n", in_flight);
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			BenchClient* client = (BenchClient*) events[i].data.ptr;
+			chat_session_process(client->session);
+			if (client->joined || client->closed) {
+				epoll_ctl(epfd, EPOLL_CTL_DEL, chat_session_fd(client->session), NULL);
+				in_flight--;
+				joined += client->joined;
+				if (client->id < config.rooms) {
+					room_numbers[client->room] = chat_session_room(client->session);
+				}
+			}
+		}
+	}
+	close(epfd);
+	return joined;
+}
+
+/*========================================= RUN ==========================================*/
+
+static void send_message(Worker* worker, BenchClient* client, uint64_t now) {
+	char payload[BENCH_MAX_PAYLOAD + 1];
+	int len = snprintf(payload, sizeof(payload), BENCH_MARKER "%d %llu ", client->id, (unsigned long long) now);
+	if (len < config.payload) {
+		memset(payload + len, 'x', config.payload - len);
+		len = config.payload;
+	}
+	if (chat_session_send(client->session, payload, len) < 0) {
+		return;
+	}
+	if (now >= config.measure_from && now < config.stop_at) {
+		worker->sent++;
+		worker->expected += room_members[client->room] - 1;
+	}
+}
+
+static void* worker_main(void* arg) {
+	Worker* worker = (Worker*) arg;
+	uint64_t interval = config.rate > 0 ? (uint64_t) (1e9 / config.rate) : 0;
+	uint64_t start = now_ns();
+	unsigned int seed = worker->nclients;
+	for (int i = 0; i < worker->nclients; i++) {
+		// spread the clients over the first interval so they don't all send in step
+		worker->clients[i]->next_send = start + (interval > 0 ? (uint64_t) rand_r(&seed) % interval : 0);
+	}
+
+	struct epoll_event events[BENCH_EVENTS];
+	uint64_t now = start;
+	while (now < config.drain_until) {
+		uint64_t wake_at = config.drain_until;
+		for (int i = 0; i < worker->nclients; i++) {
+			BenchClient* client = worker->clients[i];
+			if (interval == 0 || client->closed) {
+				continue;
+			}
+			// a client that fell behind catches up, the rate is what was asked for
+			while (client->next_send <= now && client->next_send < config.stop_at) {
+				send_message(worker, client, now);
+				client->next_send += interval;
+			}
+			if (client->next_send < config.stop_at && client->next_send < wake_at) {
+				wake_at = client->next_send;
+			}
+		}
+
+		int n = epoll_wait(worker->epfd, events, BENCH_EVENTS, ms_until_ns(wake_at));
+		if (n < 0 && errno != EINTR) error("ERROR on epoll_wait");
+		for (int i = 0; i < n; i++) {
+			chat_session_process(((BenchClient*) events[i].data.ptr)->session);
+		}
+		now = now_ns();
+	}
+
+	// leave, and give the server the drain time again to close the connections
+	int leaving = 0;
+	for (int i = 0; i < worker->nclients; i++) {
+		worker->clients[i]->leaving = 1;
+		leaving += chat_session_leave(worker->clients[i]->session) == 0;
+	}
+	uint64_t deadline = now_ns() + BENCH_DRAIN_MS * 1000000ULL;
+	while (leaving > 0 && now_ns() < deadline) {
+		int n = epoll_wait(worker->epfd, events, BENCH_EVENTS, ms_until_ns(deadline));
+		for (int i = 0; i < n; i++) {
+			BenchClient* client = (BenchClient*) events[i].data.ptr;
+			chat_session_process(client->session);
+			if (chat_session_state(client->session) == CHAT_CLOSED) {
+				epoll_ctl(worker->epfd, EPOLL_CTL_DEL, chat_session_fd(client->session), NULL);
+				leaving--;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*========================================= CHURN ==========================================*/
+
+static void on_churn_rooms(ChatSession* session, ConnectionConfirmation* cc, void* context) {
+	(void) cc;
+	(void) context;
+	char room[16];
+	snprintf(room, sizeof(room), "%d", room_numbers[0]);
+	chat_session_choose_room(session, room);
+}
+
+static void on_churn_joined(ChatSession* session, ConnectionConfirmation* cc, void* context) {
+	(void) cc;
+	ChurnCycle* cycle = (ChurnCycle*) context;
+	cycle->joined = now_ns();
+	chat_session_leave(session);
+}
+
+static void on_churn_disconnected(ChatSession* session, ChatState state, void* context) {
+	(void) session;
+	(void) state;
+	ChurnCycle* cycle = (ChurnCycle*) context;
+	cycle->closed = now_ns();
+}
+
+static const ChatCallbacks churn_callbacks = { on_churn_rooms, on_churn_joined, NULL, NULL, on_churn_disconnected };
+
+static void start_cycle(Worker* worker, uint64_t now) {
+	int measured = now >= config.measure_from;
+	if (worker->in_flight >= churn_in_flight) {
+		worker->missed += measured;
+		return;
+	}
+	ChurnCycle* cycle = (ChurnCycle*) calloc(1, sizeof(ChurnCycle));
+	if (cycle == NULL) error("ERROR allocating churn cycle");
+	char username[MAX_USERNAME_LEN];
+	snprintf(username, sizeof(username), "churn%d.%llu", (int) (worker - workers), (unsigned long long) worker->seq);
+	switch (config.kinds[worker->seq % strlen(config.kinds)]) {
+		case 'n': cycle->kind = CHURN_NEW; break;
+		case 's': cycle->kind = CHURN_SELECT; break;
+		default: cycle->kind = CHURN_JOIN;
+	}
+	worker->seq++;
+	cycle->measured = measured;
+	cycle->started = now;
+	cycle->session = chat_session_create(username, &churn_callbacks, cycle);
+	cycle->next = worker->cycles;
+	worker->cycles = cycle;
+	worker->in_flight++;
+	worker->started += measured;
+
+	char room[16];
+	snprintf(room, sizeof(room), "%d", room_numbers[0]);
+	const char* request = cycle->kind == CHURN_NEW ? CREATE_NEW_ROOM_COMMAND : cycle->kind == CHURN_SELECT ? NULL : room;
+	struct epoll_event ev = { EPOLLIN, { .ptr = cycle } };
+	if (cycle->session == NULL || chat_session_connect(cycle->session, &serv_addr, request) < 0 ||
+	epoll_ctl(worker->epfd, EPOLL_CTL_ADD, chat_session_fd(cycle->session), &ev) < 0) {
+		// out of descriptors most likely, fails when reaped
+		cycle->closed = now;
+	}
+}
+
+// frees the cycles that ended, and with force or past BENCH_CHURN_TIMEOUT_MS the ones that didn't
+static void reap_cycles(Worker* worker, uint64_t now, int force) {
+	ChurnCycle** link = &worker->cycles;
+	while (*link != NULL) {
+		ChurnCycle* cycle = *link;
+		if (cycle->closed == 0 && !force && now - cycle->started < BENCH_CHURN_TIMEOUT_MS * 1000000ULL) {
+			link = &cycle->next;
+			continue;
+		}
+		if (cycle->measured) {
+			if (cycle->joined != 0 && cycle->closed != 0) {
+				worker->completed++;
+				hist_record(&worker->connect, cycle->connected - cycle->started);
+				hist_record(&worker->handshake[cycle->kind], cycle->joined - cycle->connected);
+				hist_record(&worker->cycle, cycle->closed - cycle->started);
+			} else {
+				worker->failed++;
+			}
+		}
+		*link = cycle->next;
+		if (cycle->session != NULL) {
+			epoll_ctl(worker->epfd, EPOLL_CTL_DEL, chat_session_fd(cycle->session), NULL);
+			chat_session_destroy(cycle->session);
+		}
+		free(cycle);
+		worker->in_flight--;
+	}
+}
+
+static void* churn_main(void* arg) {
+	Worker* worker = (Worker*) arg;
+	uint64_t interval = (uint64_t) (1e9 * config.threads / config.churn);
+	// the threads take turns within the interval
+	uint64_t next_start = now_ns() + interval * (worker - workers) / config.threads;
+
+	struct epoll_event events[BENCH_EVENTS];
+	uint64_t now = now_ns();
+	while (now < config.drain_until && (now < config.stop_at || worker->cycles != NULL)) {
+		// open loop: a slow server gets more cycles in flight, not fewer started
+		while (next_start <= now && next_start < config.stop_at) {
+			start_cycle(worker, now);
+			next_start += interval;
+		}
+		uint64_t wake_at = next_start < config.stop_at ? next_start : config.drain_until;
+		if (wake_at > now + 100000000ULL) {
+			wake_at = now + 100000000ULL; // timeouts
+		}
+
+		int n = epoll_wait(worker->epfd, events, BENCH_EVENTS, ms_until_ns(wake_at));
+		if (n < 0 && errno != EINTR) error("ERROR on epoll_wait");
+		for (int i = 0; i < n; i++) {
+			ChurnCycle* cycle = (ChurnCycle*) events[i].data.ptr;
+			uint64_t before = now_ns();
+			chat_session_process(cycle->session);
+			// the first request goes out in the same call that sees the connection is up
+			ChatState state = chat_session_state(cycle->session);
+			if (cycle->connected == 0 && (state == CHAT_HANDSHAKING || cycle->joined != 0)) {
+				cycle->connected = before;
+			}
+		}
+		now = now_ns();
+		reap_cycles(worker, now, 0);
+	}
+	// still running after the drain, they failed
+	reap_cycles(worker, now, 1);
+	__atomic_sub_fetch(&workers_running, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// a TcpExt counter from /proc/net/netstat, for the whole system. -1 if there is none
+static long long tcp_ext_counter(const char* name) {
+	FILE* netstat = fopen("/proc/net/netstat", "r");
+	if (netstat == NULL) {
+		return -1;
+	}
+	// a line of names, then a line of their values
+	char names[8192];
+	char values[8192];
+	long long counter = -1;
+	while (counter < 0 && fgets(names, sizeof(names), netstat) != NULL && fgets(values, sizeof(values), netstat) != NULL) {
+		if (strncmp(names, "TcpExt:", 7) != 0) {
+			continue;
+		}
+		char* names_pos;
+		char* values_pos;
+		char* n = strtok_r(names, " \n", &names_pos);
+		char* v = strtok_r(values, " \n", &values_pos);
+		while (n != NULL && v != NULL) {
+			if (strcmp(n, name) == 0) {
+				counter = atoll(v);
+				break;
+			}
+			n = strtok_r(NULL, " \n", &names_pos);
+			v = strtok_r(NULL, " \n", &values_pos);
+		}
+	}
+	fclose(netstat);
+	return counter;
+}
+
+/*========================================= REPORT ==========================================*/
+
+static void print_latency(const Histogram* hist) {
+	printf("{ \"count\": %llu, \"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f }",
+	(unsigned long long) hist->total, hist->total > 0 ? hist->min / 1e3 : 0, hist_mean(hist) / 1e3,
+	hist_percentile(hist, 50) / 1e3, hist_percentile(hist, 99) / 1e3,
+	hist_percentile(hist, 99.9) / 1e3, hist->max / 1e3);
+}
+
+static void print_report(int connected, double setup_s) {
+	Histogram latency;
+	hist_init(&latency);
+	uint64_t sent = 0, expected = 0, delivered = 0, delivered_bytes = 0, disconnects = 0;
+	for (int i = 0; i < config.threads; i++) {
+		hist_merge(&latency, &workers[i].latency);
+		sent += workers[i].sent;
+		expected += workers[i].expected;
+		delivered += workers[i].delivered;
+		delivered_bytes += workers[i].delivered_bytes;
+		disconnects += workers[i].disconnects;
+	}
+
+	printf("{\n");
+	printf("  \"mode\": \"chat\",\n");
+	printf("  \"clients\": %d,\n  \"rooms\": %d,\n  \"threads\": %d,\n", config.clients, config.rooms, config.threads);
+	printf("  \"rate_per_client\": %g,\n  \"payload_bytes\": %d,\n", config.rate, config.payload);
+	printf("  \"warmup_s\": %g,\n  \"duration_s\": %g,\n", config.warmup, config.duration);
+	printf("  \"connected\": %d,\n  \"setup_s\": %.3f,\n", connected, setup_s);
+	printf("  \"sent\": %llu,\n  \"expected\": %llu,\n  \"delivered\": %llu,\n  \"lost\": %llu,\n",
+	(unsigned long long) sent, (unsigned long long) expected, (unsigned long long) delivered,
+	(unsigned long long) (expected > delivered ? expected - delivered : 0));
+	printf("  \"disconnects\": %llu,\n", (unsigned long long) disconnects);
+	printf("  \"sent_per_s\": %.1f,\n  \"delivered_per_s\": %.1f,\n  \"delivered_bytes_per_s\": %.1f,\n",
+	sent / config.duration, delivered / config.duration, delivered_bytes / config.duration);
+	printf("  \"latency_us\": ");
+	print_latency(&latency);
+	printf("\n}\n");
+}
+
+// counters are the kernel's, over the measured part of the run. -1 where they couldn't be read
+static void print_churn_report(long long overflows, long long drops, long long syn_retransmits) {
+	Histogram connect, cycle, handshake[CHURN_KINDS];
+	hist_init(&connect);
+	hist_init(&cycle);
+	for (int k = 0; k < CHURN_KINDS; k++) {
+		hist_init(&handshake[k]);
+	}
+	uint64_t started = 0, completed = 0, failed = 0, missed = 0;
+	for (int i = 0; i < config.threads; i++) {
+		hist_merge(&connect, &workers[i].connect);
+		hist_merge(&cycle, &workers[i].cycle);
+		for (int k = 0; k < CHURN_KINDS; k++) {
+			hist_merge(&handshake[k], &workers[i].handshake[k]);
+		}
+		started += workers[i].started;
+		completed += workers[i].completed;
+		failed += workers[i].failed;
+		missed += workers[i].missed;
+	}
+
+	printf("{\n");
+	printf("  \"mode\": \"churn\",\n");
+	printf("  \"threads\": %d,\n  \"target_per_s\": %g,\n  \"kinds\": \"%s\",\n", config.threads, config.churn, config.kinds);
+	printf("  \"warmup_s\": %g,\n  \"duration_s\": %g,\n", config.warmup, config.duration);
+	printf("  \"started\": %llu,\n  \"completed\": %llu,\n  \"failed\": %llu,\n  \"missed\": %llu,\n",
+	(unsigned long long) started, (unsigned long long) completed, (unsigned long long) failed, (unsigned long long) missed);
+	printf("  \"handshakes_per_s\": %.1f,\n", completed / config.duration);
+	printf("  \"listen_overflows\": %lld,\n  \"listen_drops\": %lld,\n  \"syn_retransmits\": %lld,\n",
+	overflows, drops, syn_retransmits);
+	printf("  \"connect_us\": ");
+	print_latency(&connect);
+	printf(",\n  \"handshake_us\": {\n");
+	for (int k = 0; k < CHURN_KINDS; k++) {
+		printf("    \"%s\": ", churn_kind_names[k]);
+		print_latency(&handshake[k]);
+		printf(k < CHURN_KINDS - 1 ? ",\n" : "\n");
+	}
+	printf("  },\n  \"cycle_us\": ");
+	print_latency(&cycle);
+	printf("\n}\n");
+}
+
+static void clean_up() {
+	for (int t = 0; t < config.threads; t++) {
+		close(workers[t].epfd);
+		free(workers[t].clients);
+	}
+	for (int i = 0; i < config.clients; i++) {
+		chat_session_destroy(clients[i].session);
+	}
+	free(workers);
+	free(room_members);
+	free(room_numbers);
+	free(clients);
+}
+
+// runs the churn threads, and the client keeping the room open on this one until they are done
+static void run_churn() {
+	workers_running = config.threads;
+	for (int t = 0; t < config.threads; t++) {
+		if (pthread_create(&workers[t].thread, NULL, churn_main, &workers[t]) != 0) {
+			error("ERROR creating worker thread");
+		}
+	}
+
+	// the kernel's counters are read when the measured part starts and ends
+	const char* counters[] = { "ListenOverflows", "ListenDrops", "TCPSynRetrans" };
+	long long before[3] = { -1, -1, -1 };
+	long long after[3] = { -1, -1, -1 };
+	int measuring = 0;
+	int measured = 0;
+	struct pollfd pfd = { chat_session_fd(clients[0].session), POLLIN, 0 };
+	while (__atomic_load_n(&workers_running, __ATOMIC_ACQUIRE) > 0) {
+		uint64_t now = now_ns();
+		if (!measuring && now >= config.measure_from) {
+			for (int i = 0; i < 3; i++) before[i] = tcp_ext_counter(counters[i]);
+			measuring = 1;
+		}
+		if (!measured && now >= config.stop_at) {
+			for (int i = 0; i < 3; i++) after[i] = tcp_ext_counter(counters[i]);
+			measured = 1;
+		}
+		// it has to keep reading everyone coming and going, or the server drops it as too slow
+		if (poll(&pfd, 1, 10) > 0) {
+			chat_session_process(clients[0].session);
+		}
+	}
+	for (int t = 0; t < config.threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+	}
+	if (!measured) {
+		for (int i = 0; i < 3; i++) after[i] = tcp_ext_counter(counters[i]);
+	}
+
+	long long delta[3];
+	for (int i = 0; i < 3; i++) {
+		delta[i] = before[i] >= 0 && after[i] >= 0 ? after[i] - before[i] : -1;
+	}
+	print_churn_report(delta[0], delta[1], delta[2]);
+	clean_up();
+}
+
+int main(int argc, char* argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "n:m:r:s:d:w:t:c:k:")) != -1) {
+		switch (opt) {
+			case 'n': config.clients = atoi(optarg); break;
+			case 'm': config.rooms = atoi(optarg); break;
+			case 'r': config.rate = atof(optarg); break;
+			case 's': config.payload = atoi(optarg); break;
+			case 'd': config.duration = atof(optarg); break;
+			case 'w': config.warmup = atof(optarg); break;
+			case 't': config.threads = atoi(optarg); break;
+			case 'c': config.churn = atof(optarg); break;
+			case 'k': config.kinds = optarg; break;
+			default: argc = 0; // usage below
+		}
+	}
+	if (argc - optind != 1 || config.rooms < 1 || config.clients < config.rooms || config.threads < 1 ||
+	config.rate < 0 || config.duration <= 0 || config.warmup < 0 || config.payload > BENCH_MAX_PAYLOAD ||
+	config.churn < 0 || config.kinds[0] == '\0' || strspn(config.kinds, "jns") != strlen(config.kinds)) {
+		error("ERROR: Invalid arguments\n"
+		"Usage: ./chat_bench [-n clients] [-m rooms] [-r rate] [-s size] [-d duration] [-w warmup] [-t threads] <hostname>\n"
+		"       ./chat_bench -c <rate> [-k kinds] [-d duration] [-w warmup] [-t threads] <hostname>\n"
+		"-n: clients, at least one per room (10)\n"
+		"-m: rooms the clients are spread over (1)\n"
+		"-r: messages a second each client sends, 0 for none (1)\n"
+		"-s: payload bytes per message, at most 255 (64)\n"
+		"-d: seconds measured (10), after -w seconds of warmup (1)\n"
+		"-t: threads running the clients (1)\n"
+		"-c: churn, connect/handshake/leave cycles a second over all threads instead of chatting\n"
+		"-k: handshakes the cycles take turns with, j JOIN_ROOM, n CREATE_NEW_ROOM, s SELECT_ROOM (jns)");
+	}
+	if (config.churn > 0) {
+		// one client keeps the room open that the churning clients join
+		config.clients = 1;
+		config.rooms = 1;
+	} else if (config.threads > config.clients) {
+		config.threads = config.clients;
+	}
+
+	// three descriptors per client
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		if (limit.rlim_cur < limit.rlim_max) {
+			limit.rlim_cur = limit.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &limit);
+		}
+		int fit = (int) ((limit.rlim_cur - 64) / 3 / config.threads);
+		if (fit < churn_in_flight) churn_in_flight = fit;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	set_server_addr(argv[optind], &serv_addr);
+
+	clients = (BenchClient*) calloc(config.clients, sizeof(BenchClient));
+	room_numbers = (int*) calloc(config.rooms, sizeof(int));
+	room_members = (int*) calloc(config.rooms, sizeof(int));
+	workers = (Worker*) calloc(config.threads, sizeof(Worker));
+	if (clients == NULL || room_numbers == NULL || room_members == NULL || workers == NULL) {
+		error("ERROR allocating clients");
+	}
+	for (int i = 0; i < config.clients; i++) {
+		char username[MAX_USERNAME_LEN];
+		snprintf(username, sizeof(username), "bench%d", i);
+		clients[i].id = i;
+		clients[i].room = i % config.rooms;
+		clients[i].session = chat_session_create(username, &bench_callbacks, &clients[i]);
+		if (clients[i].session == NULL) error("ERROR creating session");
+	}
+
+	// the rooms have to exist before anyone can join them
+	uint64_t setup_start = now_ns();
+	if (connect_clients(&serv_addr, 0, config.rooms) < config.rooms) {
+		error("ERROR creating the rooms");
+	}
+	int connected = config.rooms + connect_clients(&serv_addr, config.rooms, config.clients);
+	double setup_s = (now_ns() - setup_start) / 1e9;
+	fprintf(stderr, "%d of %d clients joined in %.2f s\n", connected, config.clients, setup_s);
+
+	uint64_t start = now_ns();
+	config.measure_from = start + (uint64_t) (config.warmup * 1e9);
+	config.stop_at = config.measure_from + (uint64_t) (config.duration * 1e9);
+	config.drain_until = config.stop_at + BENCH_DRAIN_MS * 1000000ULL;
+
+	for (int t = 0; t < config.threads; t++) {
+		Worker* worker = &workers[t];
+		hist_init(&worker->latency);
+		hist_init(&worker->connect);
+		hist_init(&worker->cycle);
+		for (int k = 0; k < CHURN_KINDS; k++) {
+			hist_init(&worker->handshake[k]);
+		}
+		worker->epfd = epoll_create1(0);
+		worker->clients = (BenchClient**) calloc(config.clients / config.threads + 1, sizeof(BenchClient*));
+		if (worker->epfd < 0 || worker->clients == NULL) error("ERROR setting up worker");
+	}
+	if (config.churn > 0) {
+		run_churn();
+		return 0;
+	}
+	for (int i = 0; i < config.clients; i++) {
+		if (!clients[i].joined) {
+			continue;
+		}
+		Worker* worker = &workers[i % config.threads];
+		clients[i].worker = worker;
+		worker->clients[worker->nclients++] = &clients[i];
+		struct epoll_event ev = { EPOLLIN, { .ptr = &clients[i] } };
+		if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, chat_session_fd(clients[i].session), &ev) < 0) {
+			error("ERROR on epoll_ctl");
+		}
+	}
+	for (int t = 0; t < config.threads; t++) {
+		if (pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) != 0) {
+			error("ERROR creating worker thread");
+		}
+	}
+	for (int t = 0; t < config.threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+	}
+
+	print_report(connected, setup_s);
+	clean_up();
+	return 0;
+}
@@ -0,0 +1,644 @@
+#define _GNU_SOURCE // for accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "socket_setup.h"
+#include "util.h"
+
+/* A TCP proxy that makes a bad network out of loopback, for running the
+ * clients or chat_bench through instead of straight at the server. Clients
+ * connect to the proxy's port and every connection gets its own connection to
+ * the server. Bytes read from one side are held back and written to the other
+ * according to the impairments, per connection and per direction:
+ *
+ *   -d delay      milliseconds added to every byte
+ *   -j jitter     up to this many more milliseconds, random per read. bytes never overtake each other, so
+ *                 jitter bunches them up behind a late read like it would on a real link
+ *   -b bandwidth  KiB a second the connection can carry
+ *   -c coalesce   deliver in bursts, everything due within a window of this many milliseconds at once
+ *   -s split      cut reads into pieces of 1 to split bytes, written separately...
+ *   -g gap        ...this many milliseconds apart (0.2), so the far side reads them separately
+ *   -t every:for  stall about every `every` milliseconds (exponentially distributed) for `for` milliseconds
+ *   -w bytes      kernel send and receive buffer size of the proxy's sockets, small to push back sooner
+ *   -o direction  which way the impairments apply: up (client to server), down or both (the default)
+ *
+ * A direction holds at most PROXY_MAX_QUEUED bytes. Beyond that the proxy stops
+ * reading from its source until the far side takes more, so a slow link pushes
+ * back on the sender like TCP would. Everything runs on one thread, with a
+ * timerfd for the next write that is due.
+ *
+ * On SIGINT or SIGTERM it prints one JSON object with what went through.
+ *
+ * usage: ./chat_proxy [-p port] [impairments] <server-ip[:port]>
+ */
+
+#define PROXY_PORT 1005
+#define PROXY_READ_SIZE (64 * 1024)
+#define PROXY_MAX_QUEUED (256 * 1024)
+#define PROXY_EVENTS 64
+#define PROXY_BACKLOG 1024
+#define PROXY_IOV 64 // chunks gathered into one write
+#define SIDE_DONE ((uint32_t) -1) // Side.events once it is out of epoll
+
+typedef struct _Impairment {
+	uint64_t delay_ns;
+	uint64_t jitter_ns;
+	double bandwidth; // bytes a second, 0 for no cap
+	uint64_t coalesce_ns;
+	size_t split;
+	uint64_t gap_ns;
+	uint64_t stall_every_ns;
+	uint64_t stall_for_ns;
+} Impairment;
+
+// bytes read at once, written at deliver_at
+typedef struct _Chunk {
+	uint64_t deliver_at;
+	size_t len;
+	size_t sent;
+	struct _Chunk* next;
+	unsigned char data[];
+} Chunk;
+
+struct _ProxyConn;
+
+// one direction of a proxied connection
+typedef struct _Pipe {
+	struct _ProxyConn* conn;
+	const Impairment* impairment;
+	int src;
+	int dst;
+	Chunk* head;
+	Chunk* tail;
+	size_t queued;
+	uint64_t last_deliver; // no byte goes out before the ones read earlier
+	uint64_t link_free; // when the bandwidth cap has sent what is queued
+	uint64_t next_stall;
+	uint64_t stall_until;
+	uint64_t rng;
+	int eof; // the source is done, shut the destination down once the queue is empty
+	int blocked; // the last write to dst would have blocked
+	struct _Pipe* prev_pending; // in the list of pipes with something queued
+	struct _Pipe* next_pending;
+	int pending;
+} Pipe;
+
+// a side of a connection, what epoll hands back
+typedef struct _Side {
+	struct _ProxyConn* conn;
+	int fd;
+	Pipe* in; // reads from this side
+	Pipe* out; // writes to this side
+	uint32_t events; // registered with epoll
+} Side;
+
+typedef struct _ProxyConn {
+	Side client;
+	Side server;
+	Pipe up;
+	Pipe down;
+	int closed;
+	struct _ProxyConn* next_dead;
+} ProxyConn;
+
+static Impairment up_impairment, down_impairment;
+static int sockbuf;
+static uint64_t seed = 1;
+static int epfd, timerfd;
+static struct sockaddr_in server_addr;
+static Pipe* pending_head;
+static ProxyConn* graveyard; // closed during this round of events, freed after it
+static volatile sig_atomic_t stopping;
+static uint64_t connections, open_conns, connect_failures, bytes_up, bytes_down, stalls, writes, backpressured;
+
+static uint64_t monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t splitmix64(uint64_t* state) {
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+// uniform in [0, 1)
+static double uniform(uint64_t* rng) {
+	return (splitmix64(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t ms_to_ns(const char* ms) {
+	return (uint64_t) (atof(ms) * 1e6);
+}
+
+/*========================================= SCHEDULE ==========================================*/
+
+static void set_pending(Pipe* pipe, int pending) {
+	if (pipe->pending == pending) {
+		return;
+	}
+	pipe->pending = pending;
+	if (pending) {
+		pipe->prev_pending = NULL;
+		pipe->next_pending = pending_head;
+		if (pending_head != NULL) {
+			pending_head->prev_pending = pipe;
+		}
+		pending_head = pipe;
+	} else {
+		if (pipe->prev_pending != NULL) {
+			pipe->prev_pending->next_pending = pipe->next_pending;
+		} else {
+			pending_head = pipe->next_pending;
+		}
+		if (pipe->next_pending != NULL) {
+			pipe->next_pending->prev_pending = pipe->prev_pending;
+		}
+	}
+}
+
+static void queue_chunk(Pipe* pipe, const unsigned char* data, size_t len, uint64_t deliver_at) {
+	Chunk* chunk = (Chunk*) malloc(sizeof(Chunk) + len);
+	if (chunk == NULL) error("ERROR allocating chunk");
+	memcpy(chunk->data, data, len);
+	chunk->len = len;
+	chunk->sent = 0;
+	chunk->next = NULL;
+	chunk->deliver_at = deliver_at;
+	if (pipe->tail == NULL) {
+		pipe->head = chunk;
+	} else {
+		pipe->tail->next = chunk;
+	}
+	pipe->tail = chunk;
+	pipe->queued += len;
+	set_pending(pipe, 1);
+}
+
+// when a read's bytes are due at the far side
+static void schedule(Pipe* pipe, const unsigned char* data, size_t len, uint64_t now) {
+	const Impairment* imp = pipe->impairment;
+	uint64_t departure = now;
+	if (imp->bandwidth > 0) {
+		// serialized behind what is already on the link
+		departure = (pipe->link_free > now ? pipe->link_free : now) + (uint64_t) (len * 1e9 / imp->bandwidth);
+		pipe->link_free = departure;
+	}
+	uint64_t deliver_at = departure + imp->delay_ns;
+	if (imp->jitter_ns > 0) {
+		deliver_at += (uint64_t) (uniform(&pipe->rng) * imp->jitter_ns);
+	}
+	if (imp->coalesce_ns > 0) {
+		deliver_at = (deliver_at + imp->coalesce_ns - 1) / imp->coalesce_ns * imp->coalesce_ns;
+	}
+	if (deliver_at < pipe->last_deliver) {
+		deliver_at = pipe->last_deliver;
+	}
+
+	if (imp->split == 0) {
+		queue_chunk(pipe, data, len, deliver_at);
+	} else {
+		while (len > 0) {
+			size_t piece = 1 + splitmix64(&pipe->rng) % imp->split;
+			if (piece > len) {
+				piece = len;
+			}
+			queue_chunk(pipe, data, piece, deliver_at);
+			data += piece;
+			len -= piece;
+			deliver_at += imp->gap_ns;
+		}
+	}
+	pipe->last_deliver = deliver_at;
+}
+
+// the end of the stall now falls in, 0 when not stalled. stalls are only worked out when something is to be written
+static uint64_t stalled_until(Pipe* pipe, uint64_t now) {
+	const Impairment* imp = pipe->impairment;
+	if (imp->stall_every_ns == 0) {
+		return 0;
+	}
+	while (now >= pipe->next_stall) {
+		pipe->stall_until = pipe->next_stall + imp->stall_for_ns;
+		pipe->next_stall = pipe->stall_until + (uint64_t) (-log(1.0 - uniform(&pipe->rng)) * imp->stall_every_ns);
+		stalls++;
+	}
+	return now < pipe->stall_until ? pipe->stall_until : 0;
+}
+
+/*========================================= CONNECTIONS ==========================================*/
+
+static void update_events(Side* side) {
+	if (side->fd < 0 || side->events == SIDE_DONE) {
+		return;
+	}
+	if (side->in->eof && side->out->eof && side->out->head == NULL) {
+		// read to the end and shut down, only a hangup would still be reported for it
+		if (epoll_ctl(epfd, EPOLL_CTL_DEL, side->fd, NULL) < 0) error("ERROR removing socket from epoll");
+		side->events = SIDE_DONE;
+		return;
+	}
+	uint32_t events = 0;
+	if (!side->in->eof && side->in->queued < PROXY_MAX_QUEUED) {
+		events |= EPOLLIN;
+	}
+	if (side->out->blocked) {
+		events |= EPOLLOUT;
+	}
+	if (events != side->events) {
+		struct epoll_event ev = { .events = events, .data.ptr = side };
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, side->fd, &ev) < 0) error("ERROR updating epoll");
+		side->events = events;
+	}
+}
+
+static void free_pipe(Pipe* pipe) {
+	set_pending(pipe, 0);
+	while (pipe->head != NULL) {
+		Chunk* next = pipe->head->next;
+		free(pipe->head);
+		pipe->head = next;
+	}
+	pipe->tail = NULL;
+	pipe->queued = 0;
+}
+
+static void close_conn(ProxyConn* conn) {
+	if (conn->closed) {
+		return;
+	}
+	conn->closed = 1;
+	free_pipe(&conn->up);
+	free_pipe(&conn->down);
+	close(conn->client.fd);
+	close(conn->server.fd);
+	conn->client.fd = conn->server.fd = -1;
+	open_conns--;
+	conn->next_dead = graveyard;
+	graveyard = conn;
+}
+
+static void init_pipe(Pipe* pipe, ProxyConn* conn, const Impairment* imp, int src, int dst, uint64_t now) {
+	pipe->conn = conn;
+	pipe->impairment = imp;
+	pipe->src = src;
+	pipe->dst = dst;
+	pipe->rng = seed ^ (connections * 2 + (imp == &down_impairment));
+	if (imp->stall_every_ns > 0) {
+		pipe->next_stall = now + (uint64_t) (-log(1.0 - uniform(&pipe->rng)) * imp->stall_every_ns);
+	}
+}
+
+static void set_sockopts(int fd) {
+	int yes = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	if (sockbuf > 0) {
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sockbuf, sizeof(sockbuf));
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sockbuf, sizeof(sockbuf));
+	}
+}
+
+static void accept_conn(int listenfd, uint64_t now) {
+	int clientfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (clientfd < 0) {
+		return;
+	}
+	int serverfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (serverfd < 0) {
+		perror("ERROR opening socket");
+		close(clientfd);
+		return;
+	}
+	set_sockopts(clientfd);
+	set_sockopts(serverfd);
+	if (connect(serverfd, (struct sockaddr*) &server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+		connect_failures++;
+		close(clientfd);
+		close(serverfd);
+		return;
+	}
+
+	ProxyConn* conn = (ProxyConn*) calloc(1, sizeof(ProxyConn));
+	if (conn == NULL) error("ERROR allocating connection");
+	connections++;
+	open_conns++;
+	init_pipe(&conn->up, conn, &up_impairment, clientfd, serverfd, now);
+	init_pipe(&conn->down, conn, &down_impairment, serverfd, clientfd, now);
+	conn->client = (Side) { conn, clientfd, &conn->up, &conn->down, EPOLLIN };
+	// nothing is read from or written to the server until the connect completes
+	conn->up.blocked = 1;
+	conn->server = (Side) { conn, serverfd, &conn->down, &conn->up, EPOLLIN | EPOLLOUT };
+
+	struct epoll_event ev = { .events = conn->client.events, .data.ptr = &conn->client };
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, clientfd, &ev) < 0) error("ERROR adding socket to epoll");
+	ev = (struct epoll_event) { .events = conn->server.events, .data.ptr = &conn->server };
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, serverfd, &ev) < 0) error("ERROR adding socket to epoll");
+}
+
+static void read_side(Side* side, uint64_t now) {
+	Pipe* pipe = side->in;
+	unsigned char buffer[PROXY_READ_SIZE];
+	while (!pipe->eof && pipe->queued < PROXY_MAX_QUEUED) {
+		ssize_t n = recv(side->fd, buffer, sizeof(buffer), 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (n < 0) {
+			close_conn(side->conn);
+			return;
+		}
+		if (n == 0) {
+			// passed on in order, after what is still queued
+			pipe->eof = 1;
+			set_pending(pipe, 1);
+			break;
+		}
+		schedule(pipe, buffer, n, now);
+		if (side == &side->conn->client) {
+			bytes_up += n;
+		} else {
+			bytes_down += n;
+		}
+	}
+	if (pipe->queued >= PROXY_MAX_QUEUED) {
+		backpressured++;
+	}
+	update_events(side);
+}
+
+// writes what is due. returns when the next write is due, 0 for nothing to wait for
+static uint64_t write_pipe(Pipe* pipe, uint64_t now) {
+	if (pipe->conn->closed || pipe->blocked) {
+		return 0;
+	}
+	Side* dst_side = pipe == &pipe->conn->up ? &pipe->conn->server : &pipe->conn->client;
+	Side* src_side = pipe == &pipe->conn->up ? &pipe->conn->client : &pipe->conn->server;
+
+	while (pipe->head != NULL) {
+		if (pipe->head->deliver_at > now) {
+			return pipe->head->deliver_at;
+		}
+		uint64_t stall = stalled_until(pipe, now);
+		if (stall != 0) {
+			return stall;
+		}
+		// whatever else is due goes out in the same write, unless reads are being split up
+		struct iovec iov[PROXY_IOV];
+		int iovcnt = 0;
+		for (Chunk* chunk = pipe->head; chunk != NULL && chunk->deliver_at <= now && iovcnt < PROXY_IOV; chunk = chunk->next) {
+			iov[iovcnt].iov_base = chunk->data + chunk->sent;
+			iov[iovcnt].iov_len = chunk->len - chunk->sent;
+			iovcnt++;
+			if (pipe->impairment->split > 0) {
+				break;
+			}
+		}
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		ssize_t n = sendmsg(pipe->dst, &msg, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// the far side isn't reading, EPOLLOUT says when it does
+			pipe->blocked = 1;
+			update_events(dst_side);
+			return 0;
+		}
+		if (n < 0) {
+			close_conn(pipe->conn);
+			return 0;
+		}
+		writes++;
+		while (n > 0) {
+			Chunk* chunk = pipe->head;
+			size_t take = chunk->len - chunk->sent < (size_t) n ? chunk->len - chunk->sent : (size_t) n;
+			chunk->sent += take;
+			n -= take;
+			if (chunk->sent < chunk->len) {
+				break;
+			}
+			pipe->head = chunk->next;
+			if (pipe->head == NULL) {
+				pipe->tail = NULL;
+			}
+			pipe->queued -= chunk->len;
+			free(chunk);
+		}
+	}
+
+	set_pending(pipe, 0);
+	if (pipe->eof) {
+		shutdown(pipe->dst, SHUT_WR);
+		if (pipe->conn->up.eof && pipe->conn->down.eof && pipe->conn->up.head == NULL && pipe->conn->down.head == NULL) {
+			close_conn(pipe->conn);
+			return 0;
+		}
+	}
+	// room again to read
+	update_events(src_side);
+	return 0;
+}
+
+static void write_side(Side* side, uint64_t now) {
+	if (side->out->blocked) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(side->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+			// the connect to the server failed
+			connect_failures++;
+			close_conn(side->conn);
+			return;
+		}
+		side->out->blocked = 0;
+		update_events(side);
+	}
+	write_pipe(side->out, now);
+}
+
+/*========================================= MAIN ==========================================*/
+
+static void on_signal(int sig) {
+	(void) sig;
+	stopping = 1;
+}
+
+static void print_report() {
+	printf("{\n");
+	printf("  \"connections\": %llu,\n  \"open\": %llu,\n  \"connect_failures\": %llu,\n", (unsigned long long) connections,
+	(unsigned long long) open_conns, (unsigned long long) connect_failures);
+	printf("  \"bytes_up\": %llu,\n  \"bytes_down\": %llu,\n  \"writes\": %llu,\n", (unsigned long long) bytes_up,
+	(unsigned long long) bytes_down, (unsigned long long) writes);
+	printf("  \"stalls\": %llu,\n  \"backpressured\": %llu\n", (unsigned long long) stalls, (unsigned long long) backpressured);
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void usage(char* name) {
+	fprintf(stderr,
+	"usage: %s [-p port] [-d delay] [-j jitter] [-b bandwidth] [-c coalesce] [-s split] [-g gap] [-t every:for] [-w bytes]\n"
+	"       [-o up|down|both] [-x seed] <server-ip[:port]>\n"
+	"times in milliseconds, bandwidth in KiB a second, see chat_proxy.c\n", name);
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	int port = PROXY_PORT;
+	const char* direction = "both";
+	Impairment imp;
+	memset(&imp, 0, sizeof(imp));
+	imp.gap_ns = 200000;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "p:d:j:b:c:s:g:t:w:o:x:")) != -1) {
+		switch (opt) {
+			case 'p': port = atoi(optarg); break;
+			case 'd': imp.delay_ns = ms_to_ns(optarg); break;
+			case 'j': imp.jitter_ns = ms_to_ns(optarg); break;
+			case 'b': imp.bandwidth = atof(optarg) * 1024; break;
+			case 'c': imp.coalesce_ns = ms_to_ns(optarg); break;
+			case 's': imp.split = (size_t) atol(optarg); break;
+			case 'g': imp.gap_ns = ms_to_ns(optarg); break;
+			case 't': {
+				char* colon = strchr(optarg, ':');
+				if (colon == NULL) usage(argv[0]);
+				imp.stall_every_ns = ms_to_ns(optarg);
+				imp.stall_for_ns = ms_to_ns(colon + 1);
+				break;
+			}
+			case 'w': sockbuf = atoi(optarg); break;
+			case 'o': direction = optarg; break;
+			case 'x': seed = strtoull(optarg, NULL, 10); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1) {
+		usage(argv[0]);
+	}
+	if (strcmp(direction, "up") == 0 || strcmp(direction, "both") == 0) {
+		up_impairment = imp;
+	}
+	if (strcmp(direction, "down") == 0 || strcmp(direction, "both") == 0) {
+		down_impairment = imp;
+	}
+	if (strcmp(direction, "up") != 0 && strcmp(direction, "down") != 0 && strcmp(direction, "both") != 0) {
+		usage(argv[0]);
+	}
+	set_server_addr(argv[optind], &server_addr);
+
+	signal(SIGPIPE, SIG_IGN);
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenfd < 0) error("ERROR opening socket");
+	int yes = 1;
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+	struct sockaddr_in listen_addr;
+	memset(&listen_addr, 0, sizeof(listen_addr));
+	listen_addr.sin_family = AF_INET;
+	listen_addr.sin_addr.s_addr = INADDR_ANY;
+	listen_addr.sin_port = htons(port);
+	if (bind(listenfd, (struct sockaddr*) &listen_addr, sizeof(listen_addr)) < 0) error("ERROR on binding");
+	if (listen(listenfd, PROXY_BACKLOG) < 0) error("ERROR on listen");
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) error("ERROR creating epoll instance");
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerfd < 0) error("ERROR creating timer");
+	// the listener and the timer are told apart from the sides by their data.ptr
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listenfd };
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) error("ERROR adding listener to epoll");
+	ev = (struct epoll_event) { .events = EPOLLIN, .data.ptr = &timerfd };
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev) < 0) error("ERROR adding timer to epoll");
+
+	while (!stopping) {
+		struct epoll_event events[PROXY_EVENTS];
+		int n = epoll_wait(epfd, events, PROXY_EVENTS, -1);
+		if (n < 0 && errno != EINTR) error("ERROR waiting on epoll");
+		uint64_t now = monotonic_ns();
+
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr == &listenfd) {
+				for (int j = 0; j < PROXY_EVENTS; j++) {
+					accept_conn(listenfd, now);
+				}
+				continue;
+			}
+			if (events[i].data.ptr == &timerfd) {
+				uint64_t expirations;
+				if (read(timerfd, &expirations, sizeof(expirations)) < 0) {
+					// spurious, the timer was moved since
+				}
+				continue;
+			}
+			Side* side = (Side*) events[i].data.ptr;
+			if (side->conn->closed) {
+				continue;
+			}
+			if (events[i].events & EPOLLERR) {
+				// reset, or the connect to the server failed
+				if (side == &side->conn->server && side->out->blocked && side->conn->up.queued == 0) {
+					connect_failures++;
+				}
+				close_conn(side->conn);
+				continue;
+			}
+			if (events[i].events & EPOLLOUT) {
+				write_side(side, now);
+			}
+			if (!side->conn->closed && (events[i].events & (EPOLLIN | EPOLLHUP))) {
+				read_side(side, now);
+			}
+		}
+
+		// everything due goes out, and the timer is set for whatever is due next
+		uint64_t next = 0;
+		Pipe* pipe = pending_head;
+		while (pipe != NULL) {
+			Pipe* next_pipe = pipe->next_pending;
+			uint64_t due = write_pipe(pipe, now);
+			if (due != 0 && (next == 0 || due < next)) {
+				next = due;
+			}
+			pipe = next_pipe;
+		}
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		if (next != 0) {
+			its.it_value.tv_sec = next / 1000000000ULL;
+			its.it_value.tv_nsec = next % 1000000000ULL;
+		}
+		if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) error("ERROR setting timer");
+
+		while (graveyard != NULL) {
+			ProxyConn* next_dead = graveyard->next_dead;
+			free(graveyard);
+			graveyard = next_dead;
+		}
+	}
+
+	print_report();
+	return 0;
+}
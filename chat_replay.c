@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+#include "handshake.h"
+#include "socket_setup.h"
+#include "histogram.h"
+#include "util.h"
+
+/* Plays a capture taken with main_server -C back at a server: every captured
+ * connection is opened again and sends the same bytes, at the captured times
+ * (-x 1, the default), N times as fast (-x N) or as fast as the server takes
+ * them (-x 0). Whatever the server sends back is read and dropped, apart from
+ * the handshake confirmations.
+ *
+ * Rooms are numbered by the server in the order they are created, so a replay
+ * at a fresh server gets its rooms numbered differently when they are created
+ * in a different order (or the capture started while rooms already existed).
+ * The capture records which room each handshake ended in, and a JOIN_ROOM for a
+ * room the capture created is rewritten to the number that room got this time,
+ * waiting for it if its creator's handshake hasn't finished yet. Rooms that were
+ * there before the capture keep their numbers. A RESUME_SESSION can't succeed, the
+ * tokens are the old server's.
+ *
+ * The report is one JSON object on stdout: what was replayed, how long it took,
+ * and how late the records went out against their schedule, in microseconds.
+ *
+ * usage: ./chat_replay [-x speed] <capture-file> <ip-address>
+ */
+
+#define REPLAY_EVENTS 64
+#define REPLAY_POLL_MS 100
+#define REPLAY_MAX_QUEUED (64 * 1024 * 1024) // bytes waiting to be sent before reading further into the capture
+
+typedef struct _ReplayConn {
+	uint32_t id;
+	int fd; // -1 once closed
+	unsigned char* out; // captured bytes not sent yet
+	size_t out_len;
+	size_t out_sent;
+	size_t out_cap;
+	int held; // a JOIN_ROOM at hold_offset waits for its room's number
+	size_t hold_offset;
+	ConnectionRequest hold_request;
+	unsigned char request[sizeof(ConnectionRequest)]; // the handshake request being put together
+	size_t request_len;
+	int in_handshake; // in the capture, until its CAPTURE_ROOM
+	int created; // its last request was CREATE_NEW_ROOM
+	int32_t recorded_room; // where the capture's handshake ended, 0 until then
+	int32_t live_room; // where this one's ended, 0 until then
+	int confirmations; // expected from the server
+	unsigned char cc[sizeof(ConnectionConfirmation)];
+	size_t cc_len;
+	int closing; // the capture closed it: close once out is sent
+} ReplayConn;
+
+static double speed = 1.0;
+static struct sockaddr_in serv_addr;
+static int epfd;
+static ReplayConn** conns; // by capture connection id
+static uint32_t num_conns;
+static int32_t* room_map; // capture room number to the live one, 0 for not known
+static int32_t num_rooms;
+static size_t queued; // bytes in every out buffer
+static int open_conns;
+static uint64_t records, data_records, connections, bytes_sent, bytes_received;
+static uint64_t connect_failures, handshake_failures, resets;
+static Histogram lateness;
+
+static uint64_t monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*========================================= ROOMS ==========================================*/
+
+static void grow_rooms(int32_t room) {
+	if (room < num_rooms) {
+		return;
+	}
+	int32_t n = num_rooms > 0 ? num_rooms : 64;
+	while (n <= room) {
+		n *= 2;
+	}
+	room_map = (int32_t*) realloc(room_map, n * sizeof(int32_t));
+	if (room_map == NULL) error("ERROR allocating room map");
+	memset(room_map + num_rooms, 0, (n - num_rooms) * sizeof(int32_t));
+	num_rooms = n;
+}
+
+static void flush_conn(ReplayConn* conn);
+
+// the capture's room number turned out to be live_room this time, let the joins waiting on it go
+static void map_room(int32_t recorded, int32_t live) {
+	if (recorded <= 0) {
+		return;
+	}
+	grow_rooms(recorded);
+	room_map[recorded] = live;
+	for (uint32_t i = 1; i <= num_conns; i++) {
+		ReplayConn* conn = conns[i];
+		if (conn != NULL && conn->held && conn->hold_request.room_number == recorded) {
+			conn->hold_request.room_number = live;
+			Buffer cr_buffer = { conn->out + conn->hold_offset, sizeof(ConnectionRequest) };
+			serialize_connection_request(&cr_buffer, &conn->hold_request);
+			conn->held = 0;
+			flush_conn(conn);
+		}
+	}
+}
+
+// a room some handshake in the capture created, whose creator hasn't got its number from the server yet
+static int room_pending(int32_t recorded) {
+	for (uint32_t i = 1; i <= num_conns; i++) {
+		ReplayConn* conn = conns[i];
+		if (conn != NULL && conn->created && conn->recorded_room == recorded && conn->live_room == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*========================================= CONNECTIONS ==========================================*/
+
+static void close_conn(ReplayConn* conn) {
+	if (conn->fd < 0) {
+		return;
+	}
+	close(conn->fd);
+	conn->fd = -1;
+	queued -= conn->out_len - conn->out_sent;
+	free(conn->out);
+	conn->out = NULL;
+	conn->out_len = conn->out_sent = conn->out_cap = 0;
+	conn->held = 0;
+	open_conns--;
+	if (conn->created && conn->recorded_room > 0 && conn->live_room == 0) {
+		// its room never got made, the joins waiting on it go out as they were captured and fail
+		map_room(conn->recorded_room, conn->recorded_room);
+	}
+}
+
+// the capture closed it: close once everything is sent and the confirmations are read,
+// joins may be waiting for the number of the room it created
+static void close_if_done(ReplayConn* conn) {
+	if (conn->fd >= 0 && conn->closing && conn->out_len == 0 && conn->confirmations == 0) {
+		close_conn(conn);
+	}
+}
+
+static void append_out(ReplayConn* conn, const void* data, size_t len) {
+	if (conn->out_len + len > conn->out_cap) {
+		size_t cap = conn->out_cap > 0 ? conn->out_cap : 4096;
+		while (cap < conn->out_len + len) {
+			cap *= 2;
+		}
+		conn->out = (unsigned char*) realloc(conn->out, cap);
+		if (conn->out == NULL) error("ERROR allocating replay buffer");
+		conn->out_cap = cap;
+	}
+	memcpy(conn->out + conn->out_len, data, len);
+	conn->out_len += len;
+	queued += len;
+}
+
+// sends what it can without blocking, up to a held request
+static void flush_conn(ReplayConn* conn) {
+	while (conn->fd >= 0) {
+		size_t limit = conn->held ? conn->hold_offset : conn->out_len;
+		if (conn->out_sent == limit) {
+			break;
+		}
+		ssize_t n = send(conn->fd, conn->out + conn->out_sent, limit - conn->out_sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		if (n <= 0) {
+			resets++;
+			close_conn(conn);
+			return;
+		}
+		conn->out_sent += n;
+		bytes_sent += n;
+		queued -= n;
+	}
+	if (conn->fd >= 0 && conn->out_sent == conn->out_len) {
+		conn->out_sent = conn->out_len = 0;
+		close_if_done(conn);
+	}
+}
+
+static void open_conn(uint32_t id) {
+	if (id > num_conns) {
+		conns = (ReplayConn**) realloc(conns, (id + 1) * sizeof(ReplayConn*));
+		if (conns == NULL) error("ERROR allocating replay connections");
+		memset(conns + num_conns + 1, 0, (id - num_conns) * sizeof(ReplayConn*));
+		num_conns = id;
+	}
+	ReplayConn* conn = (ReplayConn*) calloc(1, sizeof(ReplayConn));
+	if (conn == NULL) error("ERROR allocating replay connection");
+	conn->id = id;
+	conn->in_handshake = 1;
+	conns[id] = conn;
+	connections++;
+
+	conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (conn->fd < 0) error("ERROR opening socket");
+	if (connect(conn->fd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) < 0 && errno != EINPROGRESS) {
+		connect_failures++;
+		close(conn->fd);
+		conn->fd = -1;
+		return;
+	}
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = conn };
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) error("ERROR adding socket to epoll");
+	open_conns++;
+}
+
+// a whole handshake request from the capture: queued, rewritten or held for its room
+static void queue_request(ReplayConn* conn) {
+	ConnectionRequest cr;
+	Buffer cr_buffer = { conn->request, sizeof(ConnectionRequest) };
+	deserialize_connection_request(&cr, &cr_buffer);
+	conn->request_len = 0;
+	conn->created = (cr.type == CREATE_NEW_ROOM);
+	conn->confirmations++;
+
+	if (cr.type == JOIN_ROOM && cr.room_number > 0) {
+		grow_rooms(cr.room_number);
+		if (room_map[cr.room_number] != 0) {
+			cr.room_number = room_map[cr.room_number];
+		} else if (room_pending(cr.room_number)) {
+			conn->held = 1;
+			conn->hold_offset = conn->out_len;
+			conn->hold_request = cr;
+		}
+		serialize_connection_request(&cr_buffer, &cr);
+	}
+	append_out(conn, conn->request, sizeof(ConnectionRequest));
+}
+
+static void replay_data(ReplayConn* conn, const unsigned char* data, size_t len) {
+	data_records++;
+	while (conn->in_handshake && len > 0) {
+		size_t take = sizeof(ConnectionRequest) - conn->request_len;
+		if (take > len) {
+			take = len;
+		}
+		memcpy(conn->request + conn->request_len, data, take);
+		conn->request_len += take;
+		data += take;
+		len -= take;
+		if (conn->request_len == sizeof(ConnectionRequest)) {
+			queue_request(conn);
+		}
+	}
+	if (len > 0) {
+		append_out(conn, data, len);
+	}
+	flush_conn(conn);
+}
+
+// reads and drops what the server sent, apart from the confirmations
+static void read_conn(ReplayConn* conn) {
+	unsigned char buffer[64 * 1024];
+	while (conn->fd >= 0) {
+		ssize_t n = recv(conn->fd, buffer, sizeof(buffer), 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		if (n <= 0) {
+			// the server hung up, whatever the capture still has for this connection goes nowhere
+			close_conn(conn);
+			return;
+		}
+		bytes_received += n;
+
+		size_t used = 0;
+		while (conn->confirmations > 0 && used < (size_t) n) {
+			size_t take = sizeof(ConnectionConfirmation) - conn->cc_len;
+			if (take > n - used) {
+				take = n - used;
+			}
+			memcpy(conn->cc + conn->cc_len, buffer + used, take);
+			conn->cc_len += take;
+			used += take;
+			if (conn->cc_len < sizeof(ConnectionConfirmation)) {
+				break;
+			}
+			ConnectionConfirmation cc;
+			Buffer cc_buffer = { conn->cc, sizeof(ConnectionConfirmation) };
+			deserialize_connection_confirmation(&cc, &cc_buffer);
+			conn->cc_len = 0;
+			conn->confirmations--;
+			if (cc.status == CONFIRMATION_FAILURE) {
+				handshake_failures++;
+			} else if (cc.status != CONFIRMATION_PENDING) {
+				conn->live_room = cc.connected_room.room_number;
+				if (conn->created && conn->recorded_room > 0) {
+					map_room(conn->recorded_room, conn->live_room);
+				}
+			}
+		}
+		close_if_done(conn);
+	}
+}
+
+/*========================================= CAPTURE ==========================================*/
+
+static void replay_record(CaptureRecord* rec, const unsigned char* data) {
+	records++;
+	if (rec->type == CAPTURE_OPEN) {
+		open_conn(rec->conn);
+		return;
+	}
+	ReplayConn* conn = rec->conn <= num_conns ? conns[rec->conn] : NULL;
+	if (conn == NULL) {
+		return; // opened before the capture started
+	}
+
+	switch (rec->type) {
+		case CAPTURE_DATA:
+			if (conn->fd >= 0) {
+				replay_data(conn, data, rec->len);
+			}
+			break;
+		case CAPTURE_ROOM:
+			conn->in_handshake = 0;
+			if (rec->len == sizeof(int32_t)) {
+				memcpy(&conn->recorded_room, data, sizeof(int32_t));
+			}
+			if (conn->created && conn->live_room > 0) {
+				map_room(conn->recorded_room, conn->live_room);
+			}
+			break;
+		case CAPTURE_CLOSE:
+			conn->closing = 1;
+			flush_conn(conn);
+			break;
+	}
+}
+
+static void print_report(double elapsed_s) {
+	printf("{\n");
+	printf("  \"speed\": %g,\n", speed);
+	printf("  \"records\": %llu,\n  \"data_records\": %llu,\n  \"connections\": %llu,\n", (unsigned long long) records,
+	(unsigned long long) data_records, (unsigned long long) connections);
+	printf("  \"connect_failures\": %llu,\n  \"handshake_failures\": %llu,\n  \"resets\": %llu,\n",
+	(unsigned long long) connect_failures, (unsigned long long) handshake_failures, (unsigned long long) resets);
+	printf("  \"elapsed_s\": %.3f,\n", elapsed_s);
+	printf("  \"bytes_sent\": %llu,\n  \"bytes_received\": %llu,\n", (unsigned long long) bytes_sent,
+	(unsigned long long) bytes_received);
+	printf("  \"data_records_per_s\": %.1f,\n  \"bytes_sent_per_s\": %.1f,\n", elapsed_s > 0 ? data_records / elapsed_s : 0,
+	elapsed_s > 0 ? bytes_sent / elapsed_s : 0);
+	printf("  \"lateness_us\": { \"count\": %llu, \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f }\n",
+	(unsigned long long) lateness.total, hist_percentile(&lateness, 50) / 1e3, hist_percentile(&lateness, 99) / 1e3,
+	lateness.max / 1e3);
+	printf("}\n");
+}
+
+int main(int argc, char* argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "x:")) != -1) {
+		switch (opt) {
+			case 'x': speed = atof(optarg); break;
+			default: argc = 0; // usage below
+		}
+	}
+	if (argc - optind != 2 || speed < 0) {
+		fprintf(stderr, "usage: %s [-x speed, 0 for as fast as possible] <capture-file> <ip-address>\n", argv[0]);
+		exit(1);
+	}
+
+	FILE* capture = fopen(argv[optind], "rb");
+	if (capture == NULL) error("ERROR opening capture file");
+	char magic[CAPTURE_MAGIC_LEN];
+	if (fread(magic, 1, sizeof(magic), capture) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+		fprintf(stderr, "%s is not a capture\n", argv[optind]);
+		exit(1);
+	}
+	set_server_addr(argv[optind + 1], &serv_addr);
+	signal(SIGPIPE, SIG_IGN);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) error("ERROR creating epoll instance");
+	hist_init(&lateness);
+
+	unsigned char* data = (unsigned char*) malloc(CAPTURE_BUFFER_SIZE);
+	if (data == NULL) error("ERROR allocating record buffer");
+	CaptureRecord rec;
+	int have_record = 0;
+	int more = 1;
+	uint64_t start = monotonic_ns();
+
+	while (more || have_record || open_conns > 0) {
+		// everything that is due, unless too much is waiting for the server already
+		int timeout = REPLAY_POLL_MS;
+		while (queued < REPLAY_MAX_QUEUED) {
+			if (!have_record) {
+				if (!more || fread(&rec, sizeof(rec), 1, capture) != 1 || rec.len > CAPTURE_BUFFER_SIZE ||
+				fread(data, 1, rec.len, capture) != rec.len) {
+					more = 0;
+					break;
+				}
+				have_record = 1;
+			}
+			uint64_t due = speed > 0 ? start + (uint64_t) (rec.time_ns / speed) : 0;
+			uint64_t now = monotonic_ns();
+			if (due > now) {
+				uint64_t wait_ms = (due - now + 999999) / 1000000;
+				timeout = wait_ms < REPLAY_POLL_MS ? (int) wait_ms : REPLAY_POLL_MS;
+				break;
+			}
+			if (speed > 0) {
+				hist_record(&lateness, now - due);
+			}
+			replay_record(&rec, data);
+			have_record = 0;
+		}
+		if (!more && !have_record && open_conns == 0) {
+			break;
+		}
+		if (!more && !have_record) {
+			// the capture is done, the rest only has to drain. connections the capture never closed are left
+			// open by the server, so they are closed here once what they had is sent
+			for (uint32_t i = 1; i <= num_conns; i++) {
+				if (conns[i] != NULL && conns[i]->fd >= 0 && !conns[i]->closing) {
+					conns[i]->closing = 1;
+					flush_conn(conns[i]);
+				}
+			}
+		}
+
+		struct epoll_event events[REPLAY_EVENTS];
+		int n = epoll_wait(epfd, events, REPLAY_EVENTS, timeout);
+		if (n < 0 && errno != EINTR) error("ERROR waiting on epoll");
+		for (int i = 0; i < n; i++) {
+			ReplayConn* conn = (ReplayConn*) events[i].data.ptr;
+			if (events[i].events & EPOLLIN) {
+				read_conn(conn);
+			}
+			if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+				flush_conn(conn);
+			}
+		}
+	}
+
+	print_report((monotonic_ns() - start) / 1e9);
+	return 0;
+}
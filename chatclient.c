@@ -0,0 +1,639 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+
+#include "chatclient.h"
+
+struct _ChatSession {
+	char username[MAX_USERNAME_LEN];
+	ChatCallbacks callbacks;
+	void* context;
+	struct sockaddr_in serv_addr;
+	int sockfd; // -1 while there is no connection
+	uint32_t connections; // bumped for every new connection, the descriptor number may come back
+	int epfd; // what the caller polls: the socket and wakefd
+	int wakefd; // eventfd bumped when another thread queues something
+	uint32_t watching; // epoll events the socket is registered for
+	ConnectionRequestType request; // what the handshake asks for once connected
+	int request_room;
+	int resuming; // the handshake presents the resumption token
+	int has_room; // joined once, so there is a room and token to come back to
+	ConnectionConfirmation cc; // last confirmation, the room and token to reconnect with
+	// bytes from the server not handled yet, whole frames are handled as they complete
+	unsigned char* in;
+	size_t in_len;
+	size_t in_capacity;
+	uint32_t in_skip; // payload bytes of an oversized frame still to throw away
+	// what is waiting to be written, in order. guarded by mutex along with state
+	unsigned char* out;
+	size_t out_len;
+	size_t out_sent; // of out_len, already written
+	size_t out_capacity;
+	ChatState state;
+	pthread_mutex_t mutex;
+};
+
+static void drop_connection(ChatSession* session, ChatState state);
+static void connection_lost(ChatSession* session, int err);
+
+static void set_state(ChatSession* session, ChatState state) {
+	pthread_mutex_lock(&session->mutex);
+	session->state = state;
+	pthread_mutex_unlock(&session->mutex);
+}
+
+// grows buf to hold at least need bytes, doubling from CHAT_INITIAL_BUFFER. returns -1 (ENOMEM)
+// with buf as it was if there is no memory for it
+static int reserve(unsigned char** buf, size_t* capacity, size_t need) {
+	if (need <= *capacity) {
+		return 0;
+	}
+	size_t grown = *capacity > 0 ? *capacity : CHAT_INITIAL_BUFFER;
+	while (grown < need) {
+		grown *= 2;
+	}
+	unsigned char* grown_buf = (unsigned char*) realloc(*buf, grown);
+	if (grown_buf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	*buf = grown_buf;
+	*capacity = grown;
+	return 0;
+}
+
+/*========================================= SESSION LIFETIME ==========================================*/
+
+// returns NULL with errno set if the session's memory or descriptors can't be had, e.g. EMFILE
+ChatSession* chat_session_create(const char* username, const ChatCallbacks* callbacks, void* context) {
+	ChatSession* session = (ChatSession*) malloc(sizeof(ChatSession));
+	if (session == NULL) {
+		return NULL;
+	}
+	memset(session, 0, sizeof(ChatSession));
+	strncpy(session->username, username, MAX_USERNAME_LEN - 1);
+	if (callbacks != NULL) {
+		session->callbacks = *callbacks;
+	}
+	session->context = context;
+	session->sockfd = -1;
+	session->state = CHAT_IDLE;
+	pthread_mutex_init(&session->mutex, NULL);
+
+	session->epfd = epoll_create1(EPOLL_CLOEXEC);
+	session->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event ev = { EPOLLIN, { .fd = session->wakefd } };
+	if (session->epfd < 0 || session->wakefd < 0
+	|| epoll_ctl(session->epfd, EPOLL_CTL_ADD, session->wakefd, &ev) < 0) {
+		int err = errno;
+		if (session->wakefd >= 0) {
+			close(session->wakefd);
+		}
+		if (session->epfd >= 0) {
+			close(session->epfd);
+		}
+		pthread_mutex_destroy(&session->mutex);
+		free(session);
+		errno = err;
+		return NULL;
+	}
+	return session;
+}
+
+void chat_session_destroy(ChatSession* session) {
+	drop_connection(session, CHAT_CLOSED);
+	close(session->wakefd);
+	close(session->epfd);
+	free(session->in);
+	free(session->out);
+	pthread_mutex_destroy(&session->mutex);
+	free(session);
+}
+
+/*========================================= QUEUEING ==========================================*/
+
+static void wake(ChatSession* session) {
+	uint64_t one = 1;
+	if (write(session->wakefd, &one, sizeof(one)) < 0) {
+		// already pending, the caller wakes either way
+	}
+}
+
+// appends one frame, in up to two pieces, to the queue. guarded by mutex. returns -1 (ENOMEM) if
+// the queue can't grow
+static int push_locked(ChatSession* session, const void* head, size_t head_len, const void* body, size_t body_len) {
+	size_t len = head_len + body_len;
+	if (session->out_len + len > session->out_capacity && session->out_sent > 0) {
+		// make room by dropping what is written before growing
+		memmove(session->out, session->out + session->out_sent, session->out_len - session->out_sent);
+		session->out_len -= session->out_sent;
+		session->out_sent = 0;
+	}
+	if (reserve(&session->out, &session->out_capacity, session->out_len + len) < 0) {
+		return -1;
+	}
+	memcpy(session->out + session->out_len, head, head_len);
+	if (body_len > 0) {
+		memcpy(session->out + session->out_len + head_len, body, body_len);
+	}
+	session->out_len += len;
+	return 0;
+}
+
+// queues a frame and wakes whoever processes the session. only a joined session takes frames from
+// the caller, the handshake queues its requests itself. returns -1 if the connection is gone (EPIPE)
+// or there is no memory to queue it (ENOMEM)
+static int push(ChatSession* session, const void* head, size_t head_len, const void* body, size_t body_len,
+int handshake) {
+	pthread_mutex_lock(&session->mutex);
+	if (!handshake && session->state != CHAT_JOINED) {
+		pthread_mutex_unlock(&session->mutex);
+		errno = EPIPE;
+		return -1;
+	}
+	if (push_locked(session, head, head_len, body, body_len) < 0) {
+		pthread_mutex_unlock(&session->mutex);
+		return -1;
+	}
+	pthread_mutex_unlock(&session->mutex);
+	wake(session);
+	return 0;
+}
+
+// writes as much of the queue as the socket takes without blocking. returns -1 if the connection failed
+static int flush(ChatSession* session) {
+	int status = 0;
+	pthread_mutex_lock(&session->mutex);
+	while (session->out_sent < session->out_len) {
+		ssize_t n = send(session->sockfd, session->out + session->out_sent, session->out_len - session->out_sent,
+		MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (n <= 0) {
+			errno = n == 0 ? ECONNRESET : errno;
+			status = -1;
+			break;
+		}
+		session->out_sent += n;
+	}
+	if (session->out_sent == session->out_len) {
+		session->out_sent = 0;
+		session->out_len = 0;
+	}
+	pthread_mutex_unlock(&session->mutex);
+	return status;
+}
+
+static int pending(ChatSession* session) {
+	pthread_mutex_lock(&session->mutex);
+	int pending = session->out_sent < session->out_len;
+	pthread_mutex_unlock(&session->mutex);
+	return pending;
+}
+
+/*========================================= CONNECTING ==========================================*/
+
+// keeps the socket registered for what we are waiting on: the connect finishing, or frames and room
+// to write. returns -1 if epoll won't have it
+static int watch(ChatSession* session, uint32_t events) {
+	if (session->sockfd < 0 || events == session->watching) {
+		return 0;
+	}
+	struct epoll_event ev = { events, { .fd = session->sockfd } };
+	if (epoll_ctl(session->epfd, EPOLL_CTL_MOD, session->sockfd, &ev) < 0) {
+		return -1;
+	}
+	session->watching = events;
+	return 0;
+}
+
+// starts a non-blocking connect, the handshake goes out once it is through
+static int open_connection(ChatSession* session) {
+	int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sockfd < 0) {
+		return -1;
+	}
+	// chat lines are small and the server answers each, Nagle would hold them behind its delayed ACK
+	int yes = 1;
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	if (connect(sockfd, (struct sockaddr*) &session->serv_addr, sizeof(session->serv_addr)) < 0
+	&& errno != EINPROGRESS) {
+		close(sockfd);
+		return -1;
+	}
+	struct epoll_event ev = { EPOLLOUT, { .fd = sockfd } };
+	if (epoll_ctl(session->epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+		int err = errno;
+		close(sockfd);
+		errno = err;
+		return -1;
+	}
+	session->sockfd = sockfd;
+	session->connections++;
+	session->watching = EPOLLOUT;
+	session->in_len = 0;
+	session->in_skip = 0;
+	set_state(session, CHAT_CONNECTING);
+	return 0;
+}
+
+// closes the socket, whatever was queued for it is lost with it. the state changes along with the
+// queue being emptied, so nothing another thread queues meanwhile ends up on the next connection
+static void drop_connection(ChatSession* session, ChatState state) {
+	if (session->sockfd >= 0) {
+		epoll_ctl(session->epfd, EPOLL_CTL_DEL, session->sockfd, NULL);
+		close(session->sockfd);
+		session->sockfd = -1;
+	}
+	pthread_mutex_lock(&session->mutex);
+	session->out_len = 0;
+	session->out_sent = 0;
+	session->state = state;
+	pthread_mutex_unlock(&session->mutex);
+	session->in_len = 0;
+	session->in_skip = 0;
+}
+
+// queues the ConnectionRequest for the current step of the handshake. returns -1 (ENOMEM) if it can't
+static int send_request(ChatSession* session, ConnectionRequestType type, int room_number) {
+	ConnectionRequest cr;
+	init_connection_request_struct(type, room_number, &cr, session->username);
+	if (type == RESUME_SESSION) {
+		memcpy(cr.resumption_token, session->cc.resumption_token, RESUMPTION_TOKEN_LEN);
+	}
+	unsigned char data[sizeof(ConnectionRequest)];
+	Buffer cr_buffer = { data, sizeof(data) };
+	serialize_connection_request(&cr_buffer, &cr);
+	return push(session, cr_buffer.data, cr_buffer.size, NULL, 0, 1);
+}
+
+// room is a room number, CREATE_NEW_ROOM_COMMAND, or NULL to have the server list its rooms first
+int chat_session_connect(ChatSession* session, struct sockaddr_in* serv_addr, const char* room) {
+	if (session->sockfd >= 0) {
+		errno = EISCONN;
+		return -1;
+	}
+	session->serv_addr = *serv_addr;
+	session->request_room = UNINITIALIZED_ROOM_NUMBER;
+	if (room == NULL) {
+		session->request = SELECT_ROOM;
+	} else if (strcmp(room, CREATE_NEW_ROOM_COMMAND) == 0) {
+		session->request = CREATE_NEW_ROOM;
+	} else {
+		session->request = JOIN_ROOM;
+		session->request_room = strtol(room, NULL, 10);
+	}
+	session->resuming = 0;
+	return open_connection(session);
+}
+
+// answers the server's room list. anything but a room number or CREATE_NEW_ROOM_COMMAND cancels the handshake
+int chat_session_choose_room(ChatSession* session, const char* room) {
+	if (session->state != CHAT_CHOOSING_ROOM) {
+		errno = EINVAL;
+		return -1;
+	}
+	char choice[MAX_USERNAME_LEN];
+	strncpy(choice, room != NULL ? room : "", sizeof(choice) - 1);
+	choice[sizeof(choice) - 1] = '\0';
+	trim_whitespace(choice);
+
+	set_state(session, CHAT_HANDSHAKING);
+	int status;
+	if (strcmp(choice, CREATE_NEW_ROOM_COMMAND) == 0) {
+		status = send_request(session, CREATE_NEW_ROOM, UNINITIALIZED_ROOM_NUMBER);
+	} else if (is_number(choice)) {
+		status = send_request(session, JOIN_ROOM, strtol(choice, NULL, 10));
+	} else {
+		status = send_request(session, CANCEL_HANDSHAKE, UNINITIALIZED_ROOM_NUMBER);
+	}
+	if (status < 0) {
+		// still up to the caller to choose
+		set_state(session, CHAT_CHOOSING_ROOM);
+	}
+	return status;
+}
+
+// opens a new connection after a drop and presents the resumption token, so we get our old room
+// slot and color back without the room seeing us leave and rejoin. if the server no longer holds
+// the session we rejoin the same room as a new member
+int chat_session_reconnect(ChatSession* session) {
+	if (session->state != CHAT_IDLE || !session->has_room) {
+		errno = EINVAL;
+		return -1;
+	}
+	session->resuming = 1;
+	if (open_connection(session) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// the server answered a ConnectionRequest
+static void handle_confirmation(ChatSession* session, ConnectionConfirmation* cc) {
+	if (session->resuming && cc->status != CONFIRMATION_RESUMED) {
+		// session expired on the server, rejoin the room as a new member
+		drop_connection(session, CHAT_IDLE);
+		session->resuming = 0;
+		session->request = JOIN_ROOM;
+		session->request_room = session->cc.connected_room.room_number;
+		if (open_connection(session) < 0) {
+			connection_lost(session, errno);
+		}
+		return;
+	}
+
+	switch (cc->status) {
+		case CONFIRMATION_SUCCESS:
+		case CONFIRMATION_SUCCESS_NEW:
+		case CONFIRMATION_RESUMED:
+			session->cc = *cc;
+			session->has_room = 1;
+			session->resuming = 0;
+			set_state(session, CHAT_JOINED);
+			if (session->callbacks.joined != NULL) {
+				session->callbacks.joined(session, cc, session->context);
+			}
+			break;
+		case CONFIRMATION_PENDING:
+			set_state(session, CHAT_CHOOSING_ROOM);
+			if (session->callbacks.rooms != NULL) {
+				session->callbacks.rooms(session, cc, session->context);
+			}
+			break;
+		default:
+			// the server refused us and closes the connection
+			drop_connection(session, CHAT_CLOSED);
+			errno = EACCES;
+			if (session->callbacks.disconnected != NULL) {
+				session->callbacks.disconnected(session, CHAT_CLOSED, session->context);
+			}
+	}
+}
+
+// the connection failed or the server closed it, err says why (errno in the callback). a session
+// that got into a room may be resumed, unless it was leaving anyway
+static void connection_lost(ChatSession* session, int err) {
+	ChatState was = chat_session_state(session);
+	ChatState state = (was == CHAT_LEAVING || !session->has_room) ? CHAT_CLOSED : CHAT_IDLE;
+	drop_connection(session, state);
+	errno = err;
+	if (session->callbacks.disconnected != NULL) {
+		session->callbacks.disconnected(session, state, session->context);
+	}
+}
+
+/*========================================= EVENTS ==========================================*/
+
+int chat_session_fd(ChatSession* session) {
+	return session->epfd;
+}
+
+// handles the whole confirmations and frames in the input buffer. returns -1 if the connection
+// should be dropped, 1 if the handshake replaced it
+static int handle_input(ChatSession* session) {
+	uint32_t connection = session->connections;
+	size_t pos = 0;
+	int status = 0;
+	while (status == 0) {
+		if (session->in_skip > 0) {
+			size_t take = session->in_len - pos < session->in_skip ? session->in_len - pos : session->in_skip;
+			pos += take;
+			session->in_skip -= take;
+			if (session->in_skip > 0) {
+				break;
+			}
+			continue;
+		}
+
+		ChatState state = chat_session_state(session);
+		if (state == CHAT_HANDSHAKING) {
+			if (session->in_len - pos < sizeof(ConnectionConfirmation)) {
+				break;
+			}
+			ConnectionConfirmation cc;
+			Buffer cc_buffer = { session->in + pos, sizeof(ConnectionConfirmation) };
+			deserialize_connection_confirmation(&cc, &cc_buffer);
+			pos += sizeof(ConnectionConfirmation);
+			handle_confirmation(session, &cc);
+			if (session->sockfd < 0 || session->connections != connection) {
+				// refused, or on to a new connection: the rest of the input went with the old one
+				return 1;
+			}
+			continue;
+		}
+		if (state != CHAT_JOINED && state != CHAT_LEAVING) {
+			// nothing more is due until the room is chosen
+			break;
+		}
+
+		if (session->in_len - pos < FRAME_HEADER_LEN) {
+			break;
+		}
+		FrameHeader header;
+		Buffer fh_buffer = { session->in + pos, FRAME_HEADER_LEN };
+		deserialize_frame_header(&header, &fh_buffer);
+		if (header.length > CHAT_MAX_FRAME_PAYLOAD) {
+			// nothing we understand is this big
+			pos += FRAME_HEADER_LEN;
+			session->in_skip = header.length;
+			continue;
+		}
+		if (session->in_len - pos < FRAME_HEADER_LEN + header.length) {
+			// the next read has to fit the whole frame
+			if (reserve(&session->in, &session->in_capacity, FRAME_HEADER_LEN + header.length) < 0) {
+				status = -1;
+			}
+			break;
+		}
+		Buffer payload = { session->in + pos + FRAME_HEADER_LEN, header.length };
+		if (header.type == FRAME_CHAT) {
+			if (session->callbacks.message != NULL) {
+				// up to a NUL, the way it used to be printed
+				size_t len = strnlen((char*) payload.data, payload.size);
+				session->callbacks.message(session, (char*) payload.data, len, session->context);
+			}
+		} else if (session->callbacks.frame != NULL) {
+			status = session->callbacks.frame(session, &header, &payload, session->context);
+			errno = ECONNABORTED;
+		}
+		pos += FRAME_HEADER_LEN + header.length;
+	}
+	// keep the start of an unfinished frame
+	memmove(session->in, session->in + pos, session->in_len - pos);
+	session->in_len -= pos;
+	return status;
+}
+
+// reads what the socket has and handles it. returns -1 if the connection closed, 1 if it was replaced
+static int read_socket(ChatSession* session) {
+	for (int reads = 0; reads < CHAT_READS_PER_PROCESS; reads++) {
+		if (reserve(&session->in, &session->in_capacity, session->in_len + 1) < 0) {
+			return -1;
+		}
+		ssize_t n = recv(session->sockfd, session->in + session->in_len, session->in_capacity - session->in_len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		if (n <= 0) {
+			errno = n == 0 ? ECONNRESET : errno;
+			return -1;
+		}
+		session->in_len += n;
+		int status = handle_input(session);
+		if (status != 0) {
+			return status;
+		}
+	}
+	return 0;
+}
+
+// does whatever the session has waiting: finishes connecting, reads and handles what the server
+// sent and writes what is queued. call it when chat_session_fd() is readable
+int chat_session_process(ChatSession* session) {
+	struct epoll_event events[2];
+	int n = epoll_wait(session->epfd, events, 2, 0);
+	if (n < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+	uint32_t socket_events = 0;
+	for (int i = 0; i < n; i++) {
+		if (events[i].data.fd == session->wakefd) {
+			uint64_t count;
+			if (read(session->wakefd, &count, sizeof(count)) < 0) {
+				// raced with another drain, nothing to do
+			}
+		} else {
+			socket_events = events[i].events;
+		}
+	}
+
+	if (session->sockfd < 0) {
+		return 0;
+	}
+	if (chat_session_state(session) == CHAT_CONNECTING) {
+		if (socket_events == 0) {
+			return 0;
+		}
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(session->sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+			connection_lost(session, err != 0 ? err : errno);
+			return 0;
+		}
+		set_state(session, CHAT_HANDSHAKING);
+		if (send_request(session, session->resuming ? RESUME_SESSION : session->request,
+		session->resuming ? session->cc.connected_room.room_number : session->request_room) < 0) {
+			connection_lost(session, errno);
+			return 0;
+		}
+	}
+
+	int status = 0;
+	if (socket_events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		status = read_socket(session);
+	}
+	if (status > 0) {
+		// the handshake went on to a new connection, or ended
+		return 0;
+	}
+	// acks from the frames just handled go out with whatever else is queued
+	if (status == 0) {
+		status = flush(session);
+	}
+	if (status < 0) {
+		connection_lost(session, errno);
+		return 0;
+	}
+	if (watch(session, EPOLLIN | (pending(session) ? EPOLLOUT : 0)) < 0) {
+		connection_lost(session, errno);
+	}
+	return 0;
+}
+
+/*========================================= SENDING ==========================================*/
+
+// queues a chat message for the room
+int chat_session_send(ChatSession* session, const char* text, size_t len) {
+	return chat_session_send_frame(session, FRAME_CHAT, CHAT_STREAM_ID, text, len);
+}
+
+int chat_session_send_frame(ChatSession* session, FrameType type, uint32_t stream_id, const void* payload,
+uint32_t length) {
+	unsigned char data[FRAME_HEADER_LEN];
+	Buffer fh_buffer = { data, sizeof(data) };
+	FrameHeader fh = { (uint8_t) type, stream_id, length };
+	serialize_frame_header(&fh_buffer, &fh);
+	return push(session, fh_buffer.data, fh_buffer.size, payload, length, 0);
+}
+
+// queues a FILE_CHUNK with length bytes of the file from offset, crc is their CRC32C
+int chat_session_send_chunk(ChatSession* session, uint32_t stream_id, uint64_t offset, uint32_t crc,
+const void* data, uint32_t length) {
+	unsigned char head[FRAME_HEADER_LEN + CHUNK_PREFIX_LEN];
+	Buffer ch_buffer = { head, sizeof(head) };
+	serialize_chunk_header(&ch_buffer, stream_id, offset, crc, length);
+	return push(session, ch_buffer.data, ch_buffer.size, data, length, 0);
+}
+
+// asks the server to take us out of the room. it closes the connection once it has, and the
+// session ends with the disconnected callback
+int chat_session_leave(ChatSession* session) {
+	unsigned char data[FRAME_HEADER_LEN];
+	Buffer fh_buffer = { data, sizeof(data) };
+	FrameHeader fh = { FRAME_CHAT, CHAT_STREAM_ID, strlen(CHAT_EXIT_MESSAGE) };
+	serialize_frame_header(&fh_buffer, &fh);
+
+	pthread_mutex_lock(&session->mutex);
+	if (session->state != CHAT_JOINED) {
+		pthread_mutex_unlock(&session->mutex);
+		errno = EPIPE;
+		return -1;
+	}
+	if (push_locked(session, fh_buffer.data, fh_buffer.size, CHAT_EXIT_MESSAGE, strlen(CHAT_EXIT_MESSAGE)) < 0) {
+		pthread_mutex_unlock(&session->mutex);
+		return -1;
+	}
+	session->state = CHAT_LEAVING;
+	pthread_mutex_unlock(&session->mutex);
+	wake(session);
+	return 0;
+}
+
+/*========================================= STATE ==========================================*/
+
+ChatState chat_session_state(ChatSession* session) {
+	pthread_mutex_lock(&session->mutex);
+	ChatState state = session->state;
+	pthread_mutex_unlock(&session->mutex);
+	return state;
+}
+
+const char* chat_session_username(ChatSession* session) {
+	return session->username;
+}
+
+// the room we are in, or were in before the connection dropped. UNINITIALIZED_ROOM_NUMBER before joining
+int chat_session_room(ChatSession* session) {
+	return session->has_room ? session->cc.connected_room.room_number : UNINITIALIZED_ROOM_NUMBER;
+}
+
+// the current connection's socket, -1 while there is none. for logs and probes only, the session
+// does all the reading and writing on it
+int chat_session_socket(ChatSession* session) {
+	return session->sockfd;
+}
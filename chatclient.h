@@ -0,0 +1,96 @@
+#ifndef CHATCLIENT_H
+#define CHATCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "handshake.h"
+#include "frame.h"
+#include "util.h"
+
+/* A client's session with the chat server that never blocks, for embedding any
+ * number of them in one process (libchatclient.a). Each session has its own
+ * username, socket, queues and handshake state, and hands out one descriptor that
+ * stays the same across reconnects: poll it for POLLIN and call
+ * chat_session_process() when it fires. That connects, runs the handshake, writes
+ * what is queued and reads the server's frames, calling back into the caller as
+ * things happen. Callbacks run on the thread calling chat_session_process(), which
+ * is the only thread that may call the other functions too, except the sends and
+ * chat_session_leave(): those only queue, so any thread may call them.
+ *
+ * The library does the wire protocol, not the policy. When a connection drops the
+ * session goes back to CHAT_IDLE and chat_session_reconnect() resumes it (falling
+ * back to rejoining the room), when and how often is up to the caller. File
+ * transfers are frames like any other, see frame.h.
+ *
+ * Nothing in here exits the process. Running out of descriptors or memory makes
+ * the call return NULL or -1 with errno set, or drops the connection with errno
+ * in the disconnected callback, and the caller decides what to do about it.
+ */
+
+#define CHAT_MAX_FRAME_PAYLOAD ((MAX_MANIFEST_CHUNKS + 7) / 8) // largest frame the server sends us, a FILE_NEED bitmap
+#define CHAT_READS_PER_PROCESS 16 // socket reads one chat_session_process() does before giving the caller a turn
+#define CHAT_INITIAL_BUFFER 4096 // queues start this small and grow to the largest frame seen
+#define CHAT_EXIT_MESSAGE "\n" // chat line the server takes as us leaving the room
+
+typedef enum _ChatState {
+	CHAT_IDLE, // not connected: not yet, or the connection dropped and the session may be resumed
+	CHAT_CONNECTING,
+	CHAT_HANDSHAKING,
+	CHAT_CHOOSING_ROOM, // the server listed its rooms, waiting for chat_session_choose_room()
+	CHAT_JOINED,
+	CHAT_LEAVING, // asked to leave, waiting for the server to close
+	CHAT_CLOSED // left, refused by the server, or lost before ever joining
+} ChatState;
+
+typedef struct _ChatSession ChatSession;
+
+// any of them may be NULL
+typedef struct _ChatCallbacks {
+	// the server wants us to pick a room, cc->available_rooms lists them
+	void (*rooms)(ChatSession* session, ConnectionConfirmation* cc, void* context);
+	// in a room, cc->status tells a new room (CONFIRMATION_SUCCESS_NEW) and a resumed session (CONFIRMATION_RESUMED) apart
+	void (*joined)(ChatSession* session, ConnectionConfirmation* cc, void* context);
+	// a chat line from the room, as the server rendered it
+	void (*message)(ChatSession* session, const char* text, size_t len, void* context);
+	// every frame that isn't chat. returns -1 to drop the connection
+	int (*frame)(ChatSession* session, FrameHeader* header, Buffer* payload, void* context);
+	// the connection is gone, state is CHAT_IDLE if the session can be resumed and CHAT_CLOSED if not.
+	// errno says why, EACCES if the server refused the handshake
+	void (*disconnected)(ChatSession* session, ChatState state, void* context);
+} ChatCallbacks;
+
+// SESSION LIFETIME
+
+ChatSession* chat_session_create(const char* username, const ChatCallbacks* callbacks, void* context);
+void chat_session_destroy(ChatSession* session);
+
+// CONNECTING
+
+int chat_session_connect(ChatSession* session, struct sockaddr_in* serv_addr, const char* room);
+int chat_session_choose_room(ChatSession* session, const char* room);
+int chat_session_reconnect(ChatSession* session);
+
+// EVENTS
+
+int chat_session_fd(ChatSession* session);
+int chat_session_process(ChatSession* session);
+
+// SENDING
+
+int chat_session_send(ChatSession* session, const char* text, size_t len);
+int chat_session_send_frame(ChatSession* session, FrameType type, uint32_t stream_id, const void* payload,
+uint32_t length);
+int chat_session_send_chunk(ChatSession* session, uint32_t stream_id, uint64_t offset, uint32_t crc,
+const void* data, uint32_t length);
+int chat_session_leave(ChatSession* session);
+
+// STATE
+
+ChatState chat_session_state(ChatSession* session);
+const char* chat_session_username(ChatSession* session);
+int chat_session_room(ChatSession* session);
+int chat_session_socket(ChatSession* session);
+
+#endif
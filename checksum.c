@@ -0,0 +1,222 @@
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "checksum.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/*========================================= CRC32C =========================================*/
+
+#define CRC32C_POLY 0x82f63b78 // Castagnoli, bit reversed
+
+static uint32_t crc_table[8][256]; // slicing-by-8
+static int has_sse42 = 0;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc_table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int t = 1; t < 8; t++) {
+			crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xff];
+		}
+	}
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	has_sse42 = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+int crc32c_has_hw() {
+	pthread_once(&crc_once, crc32c_init);
+	return has_sse42;
+}
+
+// eight bytes per step through the tables, for CPUs without the crc32 instruction
+uint32_t crc32c_sw(uint32_t crc, const void* data, size_t len) {
+	pthread_once(&crc_once, crc32c_init);
+	const unsigned char* p = (const unsigned char*) data;
+	crc = ~crc;
+	while (len >= 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		word = le64toh(word) ^ crc;
+		crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff]
+		^ crc_table[5][(word >> 16) & 0xff] ^ crc_table[4][(word >> 24) & 0xff]
+		^ crc_table[3][(word >> 32) & 0xff] ^ crc_table[2][(word >> 40) & 0xff]
+		^ crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+	}
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+// the crc32 instruction does eight bytes a cycle, the build doesn't assume SSE4.2 so only this
+// function is compiled for it and crc32c() checks the CPU before calling it
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const void* data, size_t len) {
+	const unsigned char* p = (const unsigned char*) data;
+	uint64_t c = ~crc & 0xffffffff;
+	while (len >= 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		c = _mm_crc32_u64(c, word);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		c = _mm_crc32_u8((uint32_t) c, *p++);
+	}
+	return ~(uint32_t) c;
+}
+#else
+uint32_t crc32c_hw(uint32_t crc, const void* data, size_t len) {
+	return crc32c_sw(crc, data, len);
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+	if (crc32c_has_hw()) {
+		return crc32c_hw(crc, data, len);
+	}
+	return crc32c_sw(crc, data, len);
+}
+
+/*========================================= XXH64 =========================================*/
+
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3 0x165667b19e3779f9ULL
+#define PRIME64_4 0x85ebca77c2b2ae63ULL
+#define PRIME64_5 0x27d4eb2f165667c5ULL
+
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static uint64_t read64(const unsigned char* p) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return le64toh(v);
+}
+
+static uint32_t read32(const unsigned char* p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return le32toh(v);
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+	acc += input * PRIME64_2;
+	acc = ROTL64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+void xxh64_init(Xxh64* state, uint64_t seed) {
+	memset(state, 0, sizeof(Xxh64));
+	state->seed = seed;
+	state->v[0] = seed + PRIME64_1 + PRIME64_2;
+	state->v[1] = seed + PRIME64_2;
+	state->v[2] = seed;
+	state->v[3] = seed - PRIME64_1;
+}
+
+// folds 32 byte stripes into the four lanes, anything shorter waits in the buffer
+void xxh64_update(Xxh64* state, const void* data, size_t len) {
+	const unsigned char* p = (const unsigned char*) data;
+	state->total_len += len;
+
+	if (state->buffered + len < 32) {
+		memcpy(state->buffer + state->buffered, p, len);
+		state->buffered += len;
+		return;
+	}
+	if (state->buffered > 0) {
+		uint32_t fill = 32 - state->buffered;
+		memcpy(state->buffer + state->buffered, p, fill);
+		for (int i = 0; i < 4; i++) {
+			state->v[i] = xxh64_round(state->v[i], read64(state->buffer + i * 8));
+		}
+		p += fill;
+		len -= fill;
+		state->buffered = 0;
+	}
+
+	uint64_t v0 = state->v[0], v1 = state->v[1], v2 = state->v[2], v3 = state->v[3];
+	while (len >= 32) {
+		v0 = xxh64_round(v0, read64(p));
+		v1 = xxh64_round(v1, read64(p + 8));
+		v2 = xxh64_round(v2, read64(p + 16));
+		v3 = xxh64_round(v3, read64(p + 24));
+		p += 32;
+		len -= 32;
+	}
+	state->v[0] = v0;
+	state->v[1] = v1;
+	state->v[2] = v2;
+	state->v[3] = v3;
+
+	memcpy(state->buffer, p, len);
+	state->buffered = len;
+}
+
+uint64_t xxh64_digest(const Xxh64* state) {
+	uint64_t h;
+	if (state->total_len >= 32) {
+		h = ROTL64(state->v[0], 1) + ROTL64(state->v[1], 7) + ROTL64(state->v[2], 12) + ROTL64(state->v[3], 18);
+		for (int i = 0; i < 4; i++) {
+			h = xxh64_merge(h, state->v[i]);
+		}
+	} else {
+		h = state->seed + PRIME64_5;
+	}
+	h += state->total_len;
+
+	const unsigned char* p = state->buffer;
+	uint32_t len = state->buffered;
+	while (len >= 8) {
+		h ^= xxh64_round(0, read64(p));
+		h = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+		len -= 8;
+	}
+	if (len >= 4) {
+		h ^= (uint64_t) read32(p) * PRIME64_1;
+		h = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+		len -= 4;
+	}
+	while (len-- > 0) {
+		h ^= (*p++) * PRIME64_5;
+		h = ROTL64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t xxh64(const void* data, size_t len, uint64_t seed) {
+	Xxh64 state;
+	xxh64_init(&state, seed);
+	xxh64_update(&state, data, len);
+	return xxh64_digest(&state);
+}
@@ -0,0 +1,32 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Integrity checks for file transfers. Every FILE_CHUNK carries the CRC32C of its
+ * bytes, computed with the SSE4.2 crc32 instruction where the CPU has it and with
+ * tables otherwise. The whole file is covered by a streaming 64-bit XXH64 digest
+ * the sender puts in its offer and the receiver confirms when the file completes.
+ */
+
+// crc is 0 to start, or the result for the bytes before data to carry on from
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void* data, size_t len);
+uint32_t crc32c_hw(uint32_t crc, const void* data, size_t len); // only if crc32c_has_hw()
+int crc32c_has_hw();
+
+typedef struct _Xxh64 {
+	uint64_t v[4]; // the four lanes
+	uint64_t total_len;
+	unsigned char buffer[32]; // input not yet folded into the lanes
+	uint32_t buffered;
+	uint64_t seed;
+} Xxh64;
+
+void xxh64_init(Xxh64* state, uint64_t seed);
+void xxh64_update(Xxh64* state, const void* data, size_t len);
+uint64_t xxh64_digest(const Xxh64* state);
+uint64_t xxh64(const void* data, size_t len, uint64_t seed);
+
+#endif
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "checksum.h"
+#include "frame.h"
+
+/* Throughput of the transfer checksums: CRC32C with the crc32 instruction and with
+ * tables, and XXH64, over buffers the size of a FILE_CHUNK and bigger. Checks the
+ * implementations agree and match the published test vectors before timing them.
+ *
+ * usage: ./checksum_bench [megabytes per run]
+ */
+
+#define DEFAULT_TOTAL_MB 2048
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t crc_hw(const void* data, size_t len) { return crc32c_hw(0, data, len); }
+static uint32_t crc_sw(const void* data, size_t len) { return crc32c_sw(0, data, len); }
+static uint32_t digest(const void* data, size_t len) { return (uint32_t) xxh64(data, len, 0); }
+
+// runs fn over the buffer in block sized pieces until total bytes went through, returns GB/s
+static double run(uint32_t (*fn)(const void*, size_t), const unsigned char* buffer, size_t block, size_t total) {
+	uint32_t sink = 0;
+	size_t blocks_per_pass = (64 * 1024 * 1024) / block;
+	size_t done = 0;
+	double start = now();
+	while (done < total) {
+		for (size_t i = 0; i < blocks_per_pass && done < total; i++) {
+			sink ^= fn(buffer + i * block, block);
+			done += block;
+		}
+	}
+	double elapsed = now() - start;
+	// keep the calls from being optimized away
+	if (sink == 0x12345678) printf(" ");
+	return done / elapsed / 1e9;
+}
+
+static int check(const char* what, uint64_t got, uint64_t want) {
+	if (got != want) {
+		printf("FAIL %s: got %016llx, want %016llx\n", what, (unsigned long long) got, (unsigned long long) want);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	size_t total = (size_t) (argc > 1 ? atoi(argv[1]) : DEFAULT_TOTAL_MB) * 1024 * 1024;
+	size_t buffer_size = 64 * 1024 * 1024;
+	unsigned char* buffer = (unsigned char*) malloc(buffer_size);
+	if (buffer == NULL) {
+		printf("out of memory\n");
+		return 1;
+	}
+	srand(1);
+	for (size_t i = 0; i < buffer_size; i++) {
+		buffer[i] = rand();
+	}
+
+	int failed = 0;
+	failed |= check("crc32c", crc32c(0, "123456789", 9), 0xe3069283);
+	failed |= check("crc32c_sw", crc32c_sw(0, "123456789", 9), 0xe3069283);
+	failed |= check("xxh64 empty", xxh64("", 0, 0), 0xef46db3751d8e999ULL);
+	failed |= check("xxh64 abc", xxh64("abc", 3, 0), 0x44bc2cf5ad770999ULL);
+	failed |= check("crc32c hw/sw", crc32c(0, buffer, 1000003), crc32c_sw(0, buffer, 1000003));
+	Xxh64 state;
+	xxh64_init(&state, 0);
+	for (size_t off = 0; off < 1000003; off += 1000) {
+		xxh64_update(&state, buffer + off, off + 1000 < 1000003 ? 1000 : 1000003 - off);
+	}
+	failed |= check("xxh64 streaming", xxh64_digest(&state), xxh64(buffer, 1000003, 0));
+	if (failed) {
+		return 1;
+	}
+
+	printf("crc32 instruction: %s\n", crc32c_has_hw() ? "yes" : "no");
+	printf("%-12s %10s %10s %10s\n", "block", "crc32c_hw", "crc32c_sw", "xxh64");
+	size_t blocks[] = { 4096, FILE_CHUNK_SIZE, 1024 * 1024 };
+	for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+		double hw = crc32c_has_hw() ? run(crc_hw, buffer, blocks[i], total) : 0;
+		double sw = run(crc_sw, buffer, blocks[i], total);
+		double xx = run(digest, buffer, blocks[i], total);
+		printf("%-12zu %7.2f GB/s %5.2f GB/s %5.2f GB/s\n", blocks[i], hw, sw, xx);
+	}
+
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk_store.h"
+#include "cdc.h"
+#include "sha256.h"
+#include "checksum.h"
+#include "util.h"
+
+CHUNK* chunk_buckets[CHUNK_STORE_BUCKETS];
+
+static CHUNK** chunk_bucket(const unsigned char* hash) {
+	uint32_t h;
+	memcpy(&h, hash, sizeof(h)); // the hash is already uniform
+	return &chunk_buckets[h % CHUNK_STORE_BUCKETS];
+}
+
+// finds a chunk that can be shared: stored ones, and ones the manifest being built lays out
+// itself (they have no spool yet). a chunk another upload is still receiving doesn't count,
+// that upload may never finish
+static CHUNK* chunk_find(const unsigned char* hash, uint32_t length) {
+	for (CHUNK* cur = *chunk_bucket(hash); cur != NULL; cur = cur->next) {
+		if (cur->length == length && memcmp(cur->hash, hash, CHUNK_HASH_LEN) == 0
+		&& (cur->stored || cur->spool == NULL)) {
+			return cur;
+		}
+	}
+	return NULL;
+}
+
+static CHUNK* chunk_add(const unsigned char* hash, uint32_t length, uint64_t offset) {
+	CHUNK* chunk = (CHUNK*) malloc(sizeof(CHUNK));
+	if (chunk == NULL) error("ERROR allocating chunk");
+	memset(chunk, 0, sizeof(CHUNK));
+	memcpy(chunk->hash, hash, CHUNK_HASH_LEN);
+	chunk->length = length;
+	chunk->offset = offset;
+
+	CHUNK** bucket = chunk_bucket(hash);
+	chunk->next = *bucket;
+	*bucket = chunk;
+	return chunk;
+}
+
+// the last reference drops the chunk from the store and gives its bytes back
+static void chunk_release(CHUNK* chunk) {
+	if (--chunk->refs > 0) {
+		return;
+	}
+
+	CHUNK** link = chunk_bucket(chunk->hash);
+	while (*link != chunk) {
+		link = &(*link)->next;
+	}
+	*link = chunk->next;
+
+	if (chunk->spool != NULL) {
+		spool_discard(chunk->spool, chunk->offset, chunk->length);
+		spool_release(chunk->spool);
+	}
+	free(chunk);
+}
+
+// checks a fully received chunk against its hash, after which it can be shared.
+// returns -1 if the bytes don't match
+int chunk_verify(CHUNK* chunk) {
+	unsigned char digest[SHA256_DIGEST_LEN];
+	sha256(chunk->spool->map + chunk->offset, chunk->length, digest);
+	if (memcmp(digest, chunk->hash, CHUNK_HASH_LEN) != 0) {
+		return -1;
+	}
+	chunk->stored = 1;
+	return 0;
+}
+
+// CRC32C of length received bytes at offset in the chunk. deliveries cut their frames at
+// FILE_CHUNK_SIZE steps from the chunk's start, so those pieces are checksummed once and the
+// result is shared by every receiver of every file using the chunk
+uint32_t chunk_crc(CHUNK* chunk, uint32_t offset, uint32_t length) {
+	const unsigned char* data = chunk->spool->map + chunk->offset + offset;
+	uint32_t block = offset / FILE_CHUNK_SIZE;
+	uint32_t block_len = chunk->length - block * FILE_CHUNK_SIZE;
+	if (block_len > FILE_CHUNK_SIZE) {
+		block_len = FILE_CHUNK_SIZE;
+	}
+	if (offset % FILE_CHUNK_SIZE != 0 || length != block_len) {
+		return crc32c(0, data, length);
+	}
+	if (!(chunk->crcs_known & (1u << block))) {
+		chunk->block_crcs[block] = crc32c(0, data, length);
+		chunk->crcs_known |= 1u << block;
+	}
+	return chunk->block_crcs[block];
+}
+
+// resolves a sender's chunk list against the store. chunks the store has are shared, the rest
+// (each only once, however often the file repeats it) are laid out one after the other in a new
+// spool file that only has to hold those. returns NULL with reason set if the list doesn't add up
+// to the file or there is no room for the new chunks
+MANIFEST* manifest_create(const char* owner, const ManifestEntry* entries, uint32_t num_chunks, uint64_t file_size, char** reason) {
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < num_chunks; i++) {
+		if (entries[i].length == 0 || entries[i].length > CDC_MAX_CHUNK) {
+			*reason = "bad chunk list";
+			return NULL;
+		}
+		total += entries[i].length;
+	}
+	if (total != file_size) {
+		*reason = "bad chunk list";
+		return NULL;
+	}
+
+	MANIFEST* manifest = (MANIFEST*) malloc(sizeof(MANIFEST));
+	if (manifest == NULL) error("ERROR allocating manifest");
+	memset(manifest, 0, sizeof(MANIFEST));
+	manifest->num_chunks = num_chunks;
+	manifest->chunks = (CHUNK**) malloc((num_chunks + 1) * sizeof(CHUNK*));
+	manifest->offsets = (uint64_t*) malloc((num_chunks + 1) * sizeof(uint64_t));
+	manifest->needed = (unsigned char*) calloc(num_chunks + 1, 1);
+	manifest->source_of = (uint32_t*) calloc(num_chunks + 1, sizeof(uint32_t));
+	manifest->sources = (SPOOL**) malloc((num_chunks + 1) * sizeof(SPOOL*));
+	if (manifest->chunks == NULL || manifest->offsets == NULL || manifest->needed == NULL
+	|| manifest->source_of == NULL || manifest->sources == NULL) {
+		error("ERROR allocating manifest");
+	}
+
+	// share what the store has, lay out the rest. the new chunks go in the store right away (without
+	// a spool) so a chunk repeated further down the file is shared with its first copy
+	uint64_t new_bytes = 0;
+	uint64_t offset = 0;
+	for (uint32_t i = 0; i < num_chunks; i++) {
+		CHUNK* chunk = chunk_find(entries[i].hash, entries[i].length);
+		if (chunk == NULL) {
+			chunk = chunk_add(entries[i].hash, entries[i].length, new_bytes);
+			new_bytes += entries[i].length;
+			manifest->needed[i] = 1;
+		}
+		chunk->refs++;
+		manifest->chunks[i] = chunk;
+		manifest->offsets[i] = offset;
+		offset += entries[i].length;
+	}
+	manifest->offsets[num_chunks] = file_size;
+
+	manifest->spool = spool_create(owner, new_bytes, reason);
+	if (manifest->spool == NULL) {
+		manifest_release(manifest);
+		return NULL;
+	}
+
+	// the new chunks live in the new spool, the rest wherever they were stored first
+	manifest->sources[manifest->num_sources++] = manifest->spool;
+	for (uint32_t i = 0; i < num_chunks; i++) {
+		CHUNK* chunk = manifest->chunks[i];
+		if (chunk->spool == NULL) {
+			chunk->spool = manifest->spool;
+			spool_retain(manifest->spool);
+		}
+		uint32_t source = 0;
+		while (source < manifest->num_sources && manifest->sources[source] != chunk->spool) {
+			source++;
+		}
+		if (source == manifest->num_sources) {
+			manifest->sources[manifest->num_sources++] = chunk->spool;
+		}
+		manifest->source_of[i] = source;
+	}
+
+	return manifest;
+}
+
+// drops the manifest's references, chunks nobody else uses go with it
+void manifest_release(MANIFEST* manifest) {
+	for (uint32_t i = 0; i < manifest->num_chunks; i++) {
+		if (manifest->chunks[i] != NULL) {
+			chunk_release(manifest->chunks[i]);
+		}
+	}
+	if (manifest->spool != NULL) {
+		spool_release(manifest->spool);
+	}
+	free(manifest->chunks);
+	free(manifest->offsets);
+	free(manifest->needed);
+	free(manifest->source_of);
+	free(manifest->sources);
+	free(manifest);
+}
+
+// index of the chunk holding the file byte at offset (num_chunks at the end of the file)
+uint32_t manifest_find_chunk(MANIFEST* manifest, uint64_t offset) {
+	uint32_t lo = 0, hi = manifest->num_chunks;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (manifest->offsets[mid + 1] <= offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
@@ -0,0 +1,53 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <stdint.h>
+
+#include "cdc.h"
+#include "frame.h"
+#include "spool.h"
+
+/* Content-addressed store of file chunks. A sender announces the SHA-256 of each
+ * content-defined chunk of its file (see cdc.h) and only uploads the ones the
+ * store doesn't have, the others are shared with the uploads that brought them.
+ * Chunks live in the spool file of the upload that stored them first and are
+ * reference counted by every upload using them. The last reference punches the
+ * chunk out of its spool file.
+ */
+
+#define CHUNK_STORE_BUCKETS 4096
+#define CHUNK_CRC_BLOCKS (CDC_MAX_CHUNK / FILE_CHUNK_SIZE) // FILE_CHUNK sized pieces of the biggest chunk
+
+typedef struct _CHUNK {
+	unsigned char hash[CHUNK_HASH_LEN];
+	uint32_t length;
+	SPOOL* spool; // holds a reference
+	uint64_t offset; // where in the spool
+	int stored; // every byte received and checked against the hash
+	int refs; // manifests using it
+	uint32_t block_crcs[CHUNK_CRC_BLOCKS]; // CRC32C of each FILE_CHUNK_SIZE piece, from the chunk's start
+	uint32_t crcs_known; // bit per piece whose CRC is in block_crcs
+	struct _CHUNK* next; // hash bucket
+} CHUNK;
+
+// a file as a list of chunks, in file order. a chunk repeated in the file is listed each time
+typedef struct _MANIFEST {
+	uint32_t num_chunks;
+	CHUNK** chunks;
+	uint64_t* offsets; // file offset of each chunk, num_chunks + 1 entries (the last is the file size)
+	unsigned char* needed; // one flag per chunk: the sender has to upload it
+	SPOOL* spool; // where the chunks the store lacked go
+	SPOOL** sources; // every spool the file's chunks are in, delivery streams read from these
+	uint32_t num_sources;
+	uint32_t* source_of; // index into sources for each chunk
+} MANIFEST;
+
+// NOTE: none of these lock, callers hold rooms_mutex
+
+MANIFEST* manifest_create(const char* owner, const ManifestEntry* entries, uint32_t num_chunks, uint64_t file_size, char** reason);
+void manifest_release(MANIFEST* manifest);
+uint32_t manifest_find_chunk(MANIFEST* manifest, uint64_t offset);
+int chunk_verify(CHUNK* chunk);
+uint32_t chunk_crc(CHUNK* chunk, uint32_t offset, uint32_t length);
+
+#endif
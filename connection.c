@@ -0,0 +1,704 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "connection.h"
+#include "transport.h"
+#include "metrics.h"
+#include "tracer.h"
+#include "probes.h"
+
+static void* conn_writer(void* args);
+
+/*========================================= FRAMES ==========================================*/
+
+// serializes a frame once so it can be queued on any number of connections
+OutFrame* outframe_create(FrameType type, uint32_t stream_id, const void* payload, uint32_t length) {
+	OutFrame* frame = (OutFrame*) malloc(sizeof(OutFrame) + FRAME_HEADER_LEN + length);
+	if (frame == NULL) error("ERROR allocating frame");
+
+	frame->refs = 1;
+	frame->received_at = 0;
+	frame->trace_id = 0;
+	frame->traffic_class = type == FRAME_CHAT ? CLASS_CHAT : CLASS_CONTROL; // announcements are marked by the caller
+	frame->len = FRAME_HEADER_LEN + length;
+
+	Buffer fh_buffer = { frame->data, FRAME_HEADER_LEN };
+	FrameHeader fh = { (uint8_t) type, stream_id, length };
+	serialize_frame_header(&fh_buffer, &fh);
+	if (length > 0) {
+		memcpy(frame->data + FRAME_HEADER_LEN, payload, length);
+	}
+
+	return frame;
+}
+
+// NOTE: a shared frame is released by several writer threads at once, so the count is atomic
+void outframe_release(OutFrame* frame) {
+	if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (frame->received_at != 0) {
+			// written (or dropped) everywhere it was queued
+			metrics_since(METRIC_BROADCAST, frame->received_at);
+		}
+		free(frame);
+	}
+}
+
+static void outframe_retain(OutFrame* frame) {
+	__atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*========================================= TRAFFIC CLASSES ==========================================*/
+
+#define VTIME_PER_BYTE 64 // virtual time a byte costs a class of weight 1, high enough for the weights to divide it
+
+static const uint32_t class_weights[NUM_CLASSES] = { CONTROL_WEIGHT, CHAT_WEIGHT, PRESENCE_WEIGHT, BULK_WEIGHT };
+static const double class_rate_limits[NUM_CLASSES] = {
+	CONTROL_RATE_LIMIT, CHAT_RATE_LIMIT, PRESENCE_RATE_LIMIT, BULK_RATE_LIMIT
+};
+
+static TokenBucket class_buckets[NUM_CLASSES]; // shared by every connection's writer
+static pthread_once_t buckets_once = PTHREAD_ONCE_INIT;
+
+static uint64_t elapsed_ns(const struct timespec* from, const struct timespec* to) {
+	return (to->tv_sec - from->tv_sec) * 1000000000ULL + to->tv_nsec - from->tv_nsec;
+}
+
+static void bucket_init(TokenBucket* bucket, double rate) {
+	pthread_mutex_init(&bucket->mutex, NULL);
+	bucket->rate = rate;
+	bucket->burst = rate * RATE_LIMIT_BURST_MS / 1000;
+	bucket->tokens = bucket->burst;
+	clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+static void init_class_buckets() {
+	for (int cls = 0; cls < NUM_CLASSES; cls++) {
+		bucket_init(&class_buckets[cls], class_rate_limits[cls]);
+	}
+}
+
+// nanoseconds until the bucket has tokens again, 0 if it has some now
+static uint64_t bucket_wait(TokenBucket* bucket) {
+	if (bucket->rate == 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&bucket->mutex);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bucket->tokens += elapsed_ns(&bucket->last, &now) * bucket->rate / 1e9;
+	if (bucket->tokens > bucket->burst) {
+		bucket->tokens = bucket->burst;
+	}
+	bucket->last = now;
+	uint64_t wait = bucket->tokens > 0 ? 0 : (uint64_t) (-bucket->tokens * 1e9 / bucket->rate) + 1;
+	pthread_mutex_unlock(&bucket->mutex);
+	return wait;
+}
+
+static void bucket_take(TokenBucket* bucket, uint32_t bytes) {
+	if (bucket->rate == 0) {
+		return;
+	}
+	pthread_mutex_lock(&bucket->mutex);
+	bucket->tokens -= bytes;
+	pthread_mutex_unlock(&bucket->mutex);
+}
+
+/*========================================= STREAMS ==========================================*/
+
+static OutStream* create_stream(uint32_t stream_id) {
+	OutStream* stream = (OutStream*) malloc(sizeof(OutStream));
+	if (stream == NULL) error("ERROR allocating stream");
+	memset(stream, 0, sizeof(OutStream));
+	stream->id = stream_id;
+	return stream;
+}
+
+static void close_stream_files(OutStream* stream) {
+	for (uint32_t i = 0; i < stream->num_files; i++) {
+		close(stream->filefds[i]);
+	}
+	free(stream->filefds);
+}
+
+// NOTE: an aborted stream may linger until the writer lets go of it, a resumed
+// delivery opens a fresh one under the same id
+static OutStream* find_stream(CONNECTION* conn, uint32_t stream_id) {
+	for (OutStream* cur = conn->streams; cur != NULL; cur = cur->next) {
+		if (cur->id == stream_id && !cur->aborted) {
+			return cur;
+		}
+	}
+	return NULL;
+}
+
+// entries queued on every connection and not yet written or dropped
+static size_t backlog;
+static size_t queued_bytes; // the frames' bytes of them, file chunks not counted
+static size_t connections;
+
+size_t conn_count() {
+	return __atomic_load_n(&connections, __ATOMIC_RELAXED);
+}
+
+size_t conn_queued_bytes() {
+	return __atomic_load_n(&queued_bytes, __ATOMIC_RELAXED);
+}
+
+void conn_queue_stats(CONNECTION* conn, ConnQueueStats* stats) {
+	stats->frames = __atomic_load_n(&conn->queued_frames, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&conn->queued_frame_bytes, __ATOMIC_RELAXED);
+	stats->backlogged_since = __atomic_load_n(&conn->backlogged_since, __ATOMIC_RELAXED);
+}
+
+size_t conn_backlog() {
+	return __atomic_load_n(&backlog, __ATOMIC_ACQUIRE);
+}
+
+// every entry that made it onto a queue leaves through here, written or not
+static void free_entry(OutEntry* entry) {
+	if (entry->frame != NULL) {
+		outframe_release(entry->frame);
+	}
+	free(entry);
+	__atomic_sub_fetch(&backlog, 1, __ATOMIC_RELEASE);
+}
+
+static void free_entries(OutEntry* entry) {
+	while (entry != NULL) {
+		OutEntry* next = entry->next;
+		free_entry(entry);
+		entry = next;
+	}
+}
+
+static void append_entry(OutStream* stream, OutEntry* entry) {
+	__atomic_add_fetch(&backlog, 1, __ATOMIC_RELAXED);
+	entry->next = NULL;
+	if (stream->tail == NULL) {
+		stream->head = entry;
+	} else {
+		stream->tail->next = entry;
+	}
+	stream->tail = entry;
+}
+
+// a class that had nothing queued starts where the connection's virtual time is, it doesn't get
+// credit for having been idle. guarded by conn->mutex
+static void wake_class(CONNECTION* conn, TrafficClass cls) {
+	OutClass* queue = &conn->classes[cls];
+	queue->start = queue->finish > conn->vtime ? queue->finish : conn->vtime;
+	pthread_cond_signal(&conn->cond);
+}
+
+// puts a stream with something to write at the back of the round-robin list, guarded by conn->mutex
+static void activate_stream(CONNECTION* conn, OutStream* stream) {
+	if (stream->active) {
+		return;
+	}
+	stream->active = 1;
+	stream->next_active = NULL;
+	if (conn->active_tail == NULL) {
+		conn->active_head = stream;
+		wake_class(conn, CLASS_BULK);
+	} else {
+		conn->active_tail->next_active = stream;
+	}
+	conn->active_tail = stream;
+}
+
+// takes a stream off the round-robin list, guarded by conn->mutex
+static void deactivate_stream(CONNECTION* conn, OutStream* stream) {
+	OutStream* prev = NULL;
+	for (OutStream* cur = conn->active_head; cur != stream; cur = cur->next_active) {
+		prev = cur;
+	}
+	if (prev == NULL) {
+		conn->active_head = stream->next_active;
+	} else {
+		prev->next_active = stream->next_active;
+	}
+	if (conn->active_tail == stream) {
+		conn->active_tail = prev;
+	}
+	stream->next_active = NULL;
+	stream->active = 0;
+	// an idle stream doesn't bank credit
+	stream->deficit = 0;
+	stream->turn = 0;
+}
+
+// frees a finished file stream once nobody is using it, guarded by conn->mutex
+static void maybe_free_stream(CONNECTION* conn, OutStream* stream) {
+	if (!stream->closing || stream->head != NULL || stream->refs > 0 || stream->active) {
+		return;
+	}
+
+	OutStream** link = &conn->streams;
+	while (*link != stream) {
+		link = &(*link)->next;
+	}
+	*link = stream->next;
+
+	close_stream_files(stream);
+	free(stream);
+}
+
+// opens a stream for chunks of the given files, which are duplicated so the stream doesn't
+// depend on the caller keeping them open. returns 0, or -1 if the connection is gone
+int conn_open_stream(CONNECTION* conn, uint32_t stream_id, const int* filefds, uint32_t num_files) {
+	OutStream* stream = create_stream(stream_id);
+	stream->filefds = (int*) malloc(num_files * sizeof(int));
+	if (stream->filefds == NULL) error("ERROR allocating stream files");
+	while (stream->num_files < num_files) {
+		int fd = fcntl(filefds[stream->num_files], F_DUPFD_CLOEXEC, 0);
+		if (fd < 0) {
+			close_stream_files(stream);
+			free(stream);
+			return -1;
+		}
+		stream->filefds[stream->num_files++] = fd;
+	}
+
+	pthread_mutex_lock(&conn->mutex);
+	if (conn->dead) {
+		pthread_mutex_unlock(&conn->mutex);
+		close_stream_files(stream);
+		free(stream);
+		return -1;
+	}
+	stream->next = conn->streams;
+	conn->streams = stream;
+	pthread_mutex_unlock(&conn->mutex);
+
+	return 0;
+}
+
+// queues a FILE_CHUNK of chunk_len bytes at file offset offset, read from the stream's file
+// number source starting at source_offset, behind what is already there
+int conn_push_chunk(CONNECTION* conn, uint32_t stream_id, uint64_t offset, uint32_t source, uint64_t source_offset,
+uint32_t chunk_len, uint32_t crc) {
+	OutEntry* entry = (OutEntry*) malloc(sizeof(OutEntry));
+	if (entry == NULL) error("ERROR allocating stream entry");
+	memset(entry, 0, sizeof(OutEntry));
+	entry->chunk_len = chunk_len;
+	entry->offset = offset;
+	entry->source = source;
+	entry->source_offset = source_offset;
+	entry->crc = crc;
+
+	pthread_mutex_lock(&conn->mutex);
+	OutStream* stream = find_stream(conn, stream_id);
+	if (stream == NULL || stream->closing || conn->dead || source >= stream->num_files) {
+		pthread_mutex_unlock(&conn->mutex);
+		free(entry);
+		return -1;
+	}
+	append_entry(stream, entry);
+	activate_stream(conn, stream);
+	pthread_mutex_unlock(&conn->mutex);
+
+	return 0;
+}
+
+// queues a last frame behind the stream's file bytes (so it can't overtake them) and closes the stream
+int conn_finish_stream(CONNECTION* conn, uint32_t stream_id, OutFrame* last) {
+	pthread_mutex_lock(&conn->mutex);
+	OutStream* stream = find_stream(conn, stream_id);
+	if (stream == NULL || stream->closing || conn->dead) {
+		pthread_mutex_unlock(&conn->mutex);
+		return -1;
+	}
+
+	if (last != NULL) {
+		OutEntry* entry = (OutEntry*) malloc(sizeof(OutEntry));
+		if (entry == NULL) error("ERROR allocating stream entry");
+		outframe_retain(last);
+		memset(entry, 0, sizeof(OutEntry));
+		entry->frame = last;
+		append_entry(stream, entry);
+		activate_stream(conn, stream);
+	}
+	stream->closing = 1;
+	maybe_free_stream(conn, stream);
+	pthread_mutex_unlock(&conn->mutex);
+
+	return 0;
+}
+
+// drops a file stream and whatever of it is still queued
+void conn_abort_stream(CONNECTION* conn, uint32_t stream_id) {
+	pthread_mutex_lock(&conn->mutex);
+	OutStream* stream = find_stream(conn, stream_id);
+	if (stream != NULL) {
+		while (stream->head != NULL) {
+			OutEntry* entry = stream->head;
+			stream->head = entry->next;
+			free_entry(entry);
+		}
+		stream->tail = NULL;
+		stream->aborted = 1;
+		stream->closing = 1;
+		// being written the writer frees it
+		if (stream->active && stream->refs == 0) {
+			deactivate_stream(conn, stream);
+		}
+		maybe_free_stream(conn, stream);
+	}
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+/*========================================= CONNECTION ==========================================*/
+
+// wraps an accepted socket and starts its writer thread
+CONNECTION* conn_create(int fd) {
+	CONNECTION* conn = (CONNECTION*) malloc(sizeof(CONNECTION));
+	if (conn == NULL) error("ERROR allocating connection");
+	memset(conn, 0, sizeof(CONNECTION));
+
+	conn->fd = fd;
+	conn->refs = 2; // the caller and the writer thread
+	__atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+	pthread_once(&buckets_once, init_class_buckets);
+	bucket_init(&conn->user_bucket, USER_BULK_RATE_LIMIT);
+	pthread_mutex_init(&conn->mutex, NULL);
+	// timed waits for tokens are on the monotonic clock
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&conn->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	// a full socket buffer would be megabytes of file data ahead of any chat line, keep it short
+	// so the writer's queues decide the order
+	int lowat = UNSENT_LOWAT;
+	setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+	// frames go out back to back and small, Nagle would hold each behind the peer's delayed ACK.
+	// write_entry() passes MSG_MORE where a header has its payload right behind it
+	int yes = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, conn_writer, (void*) conn) != 0) {
+		error("ERROR creating connection writer thread");
+	}
+	pthread_detach(tid);
+
+	return conn;
+}
+
+void conn_retain(CONNECTION* conn) {
+	pthread_mutex_lock(&conn->mutex);
+	conn->refs++;
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+// the last reference closes the socket, so its descriptor can't be reused while anyone still writes to it
+void conn_release(CONNECTION* conn) {
+	pthread_mutex_lock(&conn->mutex);
+	int refs = --conn->refs;
+	pthread_mutex_unlock(&conn->mutex);
+	if (refs > 0) {
+		return;
+	}
+
+	for (int cls = 0; cls < NUM_CLASSES; cls++) {
+		free_entries(conn->classes[cls].head);
+	}
+	OutStream* stream = conn->streams;
+	while (stream != NULL) {
+		OutStream* next = stream->next;
+		free_entries(stream->head);
+		close_stream_files(stream);
+		free(stream);
+		stream = next;
+	}
+
+	transport->close(conn->fd);
+	__atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+	pthread_mutex_destroy(&conn->user_bucket.mutex);
+	pthread_mutex_destroy(&conn->mutex);
+	pthread_cond_destroy(&conn->cond);
+	free(conn);
+}
+
+// graceful: the writer flushes what is queued, then shuts the socket down
+void conn_close(CONNECTION* conn) {
+	pthread_mutex_lock(&conn->mutex);
+	conn->closing = 1;
+	pthread_cond_signal(&conn->cond);
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+// immediate: queued data is dropped and blocked reads and writes on the socket fail
+void conn_abort(CONNECTION* conn) {
+	pthread_mutex_lock(&conn->mutex);
+	conn->dead = 1;
+	transport->shutdown(conn->fd, SHUT_RDWR);
+	pthread_cond_signal(&conn->cond);
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+// queues a frame on its class. returns -1 if the connection is gone or too far behind
+int conn_enqueue_frame(CONNECTION* conn, OutFrame* frame) {
+	OutEntry* entry = (OutEntry*) malloc(sizeof(OutEntry));
+	if (entry == NULL) error("ERROR allocating stream entry");
+	memset(entry, 0, sizeof(OutEntry));
+	entry->frame = frame;
+
+	pthread_mutex_lock(&conn->mutex);
+	if (conn->dead) {
+		pthread_mutex_unlock(&conn->mutex);
+		free(entry);
+		return -1;
+	}
+	if (conn->queued_frame_bytes + frame->len > MAX_QUEUED_FRAME_BYTES) {
+		// a client this far behind would hold an unbounded amount of memory, cut it loose
+		conn->dead = 1;
+		transport->shutdown(conn->fd, SHUT_RDWR);
+		pthread_cond_signal(&conn->cond);
+		pthread_mutex_unlock(&conn->mutex);
+		free(entry);
+		return -1;
+	}
+	outframe_retain(frame);
+	if (frame->trace_id != 0) {
+		entry->enqueued_at = metrics_now();
+		trace_enqueue(frame->trace_id, conn->fd, entry->enqueued_at);
+	}
+	__atomic_add_fetch(&backlog, 1, __ATOMIC_RELAXED);
+	if (conn->queued_frames == 0) {
+		__atomic_store_n(&conn->backlogged_since, metrics_now(), __ATOMIC_RELAXED);
+	}
+	// only changed under the mutex, stored atomically for conn_queue_stats()
+	__atomic_store_n(&conn->queued_frames, conn->queued_frames + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&conn->queued_frame_bytes, conn->queued_frame_bytes + frame->len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&queued_bytes, frame->len, __ATOMIC_RELAXED);
+	OutClass* queue = &conn->classes[frame->traffic_class];
+	if (queue->head == NULL) {
+		queue->head = entry;
+		wake_class(conn, frame->traffic_class);
+	} else {
+		queue->tail->next = entry;
+	}
+	queue->tail = entry;
+	pthread_mutex_unlock(&conn->mutex);
+
+	return 0;
+}
+
+/*========================================= WRITER ==========================================*/
+
+static uint32_t entry_cost(OutEntry* entry) {
+	return entry->frame != NULL ? entry->frame->len : FRAME_HEADER_LEN + CHUNK_PREFIX_LEN + entry->chunk_len;
+}
+
+// writes one entry to the socket, file bytes go from the page cache to the socket with sendfile()
+static int write_entry(int fd, OutStream* stream, OutEntry* entry) {
+	if (entry->frame != NULL) {
+		return send_all(fd, entry->frame->data, entry->frame->len, 0);
+	}
+
+	if (send_chunk_header(fd, stream->id, entry->offset, entry->crc, entry->chunk_len, MSG_MORE) < 0) {
+		return -1;
+	}
+	off_t offset = entry->source_offset;
+	uint32_t remaining = entry->chunk_len;
+	while (remaining > 0) {
+		ssize_t n = transport->sendfile(fd, stream->filefds[entry->source], &offset, remaining);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		remaining -= n;
+	}
+	return 0;
+}
+
+// nanoseconds until the class may send again, 0 if it may now
+static uint64_t class_wait(CONNECTION* conn, TrafficClass cls) {
+	uint64_t wait = bucket_wait(&class_buckets[cls]);
+	if (cls == CLASS_BULK) {
+		uint64_t user_wait = bucket_wait(&conn->user_bucket);
+		if (user_wait > wait) {
+			wait = user_wait;
+		}
+	}
+	return wait;
+}
+
+// start-time fair queueing over the classes: of those with something queued and tokens to send it,
+// the one with the lowest start tag goes next, a tie goes to the more interactive class. returns -1
+// if none can go, with wait_ns set to when the first throttled one can (0 if nothing is queued)
+static int pick_class(CONNECTION* conn, uint64_t* wait_ns) {
+	int best = -1;
+	*wait_ns = 0;
+	for (int cls = 0; cls < NUM_CLASSES; cls++) {
+		if (cls == CLASS_BULK ? conn->active_head == NULL : conn->classes[cls].head == NULL) {
+			continue;
+		}
+		uint64_t wait = class_wait(conn, cls);
+		if (wait > 0) {
+			if (*wait_ns == 0 || wait < *wait_ns) {
+				*wait_ns = wait;
+			}
+			continue;
+		}
+		if (best < 0 || conn->classes[cls].start < conn->classes[best].start) {
+			best = cls;
+		}
+	}
+	return best;
+}
+
+// deficit round-robin over the file streams: a stream earns DRR_QUANTUM bytes of credit when its
+// turn comes and keeps the turn while it can pay for its next entry
+static OutStream* next_bulk_stream(CONNECTION* conn) {
+	while (1) {
+		OutStream* stream = conn->active_head;
+		if (!stream->turn) {
+			stream->turn = 1;
+			stream->deficit += DRR_QUANTUM;
+		}
+		if (entry_cost(stream->head) <= stream->deficit) {
+			return stream;
+		}
+		// to the back of the line with the credit it has left
+		stream->turn = 0;
+		if (stream->next_active != NULL) {
+			conn->active_head = stream->next_active;
+			stream->next_active = NULL;
+			conn->active_tail->next_active = stream;
+			conn->active_tail = stream;
+		}
+	}
+}
+
+// sends one entry at a time from the class pick_class() chooses, until the connection dies or is
+// closed with nothing left to send
+static void* conn_writer(void* args) {
+	CONNECTION* conn = (CONNECTION*) args;
+	char name[16];
+	snprintf(name, sizeof(name), "w:%d", conn->fd);
+	name_thread(name);
+
+	pthread_mutex_lock(&conn->mutex);
+	while (!conn->dead) {
+		uint64_t wait_ns;
+		int cls = pick_class(conn, &wait_ns);
+		if (cls < 0) {
+			if (wait_ns > 0) {
+				// throttled, the tokens are back by then unless something else wakes us first
+				struct timespec deadline;
+				clock_gettime(CLOCK_MONOTONIC, &deadline);
+				deadline.tv_sec += (deadline.tv_nsec + wait_ns) / 1000000000;
+				deadline.tv_nsec = (deadline.tv_nsec + wait_ns) % 1000000000;
+				pthread_cond_timedwait(&conn->cond, &conn->mutex, &deadline);
+			} else if (conn->closing) {
+				break;
+			} else {
+				pthread_cond_wait(&conn->cond, &conn->mutex);
+			}
+			continue;
+		}
+
+		OutClass* queue = &conn->classes[cls];
+		OutStream* stream = NULL;
+		OutEntry* entry;
+		if (cls == CLASS_BULK) {
+			stream = next_bulk_stream(conn);
+			entry = stream->head;
+			stream->head = entry->next;
+			if (stream->head == NULL) {
+				stream->tail = NULL;
+			}
+			stream->deficit -= entry_cost(entry);
+			stream->refs++;
+		} else {
+			entry = queue->head;
+			queue->head = entry->next;
+			if (queue->head == NULL) {
+				queue->tail = NULL;
+			}
+			__atomic_store_n(&conn->queued_frame_bytes, conn->queued_frame_bytes - entry->frame->len, __ATOMIC_RELAXED);
+			__atomic_store_n(&conn->queued_frames, conn->queued_frames - 1, __ATOMIC_RELAXED);
+			if (conn->queued_frames == 0) {
+				__atomic_store_n(&conn->backlogged_since, 0, __ATOMIC_RELAXED);
+			}
+			__atomic_sub_fetch(&queued_bytes, entry->frame->len, __ATOMIC_RELAXED);
+		}
+
+		uint32_t cost = entry_cost(entry);
+		conn->vtime = queue->start;
+		queue->finish = queue->start + (uint64_t) cost * VTIME_PER_BYTE / class_weights[cls];
+		queue->start = queue->finish;
+		bucket_take(&class_buckets[cls], cost);
+		if (cls == CLASS_BULK) {
+			bucket_take(&conn->user_bucket, cost);
+		}
+
+		// write without the lock so producers can keep queueing
+		pthread_mutex_unlock(&conn->mutex);
+		uint64_t write_at = entry->enqueued_at != 0 ? metrics_now() : 0;
+		int status = write_entry(conn->fd, stream, entry);
+		if (status == 0) {
+			metrics_count(COUNTER_FRAMES_OUT, 1);
+			metrics_count(COUNTER_BYTES_OUT, cost);
+			PROBE3(frame__write, conn->fd, cls, cost);
+			if (write_at != 0) {
+				trace_write(entry->frame->trace_id, conn->fd, entry->enqueued_at, write_at);
+			}
+		}
+		free_entry(entry);
+		pthread_mutex_lock(&conn->mutex);
+
+		if (status < 0) {
+			conn->dead = 1;
+		}
+		if (stream != NULL) {
+			stream->refs--;
+			if (stream->head == NULL) {
+				deactivate_stream(conn, stream);
+				maybe_free_stream(conn, stream);
+			}
+		}
+	}
+
+	// nothing is written to this socket again
+	conn->dead = 1;
+	transport->shutdown(conn->fd, SHUT_RDWR);
+	for (int cls = 0; cls < NUM_CLASSES; cls++) {
+		free_entries(conn->classes[cls].head);
+		conn->classes[cls].head = NULL;
+		conn->classes[cls].tail = NULL;
+	}
+	__atomic_sub_fetch(&queued_bytes, conn->queued_frame_bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&conn->queued_frame_bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&conn->queued_frames, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&conn->backlogged_since, 0, __ATOMIC_RELAXED);
+	conn->active_head = NULL;
+	conn->active_tail = NULL;
+	OutStream* stream = conn->streams;
+	while (stream != NULL) {
+		OutStream* next = stream->next;
+		free_entries(stream->head);
+		stream->head = NULL;
+		stream->tail = NULL;
+		stream->active = 0;
+		stream->closing = 1;
+		stream->aborted = 1;
+		maybe_free_stream(conn, stream);
+		stream = next;
+	}
+	pthread_mutex_unlock(&conn->mutex);
+
+	conn_release(conn);
+	return NULL;
+}
@@ -0,0 +1,158 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "frame.h"
+
+/* Outbound side of a client connection. Nothing but the connection's writer thread
+ * writes to its socket. What it sends falls into four traffic classes: control
+ * (file negotiation and progress), chat, presence (joins and leaves) and bulk (file
+ * bytes). Every file delivery gets its own stream whose chunks are byte ranges of
+ * spool files, sent with sendfile() when their turn comes, and the bulk class
+ * interleaves those streams with deficit round-robin. Between the classes the
+ * writer does weighted fair queueing, so a chat line waits for at most one chunk
+ * of a multi-gigabyte file, and token buckets can cap a class across the whole
+ * server and the file bytes each user is sent.
+ */
+
+typedef enum _TrafficClass {
+	CLASS_CONTROL,
+	CLASS_CHAT,
+	CLASS_PRESENCE,
+	CLASS_BULK, // FILE_CHUNKs and the frames that close their streams
+	NUM_CLASSES
+} TrafficClass;
+
+// share of a saturated connection each class gets while they are all backlogged
+#define CONTROL_WEIGHT 8
+#define CHAT_WEIGHT 4
+#define PRESENCE_WEIGHT 2
+#define BULK_WEIGHT 1
+
+// egress limits in bytes per second, 0 for none. the class limits are for all connections together
+#define CONTROL_RATE_LIMIT 0
+#define CHAT_RATE_LIMIT 0
+#define PRESENCE_RATE_LIMIT 0
+#define BULK_RATE_LIMIT 0
+#define USER_BULK_RATE_LIMIT 0 // file bytes sent to any one client
+#define RATE_LIMIT_BURST_MS 100 // a bucket holds this long's worth of tokens
+
+#define UNSENT_LOWAT (128 * 1024) // bytes the kernel may hold unsent, anything past that still waits on our queues
+#define DRR_QUANTUM FILE_CHUNK_SIZE // bytes a stream may write per scheduler round
+#define MAX_QUEUED_FRAME_BYTES (4 * 1024 * 1024) // buffered frames before a client counts as a slow consumer
+
+// a serialized frame waiting to be written. a broadcast frame is built once and shared by every queue it is on
+typedef struct _OutFrame {
+	int refs;
+	TrafficClass traffic_class; // queue it goes on, unless it closes a file stream
+	uint64_t received_at; // a chat line's metrics_now() when it was read, timed until the last queue lets go of it. 0 for none
+	uint64_t trace_id; // a sampled chat line's, see tracer.h. 0 for none
+	uint32_t len; // header + payload
+	unsigned char data[];
+} OutFrame;
+
+// one thing a stream has to write, in order
+typedef struct _OutEntry {
+	OutFrame* frame; // frame to write, or NULL for a FILE_CHUNK read from one of the file stream's files
+	uint32_t chunk_len; // file bytes in the chunk when frame is NULL
+	uint64_t offset; // file offset of the first of them, as the receiver sees it
+	uint32_t source; // which of the stream's files they are read from
+	uint64_t source_offset; // and where in it
+	uint32_t crc; // CRC32C of those bytes, sent in the chunk's prefix
+	uint64_t enqueued_at; // metrics_now() when a traced frame was queued
+	struct _OutEntry* next;
+} OutEntry;
+
+// a file delivery, part of the bulk class
+typedef struct _OutStream {
+	uint32_t id;
+	int* filefds; // files the chunks are read from (our own descriptors)
+	uint32_t num_files;
+	OutEntry* head;
+	OutEntry* tail;
+	uint32_t deficit; // DRR credit carried between rounds while the stream is backlogged
+	int turn; // got its quantum and is at the front of the round-robin list
+	int active; // on the writer's round-robin list
+	int closing; // free once drained
+	int aborted; // drop whatever is queued
+	int refs; // the writer mid-write
+	struct _OutStream* next; // every stream of the connection
+	struct _OutStream* next_active; // round-robin list
+} OutStream;
+
+// the frames of a class waiting on one connection (bulk keeps its entries on the file streams)
+typedef struct _OutClass {
+	OutEntry* head;
+	OutEntry* tail;
+	uint64_t start; // virtual time the class's next entry starts at while it is backlogged
+	uint64_t finish; // and the one its last entry finished at
+} OutClass;
+
+typedef struct _TokenBucket {
+	pthread_mutex_t mutex;
+	double rate; // bytes per second, 0 for no limit
+	double burst;
+	double tokens; // goes negative when an entry costs more than is left, the debt is paid off before the next one
+	struct timespec last; // last refill
+} TokenBucket;
+
+typedef struct _CONNECTION {
+	int fd;
+	int refs;
+	int closing; // flush what is queued, then stop
+	int dead; // socket failed, aborted or writer gone: drop everything
+	size_t queued_frame_bytes; // queued on the control, chat and presence classes
+	size_t queued_frames; // the frames themselves
+	uint64_t backlogged_since; // metrics_now() when those queues were last empty, 0 while they are
+	OutClass classes[NUM_CLASSES];
+	uint64_t vtime; // start tag of the entry written last
+	OutStream* streams; // file streams
+	OutStream* active_head; // file streams with something to write, in DRR order
+	OutStream* active_tail;
+	TokenBucket user_bucket; // file bytes to this client
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} CONNECTION;
+
+// CONNECTION LIFETIME
+
+CONNECTION* conn_create(int fd);
+void conn_retain(CONNECTION* conn);
+void conn_release(CONNECTION* conn);
+void conn_close(CONNECTION* conn);
+void conn_abort(CONNECTION* conn);
+
+// entries queued across all connections, 0 once every writer has caught up
+size_t conn_backlog();
+// bytes of the queued frames (file chunks aren't counted) and the connections open
+size_t conn_queued_bytes();
+size_t conn_count();
+
+// the frames queued for one client and since when it has had any, read without its mutex.
+// written under it with atomic stores, so the three can be a write apart from each other
+typedef struct _ConnQueueStats {
+	size_t frames;
+	size_t bytes;
+	uint64_t backlogged_since;
+} ConnQueueStats;
+
+void conn_queue_stats(CONNECTION* conn, ConnQueueStats* stats);
+
+// FRAMES
+
+OutFrame* outframe_create(FrameType type, uint32_t stream_id, const void* payload, uint32_t length);
+void outframe_release(OutFrame* frame);
+int conn_enqueue_frame(CONNECTION* conn, OutFrame* frame);
+
+// FILE STREAMS
+
+int conn_open_stream(CONNECTION* conn, uint32_t stream_id, const int* filefds, uint32_t num_files);
+int conn_push_chunk(CONNECTION* conn, uint32_t stream_id, uint64_t offset, uint32_t source, uint64_t source_offset,
+uint32_t chunk_len, uint32_t crc);
+int conn_finish_stream(CONNECTION* conn, uint32_t stream_id, OutFrame* last);
+void conn_abort_stream(CONNECTION* conn, uint32_t stream_id);
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "exporter.h"
+#include "metrics.h"
+#include "connection.h"
+#include "room.h"
+#include "util.h"
+
+static const char* const status_names[NUM_HANDSHAKE_STATUSES] = {
+	"success", "pending", "failure", "success_new", "resumed"
+};
+
+// upper bounds of the histogram buckets, in seconds
+static const double bucket_bounds[] = {
+	0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1,
+	2.5, 5, 10
+};
+#define NUM_BOUNDS (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]))
+
+static const char* const metric_help[NUM_METRICS] = {
+	"Handshake requests, from read to confirmation sent.",
+	"Chat lines, from read off the sender's socket to written to the last member's.",
+	"Join and leave announcements queued for a room.",
+	"File chunk frames, from prefix read to stored, checked and acknowledged.",
+	"Files, from offered to fully spooled.",
+	"Files to one receiver, from accepted to delivered."
+};
+
+static Histogram snapshot[NUM_METRICS]; // only the exporter thread uses these
+static uint64_t counters[NUM_COUNTERS];
+
+static void print_counter(FILE* out, const char* name, const char* help, uint64_t value) {
+	fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long) value);
+}
+
+static void print_gauge(FILE* out, const char* name, const char* help, uint64_t value) {
+	fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %llu\n", name, help, name, name, (unsigned long long) value);
+}
+
+static void print_histogram(FILE* out, Metric metric) {
+	Histogram* hist = &snapshot[metric];
+	const char* name = metric_names[metric];
+	fprintf(out, "# HELP chat_%s_seconds %s\n# TYPE chat_%s_seconds histogram\n", name, metric_help[metric], name);
+	for (size_t i = 0; i < NUM_BOUNDS; i++) {
+		fprintf(out, "chat_%s_seconds_bucket{le=\"%g\"} %llu\n", name, bucket_bounds[i],
+		(unsigned long long) hist_count_below(hist, (uint64_t) (bucket_bounds[i] * 1e9)));
+	}
+	fprintf(out, "chat_%s_seconds_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) hist->total);
+	fprintf(out, "chat_%s_seconds_sum %.9f\n", name, hist->sum / 1e9);
+	fprintf(out, "chat_%s_seconds_count %llu\n", name, (unsigned long long) hist->total);
+}
+
+static void print_metrics(FILE* out) {
+	metrics_counters(counters);
+	metrics_snapshot(snapshot);
+	RoomStats* rooms = room_stats_acquire();
+
+	print_counter(out, "chat_connections_accepted_total", "Connections accepted.", counters[COUNTER_ACCEPTED]);
+	print_gauge(out, "chat_connections", "Client connections past the handshake.", conn_count());
+
+	fprintf(out, "# HELP chat_handshakes_total Handshake confirmations sent, by status.\n"
+	"# TYPE chat_handshakes_total counter\n");
+	for (int i = 0; i < NUM_HANDSHAKE_STATUSES; i++) {
+		fprintf(out, "chat_handshakes_total{status=\"%s\"} %llu\n", status_names[i],
+		(unsigned long long) counters[COUNTER_HANDSHAKES + i]);
+	}
+
+	if (rooms != NULL) {
+		print_gauge(out, "chat_rooms", "Rooms.", rooms->num_rooms);
+		print_gauge(out, "chat_detached_members", "Members whose place is held for a resume.", rooms->detached);
+		fprintf(out, "# HELP chat_room_members Members of a room, attached or not.\n# TYPE chat_room_members gauge\n");
+		for (int i = 0; i < rooms->num_rooms; i++) {
+			fprintf(out, "chat_room_members{room=\"%d\"} %d\n", rooms->rooms[i].room_number, rooms->rooms[i].members);
+		}
+	}
+	room_stats_release(rooms);
+
+	print_counter(out, "chat_messages_received_total", "Chat lines broadcast.", counters[COUNTER_MESSAGES_IN]);
+	print_counter(out, "chat_received_bytes_total", "Bytes of frames read from clients.", counters[COUNTER_BYTES_IN]);
+	print_counter(out, "chat_sent_frames_total", "Frames and file chunks written to clients.", counters[COUNTER_FRAMES_OUT]);
+	print_counter(out, "chat_sent_bytes_total", "Bytes written to clients.", counters[COUNTER_BYTES_OUT]);
+	print_gauge(out, "chat_send_queue_entries", "Frames and file chunks queued for clients.", conn_backlog());
+	print_gauge(out, "chat_send_queue_bytes", "Bytes of the frames queued for clients, file chunks not counted.",
+	conn_queued_bytes());
+
+	for (int m = 0; m < NUM_METRICS; m++) {
+		print_histogram(out, (Metric) m);
+	}
+}
+
+// reads the request (whatever it asks for, the answer is the same) and answers it
+static void serve(int fd) {
+	char request[EXPORTER_REQUEST_MAX];
+	size_t len = 0;
+	while (len < sizeof(request) - 1) {
+		ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+		if (n <= 0) {
+			return;
+		}
+		len += n;
+		request[len] = '\0';
+		if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+			break;
+		}
+	}
+
+	char* body = NULL;
+	size_t body_len = 0;
+	FILE* out = open_memstream(&body, &body_len);
+	if (out == NULL) error("ERROR opening metrics buffer");
+	print_metrics(out);
+	fclose(out);
+
+	char header[256];
+	int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+	"Content-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+	// a real socket whatever transport the server is on
+	if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len) {
+		size_t sent = 0;
+		while (sent < body_len) {
+			ssize_t n = send(fd, body + sent, body_len - sent, MSG_NOSIGNAL);
+			if (n <= 0) {
+				break;
+			}
+			sent += n;
+		}
+	}
+	free(body);
+}
+
+static void* exporter_main(void* args) {
+	int listenfd = *(int*) args;
+	free(args);
+	name_thread("exporter");
+
+	while (1) {
+		int fd = accept(listenfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EMFILE || errno == ENFILE) {
+				usleep(100000);
+			}
+			continue;
+		}
+		struct timeval timeout = { EXPORTER_TIMEOUT_MS / 1000, (EXPORTER_TIMEOUT_MS % 1000) * 1000 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+void exporter_start(int port) {
+	int* listenfd = (int*) malloc(sizeof(int));
+	if (listenfd == NULL) error("ERROR allocating exporter arguments");
+	*listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (*listenfd < 0) error("ERROR opening metrics socket");
+	int yes = 1;
+	setsockopt(*listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+	// local only, put a proxy in front to scrape it from elsewhere
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(*listenfd, (struct sockaddr*) &addr, sizeof(addr)) < 0) error("ERROR binding metrics socket");
+	if (listen(*listenfd, 16) < 0) error("ERROR on listen for metrics");
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, exporter_main, listenfd) != 0) {
+		error("ERROR creating metrics thread");
+	}
+	pthread_detach(tid);
+}
@@ -0,0 +1,17 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+/* main_server -M <port>: an HTTP endpoint on 127.0.0.1 that answers every
+ * request with the server's metrics in the Prometheus text format. It runs on
+ * its own thread and only reads what the server publishes without a lock: the
+ * per-thread counters and histograms (metrics.h), the connection totals
+ * (connection.h) and the room copy the reaper thread makes every second
+ * (room.h). A scrape never takes rooms_mutex or a connection's mutex.
+ */
+
+#define EXPORTER_TIMEOUT_MS 1000 // a scraper that doesn't send its request in this long is dropped
+#define EXPORTER_REQUEST_MAX 4096
+
+void exporter_start(int port);
+
+#endif
@@ -0,0 +1,304 @@
+#include "frame.h"
+
+/*========================================= FRAME HEADER ==========================================*/
+
+/* ---------------------------------------- SERIALIZATION ---------------------------------------- */
+
+// serializes a FrameHeader into a buffer of FRAME_HEADER_LEN bytes
+size_t serialize_frame_header(Buffer* fh_buffer, FrameHeader* fh) {
+	assert(fh_buffer->size == sizeof(FrameHeader));
+
+	size_t offset = 0;
+
+	// serialize type (single byte, no endianness)
+	memcpy(fh_buffer->data + offset, &fh->type, sizeof(fh->type));
+	offset += sizeof(fh->type);
+
+	// serialize stream id
+	uint32_t stream_id_net = htonl(fh->stream_id);
+	memcpy(fh_buffer->data + offset, &stream_id_net, sizeof(stream_id_net));
+	offset += sizeof(stream_id_net);
+
+	// serialize payload length
+	uint32_t length_net = htonl(fh->length);
+	memcpy(fh_buffer->data + offset, &length_net, sizeof(length_net));
+	offset += sizeof(length_net);
+
+	return offset;
+}
+
+/* ---------------------------------------- DESERIALIZATION ---------------------------------------- */
+
+// deserializes a buffer of FRAME_HEADER_LEN bytes into a FrameHeader
+size_t deserialize_frame_header(FrameHeader* fh, Buffer* fh_buffer) {
+	assert(fh_buffer->size == sizeof(FrameHeader));
+
+	size_t offset = 0;
+
+	// deserialize type
+	memcpy(&fh->type, fh_buffer->data + offset, sizeof(fh->type));
+	offset += sizeof(fh->type);
+
+	// deserialize stream id
+	uint32_t stream_id_net = 0;
+	memcpy(&stream_id_net, fh_buffer->data + offset, sizeof(stream_id_net));
+	fh->stream_id = ntohl(stream_id_net);
+	offset += sizeof(stream_id_net);
+
+	// deserialize payload length
+	uint32_t length_net = 0;
+	memcpy(&length_net, fh_buffer->data + offset, sizeof(length_net));
+	fh->length = ntohl(length_net);
+	offset += sizeof(length_net);
+
+	return offset;
+}
+
+/*========================================= FILE PAYLOADS ==========================================*/
+
+/* ---------------------------------------- SERIALIZATION ---------------------------------------- */
+
+// serializes a FileOffer (FRAME_FILE_OFFER payload) into a buffer
+size_t serialize_file_offer(Buffer* fo_buffer, FileOffer* fo) {
+	assert(fo_buffer->size == sizeof(FileOffer));
+
+	size_t offset = 0;
+
+	// serialize peer username and file name (char arrays, no endianness)
+	memcpy(fo_buffer->data + offset, fo->peer, sizeof(fo->peer));
+	offset += sizeof(fo->peer);
+	memcpy(fo_buffer->data + offset, fo->file_name, sizeof(fo->file_name));
+	offset += sizeof(fo->file_name);
+
+	// serialize file size
+	uint64_t file_size_net = htobe64(fo->file_size);
+	memcpy(fo_buffer->data + offset, &file_size_net, sizeof(file_size_net));
+	offset += sizeof(file_size_net);
+
+	// serialize chunk count
+	uint32_t chunk_count_net = htonl(fo->chunk_count);
+	memcpy(fo_buffer->data + offset, &chunk_count_net, sizeof(chunk_count_net));
+	offset += sizeof(chunk_count_net);
+
+	// serialize digest
+	uint64_t digest_net = htobe64(fo->digest);
+	memcpy(fo_buffer->data + offset, &digest_net, sizeof(digest_net));
+	offset += sizeof(digest_net);
+
+	return offset;
+}
+
+// serializes a FileProgress (FRAME_FILE_ACCEPT and FRAME_FILE_ACK payload) into a buffer
+size_t serialize_file_progress(Buffer* fp_buffer, FileProgress* fp) {
+	assert(fp_buffer->size == sizeof(FileProgress));
+
+	size_t offset = 0;
+
+	// serialize offset
+	uint64_t offset_net = htobe64(fp->offset);
+	memcpy(fp_buffer->data + offset, &offset_net, sizeof(offset_net));
+	offset += sizeof(offset_net);
+
+	// serialize window
+	uint32_t window_net = htonl(fp->window);
+	memcpy(fp_buffer->data + offset, &window_net, sizeof(window_net));
+	offset += sizeof(window_net);
+
+	return offset;
+}
+
+// serializes a ManifestEntry (one record of a FRAME_FILE_MANIFEST payload) into a buffer
+size_t serialize_manifest_entry(Buffer* me_buffer, ManifestEntry* me) {
+	assert(me_buffer->size == sizeof(ManifestEntry));
+
+	size_t offset = 0;
+
+	// serialize chunk length
+	uint32_t length_net = htonl(me->length);
+	memcpy(me_buffer->data + offset, &length_net, sizeof(length_net));
+	offset += sizeof(length_net);
+
+	// serialize hash (byte array, no endianness)
+	memcpy(me_buffer->data + offset, me->hash, sizeof(me->hash));
+	offset += sizeof(me->hash);
+
+	return offset;
+}
+
+/* ---------------------------------------- DESERIALIZATION ---------------------------------------- */
+
+// deserializes a FRAME_FILE_OFFER payload into a FileOffer
+size_t deserialize_file_offer(FileOffer* fo, Buffer* fo_buffer) {
+	assert(fo_buffer->size == sizeof(FileOffer));
+
+	size_t offset = 0;
+
+	// deserialize peer username and file name, forcing termination since they came off the wire
+	memcpy(fo->peer, fo_buffer->data + offset, sizeof(fo->peer));
+	fo->peer[MAX_USERNAME_LEN - 1] = '\0';
+	offset += sizeof(fo->peer);
+	memcpy(fo->file_name, fo_buffer->data + offset, sizeof(fo->file_name));
+	fo->file_name[MAX_FILENAME_LEN - 1] = '\0';
+	offset += sizeof(fo->file_name);
+
+	// deserialize file size
+	uint64_t file_size_net = 0;
+	memcpy(&file_size_net, fo_buffer->data + offset, sizeof(file_size_net));
+	fo->file_size = be64toh(file_size_net);
+	offset += sizeof(file_size_net);
+
+	// deserialize chunk count
+	uint32_t chunk_count_net = 0;
+	memcpy(&chunk_count_net, fo_buffer->data + offset, sizeof(chunk_count_net));
+	fo->chunk_count = ntohl(chunk_count_net);
+	offset += sizeof(chunk_count_net);
+
+	// deserialize digest
+	uint64_t digest_net = 0;
+	memcpy(&digest_net, fo_buffer->data + offset, sizeof(digest_net));
+	fo->digest = be64toh(digest_net);
+	offset += sizeof(digest_net);
+
+	return offset;
+}
+
+// deserializes a FRAME_FILE_ACCEPT or FRAME_FILE_ACK payload into a FileProgress
+size_t deserialize_file_progress(FileProgress* fp, Buffer* fp_buffer) {
+	assert(fp_buffer->size == sizeof(FileProgress));
+
+	size_t offset = 0;
+
+	// deserialize offset
+	uint64_t offset_net = 0;
+	memcpy(&offset_net, fp_buffer->data + offset, sizeof(offset_net));
+	fp->offset = be64toh(offset_net);
+	offset += sizeof(offset_net);
+
+	// deserialize window
+	uint32_t window_net = 0;
+	memcpy(&window_net, fp_buffer->data + offset, sizeof(window_net));
+	fp->window = ntohl(window_net);
+	offset += sizeof(window_net);
+
+	return offset;
+}
+
+// deserializes one record of a FRAME_FILE_MANIFEST payload into a ManifestEntry
+size_t deserialize_manifest_entry(ManifestEntry* me, Buffer* me_buffer) {
+	assert(me_buffer->size == sizeof(ManifestEntry));
+
+	size_t offset = 0;
+
+	// deserialize chunk length
+	uint32_t length_net = 0;
+	memcpy(&length_net, me_buffer->data + offset, sizeof(length_net));
+	me->length = ntohl(length_net);
+	offset += sizeof(length_net);
+
+	// deserialize hash
+	memcpy(me->hash, me_buffer->data + offset, sizeof(me->hash));
+	offset += sizeof(me->hash);
+
+	return offset;
+}
+
+/*========================================= SOCKET IO ==========================================*/
+
+// sends just a frame header, the caller sends (or splices) the payload right after.
+// pass MSG_MORE in flags when a payload follows so header and payload share a segment
+int send_frame_header(int sockfd, FrameType type, uint32_t stream_id, uint32_t length, int flags) {
+	// NOTE: headers are on every message, so they are serialized on the stack instead of a malloc'd Buffer
+	unsigned char data[FRAME_HEADER_LEN];
+	Buffer fh_buffer = { data, sizeof(data) };
+	FrameHeader fh = { (uint8_t) type, stream_id, length };
+	serialize_frame_header(&fh_buffer, &fh);
+	return send_all(sockfd, fh_buffer.data, fh_buffer.size, flags);
+}
+
+// sends a whole frame. returns 0, or -1 if the peer is gone
+// NOTE: callers sharing a socket between threads must hold that socket's send lock
+int send_frame(int sockfd, FrameType type, uint32_t stream_id, const void* payload, uint32_t length) {
+	if (send_frame_header(sockfd, type, stream_id, length, length > 0 ? MSG_MORE : 0) < 0) {
+		return -1;
+	}
+	if (length == 0) {
+		return 0;
+	}
+	return send_all(sockfd, payload, length, 0);
+}
+
+// sends a FRAME_FILE_ACCEPT or FRAME_FILE_ACK
+int send_file_progress(int sockfd, FrameType type, uint32_t stream_id, uint64_t offset, uint32_t window) {
+	unsigned char data[sizeof(FileProgress)];
+	Buffer fp_buffer = { data, sizeof(data) };
+	FileProgress fp = { offset, window };
+	serialize_file_progress(&fp_buffer, &fp);
+	return send_frame(sockfd, type, stream_id, fp_buffer.data, fp_buffer.size);
+}
+
+// writes the header, file offset and checksum of a FRAME_FILE_CHUNK carrying length file bytes,
+// fh_buffer must hold FRAME_HEADER_LEN + CHUNK_PREFIX_LEN bytes
+size_t serialize_chunk_header(Buffer* fh_buffer, uint32_t stream_id, uint64_t offset, uint32_t crc, uint32_t length) {
+	Buffer header = { fh_buffer->data, FRAME_HEADER_LEN };
+	FrameHeader fh = { (uint8_t) FRAME_FILE_CHUNK, stream_id, CHUNK_PREFIX_LEN + length };
+	serialize_frame_header(&header, &fh);
+	uint64_t offset_net = htobe64(offset);
+	memcpy(fh_buffer->data + FRAME_HEADER_LEN, &offset_net, sizeof(offset_net));
+	uint32_t crc_net = htonl(crc);
+	memcpy(fh_buffer->data + FRAME_HEADER_LEN + sizeof(offset_net), &crc_net, sizeof(crc_net));
+	return FRAME_HEADER_LEN + CHUNK_PREFIX_LEN;
+}
+
+// reads the file offset and checksum at the start of a FRAME_FILE_CHUNK payload
+size_t deserialize_chunk_prefix(uint64_t* offset, uint32_t* crc, Buffer* prefix_buffer) {
+	uint64_t offset_net;
+	uint32_t crc_net;
+	memcpy(&offset_net, prefix_buffer->data, sizeof(offset_net));
+	memcpy(&crc_net, prefix_buffer->data + sizeof(offset_net), sizeof(crc_net));
+	*offset = be64toh(offset_net);
+	*crc = ntohl(crc_net);
+	return CHUNK_PREFIX_LEN;
+}
+
+// sends the header, file offset and checksum of a FRAME_FILE_CHUNK carrying length file bytes, which the caller sends next
+int send_chunk_header(int sockfd, uint32_t stream_id, uint64_t offset, uint32_t crc, uint32_t length, int flags) {
+	unsigned char data[FRAME_HEADER_LEN + CHUNK_PREFIX_LEN];
+	Buffer ch_buffer = { data, sizeof(data) };
+	serialize_chunk_header(&ch_buffer, stream_id, offset, crc, length);
+	return send_all(sockfd, data, sizeof(data), flags);
+}
+
+// receives the next frame header. returns 0, or -1 if the connection closed
+int recv_frame_header(int sockfd, FrameHeader* fh) {
+	unsigned char data[FRAME_HEADER_LEN];
+	Buffer fh_buffer = { data, sizeof(data) };
+	if (recv_all(sockfd, fh_buffer.data, fh_buffer.size) < 0) {
+		return -1;
+	}
+	deserialize_frame_header(fh, &fh_buffer);
+	return 0;
+}
+
+// reads and throws away a payload we have no use for, so the next header lines up
+int discard_payload(int sockfd, uint32_t length) {
+	unsigned char scratch[4096];
+	while (length > 0) {
+		uint32_t n = length < sizeof(scratch) ? length : sizeof(scratch);
+		if (recv_all(sockfd, scratch, n) < 0) {
+			return -1;
+		}
+		length -= n;
+	}
+	return 0;
+}
+
+// receives the file offset and checksum at the start of a FRAME_FILE_CHUNK payload. returns 0, or -1 if the connection closed
+int recv_chunk_prefix(int sockfd, uint64_t* offset, uint32_t* crc) {
+	unsigned char data[CHUNK_PREFIX_LEN];
+	if (recv_all(sockfd, data, CHUNK_PREFIX_LEN) < 0) {
+		return -1;
+	}
+	Buffer prefix_buffer = { data, sizeof(data) };
+	deserialize_chunk_prefix(offset, crc, &prefix_buffer);
+	return 0;
+}
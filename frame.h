@@ -0,0 +1,112 @@
+#ifndef FRAME_H
+#define FRAME_H
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "util.h"
+#include "handshake.h"
+
+/* After the handshake every byte on the connection (both directions) is a frame:
+ * a fixed header followed by `length` bytes of payload. Chat text travels on
+ * stream 0, each file transfer gets its own stream id so file bytes can be told
+ * apart from chat without looking at them.
+ */
+
+#define FRAME_HEADER_LEN 9
+#define CHAT_STREAM_ID 0
+#define MAX_FILENAME_LEN 64
+#define MAX_REJECT_REASON_LEN 64
+#define FILE_CHUNK_SIZE (64 * 1024) // most file bytes in a single FILE_CHUNK frame
+#define CHUNK_PREFIX_LEN 12 // FILE_CHUNK payloads start with the file offset of their first byte and the CRC32C of the bytes
+#define FILE_WINDOW (1024 * 1024) // unacknowledged bytes a receiver lets the sender have in flight
+#define CHUNK_HASH_LEN 32 // SHA-256 of a content-defined chunk, see cdc.h
+#define MAX_MANIFEST_BATCH 1024 // most ManifestEntry records in a single FILE_MANIFEST frame
+#define MAX_MANIFEST_CHUNKS (1024 * 1024) // most chunks a file may be cut into
+#define BROADCAST_PEER "*" // FileOffer peer from a sender that means everyone else in the room
+
+/*=========================================STRUCTS=========================================*/
+
+#pragma pack(push, 1)
+
+// Type of frame, decides how the payload is interpreted
+typedef enum _FrameType {
+	FRAME_CHAT, // chat text (client to server: a message, server to client: a rendered line)
+	FRAME_FILE_OFFER, // sender proposes a file, FileOffer payload
+	FRAME_FILE_ACCEPT, // receiver takes the file, FileProgress payload (start offset + window)
+	FRAME_FILE_REJECT, // receiver declined or went away, sent to the sender, reason string payload
+	FRAME_FILE_CHUNK, // file offset, CRC32C of the bytes, then raw file bytes. a sender only uploads the chunks the server asked for
+	FRAME_FILE_ACK, // receiver has written the file up to an offset, FileProgress payload
+	FRAME_FILE_COMPLETE, // sender has sent every byte, no payload
+	FRAME_FILE_CANCEL, // sender side went away, sent to the receiver, reason string payload
+	FRAME_FILE_PAUSE, // receiver dropped and may resume, sent to the sender, reason string payload
+	FRAME_FILE_RESUME, // both sides are back. asked of the receiver without payload, its FileProgress answer goes on to the sender
+	FRAME_FILE_MANIFEST, // sender lists the file's chunks after its offer, ManifestEntry records
+	FRAME_FILE_NEED // server wants these chunks uploaded, a bitmap with one bit per chunk (lowest bit first)
+} FrameType;
+
+// Header in front of every frame
+typedef struct _FrameHeader {
+	uint8_t type;
+	uint32_t stream_id; // CHAT_STREAM_ID for chat, transfer stream otherwise
+	uint32_t length; // payload bytes following the header
+} FrameHeader;
+
+// Payload of FRAME_FILE_OFFER
+typedef struct _FileOffer {
+	char peer[MAX_USERNAME_LEN]; // receiver when sent by the sender, sender when forwarded by the server
+	char file_name[MAX_FILENAME_LEN];
+	uint64_t file_size;
+	uint32_t chunk_count; // ManifestEntry records following the offer (only from the sender)
+	uint64_t digest; // XXH64 of the whole file, the receiver checks it at FILE_COMPLETE (see checksum.h)
+} FileOffer;
+
+// One chunk in a FRAME_FILE_MANIFEST payload, in file order
+typedef struct _ManifestEntry {
+	uint32_t length;
+	unsigned char hash[CHUNK_HASH_LEN];
+} ManifestEntry;
+
+// Payload of FRAME_FILE_ACCEPT, FRAME_FILE_ACK and FRAME_FILE_RESUME
+typedef struct _FileProgress {
+	uint64_t offset; // bytes the receiver has safely written
+	uint32_t window; // bytes past offset the sender may have in flight
+} FileProgress;
+#pragma pack(pop)
+
+/*=========================================FUNCTIONS=========================================*/
+
+// SERIALIZATION
+
+size_t serialize_frame_header(Buffer* fh_buffer, FrameHeader* fh);
+size_t serialize_file_offer(Buffer* fo_buffer, FileOffer* fo);
+size_t serialize_file_progress(Buffer* fp_buffer, FileProgress* fp);
+size_t serialize_manifest_entry(Buffer* me_buffer, ManifestEntry* me);
+size_t serialize_chunk_header(Buffer* fh_buffer, uint32_t stream_id, uint64_t offset, uint32_t crc, uint32_t length);
+
+// DESERIALIZATION
+
+size_t deserialize_frame_header(FrameHeader* fh, Buffer* fh_buffer);
+size_t deserialize_file_offer(FileOffer* fo, Buffer* fo_buffer);
+size_t deserialize_file_progress(FileProgress* fp, Buffer* fp_buffer);
+size_t deserialize_manifest_entry(ManifestEntry* me, Buffer* me_buffer);
+size_t deserialize_chunk_prefix(uint64_t* offset, uint32_t* crc, Buffer* prefix_buffer);
+
+// SOCKET IO
+
+int send_frame_header(int sockfd, FrameType type, uint32_t stream_id, uint32_t length, int flags);
+int send_frame(int sockfd, FrameType type, uint32_t stream_id, const void* payload, uint32_t length);
+int send_file_progress(int sockfd, FrameType type, uint32_t stream_id, uint64_t offset, uint32_t window);
+int send_chunk_header(int sockfd, uint32_t stream_id, uint64_t offset, uint32_t crc, uint32_t length, int flags);
+int recv_frame_header(int sockfd, FrameHeader* fh);
+int recv_chunk_prefix(int sockfd, uint64_t* offset, uint32_t* crc);
+int discard_payload(int sockfd, uint32_t length);
+
+#endif
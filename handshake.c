@@ -5,34 +5,35 @@
 /*========================================= CONNECTION REQUEST ==========================================*/
 
 // sends a ConnectionRequest struct to the server and receives a ConnectionConfirmation struct in return
-// until the server confirms or denies the connection
-int perform_handshake(int sockfd, struct sockaddr_in* serv_addr, Buffer* cr_buffer, char* username)
+// until the server confirms or denies the connection. The final confirmation is left in cc so the
+// caller keeps the room number and resumption token for reconnecting later.
+int perform_handshake(int sockfd, struct sockaddr_in* serv_addr, Buffer* cr_buffer, char* username,
+ConnectionConfirmation* cc)
 {
 	int n = send(sockfd, cr_buffer->data, cr_buffer->size, 0);
 	if (n < 0) error("ERROR writing to socket");
 
 	// listen in a loop until you get a successful connection confirmation
-	ConnectionConfirmation cc;
 	Buffer cc_buffer;
 	init_buffer(&cc_buffer, sizeof(ConnectionConfirmation));
 	while (1) {
-		n = recv(sockfd, cc_buffer.data, cc_buffer.size, 0);
+		n = recv(sockfd, cc_buffer.data, cc_buffer.size, MSG_WAITALL);
 		if (n < 0) { // error reading from socket
 			cleanup_buffer(&cc_buffer);
 			error("ERROR reading from socket");
 		}
-		deserialize_connection_confirmation(&cc, &cc_buffer);
-		// print_connection_confirmation(&cc);
-		if (cc.status == CONFIRMATION_SUCCESS) {
+		deserialize_connection_confirmation(cc, &cc_buffer);
+		// print_connection_confirmation(cc);
+		if (cc->status == CONFIRMATION_SUCCESS) {
 			break;
-		} else if (cc.status == CONFIRMATION_SUCCESS_NEW) {
+		} else if (cc->status == CONFIRMATION_SUCCESS_NEW) {
 			// is this getting the server or client ipv4?
 			printf("Connected to %s with new room number %d\n",
 			inet_ntoa(serv_addr->sin_addr),
-			cc.connected_room.room_number);
+			cc->connected_room.room_number);
 			break;
-		} else if (cc.status == CONFIRMATION_PENDING) {
-			handle_pending_confirmation(sockfd, &cc, username);
+		} else if (cc->status == CONFIRMATION_PENDING) {
+			handle_pending_confirmation(sockfd, cc, username);
 		} else {
 			cleanup_buffer(&cc_buffer);
 			error("ERROR: server refused connection");
@@ -44,6 +45,42 @@ int perform_handshake(int sockfd, struct sockaddr_in* serv_addr, Buffer* cr_buff
 	return 0;
 }
 
+// presents the resumption token from a previous ConnectionConfirmation on a fresh connection.
+// returns 0 if the server gave the old session back (cc then holds the new token), -1 otherwise
+// so the caller can fall back to a normal handshake
+int resume_session(int sockfd, char* username, ConnectionConfirmation* cc)
+{
+	ConnectionRequest cr;
+	init_connection_request_struct(RESUME_SESSION, cc->connected_room.room_number, &cr, username);
+	memcpy(cr.resumption_token, cc->resumption_token, RESUMPTION_TOKEN_LEN);
+
+	Buffer cr_buffer;
+	init_buffer(&cr_buffer, sizeof(ConnectionRequest));
+	serialize_connection_request(&cr_buffer, &cr);
+	int n = send(sockfd, cr_buffer.data, cr_buffer.size, 0);
+	cleanup_buffer(&cr_buffer);
+	if (n < 0) {
+		return -1;
+	}
+
+	ConnectionConfirmation resumed_cc;
+	Buffer cc_buffer;
+	init_buffer(&cc_buffer, sizeof(ConnectionConfirmation));
+	n = recv(sockfd, cc_buffer.data, cc_buffer.size, MSG_WAITALL);
+	if (n != (int) cc_buffer.size) {
+		cleanup_buffer(&cc_buffer);
+		return -1;
+	}
+	deserialize_connection_confirmation(&resumed_cc, &cc_buffer);
+	cleanup_buffer(&cc_buffer);
+
+	if (resumed_cc.status != CONFIRMATION_RESUMED) {
+		return -1;
+	}
+	*cc = resumed_cc;
+	return 0;
+}
+
 
 // given command line arguments, populates a serialized connection request buffer
 void prepare_connection_request(int argc, char* room_arg, Buffer* cr_buffer,
@@ -99,6 +136,10 @@ ConnectionRequest *cr, char* username)
 			cr->type = CANCEL_HANDSHAKE;
 			cr->room_number = UNINITIALIZED_ROOM_NUMBER;
 			break;
+		case RESUME_SESSION: // reclaiming a dropped session, caller fills in the token
+			cr->type = RESUME_SESSION;
+			cr->room_number = room_number;
+			break;
 		default:
 			error("ERROR: Invalid number of arguments");
 	}
@@ -173,6 +214,10 @@ size_t serialize_connection_request(Buffer* handshake_buffer, ConnectionRequest
 	memcpy(handshake_buffer->data + offset, &room_number_net, sizeof(room_number_net));
 	offset += sizeof(room_number_net);
 
+	// serialize resumption token (opaque bytes, no endianness)
+	memcpy(handshake_buffer->data + offset, cr->resumption_token, sizeof(cr->resumption_token));
+	offset += sizeof(cr->resumption_token);
+
 	return offset;
 }
 
@@ -211,6 +256,10 @@ size_t deserialize_connection_request(ConnectionRequest *cr, Buffer* cr_buffer)
 	cr->room_number = ntohl(room_number_net);
 	offset += sizeof(room_number_net);
 
+	// deserialize resumption token
+	memcpy(cr->resumption_token, cr_buffer->data + offset, sizeof(cr->resumption_token));
+	offset += sizeof(cr->resumption_token);
+
 	return offset;
 }
 
@@ -277,6 +326,10 @@ size_t serialize_connection_confirmation(Buffer* cc_buffer, ConnectionConfirmati
 	cleanup_buffer(&ar_buffer);
 	offset += sizeof(HandshakeAvailableRooms);
 
+	// serialize resumption token (opaque bytes, no endianness)
+	memcpy(cc_buffer->data + offset, cc->resumption_token, sizeof(cc->resumption_token));
+	offset += sizeof(cc->resumption_token);
+
 	return offset;
 }
 
@@ -377,6 +430,10 @@ size_t deserialize_connection_confirmation(ConnectionConfirmation *cc, Buffer* c
 	offset += sizeof(HandshakeAvailableRooms);
 	cleanup_buffer(&ar_buffer);
 
+	// deserialize resumption token
+	memcpy(cc->resumption_token, cc_buffer->data + offset, sizeof(cc->resumption_token));
+	offset += sizeof(cc->resumption_token);
+
 	return offset;
 }
 
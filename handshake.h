@@ -17,6 +17,7 @@
 #define UNINITIALIZED_ROOM_NUMBER -1
 #define UNINITIALIZED_NUM_CONNECTED_CLIENTS -1
 #define CREATE_NEW_ROOM_COMMAND "new" 
+#define RESUMPTION_TOKEN_LEN 16
 
 /*=========================================STRUCTS=========================================*/
 
@@ -33,7 +34,8 @@ typedef enum _ConnectionRequestType {
 	JOIN_ROOM,
 	CREATE_NEW_ROOM,
 	SELECT_ROOM,
-	CANCEL_HANDSHAKE
+	CANCEL_HANDSHAKE,
+	RESUME_SESSION
 } ConnectionRequestType;
 
 
@@ -42,6 +44,7 @@ typedef struct _ConnectionRequest {
 	char username[MAX_USERNAME_LEN];
 	ConnectionRequestType type;
 	int32_t room_number;
+	uint8_t resumption_token[RESUMPTION_TOKEN_LEN]; // only read for RESUME_SESSION
 } ConnectionRequest;
 
 
@@ -52,7 +55,8 @@ typedef enum _ConfirmationStatus {
 	CONFIRMATION_SUCCESS, // client successfully joined a room
 	CONFIRMATION_PENDING, // server wants more information from client before connecting them
 	CONFIRMATION_FAILURE, // client requested an invalid operation
-	CONFIRMATION_SUCCESS_NEW // client successfully joined a new room
+	CONFIRMATION_SUCCESS_NEW, // client successfully joined a new room
+	CONFIRMATION_RESUMED // client reclaimed its previous session with a resumption token
 } ConfirmationStatus;
 
 // basic information regarding a single room on the server
@@ -72,6 +76,7 @@ typedef struct _ConnectionConfirmation {
 	ConfirmationStatus status;
 	HandshakeRoomDescription connected_room; // if the client successfully joined a room
 	HandshakeAvailableRooms available_rooms; // for selecting a room to join
+	uint8_t resumption_token[RESUMPTION_TOKEN_LEN]; // presented on reconnect to get the same session back
 } ConnectionConfirmation;
 #pragma pack(pop)
 
@@ -79,7 +84,9 @@ typedef struct _ConnectionConfirmation {
 
 /* ---------------------------------------- CONNECTION REQUEST ---------------------------------------- */
 
-int perform_handshake(int sockfd, struct sockaddr_in* serv_addr, Buffer* cr_buffer, char* username);
+int perform_handshake(int sockfd, struct sockaddr_in* serv_addr, Buffer* cr_buffer, char* username,
+ConnectionConfirmation* cc);
+int resume_session(int sockfd, char* username, ConnectionConfirmation* cc);
 void prepare_connection_request(int argc, char* room_arg, Buffer* cr_buffer,
 char* username);
 int init_connection_request_struct(ConnectionRequestType type, int room_number,
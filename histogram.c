@@ -0,0 +1,87 @@
+#include <string.h>
+#include <math.h>
+
+#include "histogram.h"
+
+static int bucket_of(uint64_t value) {
+	if (value < (1 << HIST_SUB_BITS)) {
+		return (int) value;
+	}
+	if (value >= (1ULL << HIST_MAX_BITS)) {
+		return HIST_BUCKETS - 1;
+	}
+	// the top HIST_SUB_BITS bits of the value pick the bucket within its power of two
+	int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+	return (1 << HIST_SUB_BITS) + (shift - 1) * HIST_HALF + (int) (value >> shift) - HIST_HALF;
+}
+
+// largest value that lands in the bucket
+static uint64_t bucket_top(int bucket) {
+	if (bucket < (1 << HIST_SUB_BITS)) {
+		return bucket;
+	}
+	int i = bucket - (1 << HIST_SUB_BITS);
+	int shift = i / HIST_HALF + 1;
+	uint64_t top = i % HIST_HALF + HIST_HALF;
+	return ((top + 1) << shift) - 1;
+}
+
+void hist_init(Histogram* hist) {
+	memset(hist, 0, sizeof(*hist));
+	hist->min = UINT64_MAX;
+}
+
+// NOTE: relaxed atomics, which are plain loads and stores on x86: one thread records while others may merge
+void hist_record(Histogram* hist, uint64_t value) {
+	uint64_t* count = &hist->counts[bucket_of(value)];
+	__atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->total, hist->total + 1, __ATOMIC_RELAXED);
+	double sum = hist->sum + value;
+	__atomic_store(&hist->sum, &sum, __ATOMIC_RELAXED);
+	if (value < hist->min) __atomic_store_n(&hist->min, value, __ATOMIC_RELAXED);
+	if (value > hist->max) __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+void hist_merge(Histogram* into, const Histogram* from) {
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+	}
+	into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+	double sum;
+	__atomic_load(&from->sum, &sum, __ATOMIC_RELAXED);
+	into->sum += sum;
+	uint64_t min = __atomic_load_n(&from->min, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+	if (min < into->min) into->min = min;
+	if (max > into->max) into->max = max;
+}
+
+uint64_t hist_percentile(const Histogram* hist, double percentile) {
+	if (hist->total == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t) ceil(percentile / 100.0 * hist->total);
+	if (rank < 1) rank = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= rank) {
+			uint64_t top = bucket_top(i);
+			// the bucket's range may reach past anything actually recorded
+			return top < hist->max ? top : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+double hist_mean(const Histogram* hist) {
+	return hist->total > 0 ? hist->sum / hist->total : 0;
+}
+
+uint64_t hist_count_below(const Histogram* hist, uint64_t value) {
+	uint64_t count = 0;
+	for (int i = 0; i < HIST_BUCKETS && bucket_top(i) <= value; i++) {
+		count += hist->counts[i];
+	}
+	return count;
+}
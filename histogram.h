@@ -0,0 +1,39 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Latency histogram with log-spaced buckets, HDR style. Values below
+ * 2^HIST_SUB_BITS are counted exactly. Above that every power of two is split
+ * into 2^(HIST_SUB_BITS - 1) equal buckets, so a percentile read back is within
+ * 1/128 of what was recorded. Recording is an index computation and an
+ * increment, no allocation, no locks: one writer per histogram, merge them to
+ * read the total. A histogram can be merged while its writer records into it,
+ * the merge sees each count either before or after an increment.
+ */
+
+#define HIST_SUB_BITS 8
+#define HIST_MAX_BITS 40 // values up to 2^40 (18 minutes in ns), bigger ones go in the last bucket
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS ((1 << HIST_SUB_BITS) + (HIST_MAX_BITS - HIST_SUB_BITS) * HIST_HALF)
+
+typedef struct _Histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	double sum;
+} Histogram;
+
+void hist_init(Histogram* hist);
+void hist_record(Histogram* hist, uint64_t value);
+void hist_merge(Histogram* into, const Histogram* from);
+
+// the value at or below which percentile% of the recorded values are, 0 if none were
+uint64_t hist_percentile(const Histogram* hist, double percentile);
+double hist_mean(const Histogram* hist);
+
+// how many recorded values are at or below value, to the precision of the buckets
+uint64_t hist_count_below(const Histogram* hist, uint64_t value);
+
+#endif
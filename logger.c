@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "util.h"
+
+LogLevel log_level = LOG_LEVEL_INFO;
+
+static const char* const level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// what a record holds after its header: one 8 byte slot per numeric argument, a 2 byte length and
+// the bytes (padded to 8) per string, in the order the format has them
+typedef struct _LogRecord {
+	uint32_t size; // header included, padded to 8. 0 marks the rest of the ring as unused, go back to its start
+	uint8_t level;
+	uint8_t truncated; // arguments past LOG_RECORD_MAX were dropped
+	uint16_t pad;
+	uint64_t time_ns; // CLOCK_REALTIME
+	const char* format;
+} LogRecord;
+
+// single producer (the thread that has it), single consumer (the writer thread)
+typedef struct _LogRing {
+	unsigned char data[LOG_RING_SIZE];
+	uint64_t head; // bytes ever written, only the producer stores it
+	uint64_t tail; // bytes ever consumed, only the consumer stores it
+	struct _LogRing* next; // every ring, never freed
+	struct _LogRing* next_free;
+} LogRing;
+
+static LogRing* rings_head;
+static LogRing* free_rings;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER; // one drain at a time, the writer's or logger_flush()'s
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread LogRing* self;
+static uint64_t dropped; // records that found their ring full
+
+/*========================================= FORMATS ==========================================*/
+
+typedef enum _ArgType {
+	ARG_NONE, // %%
+	ARG_INT,
+	ARG_UINT,
+	ARG_DOUBLE,
+	ARG_STRING,
+	ARG_POINTER,
+	ARG_CHAR
+} ArgType;
+
+typedef struct _Conversion {
+	const char* start; // the '%'
+	size_t len; // of the whole spec
+	size_t length_at; // offset of the length modifier in it
+	size_t length_len;
+	int length; // 0 none, 1 h, 2 hh, 3 l, 4 ll, 5 z/j/t
+	ArgType type;
+} Conversion;
+
+// the next conversion in format at or after cur, NULL when there are none
+static const char* next_conversion(const char* cur, Conversion* conv) {
+	cur = strchr(cur, '%');
+	if (cur == NULL) {
+		return NULL;
+	}
+	const char* p = cur + 1;
+	while (*p != '\0' && strchr("-+ #0", *p) != NULL) p++;
+	while (*p >= '0' && *p <= '9') p++;
+	if (*p == '.') {
+		p++;
+		while (*p >= '0' && *p <= '9') p++;
+	}
+	conv->length_at = p - cur;
+	conv->length = 0;
+	if (p[0] == 'h' && p[1] == 'h') { conv->length = 2; p += 2; }
+	else if (p[0] == 'l' && p[1] == 'l') { conv->length = 4; p += 2; }
+	else if (*p == 'h') { conv->length = 1; p++; }
+	else if (*p == 'l') { conv->length = 3; p++; }
+	else if (*p == 'z' || *p == 'j' || *p == 't') { conv->length = 5; p++; }
+	conv->length_len = (p - cur) - conv->length_at;
+
+	switch (*p) {
+		case '%': conv->type = ARG_NONE; break;
+		case 'd': case 'i': conv->type = ARG_INT; break;
+		case 'u': case 'x': case 'X': case 'o': conv->type = ARG_UINT; break;
+		case 'f': case 'g': case 'e': conv->type = ARG_DOUBLE; break;
+		case 's': conv->type = ARG_STRING; break;
+		case 'p': conv->type = ARG_POINTER; break;
+		case 'c': conv->type = ARG_CHAR; break;
+		default: conv->type = ARG_NONE; break; // not supported, printed as it is
+	}
+	conv->start = cur;
+	conv->len = (*p != '\0') ? (size_t) (p - cur) + 1 : (size_t) (p - cur);
+	return cur + conv->len;
+}
+
+/*========================================= PRODUCERS ==========================================*/
+
+static void release_ring(void* arg) {
+	LogRing* ring = (LogRing*) arg;
+	pthread_mutex_lock(&rings_mutex);
+	ring->next_free = free_rings;
+	free_rings = ring;
+	pthread_mutex_unlock(&rings_mutex);
+}
+
+static void create_key() {
+	if (pthread_key_create(&ring_key, release_ring) != 0) error("ERROR creating logger key");
+}
+
+// once per thread. a ring left by an exited thread may still hold records, they are written in turn
+static LogRing* acquire_ring() {
+	pthread_once(&key_once, create_key);
+	pthread_mutex_lock(&rings_mutex);
+	LogRing* ring = free_rings;
+	if (ring != NULL) {
+		free_rings = ring->next_free;
+	} else {
+		ring = (LogRing*) calloc(1, sizeof(LogRing));
+		if (ring == NULL) error("ERROR allocating log ring");
+		ring->next = rings_head;
+		__atomic_store_n(&rings_head, ring, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&rings_mutex);
+	pthread_setspecific(ring_key, ring);
+	return ring;
+}
+
+static size_t pad8(size_t n) {
+	return (n + 7) & ~(size_t) 7;
+}
+
+static void put_record(LogLevel level, const char* format, va_list args) {
+	unsigned char record[LOG_RECORD_MAX];
+	LogRecord* header = (LogRecord*) record;
+	size_t len = sizeof(LogRecord);
+	header->level = (uint8_t) level;
+	header->truncated = 0;
+	header->pad = 0;
+	header->format = format;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header->time_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	// the arguments as the format says they are
+	Conversion conv;
+	const char* cur = format;
+	while ((cur = next_conversion(cur, &conv)) != NULL) {
+		if (conv.type == ARG_NONE) {
+			continue;
+		}
+		uint64_t slot = 0;
+		const char* string = NULL;
+		switch (conv.type) {
+			case ARG_INT:
+				if (conv.length >= 3) slot = (uint64_t) va_arg(args, long long);
+				else slot = (uint64_t) (long long) va_arg(args, int);
+				break;
+			case ARG_UINT:
+				if (conv.length >= 3) slot = va_arg(args, unsigned long long);
+				else slot = va_arg(args, unsigned int);
+				break;
+			case ARG_DOUBLE: {
+				double value = va_arg(args, double);
+				memcpy(&slot, &value, sizeof(slot));
+				break;
+			}
+			case ARG_POINTER: slot = (uint64_t) (uintptr_t) va_arg(args, void*); break;
+			case ARG_CHAR: slot = (uint64_t) va_arg(args, int); break;
+			case ARG_STRING: string = va_arg(args, const char*); break;
+			default: break;
+		}
+		if (header->truncated) {
+			continue; // still consumed from args
+		}
+		if (conv.type == ARG_STRING) {
+			if (string == NULL) {
+				string = "(null)";
+			}
+			size_t string_len = strnlen(string, LOG_STRING_MAX);
+			if (len + pad8(sizeof(uint16_t) + string_len) > sizeof(record)) {
+				header->truncated = 1;
+				continue;
+			}
+			uint16_t n = (uint16_t) string_len;
+			memcpy(record + len, &n, sizeof(n));
+			memcpy(record + len + sizeof(n), string, string_len);
+			len += pad8(sizeof(n) + string_len);
+		} else {
+			if (len + sizeof(slot) > sizeof(record)) {
+				header->truncated = 1;
+				continue;
+			}
+			memcpy(record + len, &slot, sizeof(slot));
+			len += sizeof(slot);
+		}
+	}
+	header->size = (uint32_t) len;
+
+	if (self == NULL) {
+		self = acquire_ring();
+	}
+	LogRing* ring = self;
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	size_t at = head % LOG_RING_SIZE;
+	size_t skip = (at + len > LOG_RING_SIZE) ? LOG_RING_SIZE - at : 0; // doesn't fit before the end, start over
+	if (head + skip + len - tail > LOG_RING_SIZE) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (skip > 0) {
+		if (skip >= sizeof(uint32_t)) {
+			memset(ring->data + at, 0, sizeof(uint32_t));
+		}
+		head += skip;
+		at = 0;
+	}
+	memcpy(ring->data + at, record, len);
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
+
+void logger_write(LogSite* site, LogLevel level, const char* format, ...) {
+	uint32_t now = (uint32_t) time(NULL);
+	if (__atomic_load_n(&site->window, __ATOMIC_RELAXED) != now
+	&& __atomic_exchange_n(&site->window, now, __ATOMIC_RELAXED) != now) {
+		// a new second for this call site
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+		uint32_t suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+		if (suppressed > 0) {
+			static LogSite suppressed_site;
+			logger_write(&suppressed_site, LOG_LEVEL_WARN, "%u lines like \"%.40s\" suppressed", suppressed, format);
+		}
+	}
+	if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= LOG_RATE_LIMIT) {
+		__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	put_record(level, format, args);
+	va_end(args);
+}
+
+/*========================================= WRITER ==========================================*/
+
+typedef struct _Batch {
+	unsigned char* data; // records copied out of the rings
+	size_t len;
+	size_t cap;
+	size_t* offsets; // of each record in data
+	size_t count;
+	size_t max;
+	char* out; // the formatted lines
+	size_t out_len;
+	size_t out_cap;
+} Batch;
+
+static Batch batch;
+
+static void batch_add(const unsigned char* record, size_t len) {
+	if (batch.len + len > batch.cap) {
+		batch.cap = (batch.len + len) * 2;
+		batch.data = (unsigned char*) realloc(batch.data, batch.cap);
+		if (batch.data == NULL) error("ERROR allocating log batch");
+	}
+	if (batch.count == batch.max) {
+		batch.max = batch.max > 0 ? batch.max * 2 : 256;
+		batch.offsets = (size_t*) realloc(batch.offsets, batch.max * sizeof(size_t));
+		if (batch.offsets == NULL) error("ERROR allocating log batch");
+	}
+	memcpy(batch.data + batch.len, record, len);
+	batch.offsets[batch.count++] = batch.len;
+	batch.len += len;
+}
+
+static int compare_records(const void* a, const void* b) {
+	const LogRecord* ra = (const LogRecord*) (batch.data + *(const size_t*) a);
+	const LogRecord* rb = (const LogRecord*) (batch.data + *(const size_t*) b);
+	return (ra->time_ns > rb->time_ns) - (ra->time_ns < rb->time_ns);
+}
+
+static void out_append(const char* text, size_t len) {
+	if (batch.out_len + len + 1 > batch.out_cap) {
+		batch.out_cap = (batch.out_len + len + 1) * 2;
+		batch.out = (char*) realloc(batch.out, batch.out_cap);
+		if (batch.out == NULL) error("ERROR allocating log output");
+	}
+	memcpy(batch.out + batch.out_len, text, len);
+	batch.out_len += len;
+}
+
+// the format again, with each conversion given its own argument back
+static void format_record(const LogRecord* record) {
+	char line[LOG_RECORD_MAX + 128];
+	time_t secs = (time_t) (record->time_ns / 1000000000ULL);
+	struct tm tm;
+	localtime_r(&secs, &tm);
+	size_t n = strftime(line, sizeof(line), "%H:%M:%S", &tm);
+	n += snprintf(line + n, sizeof(line) - n, ".%03u %-5s ", (unsigned) (record->time_ns / 1000000 % 1000),
+	level_names[record->level]);
+	out_append(line, n);
+
+	const unsigned char* arg = (const unsigned char*) record + sizeof(LogRecord);
+	const unsigned char* end = (const unsigned char*) record + record->size;
+	const char* cur = record->format;
+	Conversion conv;
+	const char* next;
+	while ((next = next_conversion(cur, &conv)) != NULL) {
+		out_append(cur, conv.start - cur);
+		cur = next;
+		if (conv.type == ARG_NONE) {
+			if (conv.start[conv.len - 1] == '%') {
+				out_append("%", 1);
+			} else {
+				out_append(conv.start, conv.len);
+			}
+			continue;
+		}
+		if (arg >= end) {
+			out_append("...", 3);
+			continue;
+		}
+
+		// the spec with its length modifier swapped for the one the argument was stored as
+		char spec[64];
+		if (conv.len + 2 >= sizeof(spec)) {
+			continue;
+		}
+		memcpy(spec, conv.start, conv.length_at);
+		size_t spec_len = conv.length_at;
+		if (conv.type == ARG_INT || conv.type == ARG_UINT) {
+			memcpy(spec + spec_len, "ll", 2);
+			spec_len += 2;
+		}
+		memcpy(spec + spec_len, conv.start + conv.length_at + conv.length_len, conv.len - conv.length_at - conv.length_len);
+		spec_len += conv.len - conv.length_at - conv.length_len;
+		spec[spec_len] = '\0';
+
+		uint64_t slot;
+		int len = 0;
+		if (conv.type == ARG_STRING) {
+			uint16_t string_len;
+			memcpy(&string_len, arg, sizeof(string_len));
+			char string[LOG_STRING_MAX + 1];
+			memcpy(string, arg + sizeof(string_len), string_len);
+			string[string_len] = '\0';
+			arg += pad8(sizeof(string_len) + string_len);
+			len = snprintf(line, sizeof(line), spec, string);
+		} else {
+			memcpy(&slot, arg, sizeof(slot));
+			arg += sizeof(slot);
+			switch (conv.type) {
+				case ARG_INT: {
+					// narrowed back first, like printf would for h and hh
+					long long value = (long long) slot;
+					if (conv.length == 1) value = (short) value;
+					if (conv.length == 2) value = (signed char) value;
+					len = snprintf(line, sizeof(line), spec, value);
+					break;
+				}
+				case ARG_UINT: {
+					unsigned long long value = slot;
+					if (conv.length == 1) value = (unsigned short) value;
+					if (conv.length == 2) value = (unsigned char) value;
+					len = snprintf(line, sizeof(line), spec, value);
+					break;
+				}
+				case ARG_DOUBLE: {
+					double value;
+					memcpy(&value, &slot, sizeof(value));
+					len = snprintf(line, sizeof(line), spec, value);
+					break;
+				}
+				case ARG_POINTER: len = snprintf(line, sizeof(line), spec, (void*) (uintptr_t) slot); break;
+				case ARG_CHAR: len = snprintf(line, sizeof(line), spec, (int) slot); break;
+				default: break;
+			}
+		}
+		if (len > 0) {
+			out_append(line, (size_t) len < sizeof(line) ? (size_t) len : sizeof(line) - 1);
+		}
+	}
+	out_append(cur, strlen(cur));
+	if (record->truncated) {
+		out_append(" [truncated]", 12);
+	}
+	if (batch.out_len == 0 || batch.out[batch.out_len - 1] != '\n') {
+		out_append("\n", 1);
+	}
+}
+
+static void write_out() {
+	size_t written = 0;
+	while (written < batch.out_len) {
+		ssize_t n = write(STDOUT_FILENO, batch.out + written, batch.out_len - written);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break; // nowhere to log to
+		}
+		written += n;
+	}
+	batch.out_len = 0;
+}
+
+// writes out what every ring holds, returns how many records that was
+static size_t drain() {
+	static uint64_t reported;
+
+	pthread_mutex_lock(&drain_mutex);
+	batch.len = 0;
+	batch.count = 0;
+	LogRing* ring = __atomic_load_n(&rings_head, __ATOMIC_ACQUIRE);
+	for (; ring != NULL; ring = ring->next) {
+		uint64_t tail = ring->tail;
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (tail < head) {
+			size_t at = tail % LOG_RING_SIZE;
+			uint32_t size = 0;
+			if (LOG_RING_SIZE - at >= sizeof(uint32_t)) {
+				memcpy(&size, ring->data + at, sizeof(size));
+			}
+			if (size == 0) {
+				// the producer went back to the start
+				tail += LOG_RING_SIZE - at;
+				continue;
+			}
+			batch_add(ring->data + at, size);
+			tail += size;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	qsort(batch.offsets, batch.count, sizeof(size_t), compare_records);
+	for (size_t i = 0; i < batch.count; i++) {
+		format_record((const LogRecord*) (batch.data + batch.offsets[i]));
+	}
+	uint64_t lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	if (lost > reported) {
+		char line[128];
+		int n = snprintf(line, sizeof(line), "%llu log lines dropped, the log is behind\n",
+		(unsigned long long) (lost - reported));
+		out_append(line, n);
+		reported = lost;
+	}
+	write_out();
+	size_t count = batch.count;
+	pthread_mutex_unlock(&drain_mutex);
+	return count;
+}
+
+static void* logger_main(void* args) {
+	(void) args;
+	name_thread("logger");
+	while (1) {
+		if (drain() == 0) {
+			struct timespec nap = { 0, LOG_POLL_MS * 1000000L };
+			nanosleep(&nap, NULL);
+		}
+	}
+	return NULL;
+}
+
+void logger_start() {
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, logger_main, NULL) != 0) {
+		error("ERROR creating logger thread");
+	}
+	pthread_detach(tid);
+	atexit(logger_flush);
+}
+
+void logger_flush() {
+	drain();
+}
+
+int logger_parse_level(const char* name) {
+	const char* names[] = { "debug", "info", "warn", "error" };
+	for (int i = 0; i < 4; i++) {
+		if (strcmp(name, names[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
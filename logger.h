@@ -0,0 +1,64 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+
+/* The server's log. A LOG_*() call doesn't format anything or make a syscall:
+ * it copies its format string pointer and arguments (strings by value) into a
+ * ring buffer of the calling thread's own, and a background thread formats the
+ * records of every ring, in timestamp order, and writes them to stdout in
+ * batches. A ring that is full drops the record rather than wait, the drops are
+ * counted in the log.
+ *
+ * Lines below log_level cost one comparison. Every call site is rate limited to
+ * LOG_RATE_LIMIT lines a second; what it had to drop is reported with its next
+ * line.
+ *
+ * Formats are checked like printf's, but only the conversions d i u x X o c s f
+ * g e p (with any flags, width, precision and h/l/z length) can be used, no *.
+ */
+
+#define LOG_RING_SIZE (16 * 1024) // bytes per thread
+#define LOG_STRING_MAX 255 // longer %s arguments are cut
+#define LOG_RECORD_MAX 1024 // the rest of a record's arguments are dropped past this
+#define LOG_RATE_LIMIT 200 // lines a second from one call site
+#define LOG_POLL_MS 5 // the writer's nap when every ring was empty
+
+typedef enum _LogLevel {
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_ERROR
+} LogLevel;
+
+// a LOG_*() call's rate limit, one per call site
+typedef struct _LogSite {
+	uint32_t window; // the second the count is for
+	uint32_t count;
+	uint32_t suppressed;
+} LogSite;
+
+extern LogLevel log_level;
+
+#define LOG(level, ...) do { \
+	static LogSite log_site_; \
+	if ((level) >= log_level) logger_write(&log_site_, (level), __VA_ARGS__); \
+} while (0)
+
+#define LOG_DEBUG(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+void logger_write(LogSite* site, LogLevel level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+// starts the writer thread. lines logged before it are kept until it runs
+void logger_start();
+
+// writes out everything logged so far, for exiting
+void logger_flush();
+
+// "debug", "info", "warn" or "error", -1 for none of them
+int logger_parse_level(const char* name);
+
+#endif
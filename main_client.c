@@ -2,39 +2,167 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <netdb.h> 
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netdb.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "handshake.h"
+#include "frame.h"
 #include "util.h"
-#include "connection_status_monitor.h"
 #include "socket_setup.h"
+#include "cdc.h"
+#include "checksum.h"
+#include "render.h"
+#include "chatclient.h"
+#include "probes.h"
 
 #define BUFFER_SIZE 512
 #define EXIT_COMMAND "\n"
+#define RESUME_ATTEMPTS 5 // reconnect attempts after a dropped connection before giving up
+#define MAX_RENAME_ATTEMPTS 10 // name.1 .. name.9 tried when a received file name is taken
 
-// TODO: implement client state in such a way that the client can set a username
-// and not have to ask the user for it again if the server asks for more information
+// the session with the server, see chatclient.h. the handlers below all work on it
+ChatSession* session = NULL;
 
-// typedef struct _ClientState {
-// 	char username[MAX_USERNAME_LEN];
-// 	pthread_mutex_t client_state_mutex;
-// } ClientState;
+// what the session loop does about a dropped connection
+typedef struct _Reconnect {
+	int pending; // waiting for at to try again
+	int attempts; // since the connection was lost, 0 while connected
+	int gave_up;
+	struct timespec at;
+} Reconnect;
 
-// global username variable
-char username[MAX_USERNAME_LEN];
+// lines the event loop reads: what is typed, or the script in headless mode
+typedef struct _Input {
+	int fd;
+	char line[BUFFER_SIZE]; // read but not handled yet
+	size_t len;
+	int eof;
+	struct timespec eof_at;
+} Input;
 
-typedef struct _ThreadArgs {
-	int clisockfd;
-	ConnectionStatusMonitor* csm;
-} ThreadArgs;
+// -u: a bot's session. no prompts, lines come from a script at a set pace, chat from the room
+// is recorded instead of shown and the totals are printed on the way out
+typedef struct _Headless {
+	int enabled;
+	char* script; // path, - for stdin
+	double rate; // lines a second, 0 for as fast as the script is read
+	double linger; // seconds to stay in the room after the script ran out
+	FILE* record; // received chat with timestamps, NULL for none
+	struct timespec started;
+	struct timespec next_line; // pacing
+	uint64_t sent;
+	uint64_t sent_bytes;
+	uint64_t received;
+	uint64_t received_bytes;
+} Headless;
 
-void init_username();
-int is_filetransfer(char* buffer);
-void* thread_main_recv(void* args);
+typedef enum _TransferState {
+	TRANSFER_OFFERED, // waiting for the receiver's answer
+	TRANSFER_ACTIVE, // bytes are flowing
+	TRANSFER_PAUSED, // a side dropped, waiting for FILE_RESUME
+	TRANSFER_DONE, // every byte acknowledged
+	TRANSFER_FAILED // declined, cancelled or the session was lost
+} TransferState;
+
+// a file we are sending, owned by its upload thread
+typedef struct _OutgoingTransfer {
+	uint32_t stream_id; // picked by us, unique on this connection
+	int filefd;
+	char recv_user[MAX_USERNAME_LEN];
+	char file_name[MAX_FILENAME_LEN];
+	uint64_t file_size;
+	unsigned char* map; // the whole file, read for chunking and checksums (NULL for an empty file)
+	uint64_t digest; // XXH64 of the whole file
+	ChunkList chunks; // how the file is cut, see cdc.h
+	unsigned char* needed; // FILE_NEED bitmap of the chunks the server lacks, NULL until it arrives
+	uint64_t bytes_acked; // receiver has written everything before this offset
+	uint64_t next_offset; // next byte to send
+	uint32_t window; // bytes past bytes_acked we may have in flight
+	uint32_t resumes; // bumped on every FILE_RESUME so a chunk sent across one doesn't move next_offset
+	TransferState state;
+	struct _OutgoingTransfer* next;
+} OutgoingTransfer;
+
+// a file someone is sending us
+typedef struct _IncomingTransfer {
+	uint32_t stream_id; // assigned by the server
+	int filefd;
+	char send_user[MAX_USERNAME_LEN];
+	char file_name[MAX_FILENAME_LEN];
+	char path[MAX_FILENAME_LEN + 8]; // where it is being written
+	uint64_t file_size;
+	uint64_t bytes_received;
+	uint64_t digest; // the sender's XXH64 of the file, checked at FILE_COMPLETE
+	Xxh64 hash; // of the bytes received so far
+	TransferState state;
+	struct _IncomingTransfer* next;
+} IncomingTransfer;
+
+// both transfer lists are guarded by transfers_mutex, transfers_cond wakes upload threads on acks
+OutgoingTransfer* outgoing_head = NULL;
+IncomingTransfer* incoming_head = NULL;
+uint32_t next_stream_id = 1;
+pthread_mutex_t transfers_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t transfers_cond = PTHREAD_COND_INITIALIZER;
+
+// -p: stdin is read and the output rendered by the session loop too, instead of their own threads
+int event_loop = 0;
+Reconnect reconnect = { 0, 0, 0, { 0, 0 } };
+Headless headless = { 0, "-", 0, 0, NULL, { 0, 0 }, { 0, 0 }, 0, 0, 0, 0 };
+
+void init_username(char* username);
+int send_to_server(FrameType type, uint32_t stream_id, const void* payload, uint32_t length);
+int send_progress_to_server(FrameType type, uint32_t stream_id, uint64_t offset, uint32_t window);
+void payload_string(Buffer* payload, char* str, size_t size);
+int send_file(char* buffer);
+int send_file_offer(OutgoingTransfer* transfer);
+char* recipient(OutgoingTransfer* transfer);
+uint32_t find_chunk(ChunkList* chunks, uint64_t offset);
+int chunk_needed(OutgoingTransfer* transfer, uint32_t i);
+int receive_file(FrameHeader* header, Buffer* payload);
+int answer_file_offer(char* buffer);
+int send_chunk_to_server(OutgoingTransfer* transfer, off_t offset, uint32_t len);
+void* thread_file_upload(void* args);
+int handle_file_accept(FrameHeader* header, Buffer* payload);
+int handle_file_need(FrameHeader* header, Buffer* payload);
+int handle_file_ack(FrameHeader* header, Buffer* payload);
+int handle_file_reject(FrameHeader* header, Buffer* payload);
+void fail_incoming_transfer(IncomingTransfer* transfer, char* reason);
+int handle_file_chunk(FrameHeader* header, Buffer* payload);
+int handle_file_complete(FrameHeader* header);
+int handle_file_cancel(FrameHeader* header, Buffer* payload);
+int handle_file_pause(FrameHeader* header, Buffer* payload);
+int handle_file_resume(FrameHeader* header, Buffer* payload);
+void pause_all_transfers();
+void fail_all_transfers();
+void on_rooms(ChatSession* session, ConnectionConfirmation* cc, void* context);
+void on_joined(ChatSession* session, ConnectionConfirmation* cc, void* context);
+void on_message(ChatSession* session, const char* text, size_t len, void* context);
+int on_frame(ChatSession* session, FrameHeader* header, Buffer* payload, void* context);
+void on_disconnected(ChatSession* session, ChatState state, void* context);
+void schedule_reconnect();
+int handle_input_line(char* buffer);
 void* thread_main_send(void* args);
+long ms_until(const struct timespec* when);
+void timespec_add(struct timespec* ts, double seconds);
+void record_message(const char* text, size_t len);
+void read_input(Input* input);
+int next_input_line(Input* input, char* buffer);
+int input_due_ms(Input* input);
+int handle_input(Input* input);
+void print_headless_stats();
+void run_session();
 
-// sets the global username. only should be called once (for threading)
-void init_username() {
+// asks for the username the session is created with
+void init_username(char* username) {
 	printf("Type your username: ");
 	if (fgets(username, MAX_USERNAME_LEN - 1, stdin) != NULL) {
 		trim_whitespace(username);
@@ -43,73 +171,307 @@ void init_username() {
 	}
 }
 
-// NOTE: can (and should) be used for both send and receive
-int is_filetransfer(char* buffer) {
-	// create copy of message in buffer (needed for strtok_r)
-	char message[BUFFER_SIZE];
-	strncpy(message, buffer, strlen(buffer));
-	
-	// determine if first token in message is "SEND"
-	char* saveptr;
-	char* send_token = strtok_r(message, " ", &saveptr);
-	// if there are no more tokens, return false (0)
-	if (send_token == NULL) {
+/*========================================= SENDING TO THE SERVER ==========================================*/
+
+// queues a frame on the session, any thread may. returns -1 if the connection is gone
+int send_to_server(FrameType type, uint32_t stream_id, const void* payload, uint32_t length) {
+	return chat_session_send_frame(session, type, stream_id, payload, length);
+}
+
+// same, for a frame carrying a FileProgress
+int send_progress_to_server(FrameType type, uint32_t stream_id, uint64_t offset, uint32_t window) {
+	FileProgress progress = { offset, window };
+	unsigned char data[sizeof(FileProgress)];
+	Buffer fp_buffer = { data, sizeof(data) };
+	serialize_file_progress(&fp_buffer, &progress);
+	return send_to_server(type, stream_id, fp_buffer.data, fp_buffer.size);
+}
+
+// copies a reason string payload into str, cut to size - 1 characters
+void payload_string(Buffer* payload, char* str, size_t size) {
+	size_t n = payload->size < size - 1 ? payload->size : size - 1;
+	memcpy(str, payload->data, n);
+	str[n] = '\0';
+}
+
+/*========================================= RECEIVING FILES ==========================================*/
+
+// the server forwarded someone's offer. remember it and ask the user, the answer comes in
+// with the typed lines
+int receive_file(FrameHeader* header, Buffer* payload) {
+	if (payload->size != sizeof(FileOffer)) {
 		return 0;
 	}
-	// if yes, return true (1)
-	else if (strncmp(send_token, "SEND", strlen(send_token)) == 0) {
-		return 1;
+
+	FileOffer offer;
+	deserialize_file_offer(&offer, payload);
+
+	IncomingTransfer* transfer = (IncomingTransfer*) malloc(sizeof(IncomingTransfer));
+	if (transfer == NULL) error("ERROR allocating transfer");
+	memset(transfer, 0, sizeof(IncomingTransfer));
+	transfer->stream_id = header->stream_id;
+	transfer->filefd = -1;
+	strncpy(transfer->send_user, offer.peer, MAX_USERNAME_LEN);
+	strncpy(transfer->file_name, offer.file_name, MAX_FILENAME_LEN);
+	transfer->file_size = offer.file_size;
+	transfer->digest = offer.digest;
+	xxh64_init(&transfer->hash, 0);
+	transfer->state = TRANSFER_OFFERED;
+
+	pthread_mutex_lock(&transfers_mutex);
+	transfer->next = incoming_head;
+	incoming_head = transfer;
+	pthread_mutex_unlock(&transfers_mutex);
+
+	PROBE2(file__receive, offer.file_name, offer.file_size);
+	render_notice("\n%s wants to send a file %s (%lu bytes) to you. Receive? [Y/N]: ",
+	offer.peer, offer.file_name, (unsigned long) offer.file_size);
+
+	return 0;
+}
+
+// opens a new file for an incoming transfer without clobbering anything already there.
+// only the base name the sender gave is used so a transfer can't write outside the current directory
+int open_incoming_file(IncomingTransfer* transfer) {
+	char name[MAX_FILENAME_LEN];
+	strncpy(name, transfer->file_name, MAX_FILENAME_LEN);
+	char* base = basename(name);
+	if (strcmp(base, "/") == 0 || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+		base = "received_file";
 	}
-	// if no, return false (0)
-	else {
-		return 0;
+
+	for (int attempt = 0; attempt < MAX_RENAME_ATTEMPTS; attempt++) {
+		if (attempt == 0) {
+			snprintf(transfer->path, sizeof(transfer->path), "%s", base);
+		} else {
+			snprintf(transfer->path, sizeof(transfer->path), "%s.%d", base, attempt);
+		}
+		int fd = open(transfer->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (fd >= 0 || errno != EEXIST) {
+			return fd;
+		}
 	}
+	return -1;
 }
 
-int receive_file(char* buffer, int sockfd) {
-	// create copy of message in buffer (needed for strtok_r)
-	char message[BUFFER_SIZE];
-	strncpy(message, buffer, strlen(buffer));
-	
-	char* saveptr;
-	char* send_token = strtok_r(message, " ", &saveptr);
-	if (send_token == NULL) {
+// if an offer is waiting, a typed Y or N answers it. returns 0 if the line was an answer,
+// -1 if it should be sent as a chat message
+int answer_file_offer(char* buffer) {
+	char answer = buffer[0];
+	if ((answer != 'Y' && answer != 'y' && answer != 'N' && answer != 'n') || buffer[1] != '\n') {
 		return -1;
 	}
-	char* send_user = strtok_r(NULL, " ", &saveptr);
-	if (send_user == NULL) {
-		return -1;
+
+	// answer the oldest offer still waiting
+	pthread_mutex_lock(&transfers_mutex);
+	IncomingTransfer* transfer = NULL;
+	for (IncomingTransfer* cur = incoming_head; cur != NULL; cur = cur->next) {
+		if (cur->state == TRANSFER_OFFERED) {
+			transfer = cur;
+		}
 	}
-	char* file_name = strtok_r(NULL, " ", &saveptr);
-	if (file_name == NULL) {
+	if (transfer == NULL) {
+		pthread_mutex_unlock(&transfers_mutex);
 		return -1;
 	}
-	
-	printf("%s wants to send a file %s to you. Receive? [Y/N]: ", send_user, file_name);
-	
-	// send approval or denial to server
-	char response[2];
-	// TODO: check whole string not just first character
-	response[0] = (char)fgetc(stdin);
-	response[1] = '\0';
 
-	int n = send(sockfd, response, 1, 0);
-	if (n < 0) {
-		error("ERROR sending file approval");
+	uint32_t stream_id = transfer->stream_id;
+	char* reason = NULL;
+	if (answer == 'Y' || answer == 'y') {
+		transfer->filefd = open_incoming_file(transfer);
+		if (transfer->filefd < 0) {
+			render_notice("Could not create a file for %s\n", transfer->file_name);
+			reason = "receiver could not create the file";
+		} else {
+			transfer->state = TRANSFER_ACTIVE;
+			render_notice("Receiving %s into %s\n", transfer->file_name, transfer->path);
+		}
+	} else {
+		reason = "receiver declined";
+	}
+	if (reason != NULL) {
+		transfer->state = TRANSFER_FAILED;
+	}
+	pthread_mutex_unlock(&transfers_mutex);
+
+	if (reason != NULL) {
+		send_to_server(FRAME_FILE_REJECT, stream_id, reason, strlen(reason));
+	} else {
+		send_progress_to_server(FRAME_FILE_ACCEPT, stream_id, 0, FILE_WINDOW);
+	}
+	return 0;
+}
+
+// unlinks an incoming transfer, guarded by transfers_mutex
+void remove_incoming_transfer(IncomingTransfer* transfer) {
+	IncomingTransfer** link = &incoming_head;
+	while (*link != NULL) {
+		if (*link == transfer) {
+			*link = transfer->next;
+			if (transfer->filefd >= 0) {
+				close(transfer->filefd);
+			}
+			free(transfer);
+			return;
+		}
+		link = &(*link)->next;
+	}
+}
+
+IncomingTransfer* find_incoming_transfer(uint32_t stream_id) {
+	for (IncomingTransfer* cur = incoming_head; cur != NULL; cur = cur->next) {
+		if (cur->stream_id == stream_id) {
+			return cur;
+		}
+	}
+	return NULL;
+}
+
+// a chunk or the whole file didn't match its checksum: drop the partial file and tell the server,
+// which tells the sender. guarded by transfers_mutex
+void fail_incoming_transfer(IncomingTransfer* transfer, char* reason) {
+	render_notice("\nTransfer of %s from %s failed: %s\n", transfer->file_name, transfer->send_user, reason);
+	unlink(transfer->path);
+	remove_incoming_transfer(transfer);
+}
+
+// checks a chunk of file bytes against its CRC, writes it to disk and acknowledges it so the
+// sender can keep going. the ack for the last bytes waits for the whole file digest at FILE_COMPLETE
+int handle_file_chunk(FrameHeader* header, Buffer* payload) {
+	uint64_t offset;
+	uint32_t crc;
+	if (payload->size < CHUNK_PREFIX_LEN || payload->size - CHUNK_PREFIX_LEN > FILE_CHUNK_SIZE) {
+		return 0;
+	}
+	deserialize_chunk_prefix(&offset, &crc, payload);
+	unsigned char* data = payload->data + CHUNK_PREFIX_LEN;
+	uint32_t length = payload->size - CHUNK_PREFIX_LEN;
+
+	pthread_mutex_lock(&transfers_mutex);
+	IncomingTransfer* transfer = find_incoming_transfer(header->stream_id);
+	int filefd = (transfer != NULL && transfer->state == TRANSFER_ACTIVE) ? transfer->filefd : -1;
+	pthread_mutex_unlock(&transfers_mutex);
+
+	// the server only relays bytes that continue the file, anything else is a leftover from before a drop
+	if (filefd < 0 || offset != transfer->bytes_received) {
+		return 0;
 	}
 
-	// receive file
+	// NOTE: only the receiving side touches bytes_received, the hash and the file, the lock is for the list
+	if (crc32c(0, data, length) != crc) {
+		char* reason = "chunk checksum mismatch";
+		pthread_mutex_lock(&transfers_mutex);
+		fail_incoming_transfer(transfer, reason);
+		pthread_mutex_unlock(&transfers_mutex);
+		return send_to_server(FRAME_FILE_REJECT, header->stream_id, reason, strlen(reason)) < 0 ? -1 : 0;
+	}
+	if (pwrite(filefd, data, length, offset) != (ssize_t) length) {
+		render_notice("Writing %s failed\n", transfer->path);
+	}
+	xxh64_update(&transfer->hash, data, length);
+	transfer->bytes_received += length;
+	PROBE3(file__chunk__receive, header->stream_id, offset, length);
+	if (transfer->bytes_received == transfer->file_size) {
+		return 0;
+	}
+
+	return send_progress_to_server(FRAME_FILE_ACK, header->stream_id, transfer->bytes_received, FILE_WINDOW);
+}
+
+// sender says that was every byte. the file only counts as received (and gets its last ack) if
+// it hashes to the sender's digest
+int handle_file_complete(FrameHeader* header) {
+	char* reason = NULL;
+	int received = 0;
+	uint64_t size = 0;
+	pthread_mutex_lock(&transfers_mutex);
+	IncomingTransfer* transfer = find_incoming_transfer(header->stream_id);
+	if (transfer != NULL && transfer->state == TRANSFER_ACTIVE) {
+		size = transfer->file_size;
+		if (transfer->bytes_received != transfer->file_size) {
+			render_notice("\nTransfer of %s from %s ended short (%lu of %lu bytes)\n", transfer->path,
+			transfer->send_user, (unsigned long) transfer->bytes_received, (unsigned long) transfer->file_size);
+			remove_incoming_transfer(transfer);
+		} else if (xxh64_digest(&transfer->hash) != transfer->digest) {
+			reason = "file digest mismatch";
+			fail_incoming_transfer(transfer, reason);
+		} else {
+			render_notice("\nReceived %s from %s (%lu bytes)\n", transfer->path, transfer->send_user,
+			(unsigned long) transfer->bytes_received);
+			remove_incoming_transfer(transfer);
+			received = 1;
+		}
+	}
+	pthread_mutex_unlock(&transfers_mutex);
+	PROBE2(file__done, header->stream_id, received);
+
+	int status = 0;
+	if (reason != NULL) {
+		status = send_to_server(FRAME_FILE_REJECT, header->stream_id, reason, strlen(reason));
+	} else if (received) {
+		status = send_progress_to_server(FRAME_FILE_ACK, header->stream_id, size, FILE_WINDOW);
+	}
+	return status < 0 ? -1 : 0;
+}
+
+// the sender went away or the server gave up on the transfer, drop the partial file
+int handle_file_cancel(FrameHeader* header, Buffer* payload) {
+	char reason[MAX_REJECT_REASON_LEN + 1];
+	payload_string(payload, reason, sizeof(reason));
+
+	pthread_mutex_lock(&transfers_mutex);
+	IncomingTransfer* transfer = find_incoming_transfer(header->stream_id);
+	if (transfer != NULL) {
+		render_notice("\nTransfer of %s from %s cancelled: %s\n", transfer->file_name, transfer->send_user, reason);
+		if (transfer->state == TRANSFER_ACTIVE) {
+			unlink(transfer->path);
+		}
+		remove_incoming_transfer(transfer);
+	}
+	pthread_mutex_unlock(&transfers_mutex);
 
 	return 0;
 }
 
-// sends file to server to send to receiving client
-// returns status of file transfer (success, fail, other?)
-int send_file(char* buffer, int sockfd) {
+/*========================================= SENDING FILES ==========================================*/
+
+// unlinks an outgoing transfer, guarded by transfers_mutex
+void remove_outgoing_transfer(OutgoingTransfer* transfer) {
+	OutgoingTransfer** link = &outgoing_head;
+	while (*link != NULL) {
+		if (*link == transfer) {
+			*link = transfer->next;
+			close(transfer->filefd);
+			if (transfer->map != NULL) {
+				munmap(transfer->map, transfer->file_size);
+			}
+			cdc_free(&transfer->chunks);
+			free(transfer->needed);
+			free(transfer);
+			return;
+		}
+		link = &(*link)->next;
+	}
+}
+
+OutgoingTransfer* find_outgoing_transfer(uint32_t stream_id) {
+	for (OutgoingTransfer* cur = outgoing_head; cur != NULL; cur = cur->next) {
+		if (cur->stream_id == stream_id) {
+			return cur;
+		}
+	}
+	return NULL;
+}
+
+// handles a typed "SEND <user> <path>" (or "SEND * <path>" for the whole room): opens the file and
+// hands it to an upload thread, which cuts it into chunks and offers it
+int send_file(char* buffer) {
 	// create copy of message in buffer (needed for strtok_r)
 	char message[BUFFER_SIZE];
-	strncpy(message, buffer, strlen(buffer));
-	
+	strncpy(message, buffer, BUFFER_SIZE);
+	message[BUFFER_SIZE - 1] = '\0';
+	trim_whitespace(message);
+
 	char* saveptr;
 	char* send_token = strtok_r(message, " ", &saveptr);
 	if (send_token == NULL) {
@@ -119,213 +481,896 @@ int send_file(char* buffer, int sockfd) {
 	if (recv_user == NULL) {
 		return -1;
 	}
-	char* file_name = strtok_r(NULL, " ", &saveptr);
-	if (file_name == NULL) {
+	char* file_path = strtok_r(NULL, " ", &saveptr);
+	if (file_path == NULL) {
 		return -1;
 	}
 
 	// open file
+	int filefd = open(file_path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (filefd < 0 || fstat(filefd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		render_notice("Cannot send %s: not a readable file\n", file_path);
+		if (filefd >= 0) {
+			close(filefd);
+		}
+		return 0;
+	}
 
-	// send file to server
+	OutgoingTransfer* transfer = (OutgoingTransfer*) malloc(sizeof(OutgoingTransfer));
+	if (transfer == NULL) error("ERROR allocating transfer");
+	memset(transfer, 0, sizeof(OutgoingTransfer));
+	transfer->filefd = filefd;
+	strncpy(transfer->recv_user, recv_user, MAX_USERNAME_LEN - 1);
+	strncpy(transfer->file_name, basename(file_path), MAX_FILENAME_LEN - 1);
+	transfer->file_size = st.st_size;
+	transfer->state = TRANSFER_OFFERED;
 
+	pthread_mutex_lock(&transfers_mutex);
+	transfer->stream_id = next_stream_id++;
+	transfer->next = outgoing_head;
+	outgoing_head = transfer;
+	pthread_mutex_unlock(&transfers_mutex);
+
+	// chunking reads the whole file, that happens on the upload thread
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, thread_file_upload, (void*) transfer) != 0) {
+		error("ERROR creating file upload thread");
+	}
 	return 0;
 }
 
-// TODO: revisit when dealing with messages cleanly and use Buffer struct
-void* thread_main_recv(void* args)
+// sends the offer followed by the file's chunk list, so the server can tell which chunks it
+// already has. returns -1 if the connection dropped on the way
+int send_file_offer(OutgoingTransfer* transfer) {
+	FileOffer offer;
+	memset(&offer, 0, sizeof(FileOffer));
+	strncpy(offer.peer, transfer->recv_user, MAX_USERNAME_LEN);
+	strncpy(offer.file_name, transfer->file_name, MAX_FILENAME_LEN);
+	offer.file_size = transfer->file_size;
+	offer.chunk_count = transfer->chunks.count;
+	offer.digest = transfer->digest;
+
+	unsigned char data[sizeof(FileOffer)];
+	Buffer fo_buffer = { data, sizeof(data) };
+	serialize_file_offer(&fo_buffer, &offer);
+	int status = send_to_server(FRAME_FILE_OFFER, transfer->stream_id, fo_buffer.data, fo_buffer.size);
+
+	unsigned char* batch = (unsigned char*) malloc(MAX_MANIFEST_BATCH * sizeof(ManifestEntry));
+	if (batch == NULL) error("ERROR allocating chunk list");
+	for (uint32_t first = 0; status == 0 && first < transfer->chunks.count; first += MAX_MANIFEST_BATCH) {
+		uint32_t n = transfer->chunks.count - first;
+		if (n > MAX_MANIFEST_BATCH) n = MAX_MANIFEST_BATCH;
+		for (uint32_t i = 0; i < n; i++) {
+			ManifestEntry entry;
+			entry.length = transfer->chunks.offsets[first + i + 1] - transfer->chunks.offsets[first + i];
+			memcpy(entry.hash, transfer->chunks.hashes + (size_t) (first + i) * CHUNK_HASH_LEN, CHUNK_HASH_LEN);
+			Buffer me_buffer = { batch + i * sizeof(ManifestEntry), sizeof(ManifestEntry) };
+			serialize_manifest_entry(&me_buffer, &entry);
+		}
+		status = send_to_server(FRAME_FILE_MANIFEST, transfer->stream_id,
+		batch, n * sizeof(ManifestEntry));
+	}
+	free(batch);
+
+	if (status == 0) {
+		PROBE2(file__offer, offer.file_name, offer.file_size);
+		render_notice("Offered %s (%lu bytes) to %s\n", offer.file_name, (unsigned long) offer.file_size, recipient(transfer));
+	}
+	return status;
+}
+
+// who the transfer is for, as shown to the user
+char* recipient(OutgoingTransfer* transfer) {
+	if (strcmp(transfer->recv_user, BROADCAST_PEER) == 0) {
+		return "the room";
+	}
+	return transfer->recv_user;
+}
+
+// the chunk holding offset, guarded by transfers_mutex
+uint32_t find_chunk(ChunkList* chunks, uint64_t offset) {
+	uint32_t lo = 0, hi = chunks->count;
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (chunks->offsets[mid] <= offset) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// whether the server asked for chunk i, guarded by transfers_mutex
+int chunk_needed(OutgoingTransfer* transfer, uint32_t i) {
+	return transfer->needed == NULL || (transfer->needed[i / 8] >> (i % 8)) & 1;
+}
+
+// sends len bytes of the file from offset in a FILE_CHUNK, and FILE_COMPLETE after the last of them.
+// returns -1 if the connection dropped
+int send_chunk_to_server(OutgoingTransfer* transfer, off_t offset, uint32_t len) {
+	uint32_t crc = crc32c(0, transfer->map + offset, len);
+	if (chat_session_send_chunk(session, transfer->stream_id, offset, crc, transfer->map + offset, len) < 0) {
+		return -1;
+	}
+	PROBE3(file__chunk__send, transfer->stream_id, offset, len);
+	int last = (uint64_t) offset + len == transfer->file_size;
+	return last ? send_to_server(FRAME_FILE_COMPLETE, transfer->stream_id, NULL, 0) : 0;
+}
+
+// cuts the file into chunks and offers it, then streams the chunks the server asked for in
+// FILE_CHUNK frames, never more than the window past the last ack, and waits for
+// the final ack. the server acks past the chunks it had already, so those are never sent. while
+// paused it waits for FILE_RESUME, which moves next_offset back to wherever the server got to
+void* thread_file_upload(void* args)
 {
 	pthread_detach(pthread_self());
 
-	int sockfd = ((ThreadArgs*) args)->clisockfd;
-	ConnectionStatusMonitor* csm = ((ThreadArgs*) args)->csm;
-	free(args);
-	
-	// keep receiving and displaying message from server
-	char buffer[BUFFER_SIZE];
-	int n;
+	OutgoingTransfer* transfer = (OutgoingTransfer*) args;
 
-	memset(buffer, 0, BUFFER_SIZE);
+	// mapped for as long as the upload runs, chunk checksums are read from the same pages
+	unsigned char* map = NULL;
+	if (transfer->file_size > 0) {
+		map = mmap(NULL, transfer->file_size, PROT_READ, MAP_SHARED, transfer->filefd, 0);
+		if (map == MAP_FAILED) {
+			map = NULL;
+		} else {
+			madvise(map, transfer->file_size, MADV_SEQUENTIAL);
+		}
+	}
+	ChunkList chunks;
+	int failed = (transfer->file_size > 0 && map == NULL) || cdc_chunk(map, transfer->file_size, &chunks) < 0;
+	if (failed) {
+		render_notice("Cannot send %s: reading it failed\n", transfer->file_name);
+		memset(&chunks, 0, sizeof(ChunkList));
+	}
+	uint64_t digest = failed ? 0 : xxh64(map, transfer->file_size, 0);
+	pthread_mutex_lock(&transfers_mutex);
+	transfer->map = map;
+	transfer->digest = digest;
+	transfer->chunks = chunks;
+	// the session may have been lost meanwhile
+	failed = failed || transfer->state == TRANSFER_FAILED;
+	pthread_mutex_unlock(&transfers_mutex);
+	if (!failed && send_file_offer(transfer) < 0) {
+		failed = 1;
+	}
 
-	n = recv(sockfd, buffer, BUFFER_SIZE, 0);
-	switch (n) {
-		case -1:
-			error("ERROR recv() failed");
-			break;
-		case 0:	
-			pthread_mutex_lock(&csm->connection_status_mutex);
-			csm->connection_status = RECEIVED_DISCONNECT_CONFIRMATION;
-			pthread_cond_signal(&csm->connection_status_cond);
-			pthread_mutex_unlock(&csm->connection_status_mutex);
-			break;
-		default:
-			// TODO: receive file
-			if (is_filetransfer(buffer)) {
-				if (receive_file(buffer, sockfd) == -1) {
-					error("ERROR receiving file");
-				}
-			}
-			else {
-				printf("\n%s\n", buffer);
+	pthread_mutex_lock(&transfers_mutex);
+	if (failed) {
+		transfer->state = TRANSFER_FAILED;
+	}
+	while (transfer->state == TRANSFER_OFFERED
+	|| ((transfer->state == TRANSFER_ACTIVE || transfer->state == TRANSFER_PAUSED)
+	&& transfer->bytes_acked < transfer->file_size)) {
+		// skip to the next chunk the server lacks
+		if (transfer->state == TRANSFER_ACTIVE && transfer->next_offset < transfer->file_size) {
+			uint32_t i = find_chunk(&transfer->chunks, transfer->next_offset);
+			while (i < transfer->chunks.count && !chunk_needed(transfer, i)) {
+				transfer->next_offset = transfer->chunks.offsets[++i];
 			}
+		}
+		uint64_t in_flight = transfer->next_offset > transfer->bytes_acked ? transfer->next_offset - transfer->bytes_acked : 0;
+		// wait for the answer, while paused, for the server to open the window, or (everything is
+		// out) for the final ack
+		if (transfer->state != TRANSFER_ACTIVE || transfer->next_offset >= transfer->file_size
+		|| in_flight >= transfer->window) {
+			pthread_cond_wait(&transfers_cond, &transfers_mutex);
+			continue;
+		}
+		off_t offset = transfer->next_offset;
+		uint32_t resumes = transfer->resumes;
+		// a frame never crosses into the next chunk, the server checks each chunk as it completes
+		uint32_t i = find_chunk(&transfer->chunks, offset);
+		uint64_t len = transfer->chunks.offsets[i + 1] - offset;
+		uint64_t room = transfer->window - in_flight;
+		if (len > room) len = room;
+		if (len > FILE_CHUNK_SIZE) len = FILE_CHUNK_SIZE;
+		pthread_mutex_unlock(&transfers_mutex);
+
+		failed = send_chunk_to_server(transfer, offset, len) < 0;
+		offset += len;
 
-			while (n > 0) {
-				memset(buffer, 0, BUFFER_SIZE);
-				n = recv(sockfd, buffer, BUFFER_SIZE, 0);
-				switch (n) {
-					case -1:
-						error("ERROR recv() failed");
-						break;
-					case 0:
-						pthread_mutex_lock(&csm->connection_status_mutex);
-						csm->connection_status = RECEIVED_DISCONNECT_CONFIRMATION;
-						pthread_cond_signal(&csm->connection_status_cond);
-						pthread_mutex_unlock(&csm->connection_status_mutex);
-						break;
-					default:
-						if (is_filetransfer(buffer)) {
-							// TODO: receive file
-							if (receive_file(buffer, sockfd) == -1) {
-								error("ERROR receiving file");
-							}
-						}
-						else {
-							printf("\n%s\n", buffer);
-						}
-				}
+		pthread_mutex_lock(&transfers_mutex);
+		if (failed) {
+			// the connection dropped. the session resuming restarts us, losing it fails us
+			if (transfer->state == TRANSFER_ACTIVE) {
+				transfer->state = TRANSFER_PAUSED;
 			}
+		} else if (transfer->resumes == resumes && (uint64_t) offset > transfer->next_offset) {
+			transfer->next_offset = offset;
+		}
 	}
+
+	if (transfer->state != TRANSFER_FAILED && transfer->bytes_acked >= transfer->file_size) {
+		transfer->state = TRANSFER_DONE;
+		render_notice("\nSent %s to %s (%lu bytes)\n", transfer->file_name, recipient(transfer),
+		(unsigned long) transfer->file_size);
+	} else {
+		render_notice("\nSending %s to %s failed\n", transfer->file_name, recipient(transfer));
+	}
+	remove_outgoing_transfer(transfer);
+	pthread_mutex_unlock(&transfers_mutex);
+
 	return NULL;
 }
 
+// the server has the chunk list, the upload starts where it says
+int handle_file_accept(FrameHeader* header, Buffer* payload) {
+	if (payload->size != sizeof(FileProgress)) {
+		return 0;
+	}
+	FileProgress progress;
+	deserialize_file_progress(&progress, payload);
+
+	pthread_mutex_lock(&transfers_mutex);
+	OutgoingTransfer* transfer = find_outgoing_transfer(header->stream_id);
+	if (transfer != NULL && transfer->state == TRANSFER_OFFERED) {
+		transfer->state = TRANSFER_ACTIVE;
+		transfer->bytes_acked = progress.offset;
+		transfer->next_offset = progress.offset;
+		transfer->window = progress.window;
+		pthread_cond_broadcast(&transfers_cond);
+	}
+	pthread_mutex_unlock(&transfers_mutex);
+
+	return 0;
+}
+
+// which chunks the server lacks, sent before it accepts the upload and again when it resumes
+int handle_file_need(FrameHeader* header, Buffer* payload) {
+	if (payload->size > (MAX_MANIFEST_CHUNKS + 7) / 8) {
+		return 0;
+	}
+	unsigned char* bitmap = (unsigned char*) malloc(payload->size + 1);
+	if (bitmap == NULL) error("ERROR allocating chunk bitmap");
+	memcpy(bitmap, payload->data, payload->size);
+
+	pthread_mutex_lock(&transfers_mutex);
+	OutgoingTransfer* transfer = find_outgoing_transfer(header->stream_id);
+	if (transfer != NULL && payload->size == (transfer->chunks.count + 7) / 8) {
+		free(transfer->needed);
+		transfer->needed = bitmap;
+		bitmap = NULL;
+	}
+	pthread_mutex_unlock(&transfers_mutex);
+
+	free(bitmap);
+	return 0;
+}
+
+// receiver wrote more of the file, slide the window
+int handle_file_ack(FrameHeader* header, Buffer* payload) {
+	if (payload->size != sizeof(FileProgress)) {
+		return 0;
+	}
+	FileProgress progress;
+	deserialize_file_progress(&progress, payload);
+
+	pthread_mutex_lock(&transfers_mutex);
+	OutgoingTransfer* transfer = find_outgoing_transfer(header->stream_id);
+	if (transfer != NULL && progress.offset > transfer->bytes_acked) {
+		transfer->bytes_acked = progress.offset;
+		transfer->window = progress.window;
+		pthread_cond_broadcast(&transfers_cond);
+	}
+	pthread_mutex_unlock(&transfers_mutex);
+
+	return 0;
+}
+
+// the server refused the file, or its receiver declined or went away
+int handle_file_reject(FrameHeader* header, Buffer* payload) {
+	char reason[MAX_REJECT_REASON_LEN + 1];
+	payload_string(payload, reason, sizeof(reason));
+
+	pthread_mutex_lock(&transfers_mutex);
+	OutgoingTransfer* transfer = find_outgoing_transfer(header->stream_id);
+	if (transfer != NULL) {
+		render_notice("\n%s was not sent to %s: %s\n", transfer->file_name, recipient(transfer), reason);
+		transfer->state = TRANSFER_FAILED;
+		pthread_cond_broadcast(&transfers_cond);
+	}
+	pthread_mutex_unlock(&transfers_mutex);
+
+	return 0;
+}
+
+// the receiver dropped, hold off until the server says to resume
+int handle_file_pause(FrameHeader* header, Buffer* payload) {
+	char reason[MAX_REJECT_REASON_LEN + 1];
+	payload_string(payload, reason, sizeof(reason));
+
+	pthread_mutex_lock(&transfers_mutex);
+	OutgoingTransfer* transfer = find_outgoing_transfer(header->stream_id);
+	if (transfer != NULL && transfer->state == TRANSFER_ACTIVE) {
+		transfer->state = TRANSFER_PAUSED;
+		render_notice("\nSending %s to %s paused: %s\n", transfer->file_name, recipient(transfer), reason);
+	}
+	pthread_mutex_unlock(&transfers_mutex);
+
+	return 0;
+}
+
+// both sides are back after a drop. without a payload the server is asking us (the receiver)
+// where we got to, with one it is telling us (the sender) where to carry on from
+int handle_file_resume(FrameHeader* header, Buffer* payload) {
+	if (payload->size == 0) {
+		pthread_mutex_lock(&transfers_mutex);
+		IncomingTransfer* transfer = find_incoming_transfer(header->stream_id);
+		int known = (transfer != NULL && transfer->state == TRANSFER_ACTIVE);
+		uint64_t offset = known ? transfer->bytes_received : 0;
+		if (known) {
+			render_notice("\nResuming %s from %s at %lu bytes\n", transfer->path, transfer->send_user, (unsigned long) offset);
+		}
+		pthread_mutex_unlock(&transfers_mutex);
+
+		if (!known) {
+			char* reason = "receiver no longer has the transfer";
+			return send_to_server(FRAME_FILE_REJECT, header->stream_id, reason, strlen(reason)) < 0 ? -1 : 0;
+		}
+		return send_progress_to_server(FRAME_FILE_RESUME, header->stream_id, offset, FILE_WINDOW);
+	}
+
+	if (payload->size != sizeof(FileProgress)) {
+		return 0;
+	}
+	FileProgress progress;
+	deserialize_file_progress(&progress, payload);
+
+	pthread_mutex_lock(&transfers_mutex);
+	OutgoingTransfer* transfer = find_outgoing_transfer(header->stream_id);
+	if (transfer != NULL && transfer->state != TRANSFER_DONE && transfer->state != TRANSFER_FAILED) {
+		// everything before the offset is stored, resend from there
+		transfer->bytes_acked = progress.offset;
+		transfer->next_offset = progress.offset;
+		transfer->window = progress.window;
+		transfer->resumes++;
+		transfer->state = TRANSFER_ACTIVE;
+		render_notice("\nResuming %s to %s at %lu bytes\n", transfer->file_name, recipient(transfer),
+		(unsigned long) progress.offset);
+		pthread_cond_broadcast(&transfers_cond);
+	}
+	pthread_mutex_unlock(&transfers_mutex);
+
+	return 0;
+}
+
+// the connection dropped. running transfers wait for the session to be resumed, the server
+// picks them back up from where its spool got to. uploads still waiting for their answer stay
+// too, the server either resumes or rejects them. offers we haven't answered are cancelled by
+// the server, so they go
+void pause_all_transfers() {
+	pthread_mutex_lock(&transfers_mutex);
+	for (OutgoingTransfer* out = outgoing_head; out != NULL; out = out->next) {
+		if (out->state == TRANSFER_ACTIVE) {
+			out->state = TRANSFER_PAUSED;
+		}
+	}
+	IncomingTransfer* in = incoming_head;
+	while (in != NULL) {
+		IncomingTransfer* next = in->next;
+		if (in->state == TRANSFER_OFFERED) {
+			remove_incoming_transfer(in);
+		}
+		in = next;
+	}
+	pthread_mutex_unlock(&transfers_mutex);
+}
+
+// the session is gone (we had to rejoin as a new member), nothing in flight survives it
+void fail_all_transfers() {
+	pthread_mutex_lock(&transfers_mutex);
+	// upload threads clean up after themselves
+	for (OutgoingTransfer* out = outgoing_head; out != NULL; out = out->next) {
+		if (out->state != TRANSFER_DONE) {
+			out->state = TRANSFER_FAILED;
+		}
+	}
+	while (incoming_head != NULL) {
+		if (incoming_head->state == TRANSFER_ACTIVE) {
+			unlink(incoming_head->path);
+		}
+		remove_incoming_transfer(incoming_head);
+	}
+	pthread_cond_broadcast(&transfers_cond);
+	pthread_mutex_unlock(&transfers_mutex);
+}
+
+/*========================================= SESSION ==========================================*/
+
+// the server listed its rooms. the session has nothing else to do until it hears back, so the
+// choice is read right here the way the handshake always did
+void on_rooms(ChatSession* session, ConnectionConfirmation* cc, void* context) {
+	(void) context;
+	print_room_selection_prompt(cc);
+	fflush(stdout);
+
+	char room_arg[MAX_USERNAME_LEN];
+	if (fgets(room_arg, MAX_USERNAME_LEN - 1, stdin) == NULL) {
+		room_arg[0] = '\0';
+	}
+	trim_whitespace(room_arg);
+	if (strcmp(room_arg, CREATE_NEW_ROOM_COMMAND) != 0 && !is_number(room_arg)) {
+		printf("Your room choice is invalid. Disconnecting...\n");
+		fflush(stdout);
+	}
+	chat_session_choose_room(session, room_arg);
+}
+
+void on_joined(ChatSession* session, ConnectionConfirmation* cc, void* context) {
+	struct sockaddr_in* serv_addr = (struct sockaddr_in*) context;
+	PROBE3(handshake__done, chat_session_socket(session), cc->status, cc->connected_room.room_number);
+
+	if (reconnect.attempts > 0) {
+		if (cc->status == CONFIRMATION_RESUMED) {
+			render_notice("Reconnected to room %d\n", cc->connected_room.room_number);
+		} else {
+			// a new session doesn't know our transfers
+			fail_all_transfers();
+			render_notice("Rejoined room %d\n", cc->connected_room.room_number);
+		}
+		reconnect.attempts = 0;
+		return;
+	}
+
+	if (cc->status == CONFIRMATION_SUCCESS_NEW) {
+		render_notice("Connected to %s with new room number %d\n", inet_ntoa(serv_addr->sin_addr),
+		cc->connected_room.room_number);
+	}
+	if (!event_loop) {
+		// typed lines only go to the room once we are in one
+		pthread_t tid_send;
+		pthread_create(&tid_send, NULL, thread_main_send, NULL);
+	}
+}
+
+void on_message(ChatSession* session, const char* text, size_t len, void* context) {
+	(void) session;
+	(void) context;
+	PROBE1(message__receive, len);
+	if (len > BUFFER_SIZE - 1) {
+		len = BUFFER_SIZE - 1;
+	}
+	if (headless.enabled) {
+		record_message(text, len);
+	} else {
+		render_message(text, len);
+	}
+}
+
+// hands a file frame from the server to what deals with it. returns -1 if the connection should be dropped
+int on_frame(ChatSession* session, FrameHeader* header, Buffer* payload, void* context) {
+	(void) session;
+	(void) context;
+	switch (header->type) {
+		case FRAME_FILE_OFFER:
+			return receive_file(header, payload);
+		case FRAME_FILE_ACCEPT:
+			return handle_file_accept(header, payload);
+		case FRAME_FILE_REJECT:
+			return handle_file_reject(header, payload);
+		case FRAME_FILE_NEED:
+			return handle_file_need(header, payload);
+		case FRAME_FILE_CHUNK:
+			return handle_file_chunk(header, payload);
+		case FRAME_FILE_ACK:
+			return handle_file_ack(header, payload);
+		case FRAME_FILE_COMPLETE:
+			return handle_file_complete(header);
+		case FRAME_FILE_CANCEL:
+			return handle_file_cancel(header, payload);
+		case FRAME_FILE_PAUSE:
+			return handle_file_pause(header, payload);
+		case FRAME_FILE_RESUME:
+			return handle_file_resume(header, payload);
+		default:
+			return 0;
+	}
+}
+
+// the connection is gone. once we are in a room that means resuming the session, a few times with
+// a growing wait in between before giving up. before that, or after leaving, there is nothing to do
+void on_disconnected(ChatSession* session, ChatState state, void* context) {
+	(void) context;
+	if (state == CHAT_CLOSED) {
+		if (chat_session_room(session) == UNINITIALIZED_ROOM_NUMBER) {
+			// never got into a room: the server is unreachable (errno says why) or refused us
+			error(errno == EACCES ? "ERROR: server refused connection" : "ERROR connecting");
+		}
+		return;
+	}
+
+	if (reconnect.attempts == 0) {
+		pause_all_transfers();
+		render_notice("Connection to server lost, reconnecting...\n");
+	}
+	schedule_reconnect();
+}
+
+// sets the time for the next reconnect attempt: right away after the drop, then backing off
+void schedule_reconnect() {
+	if (reconnect.attempts >= RESUME_ATTEMPTS) {
+		render_notice("Could not reconnect to server.\n");
+		reconnect.gave_up = 1;
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &reconnect.at);
+	if (reconnect.attempts > 0) {
+		timespec_add(&reconnect.at, 1 << (reconnect.attempts - 1));
+	}
+	reconnect.pending = 1;
+}
+
+// acts on a line typed by the user: answers a pending offer, starts a file transfer or goes to the
+// room as chat. returns 1 if it was the exit command and we are on the way out
+int handle_input_line(char* buffer) {
+	if (strncmp(buffer, EXIT_COMMAND, strlen(EXIT_COMMAND)) == 0) {
+		// while reconnecting this waits for the session to be back
+		return chat_session_leave(session) == 0;
+	}
+
+	// a Y/N line answers a pending file offer instead of going to the room
+	if (answer_file_offer(buffer) == 0) {
+		return 0;
+	}
+
+	if (is_filetransfer(buffer)) {
+		if (send_file(buffer) == -1) {
+			render_notice("Usage: SEND <username> <file> or SEND * <file>\n");
+		}
+		return 0;
+	}
+
+	if (chat_session_send(session, buffer, strlen(buffer)) < 0) {
+		render_notice("Connection lost, reconnecting. Message not sent.\n");
+		return 0;
+	}
+	PROBE1(message__send, strlen(buffer));
+	headless.sent++;
+	headless.sent_bytes += strlen(buffer);
+	return 0;
+}
+
+// reads typed lines while the session loop runs in the main thread
 void* thread_main_send(void* args)
 {
+	(void) args;
 	pthread_detach(pthread_self());
 
-	int sockfd = ((ThreadArgs*) args)->clisockfd;
-	ConnectionStatusMonitor* csm = ((ThreadArgs*) args)->csm;
-	free(args);
-
 	// keep sending messages to the server
 	char buffer[BUFFER_SIZE];
-	int n;
 
 	while (1) {
 		// You will need a bit of control on your terminal
 		// console or GUI to have a nice input window.
 		//printf("\nPlease enter the message: ");
 		memset(buffer, 0, BUFFER_SIZE);
-		// blocks until user enters a message
-		fgets(buffer, BUFFER_SIZE - 1, stdin);
-
-		n = send(sockfd, buffer, strlen(buffer), 0);
-		if (n < 0) {
-			error("ERROR writing to socket");
-		} else if (n == 0 && strlen(buffer) != 0) {
-			error("(probably) ERROR writing to socket");
-		}
-		
-		if (is_filetransfer(buffer)) {
-			// TODO: send file
-			if (send_file(buffer, sockfd) == -1) {
-				error("ERROR sending file");
-			}
+		// blocks until user enters a message, end of input leaves the room
+		int eof = fgets(buffer, BUFFER_SIZE - 1, stdin) == NULL;
+		if (eof) {
+			strcpy(buffer, EXIT_COMMAND);
 		}
 
 		// Handle user manual disconnect
-		if ((strncmp(buffer, EXIT_COMMAND, strlen(EXIT_COMMAND)) == 0)) {
-			pthread_mutex_lock(&csm->connection_status_mutex);
-			csm->connection_status = SENT_DISCONNECT_REQUEST;
-			pthread_cond_signal(&csm->connection_status_cond);
-			pthread_mutex_unlock(&csm->connection_status_mutex);
+		if (handle_input_line(buffer)) {
 			break;
 		}
+		if (eof) {
+			// the session is reconnecting, leave once it is back
+			sleep(1);
+		}
 	}
 	return NULL;
 }
 
+/*========================================= EVENT LOOP ==========================================*/
+
+long ms_until(const struct timespec* when) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long ns = (when->tv_sec - now.tv_sec) * 1000000000L + (when->tv_nsec - now.tv_nsec);
+	return ns <= 0 ? 0 : (ns + 999999) / 1000000;
+}
+
+void timespec_add(struct timespec* ts, double seconds) {
+	long ns = (long) (seconds * 1e9);
+	ts->tv_sec += ns / 1000000000L;
+	ts->tv_nsec += ns % 1000000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+// writes a received chat line to the headless record as "<unix time> <text>", with the colors
+// taken out and the line kept on one line
+void record_message(const char* message, size_t size) {
+	headless.received++;
+	headless.received_bytes += size;
+	if (headless.record == NULL) {
+		return;
+	}
+
+	char text[BUFFER_SIZE];
+	size_t len = 0;
+	for (size_t i = 0; i < size && len < sizeof(text) - 1; i++) {
+		char c = message[i];
+		if (c == '\033' && i + 1 < size && message[i + 1] == '[') {
+			// skip to the letter that ends the escape sequence
+			for (i += 2; i < size && !isalpha((unsigned char) message[i]); i++);
+			continue;
+		}
+		text[len++] = c == '\n' || c == '\r' ? ' ' : c;
+	}
+	while (len > 0 && text[len - 1] == ' ') {
+		len--;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	fprintf(headless.record, "%ld.%06ld %.*s\n", (long) now.tv_sec, now.tv_nsec / 1000, (int) len, text);
+}
+
+// reads what there is of the input. what was read is only handled by handle_input()
+void read_input(Input* input) {
+	ssize_t n = read(input->fd, input->line + input->len, BUFFER_SIZE - 1 - input->len);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return;
+	}
+	if (n <= 0) {
+		input->eof = 1;
+		clock_gettime(CLOCK_MONOTONIC, &input->eof_at);
+		timespec_add(&input->eof_at, headless.linger);
+		return;
+	}
+	input->len += n;
+}
+
+// takes the next whole line out of the input into buffer, the way fgets would have handed it
+// out. returns 0 if there is none yet
+int next_input_line(Input* input, char* buffer) {
+	char* newline = memchr(input->line, '\n', input->len);
+	size_t end;
+	if (newline != NULL) {
+		end = newline - input->line + 1;
+	} else if (input->len == BUFFER_SIZE - 1 || (input->eof && input->len > 0)) {
+		// longer than a message may be, or the last line had no newline
+		end = input->len;
+	} else {
+		return 0;
+	}
+	memcpy(buffer, input->line, end);
+	buffer[end] = '\0';
+	memmove(input->line, input->line + end, input->len - end);
+	input->len -= end;
+	return 1;
+}
+
+// milliseconds until handle_input() has something to do with what was read, -1 if it needs
+// more input first
+int input_due_ms(Input* input) {
+	if (input->eof && input->len == 0) {
+		return (int) ms_until(&input->eof_at);
+	}
+	if (memchr(input->line, '\n', input->len) == NULL && input->len < BUFFER_SIZE - 1 && !input->eof) {
+		return -1;
+	}
+	return headless.rate > 0 ? (int) ms_until(&headless.next_line) : 0;
+}
+
+// handles the whole lines read so far, in headless mode no faster than the set rate. the end of
+// the input leaves the room like the exit command does (headless mode lingers first).
+// returns 1 once we asked to leave
+int handle_input(Input* input) {
+	char buffer[BUFFER_SIZE];
+	while (input_due_ms(input) == 0) {
+		if (!next_input_line(input, buffer)) {
+			// out of input
+			strcpy(buffer, EXIT_COMMAND);
+			return handle_input_line(buffer);
+		}
+		if (headless.rate > 0) {
+			// a steady pace, without a burst to catch up after a stall
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (ms_until(&headless.next_line) == 0) {
+				headless.next_line = now;
+			}
+			timespec_add(&headless.next_line, 1.0 / headless.rate);
+		}
+		if (handle_input_line(buffer)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// totals of a headless session, for whoever runs the bots
+void print_headless_stats() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - headless.started.tv_sec) + (now.tv_nsec - headless.started.tv_nsec) / 1e9;
+	render_notice("%s: sent %lu messages (%lu bytes), received %lu messages (%lu bytes) in %.3f s\n",
+	chat_session_username(session), (unsigned long) headless.sent, (unsigned long) headless.sent_bytes,
+	(unsigned long) headless.received, (unsigned long) headless.received_bytes, elapsed);
+	if (headless.record != NULL) {
+		fclose(headless.record);
+		headless.record = NULL;
+	}
+}
+
+// runs the session from this thread until we left the room or the server stayed unreachable:
+// polls its descriptor, reconnects when it is time to and, with -p, reads the input and writes
+// the render frames too. frames are read into a buffer and handled once whole, so a slow server
+// never stalls the prompt
+void run_session() {
+	Input input = { STDIN_FILENO, { 0 }, 0, 0, { 0, 0 } };
+	if (headless.enabled && strcmp(headless.script, "-") != 0) {
+		input.fd = open(headless.script, O_RDONLY);
+		if (input.fd < 0) error("ERROR opening script");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &headless.next_line);
+
+	ChatState state;
+	while ((state = chat_session_state(session)) != CHAT_CLOSED && !reconnect.gave_up) {
+		int timeout = -1;
+		int input_due = -1;
+		if (event_loop) {
+			// output goes out a frame at a time, poll() wakes us when the next one is due
+			timeout = render_due_ms();
+			if (timeout == 0) {
+				render_frame();
+				timeout = -1;
+			}
+			// and when the next line of input may be handled. input waits while we aren't in the room
+			input_due = state == CHAT_JOINED ? input_due_ms(&input) : -1;
+			if (input_due >= 0 && (timeout < 0 || input_due < timeout)) {
+				timeout = input_due;
+			}
+		}
+		if (reconnect.pending) {
+			int reconnect_due = (int) ms_until(&reconnect.at);
+			if (timeout < 0 || reconnect_due < timeout) {
+				timeout = reconnect_due;
+			}
+		}
+		int want_input = event_loop && state == CHAT_JOINED && !input.eof && input_due < 0;
+		struct pollfd fds[2] = {
+			{ chat_session_fd(session), POLLIN, 0 },
+			{ want_input ? input.fd : -1, POLLIN, 0 },
+		};
+		if (poll(fds, 2, timeout) < 0) {
+			if (errno == EINTR) continue;
+			error("ERROR on poll");
+		}
+
+		if (reconnect.pending && ms_until(&reconnect.at) == 0) {
+			reconnect.pending = 0;
+			reconnect.attempts++;
+			PROBE1(handshake__start, reconnect.attempts);
+			if (chat_session_reconnect(session) < 0) {
+				schedule_reconnect();
+			}
+		}
+		if (fds[0].revents & POLLIN) {
+			chat_session_process(session);
+		}
+		if (fds[1].revents & (POLLIN | POLLHUP)) {
+			read_input(&input);
+		}
+		if (event_loop && chat_session_state(session) == CHAT_JOINED) {
+			handle_input(&input);
+		}
+	}
+
+	if (input.fd != STDIN_FILENO) {
+		close(input.fd);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	/*================================INITIAL CONNECTION================================*/
 	char* room_arg = NULL;
+	char username[MAX_USERNAME_LEN] = { 0 };
 
-	switch (argc) {
-		case 2:
-			break;
-		case 3:
-			room_arg = argv[2];
-			break;
-		default:
-			error("ERROR: Invalid number of arguments\n"
-			"Usage:\n"
-			"./chat_client <hostname> <room_number>\n"
-			"./chat_client <hostname> new\n"
-			"./chat_client <hostname>");
+	char* record_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "pu:s:r:l:o:")) != -1) {
+		switch (opt) {
+			case 'p':
+				event_loop = 1;
+				break;
+			case 'u':
+				// headless runs on the event loop, one thread per bot
+				headless.enabled = 1;
+				event_loop = 1;
+				strncpy(username, optarg, MAX_USERNAME_LEN - 1);
+				trim_whitespace(username);
+				break;
+			case 's':
+				headless.script = optarg;
+				break;
+			case 'r':
+				headless.rate = atof(optarg);
+				break;
+			case 'l':
+				headless.linger = atof(optarg);
+				break;
+			case 'o':
+				record_path = optarg;
+				break;
+			default:
+				argc = 0; // usage below
+		}
+	}
+	// what follows the options: the host and, unless the server is to list its rooms, a room
+	int nargs = argc - optind + 1;
+	char* hostname = argv[optind];
+
+	if (nargs == 3) {
+		room_arg = argv[optind + 1];
+	}
+	// a headless client has nobody to answer the room menu
+	if (nargs < 2 || nargs > 3 || (headless.enabled && nargs != 3)) {
+		error("ERROR: Invalid number of arguments\n"
+		"Usage:\n"
+		"./chat_client [-p] <hostname> <room_number>\n"
+		"./chat_client [-p] <hostname> new\n"
+		"./chat_client [-p] <hostname>\n"
+		"./chat_client -u <username> [-s <script>] [-r <rate>] [-l <linger>] [-o <record>] <hostname> <room_number>|new\n"
+		"-p: read the input and run the session on a single poll() loop instead of two threads\n"
+		"-u: headless, sends the lines of the script (default stdin) at rate lines a second, stays\n"
+		"    linger seconds after the last one and records the room's chat to the record file");
+	}
+	if (headless.enabled && (username[0] == '\0' || headless.rate < 0 || headless.linger < 0)) {
+		error("ERROR: Invalid headless options");
+	}
+	if (record_path != NULL) {
+		headless.record = fopen(record_path, "w");
+		if (headless.record == NULL) error("ERROR opening record file");
+	}
+
+	if (event_loop) {
+		// the loop reads stdin with read(), nothing may sit in a stdio buffer it can't see
+		setvbuf(stdin, NULL, _IONBF, 0);
 	}
 	
 	/*===========================USERNAME HANDLING================================*/
-	// initialize global variable username 	
-	init_username();
-
-	// Parse command line arguments and set up initial connection request (serialized buffer)
-	Buffer cr_buffer;
-	init_buffer(&cr_buffer, sizeof(ConnectionRequest));
-	prepare_connection_request(argc, room_arg, &cr_buffer, username);
+	if (!headless.enabled) {
+		init_username(username);
+	}
 
+	// a dropped server connection is handled by resuming, not by dying on SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
 
-	/*================================CONNECTION STATUS MONITOR============================*/
-	// Initialize connection status monitor
-	ConnectionStatusMonitor csm;
-	csm_init(&csm);
-	
 	/*================================SOCKET CONNECTION====================================*/
-	// Create socket
-	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0) error("ERROR opening socket");
-
 	struct sockaddr_in serv_addr;
-	set_server_addr(argv[1], &serv_addr);
+	set_server_addr(hostname, &serv_addr);
 
 	// Try connecting to server
 	printf("Try connecting to %s...\n", inet_ntoa(serv_addr.sin_addr));
 
-	int status = connect(sockfd, 
-			(struct sockaddr *) &serv_addr, sizeof(serv_addr));
-	if (status < 0) error("ERROR connecting");
-
-
-	/*================================SETUP THREADS========================================*/
-	// Set up send and receive threads
-	pthread_t tid_recv;
-	pthread_t tid_send;
-	ThreadArgs* args; // reuse for both threads
-	
-	perform_handshake(sockfd, &serv_addr, &cr_buffer, username);
-	cleanup_buffer(&cr_buffer);
-	
-	args = (ThreadArgs*) malloc(sizeof(ThreadArgs));
-	args->clisockfd = sockfd;
-	args->csm = &csm;
-	pthread_create(&tid_recv, NULL, thread_main_recv, (void*) args);
-	
-	args = (ThreadArgs*) malloc(sizeof(ThreadArgs));
-	args->clisockfd = sockfd;
-	args->csm = &csm;
-	pthread_create(&tid_send, NULL, thread_main_send, (void*) args);
-
-
-	// NOTE: I'm pretty sure you can't/shouldn't join a detached thread
-	// pthread_join(tid_send, NULL);
+	ChatCallbacks callbacks = { on_rooms, on_joined, on_message, on_frame, on_disconnected };
+	session = chat_session_create(username, &callbacks, &serv_addr);
+	if (session == NULL) error("ERROR creating session");
+	PROBE1(handshake__start, 0);
+	if (chat_session_connect(session, &serv_addr, room_arg) < 0) error("ERROR connecting");
 
-	pthread_mutex_lock(&csm.connection_status_mutex);
-	while (csm.connection_status != RECEIVED_DISCONNECT_CONFIRMATION) {
-		pthread_cond_wait(&csm.connection_status_cond, &csm.connection_status_mutex);
+	/*================================SESSION========================================*/
+	// without -p typed lines are read by their own thread once we are in a room, and the
+	// renderer thread writes the output
+	render_start(!event_loop);
+	clock_gettime(CLOCK_MONOTONIC, &headless.started);
+	run_session();
+	if (headless.enabled) {
+		print_headless_stats();
 	}
-	pthread_mutex_unlock(&csm.connection_status_mutex);
 
-	close(sockfd);
-
-	csm_destroy(&csm);
+	render_stop();
+	chat_session_destroy(session);
 
 	return 0;
 }
-
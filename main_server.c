@@ -10,31 +10,40 @@
 #include <time.h>
 #include <signal.h>
 #include <semaphore.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "handshake.h"
+#include "frame.h"
+#include "connection.h"
+#include "room.h"
+#include "spool.h"
+#include "chunk_store.h"
+#include "checksum.h"
 #include "util.h"
+#include "transport.h"
+#include "net_sim.h"
+#include "capture.h"
+#include "metrics.h"
+#include "exporter.h"
+#include "logger.h"
+#include "tracer.h"
+#include "probes.h"
+#include "admin.h"
 
 #define PORT_NUM 1004
 #define MAX_USERNAME_LEN 32
-#define MAX_FILENAME_LEN 64
 #define BUFFER_SIZE 256
-#define BACKLOG 5
+#define BACKLOG SOMAXCONN // a short accept queue overflows in a reconnect storm and clients wait out SYN retransmits
 #define JOINED 1
 #define LEFT 0
 #define SERVER_SHUTDOWN 1
 #define SERVER_RUNNING 0
+#define RESUME_GRACE_PERIOD 30 // seconds a dropped client's slot is held for a resume
+#define REAPER_INTERVAL 1 // seconds between sweeps for expired detached sessions
 
 // TODO: implement MAX_CLIENTS
 
-// Question do we want to add ROOM list here and create function to list available rooms, etc
-typedef struct _ServerState {
-	int num_rooms;
-	pthread_mutex_t server_state_mutex;
-} ServerState;
-
-ServerState server_state;
-
-
 typedef struct _HandshakeResult {
 	ConfirmationStatus status;
 	char username[MAX_USERNAME_LEN];
@@ -45,44 +54,65 @@ typedef struct _ThreadArgs {
 	int clisockfd;
 } ThreadArgs;
 
-typedef struct _USR {
-	int clisockfd;						// socket file descriptor
-	char username[MAX_USERNAME_LEN];	// client username
-	int color_code;						// user color
-	struct _USR* next;					// for linked list queue
-} USR;
-
-typedef struct _ROOM {
-	int room_number;
-	int num_connected_clients;
-	USR* usr_head;
-	USR* usr_tail;
-	struct _ROOM* next;
-} ROOM;
-
-ROOM* room_head = NULL;
-ROOM* room_tail = NULL;
-
-typedef struct _FileTransferThreadArgs {
-	char recv_user[MAX_USERNAME_LEN];
+// a file uploaded into the spool by its sender, guarded by rooms_mutex.
+// the upload is complete once every chunk of the file is stored
+typedef struct _UPLOAD {
+	MANIFEST* manifest;					// the file's chunks, NULL until the sender's chunk list is in
+	ManifestEntry* entries;				// the chunk list as it comes in
+	uint32_t num_entries;				// announced in the offer
+	uint32_t entries_received;
+	uint32_t entries_capacity;			// grown as the batches arrive, never past num_entries
+	uint64_t file_size;
+	uint64_t digest;					// the sender's XXH64 of the whole file, passed on to receivers
+	uint32_t cursor;					// first chunk not stored yet
+	uint64_t received;					// bytes of that chunk received so far
+	uint64_t available;					// every file byte before this is stored
+	uint32_t sender_stream_id;			// stream id the sender picked on its own connection
+	USR* sender;						// NULL once the sender left with the file fully uploaded
+	char sender_name[MAX_USERNAME_LEN];
+	char receiver_name[MAX_USERNAME_LEN];
+	int room_number;					// receivers are looked for in this room
 	char file_name[MAX_FILENAME_LEN];
-	ROOM* room;
-	USR* send_user;
-} FileTransferThreadArgs;
-
-ROOM* create_room();
-void remove_room(int room_number);
-ROOM* find_room(int room_number);
-void add_client(ROOM* room, int newclisockfd, char* username);
-void remove_client(ROOM* room, int sockfd);
-USR* find_client(ROOM* room, int sockfd);
-void print_client_list(ROOM* room);
-void print_room_list();
-int get_color_code(ROOM* room, USR* client);
-void broadcast(ROOM* room, int fromfd, char* username, int color_code, char* message);
-void announce_status(ROOM* room, int fromfd, char* username, int status);
+	time_t expires_at;					// pushed back by every manifest batch, chunk and receiver reply
+	uint64_t offered_at;				// metrics_now() when the offer came in
+	struct _UPLOAD* next;
+} UPLOAD;
+
+UPLOAD* upload_head = NULL;
+
+typedef enum _TransferState {
+	TRANSFER_WAITING,					// receiver isn't here, the file is offered once they join
+	TRANSFER_OFFERED,					// waiting for the receiver's answer
+	TRANSFER_ACTIVE,					// spooled bytes are queued as the receiver's window allows
+	TRANSFER_PAUSED,					// receiver dropped, waiting for it to resume its session
+	TRANSFER_RESUMING					// receiver is back, waiting for it to say where it got to
+} TransferState;
+
+// a spooled file on its way to one receiver, guarded by rooms_mutex
+typedef struct _TRANSFER {
+	uint32_t id;						// stream id on the receiver's connection (server assigned)
+	UPLOAD* upload;
+	USR* receiver;						// NULL while waiting
+	char receiver_name[MAX_USERNAME_LEN];
+	TransferState state;
+	uint64_t queued_offset;				// next file byte to queue, everything before it is queued for the receiver
+	uint64_t acked_offset;				// receiver has written everything before this
+	uint32_t window;					// bytes past acked_offset the receiver lets us queue
+	int complete_sent;					// FILE_COMPLETE is queued behind the last byte
+	uint64_t accepted_at;				// metrics_now() when the receiver accepted, 0 before
+	struct _TRANSFER* next;
+} TRANSFER;
+
+TRANSFER* transfer_head = NULL;
+uint32_t next_transfer_id = 1;
+
+volatile sig_atomic_t metrics_requested = 0; // SIGUSR1, printed by the reaper thread
+
+void broadcast(ROOM* room, int fromfd, char* username, int color_code, char* message, uint64_t received_at,
+uint64_t trace_id);
+void announce_status(ROOM* room, int fromfd, char* username, char* ip, int status);
 void* thread_main(void* args);
-void print_rooms_with_clients();
+void* thread_session_reaper(void* args);
 
 HandshakeResult execute_handshake(int clisockfd);
 
@@ -90,34 +120,61 @@ int init_connection_confirmation(ConnectionConfirmation* cc, ConnectionRequest*
 void handle_join_room_request(ConnectionConfirmation* cc, ConnectionRequest* cr, int clisockfd);
 void handle_create_new_room_request(ConnectionConfirmation* cc, ConnectionRequest* cr, int clisockfd);
 void handle_select_room_request(ConnectionConfirmation* cc);
+void handle_resume_session_request(ConnectionConfirmation* cc, ConnectionRequest* cr, int clisockfd);
 void handle_invalid_request(ConnectionConfirmation* cc);
 
-void mock_server_state();
 
+UPLOAD* create_upload(USR* sender, uint32_t sender_stream_id, ROOM* room, FileOffer* offer);
+UPLOAD* find_upload(USR* sender, uint32_t sender_stream_id);
+void remove_upload(UPLOAD* upload, char* reason);
+int upload_in_use(UPLOAD* upload);
+void release_upload_if_unused(UPLOAD* upload, char* reason);
+int upload_complete(UPLOAD* upload);
+void advance_upload(UPLOAD* upload);
+void finish_manifest(UPLOAD* upload, ROOM* room);
+void queue_chunk_needs(UPLOAD* upload);
+TRANSFER* create_transfer(UPLOAD* upload, char* receiver_name);
+TRANSFER* find_transfer(uint32_t id);
+void remove_transfer(TRANSFER* transfer);
+void cancel_transfer(TRANSFER* transfer, char* reason);
+void offer_transfer(TRANSFER* transfer, USR* receiver);
+int open_transfer_stream(TRANSFER* transfer);
+void pump_transfer(TRANSFER* transfer);
+void pump_upload(UPLOAD* upload);
+void detach_transfer(TRANSFER* transfer);
+void abandon_transfers(USR* client, char* reason);
+void suspend_transfers(USR* client);
+void attach_transfers(ROOM* room, USR* client);
+void touch_upload(UPLOAD* upload);
+void expire_uploads(time_t now);
+void notify_sender(UPLOAD* upload, char* format, char* receiver_name);
+int enqueue_to_client(USR* client, OutFrame* frame);
+int send_to_client(USR* client, FrameType type, uint32_t stream_id, const void* payload, uint32_t length);
+int queue_file_progress(USR* client, FrameType type, uint32_t stream_id, uint64_t offset, uint32_t window);
+int handle_file_offer(FrameHeader* header, ROOM* room, int clisockfd);
+int handle_file_manifest(FrameHeader* header, ROOM* room, int clisockfd);
+int handle_file_chunk(FrameHeader* header, ROOM* room, int clisockfd);
+int handle_file_complete(FrameHeader* header, ROOM* room, int clisockfd);
+int handle_file_reply(FrameHeader* header, ROOM* room, int clisockfd);
+int handle_file_frame(FrameHeader* header, ROOM* room, int clisockfd);
 
-int cc_set_available_rooms(ConnectionConfirmation* cc);
-
-
-void init_server_state();
 
 void clean_up();
 
 ThreadArgs* init_thread_args(int newsockfd);
+int open_listener();
+void request_metrics(int sig);
 
-void init_server_state() {
-	pthread_mutex_init(&server_state.server_state_mutex, NULL);
-	server_state.num_rooms = 0;
-}
 
 
 void clean_up() {
 	// close all client connections and free rooms and the clients in the rooms
 	ROOM* cur_room = room_head;
 	while (cur_room != NULL) {
-		printf("Closing room %d\n", cur_room->room_number);
+		LOG_INFO("Closing room %d", cur_room->room_number);
 		USR* cur_usr = cur_room->usr_head;
 		while (cur_usr != NULL) {
-			printf("Disconnecting client %s\n", cur_usr->username);
+			LOG_INFO("Disconnecting client %s", cur_usr->username);
 			USR* next_usr = cur_usr->next;
 			remove_client(cur_room, cur_usr->clisockfd);
 			cur_usr = next_usr;
@@ -130,350 +187,95 @@ void clean_up() {
 }
 
 
-ROOM* create_room()
-{
-	if (room_head == NULL) { // No rooms exist yet
-		room_head = (ROOM*) malloc(sizeof(ROOM));
-		room_head->room_number = 1;
-		room_head->num_connected_clients = 0;
-		room_head->usr_head = NULL;
-		room_head->usr_tail = NULL;
-		room_head->next = NULL;
-		room_tail = room_head;
-	} else { // At least one room exists
-		room_tail->next = (ROOM*) malloc(sizeof(ROOM));
-		room_tail->next->room_number = room_tail->room_number + 1;
-		room_tail->next->num_connected_clients = 0;
-		room_tail->next->usr_head = NULL;
-		room_tail->next->usr_tail = NULL;
-		room_tail->next->next = NULL;
-		room_tail = room_tail->next;
-	}
-
-	pthread_mutex_lock(&server_state.server_state_mutex);
-	server_state.num_rooms++;
-	pthread_mutex_unlock(&server_state.server_state_mutex);
-
-	return room_tail;
-}
-
-void remove_room(int room_number) {
-	ROOM* cur = room_head;
-	ROOM* prev;
-	
-	/* find room in room list, track previous */
-	while (cur != NULL) {
-		if (cur->room_number == room_number) {
-			break;
-		}
-		else {
-			prev = cur;
-			cur = cur->next;
-		}
-	}
-
-	// TODO: proper error handling
-	assert(cur != NULL);
-
-	/* remove room from room list */
-	// if room is head of list
-	if (cur == room_head) {
-		if (room_head == room_tail) {
-			room_head = NULL;
-			room_tail = NULL;
-		}
-		else {
-			room_head = cur->next;
-			cur->next = NULL;
-		}
-	}
-	// if room is tail of list
-	else if (cur == room_tail) {
-		prev->next = NULL;
-		room_tail = prev;
-	}
-	// if room is neither head or tail of list
-	else {
-		prev->next = cur->next;
-		cur->next = NULL;
-	}
-
-	free(cur);
-
-	pthread_mutex_lock(&server_state.server_state_mutex);
-	server_state.num_rooms--;
-	pthread_mutex_unlock(&server_state.server_state_mutex);
-}
-
-ROOM* find_room(int room_number) {
-
-	ROOM* cur_room = room_head;
-	
-	while(cur_room != NULL) {
-		// if room found, return cur_room
-		if (cur_room->room_number == room_number) {
-			return cur_room;
-		}
-		else {
-			cur_room = cur_room->next;
-		}
-	}
-	// if cur_room not found, return NULL;
-	return NULL;
-}
-
-void add_client(ROOM* room, int newclisockfd, char* username)
-{
-	/* add client to room */
-	// if room is empty, add client to head of user list
-	if (room->usr_head == NULL) {
-		room->usr_head = (USR*) malloc(sizeof(USR));
-		room->usr_head->clisockfd = newclisockfd;
-		strncpy(room->usr_head->username, username, MAX_USERNAME_LEN);
-		room->usr_head->next = NULL;
-		room->usr_tail = room->usr_head;
-	} 
-	// if room is not empty, add client to tail of list
-	else {
-		room->usr_tail->next = (USR*) malloc(sizeof(USR));
-		room->usr_tail->next->clisockfd = newclisockfd;
-		strncpy(room->usr_tail->next->username, username, MAX_USERNAME_LEN);
-		room->usr_tail->next->next = NULL;
-		room->usr_tail = room->usr_tail->next;
-	}
-	room->num_connected_clients++;
-}
-
-void remove_client(ROOM* room, int sockfd) {
-	
-	USR *cur = room->usr_head;
-	USR *prev;
-	
-	/* find client in client list, track previous */
-	while (cur != NULL) {
-		if (cur->clisockfd == sockfd) {
-			break;
-		}
-		else {
-			prev = cur;
-			cur = cur->next;
-		}
-	}
-
-	// TODO: proper error handling
-	assert(cur != NULL);
-
-	/* remove client from client list */
-	// if client is head of list
-	if (cur == room->usr_head) {
-		if (room->usr_head == room->usr_tail) {
-			room->usr_head = NULL;
-			room->usr_tail = NULL;
-		}
-		else {
-			room->usr_head = cur->next;
-			cur->next = NULL;
-		}
-	}
-	// if client is tail of list
-	else if (cur == room->usr_tail) {
-		prev->next = NULL;
-		room->usr_tail = prev;
-	}
-	// if client is neither head or tail of list
-	else {
-		prev->next = cur->next;
-		cur->next = NULL;
-	}
-
-	free(cur);
-	room->num_connected_clients--;
-}
-
-USR* find_client(ROOM* room, int sockfd) {
-	
-	USR* cur_client = room->usr_head;
-	
-	while (cur_client != NULL) {
-		// if client found, return cur_client
-		if (cur_client->clisockfd == sockfd) {
-			return cur_client;
-		}
-		cur_client = cur_client->next;
-	}
-	// if client not found, return NULL
-	return NULL;
-}
-
-void print_client_list(ROOM* room) {
-	
-	USR *cur = room->usr_head;
-
-	printf("CONNECTED CLIENTS IN ROOM %d:\n", room->room_number);
-	while (cur != NULL) {
-		struct sockaddr_in addr;
-		socklen_t len = sizeof(addr);
-		if (getpeername(cur->clisockfd, (struct sockaddr*)&addr, &len) < 0) {
-			error("ERROR Unknown client!");
-		}
-
-		printf("%s (%s)\n", cur->username, inet_ntoa(addr.sin_addr));
-		cur = cur->next;
-	}
-}
-
-void print_room_list() {
-	ROOM* cur_room = room_head;
-	while (cur_room != NULL) {
-		printf("Room %d:\n", cur_room->room_number);
-		cur_room = cur_room->next;
-	}
-}
-
-
-
-// TODO: potential refactor
-// CREATE ROOM
-// MAX_CLIENTS 
-// colors = [0, 0, 0, 0, 0]
-// colors = [91, 92, 93, 94, 95]
-// colors = [93, 91, 92, 94, 95]
-// client->color = colors[client->client_id]
-// client_id increments and decrements on join and leave
-int get_color_code(ROOM* room, USR* client) {
-
-	int random_color_code;
-	USR* cur;
-
-	int color_found = 0;
-	
-	// find a unique color code
-	while (color_found == 0) {
-		// create a random color code
-		srand(time(NULL));
-		random_color_code = (rand() % 6) + 91;
-		
-		int taken = 0;
-		
-		// determine if color code is already taken
-		if (room->usr_head == NULL) {
-			color_found = 1;
-		}
-		else {
-			cur = room->usr_head;
-			while (cur != NULL) {
-				// if taken, pick another color
-				if ((cur->clisockfd != client->clisockfd) && (cur->color_code == random_color_code)) {
-					taken = 1;
-					break;
-				}
-				cur = cur->next;
-			}
-		}
-		// if not taken, keep picked color	
-		if (taken == 0) {
-			color_found = 1;
-		}
-	}
-	
-	client->color_code = random_color_code;
-
-	return random_color_code;
-}
-
-void broadcast(ROOM* room, int fromfd, char* username, int color_code, char* message)
+void broadcast(ROOM* room, int fromfd, char* username, int color_code, char* message, uint64_t received_at,
+uint64_t trace_id)
 {
+	uint64_t fanout_at = trace_id != 0 ? metrics_now() : 0;
 	// figure out sender address
 	struct sockaddr_in cliaddr;
 	socklen_t clen = sizeof(cliaddr);
-	if (getpeername(fromfd, (struct sockaddr*)&cliaddr, &clen) < 0){
-		printf("broadcast error\n");
-		error("ERROR Unknown sender!");
+	if (transport->getpeername(fromfd, (struct sockaddr*)&cliaddr, &clen) < 0){
+		// sender dropped mid-message, its thread will notice on the next recv()
+		LOG_WARN("broadcast error");
+		return;
 	}
 
+	char buffer[CHAT_LINE_LEN];
+	// prepare message, it is the same for everyone so it is framed once and shared
+	int len = format_chat_line(buffer, sizeof(buffer), color_code, username, inet_ntoa(cliaddr.sin_addr), message);
+	OutFrame* frame = outframe_create(FRAME_CHAT, CHAT_STREAM_ID, buffer, len);
+	// timed from here on by whichever writer lets go of it last
+	frame->received_at = received_at;
+	frame->trace_id = trace_id;
+	int queued = 0;
+
 	// traverse through all connected clients in room
 	USR* cur = room->usr_head;
-	
-	char buffer[512];
 
 	while (cur != NULL) {
-		// check if cur is not the one who sent the message
-		if (cur->clisockfd != fromfd) {
-			memset(buffer, 0, 512);
-			// prepare message
-			sprintf(buffer, "\033[%dm[%s (%s)]:%s\033[0m", color_code, username, inet_ntoa(cliaddr.sin_addr), message);
-			int nmsg = strlen(buffer);
-
-			// send!
-			int nsen = send(cur->clisockfd, buffer, nmsg, 0);
-			if (nsen != nmsg) error("ERROR send() on broadcast failed");
+		// check if cur is not the one who sent the message (and is attached)
+		if (cur->clisockfd != fromfd && cur->clisockfd >= 0) {
+			// queue it! a failed queue means the recipient dropped or fell too far behind,
+			// its own thread will detach it
+			if (enqueue_to_client(cur, frame) < 0) {
+				LOG_WARN("send() on broadcast to %s failed", cur->username);
+			} else {
+				PROBE3(message__send, cur->clisockfd, fromfd, len);
+				queued++;
+			}
+		} else if (cur->clisockfd == fromfd) {
+			// for the admin socket's top talkers
+			cur->messages++;
+			cur->message_bytes += strlen(message);
 		}
 
 		cur = cur->next;
 	}
+
+	if (queued == 0) {
+		// nobody to send it to, nothing to time
+		frame->received_at = 0;
+	}
+	outframe_release(frame);
+	if (trace_id != 0) {
+		trace_message(trace_id, received_at, fanout_at, room->room_number, queued);
+	}
 }
 
 // TODO: make status an enum
 // TODO: consider removing client from room before announcing. Save username and ip address and return it from the remove client function
-void announce_status(ROOM* room, int fromfd, char* username, int status)
+// NOTE: ip is passed in rather than looked up from fromfd because a client whose
+// resume grace window expired is announced after its socket is long gone
+void announce_status(ROOM* room, int fromfd, char* username, char* ip, int status)
 {
-	// figure out sender address
-	struct sockaddr_in cliaddr;
-	socklen_t clen = sizeof(cliaddr);
-	if (getpeername(fromfd, (struct sockaddr*)&cliaddr, &clen) < 0) {
-		printf("announce error\n");
-		error("ERROR Unknown sender!");
-	}
+	uint64_t start = metrics_now();
+	char buffer[CHAT_LINE_LEN];
 
-	char buffer[512];
-	
-	char* status_string;
-	if (status) {
-		status_string = "joined";
-	}
-	else {
-		status_string = "left";
-	}
+	// prepare status announcement
+	int len = format_status_line(buffer, sizeof(buffer), username, ip, status, room->room_number);
+	OutFrame* frame = outframe_create(FRAME_CHAT, CHAT_STREAM_ID, buffer, len);
+	frame->traffic_class = CLASS_PRESENCE;
 
 	// traverse through all connected clients
 	USR* cur = room->usr_head;
 	
 	while (cur != NULL) {
-		// check if cur is not the one who sent the message
-		if (cur->clisockfd != fromfd || status) {
-			
-			// prepare status announcement
-			memset(buffer, 0, 512);
-			sprintf(buffer, "%s (%s) has %s chat room %d!\n", username, 
-			inet_ntoa(cliaddr.sin_addr), status_string, room->room_number);
-			int nmsg = strlen(buffer);
-
+		// check if cur is not the one who sent the message (and is attached)
+		if ((cur->clisockfd != fromfd || status) && cur->clisockfd >= 0) {
 			// send!
-			int nsen = send(cur->clisockfd, buffer, nmsg, 0);
-			if (nsen != nmsg) error("ERROR send() on announce_status failed");
+			if (enqueue_to_client(cur, frame) < 0) {
+				LOG_WARN("send() on announce_status to %s failed", cur->username);
+			}
 		}
 
 		cur = cur->next;
 	}
-}
-
 
-
-int cc_set_available_rooms(ConnectionConfirmation* cc) {
-	ROOM* cur_room = room_head;
-	int i = 0;
-	while (cur_room != NULL) {
-		cc->available_rooms.rooms[i].room_number = cur_room->room_number;
-		cc->available_rooms.rooms[i].num_connected_clients = cur_room->num_connected_clients;
-		i++;
-		cur_room = cur_room->next;
-	}
-	cc->available_rooms.num_rooms = i;
-	return 0;
+	outframe_release(frame);
+	metrics_since(METRIC_ANNOUNCE, start);
 }
 
 
-
 void handle_join_room_request(ConnectionConfirmation* cc, ConnectionRequest* cr, int clisockfd) {
 	// check if room number is valid
 	ROOM* requested_room = find_room(cr->room_number);
@@ -485,7 +287,8 @@ void handle_join_room_request(ConnectionConfirmation* cc, ConnectionRequest* cr,
 		cc->connected_room.room_number = cr->room_number;
 		cc->connected_room.num_connected_clients = requested_room->num_connected_clients;
 
-		add_client(requested_room, clisockfd, cr->username);
+		USR* client = add_client(requested_room, clisockfd, cr->username);
+		memcpy(cc->resumption_token, client->resumption_token, RESUMPTION_TOKEN_LEN);
 	}
 	else { // room does not exist
 		// status
@@ -501,7 +304,8 @@ void handle_create_new_room_request(ConnectionConfirmation* cc, ConnectionReques
 	cc->status = CONFIRMATION_SUCCESS_NEW;
 	// create and connect room
 	ROOM* new_room = create_room();
-	add_client(new_room, clisockfd, cr->username);
+	USR* client = add_client(new_room, clisockfd, cr->username);
+	memcpy(cc->resumption_token, client->resumption_token, RESUMPTION_TOKEN_LEN);
 	// connected room
 	cc->connected_room.room_number = new_room->room_number;
 	cc->connected_room.num_connected_clients = new_room->num_connected_clients;
@@ -517,6 +321,44 @@ void handle_select_room_request(ConnectionConfirmation* cc) {
 	cc_set_available_rooms(cc);
 }
 
+// hands a dropped client's slot (room membership, list position, color) to the new connection.
+// if the old connection is still attached it is most likely half-open (the client noticed the drop
+// before we did), so it is shut down and its thread exits without announcing anything
+void handle_resume_session_request(ConnectionConfirmation* cc, ConnectionRequest* cr, int clisockfd) {
+	USR* client;
+	ROOM* room = find_client_by_token(cr->resumption_token, &client);
+
+	if (room == NULL
+	|| strncmp(client->username, cr->username, MAX_USERNAME_LEN) != 0
+	|| (client->clisockfd < 0 && client->detached_until < time(NULL))) {
+		handle_invalid_request(cc);
+		return;
+	}
+
+	// drop the old connection, its thread wakes up and finds the slot taken.
+	// the new one is attached once the handshake is through
+	if (client->conn != NULL) {
+		suspend_transfers(client);
+		conn_abort(client->conn);
+		conn_release(client->conn);
+		client->conn = NULL;
+	}
+	client->clisockfd = clisockfd;
+	client->detached_until = 0;
+
+	// rotate the token so a captured one can only be used once
+	if (fill_random_bytes(client->resumption_token, RESUMPTION_TOKEN_LEN) < 0) {
+		error("ERROR generating resumption token");
+	}
+
+	// status
+	cc->status = CONFIRMATION_RESUMED;
+	// connected room
+	cc->connected_room.room_number = room->room_number;
+	cc->connected_room.num_connected_clients = room->num_connected_clients;
+	memcpy(cc->resumption_token, client->resumption_token, RESUMPTION_TOKEN_LEN);
+}
+
 void handle_invalid_request(ConnectionConfirmation* cc) {
 	cc->status = CONFIRMATION_FAILURE;
 	cc->connected_room.room_number = UNINITIALIZED_ROOM_NUMBER;
@@ -540,6 +382,9 @@ int init_connection_confirmation(ConnectionConfirmation* cc, ConnectionRequest*
 				handle_select_room_request(cc);
 			}
 			break;
+		case RESUME_SESSION: // client reconnecting after a drop
+			handle_resume_session_request(cc, cr, clisockfd);
+			break;
 		default:
 			// including when the client cancels the handshake
 			handle_invalid_request(cc);
@@ -548,183 +393,814 @@ int init_connection_confirmation(ConnectionConfirmation* cc, ConnectionRequest*
 	return 0;
 }
 
-void mock_server_state() {
-	server_state.num_rooms = 3;
-	ROOM* room_1 = create_room();
-	ROOM* room_2 = create_room();
-	ROOM* room_3 = create_room();
 
-	add_client(room_1, 1, "user_1");
-	add_client(room_1, 2, "user_2");
-	add_client(room_1, 3, "user_3");
+// registers a file the sender is about to upload. its chunk list follows the offer, guarded by rooms_mutex
+UPLOAD* create_upload(USR* sender, uint32_t sender_stream_id, ROOM* room, FileOffer* offer) {
+	UPLOAD* upload = (UPLOAD*) malloc(sizeof(UPLOAD));
+	if (upload == NULL) error("ERROR allocating upload");
+	memset(upload, 0, sizeof(UPLOAD));
+
+	// the count is the sender's word, entries are allocated as they arrive (handle_file_manifest)
+	upload->num_entries = offer->chunk_count;
+	upload->file_size = offer->file_size;
+	upload->digest = offer->digest;
+	upload->sender_stream_id = sender_stream_id;
+	upload->sender = sender;
+	strncpy(upload->sender_name, sender->username, MAX_USERNAME_LEN - 1);
+	strncpy(upload->receiver_name, offer->peer, MAX_USERNAME_LEN - 1);
+	upload->room_number = room->room_number;
+	strncpy(upload->file_name, offer->file_name, MAX_FILENAME_LEN - 1);
+	touch_upload(upload);
+	upload->offered_at = metrics_now();
+
+	upload->next = upload_head;
+	upload_head = upload;
+
+	return upload;
+}
+
+// finds an upload by the stream id the sender picked on its own connection
+UPLOAD* find_upload(USR* sender, uint32_t sender_stream_id) {
+	UPLOAD* cur = upload_head;
+	while (cur != NULL) {
+		if (cur->sender == sender && cur->sender_stream_id == sender_stream_id) {
+			return cur;
+		}
+		cur = cur->next;
+	}
+	return NULL;
+}
+
+// drops an upload, its deliveries and its chunks (those no other upload shares). receivers and a
+// sender that is still uploading are told why, guarded by rooms_mutex
+void remove_upload(UPLOAD* upload, char* reason) {
+	TRANSFER* cur = transfer_head;
+	while (cur != NULL) {
+		TRANSFER* next = cur->next;
+		if (cur->upload == upload) {
+			cancel_transfer(cur, reason);
+		}
+		cur = next;
+	}
+	if (upload->sender != NULL && !upload_complete(upload)) {
+		send_to_client(upload->sender, FRAME_FILE_REJECT, upload->sender_stream_id, reason, strlen(reason));
+	}
+
+	UPLOAD** link = &upload_head;
+	while (*link != upload) {
+		link = &(*link)->next;
+	}
+	*link = upload->next;
+	if (upload->manifest != NULL) {
+		manifest_release(upload->manifest);
+	}
+	free(upload->entries);
+	free(upload);
+}
+
+int upload_in_use(UPLOAD* upload) {
+	for (TRANSFER* cur = transfer_head; cur != NULL; cur = cur->next) {
+		if (cur->upload == upload) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// once nobody is left to deliver to, the file doesn't need keeping (or uploading any further)
+void release_upload_if_unused(UPLOAD* upload, char* reason) {
+	if (!upload_in_use(upload)) {
+		remove_upload(upload, reason);
+	}
+}
+
+int upload_complete(UPLOAD* upload) {
+	return upload->manifest != NULL && upload->available == upload->file_size;
+}
+
+// moves the upload's cursor past every chunk that is stored, whether it was just received or
+// the store had it already. guarded by rooms_mutex
+void advance_upload(UPLOAD* upload) {
+	MANIFEST* manifest = upload->manifest;
+	while (upload->cursor < manifest->num_chunks && manifest->chunks[upload->cursor]->stored) {
+		upload->cursor++;
+		upload->received = 0;
+	}
+	upload->available = manifest->offsets[upload->cursor] + upload->received;
+}
 
-	add_client(room_2, 4, "user_4");
-	add_client(room_2, 5, "user_5");
-	add_client(room_2, 6, "user_6");
+// the sender's chunk list is complete: work out which chunks the store lacks, tell the sender to
+// upload those and offer the file to its receiver (or everyone in the room). guarded by rooms_mutex
+void finish_manifest(UPLOAD* upload, ROOM* room) {
+	int broadcast = strncmp(upload->receiver_name, BROADCAST_PEER, MAX_USERNAME_LEN) == 0;
+	int others = 0;
+	for (USR* member = room->usr_head; member != NULL; member = member->next) {
+		if (member != upload->sender) {
+			others++;
+		}
+	}
+	if (broadcast && others == 0) {
+		remove_upload(upload, "nobody else is in the room");
+		return;
+	}
 
-	add_client(room_3, 7, "user_7");
-	add_client(room_3, 8, "user_8");
-	add_client(room_3, 9, "user_9");
+	char* reason;
+	upload->manifest = manifest_create(upload->sender_name, upload->entries, upload->num_entries,
+	upload->file_size, &reason);
+	free(upload->entries);
+	upload->entries = NULL;
+	if (upload->manifest == NULL) {
+		remove_upload(upload, reason);
+		return;
+	}
+	advance_upload(upload);
+
+	MANIFEST* manifest = upload->manifest;
+	uint64_t new_bytes = 0;
+	for (uint32_t i = 0; i < manifest->num_chunks; i++) {
+		if (manifest->needed[i]) {
+			new_bytes += manifest->chunks[i]->length;
+		}
+	}
+	LOG_INFO("File upload: %s -> %s %s (%lu bytes, %lu to upload)", upload->sender_name,
+	upload->receiver_name, upload->file_name, (unsigned long) upload->file_size, (unsigned long) new_bytes);
+	PROBE3(file__upload, upload->sender_name, upload->file_name, new_bytes);
+
+	// the sender goes at its own pace, the spool acknowledges what it has stored
+	queue_chunk_needs(upload);
+	queue_file_progress(upload->sender, FRAME_FILE_ACCEPT, upload->sender_stream_id, upload->available, FILE_WINDOW);
+
+	if (broadcast) {
+		// one delivery per member, all read from the same spooled chunks at their own pace.
+		// members that dropped are offered it when they resume
+		for (USR* member = room->usr_head; member != NULL; member = member->next) {
+			if (member == upload->sender) {
+				continue;
+			}
+			TRANSFER* transfer = create_transfer(upload, member->username);
+			if (member->conn != NULL) {
+				offer_transfer(transfer, member);
+			}
+		}
+		return;
+	}
+
+	TRANSFER* transfer = create_transfer(upload, upload->receiver_name);
+	USR* receiver = find_client_by_username(room, upload->receiver_name);
+	if (receiver != NULL && receiver->conn != NULL) {
+		offer_transfer(transfer, receiver);
+	} else if (receiver == NULL) {
+		notify_sender(upload, "%s is not here, %s is kept for them until they join\n", upload->receiver_name);
+	}
+	// (a receiver that is in the room but dropped is offered it when it resumes)
 }
 
-void print_rooms_with_clients() {
-	ROOM* cur_room = room_head;
-	while (cur_room != NULL) {
-		printf("Room %d: %d clients\n", cur_room->room_number, cur_room->num_connected_clients);
-		USR* cur_client = cur_room->usr_head;
-		while (cur_client != NULL) {
-			printf("  %s\n", cur_client->username);
-			cur_client = cur_client->next;
+// tells the sender which chunks to upload, one bit per chunk. guarded by rooms_mutex
+void queue_chunk_needs(UPLOAD* upload) {
+	MANIFEST* manifest = upload->manifest;
+	uint32_t len = (manifest->num_chunks + 7) / 8;
+	unsigned char* bitmap = (unsigned char*) calloc(len + 1, 1);
+	if (bitmap == NULL) error("ERROR allocating chunk bitmap");
+	for (uint32_t i = 0; i < manifest->num_chunks; i++) {
+		if (manifest->needed[i]) {
+			bitmap[i / 8] |= 1 << (i % 8);
 		}
-		cur_room = cur_room->next;
 	}
+	send_to_client(upload->sender, FRAME_FILE_NEED, upload->sender_stream_id, bitmap, len);
+	free(bitmap);
 }
 
-USR* find_client_by_username(ROOM* room, char* username) {
-	USR* cur = room->usr_head;
+// registers a delivery of upload to receiver_name, it waits until they are offered it.
+// guarded by rooms_mutex
+TRANSFER* create_transfer(UPLOAD* upload, char* receiver_name) {
+	TRANSFER* transfer = (TRANSFER*) malloc(sizeof(TRANSFER));
+	if (transfer == NULL) error("ERROR allocating transfer");
+	memset(transfer, 0, sizeof(TRANSFER));
+
+	transfer->id = next_transfer_id++;
+	transfer->upload = upload;
+	transfer->receiver = NULL;
+	strncpy(transfer->receiver_name, receiver_name, MAX_USERNAME_LEN - 1);
+	transfer->state = TRANSFER_WAITING;
 
+	transfer->next = transfer_head;
+	transfer_head = transfer;
+
+	return transfer;
+}
+
+// finds a transfer by the stream id the receiver knows it by
+TRANSFER* find_transfer(uint32_t id) {
+	TRANSFER* cur = transfer_head;
 	while (cur != NULL) {
-		if (strncmp(cur->username, username, MAX_USERNAME_LEN) == 0) {
-			break;
+		if (cur->id == id) {
+			return cur;
 		}
 		cur = cur->next;
 	}
-	// if client does not exist, NULL is returned
-	return cur;
+	return NULL;
 }
 
-int is_filetransfer(char* buffer) {
-	// create copy of message in buffer (needed for strtok_r)
-	char message[BUFFER_SIZE];
-	strncpy(message, buffer, strlen(buffer));
-	
-	// determine if first token in message is "SEND"
-	char* saveptr;
-	char* send_token = strtok_r(message, " ", &saveptr);
-	// if there are no more tokens, return false (0)
-	if (send_token == NULL) {
-		return 0;
+void remove_transfer(TRANSFER* transfer) {
+	TRANSFER** link = &transfer_head;
+	while (*link != NULL) {
+		if (*link == transfer) {
+			*link = transfer->next;
+			free(transfer);
+			return;
+		}
+		link = &(*link)->next;
 	}
-	// if yes, return true (1)
-	else if (strncmp(send_token, "SEND", strlen(send_token)) == 0) {
-		return 1;
+}
+
+// drops one delivery and tells its receiver why, the upload is left to the caller. guarded by rooms_mutex
+void cancel_transfer(TRANSFER* transfer, char* reason) {
+	if (transfer->receiver != NULL) {
+		if (transfer->receiver->conn != NULL) {
+			conn_abort_stream(transfer->receiver->conn, transfer->id);
+		}
+		send_to_client(transfer->receiver, FRAME_FILE_CANCEL, transfer->id, reason, strlen(reason));
 	}
-	// if no, return false (0)
-	else {
-		return 0;
+	remove_transfer(transfer);
+}
+
+// offers the spooled file to its receiver under the transfer's stream id, guarded by rooms_mutex
+void offer_transfer(TRANSFER* transfer, USR* receiver) {
+	UPLOAD* upload = transfer->upload;
+	transfer->receiver = receiver;
+	transfer->state = TRANSFER_OFFERED;
+
+	// the receiver needs to know who it is from, not who it is for
+	FileOffer offer;
+	memset(&offer, 0, sizeof(FileOffer));
+	strncpy(offer.peer, upload->sender_name, MAX_USERNAME_LEN);
+	strncpy(offer.file_name, upload->file_name, MAX_FILENAME_LEN);
+	offer.file_size = upload->file_size;
+	offer.digest = upload->digest;
+
+	unsigned char data[sizeof(FileOffer)];
+	Buffer fo_buffer = { data, sizeof(data) };
+	serialize_file_offer(&fo_buffer, &offer);
+	send_to_client(receiver, FRAME_FILE_OFFER, transfer->id, fo_buffer.data, fo_buffer.size);
+
+	LOG_INFO("File offer: %s -> %s %s (%lu bytes)", upload->sender_name, receiver->username,
+	upload->file_name, (unsigned long) offer.file_size);
+	PROBE3(file__offer, receiver->username, upload->file_name, offer.file_size);
+}
+
+// gives the delivery its own stream on the receiver's connection, reading from every spool
+// file the file's chunks are in. guarded by rooms_mutex
+int open_transfer_stream(TRANSFER* transfer) {
+	MANIFEST* manifest = transfer->upload->manifest;
+	int filefds[manifest->num_sources];
+	for (uint32_t i = 0; i < manifest->num_sources; i++) {
+		filefds[i] = manifest->sources[i]->fd;
 	}
+	return conn_open_stream(transfer->receiver->conn, transfer->id, filefds, manifest->num_sources);
 }
 
-FileTransferThreadArgs* init_FTthread_args(char* recv_user, char* file_name, ROOM* room, USR* send_user) {
+// queues as much of the file as the receiver's window and the upload allow. the chunks are only
+// byte ranges, the receiver's writer thread sendfile()s them out of the spool files when their
+// turn comes. guarded by rooms_mutex
+void pump_transfer(TRANSFER* transfer) {
+	if (transfer->state != TRANSFER_ACTIVE || transfer->receiver->conn == NULL) {
+		return;
+	}
+	CONNECTION* conn = transfer->receiver->conn;
+	UPLOAD* upload = transfer->upload;
+	MANIFEST* manifest = upload->manifest;
 
-	// prepare ThreadArgs structure to pass client socket
-	FileTransferThreadArgs* args = (FileTransferThreadArgs*)
-	malloc(sizeof(FileTransferThreadArgs));
-	if (args == NULL) error("ERROR creating FT thread arguments");
-	
-	// set recv username
-	strncpy(args->recv_user, recv_user, MAX_USERNAME_LEN);
-	
-	// set file name
-	strncpy(args->file_name, file_name, MAX_FILENAME_LEN);
-	
-	// set room
-	args->room = room;
-	
-	// set sending client
-	args->send_user = send_user;
+	uint64_t limit = transfer->acked_offset + transfer->window;
+	if (limit > upload->available) {
+		limit = upload->available;
+	}
+	while (transfer->queued_offset < limit) {
+		// a FILE_CHUNK never spans two stored chunks, they may be in different spool files. it ends
+		// at a FILE_CHUNK_SIZE step from the chunk's start so its CRC is the shared one (see chunk_crc)
+		uint32_t i = manifest_find_chunk(manifest, transfer->queued_offset);
+		CHUNK* chunk = manifest->chunks[i];
+		uint64_t in_chunk = transfer->queued_offset - manifest->offsets[i];
+		uint64_t end = manifest->offsets[i] + (in_chunk / FILE_CHUNK_SIZE + 1) * FILE_CHUNK_SIZE;
+		if (end > manifest->offsets[i + 1]) {
+			end = manifest->offsets[i + 1];
+		}
+		if (end > limit) {
+			// cut at the window, every ack would open it by one sliver and the frames would keep
+			// getting smaller (silly window syndrome). wait until all of it fits
+			break;
+		}
+		uint32_t chunk_len = end - transfer->queued_offset;
+		uint32_t crc = chunk_crc(chunk, in_chunk, chunk_len);
+		if (conn_push_chunk(conn, transfer->id, transfer->queued_offset, manifest->source_of[i],
+		chunk->offset + in_chunk, chunk_len, crc) < 0) {
+			// receiver died, its thread suspends the transfer
+			return;
+		}
+		transfer->queued_offset += chunk_len;
+	}
 
-	return args;
+	if (transfer->queued_offset == upload->file_size && !transfer->complete_sent) {
+		// queued behind the file bytes on the receiver's stream, so it can't overtake them
+		OutFrame* frame = outframe_create(FRAME_FILE_COMPLETE, transfer->id, NULL, 0);
+		conn_finish_stream(conn, transfer->id, frame);
+		outframe_release(frame);
+		transfer->complete_sent = 1;
+	}
 }
 
-void print_thread_args(char* recv_user, char* file_name) {
-	printf("Receiving user: %s\n", recv_user);
-	printf("File name: %s\n", file_name);
+// more of the upload is stored, pass it on to every receiver with room for it
+void pump_upload(UPLOAD* upload) {
+	for (TRANSFER* cur = transfer_head; cur != NULL; cur = cur->next) {
+		if (cur->upload == upload) {
+			pump_transfer(cur);
+		}
+	}
 }
 
-void* thread_file_transfer(void* args) {
-	// get thread arguments
-	char recv_user[MAX_USERNAME_LEN];
-	strncpy(recv_user, ((FileTransferThreadArgs*) args)->recv_user, MAX_USERNAME_LEN);
-	char file_name[MAX_FILENAME_LEN];
-	strncpy(file_name, ((FileTransferThreadArgs*) args)->file_name, MAX_FILENAME_LEN);
-	ROOM* room = ((FileTransferThreadArgs*) args)->room;
-	USR* send_user = ((FileTransferThreadArgs*) args)->send_user;
-	// free argument memory
-	free(args);
-	
-	// TEST print statement
-	print_thread_args(recv_user, file_name);
-	
-	// find client by username
-	USR* recv_client = find_client_by_username(room, recv_user);
-	if (recv_client == NULL) {
-		printf("receiving client not found\n");
-		pthread_exit(NULL);
+// the receiver is gone for now, the delivery waits for it to join again and starts over then.
+// guarded by rooms_mutex
+void detach_transfer(TRANSFER* transfer) {
+	if (transfer->receiver != NULL && transfer->receiver->conn != NULL) {
+		conn_abort_stream(transfer->receiver->conn, transfer->id);
 	}
-	printf("receiving client found!\n");
+	transfer->receiver = NULL;
+	transfer->state = TRANSFER_WAITING;
+	transfer->queued_offset = 0;
+	transfer->acked_offset = 0;
+	transfer->complete_sent = 0;
+}
 
-	int recvsockfd = recv_client->clisockfd;
-	// TODO: all this in this order (ask me why)
-	
-	// receive file from sending client (somehow...?)
-		
-	// notify receiving user of file transfer, ask for permission "Y/N"
-	char buffer[BUFFER_SIZE];
-	memset(buffer, 0, BUFFER_SIZE);
-	sprintf(buffer, "SEND %s %s", send_user->username, file_name);
-	send(recvsockfd, buffer, BUFFER_SIZE, 0);
-	
-	// receive response from receiving user
-	memset(buffer, 0, BUFFER_SIZE);
-	recv(recvsockfd, buffer, BUFFER_SIZE, 0);
+// the client left for good or its resume window ran out. files spooled for it wait in case it
+// joins again, an unfinished upload is cancelled and a finished one is still delivered without it.
+// guarded by rooms_mutex
+void abandon_transfers(USR* client, char* reason) {
+	for (TRANSFER* cur = transfer_head; cur != NULL; cur = cur->next) {
+		if (cur->receiver == client) {
+			detach_transfer(cur);
+		}
+	}
 
-	// if recv user denies
-	if (buffer[0] != 'Y') {
-		// TODO: maybe return status code of DENIED or something like that?
+	UPLOAD* cur = upload_head;
+	while (cur != NULL) {
+		UPLOAD* next = cur->next;
+		if (cur->sender == client) {
+			cur->sender = NULL;
+			if (!upload_complete(cur)) {
+				LOG_WARN("Upload cancelled: %s %s (%s)", cur->sender_name, cur->file_name, reason);
+				remove_upload(cur, reason);
+			}
+		}
+		cur = next;
 	}
-	// if recv user agrees
-	else {
-		// send file to receiving client (somehow...?)
+}
+
+// the client dropped but may resume its session, so its transfers wait for it instead of starting
+// over. an upload simply stops coming in, bytes still queued for a receiver may never reach it.
+// guarded by rooms_mutex
+void suspend_transfers(USR* client) {
+	for (TRANSFER* cur = transfer_head; cur != NULL; cur = cur->next) {
+		if (cur->receiver != client) {
+			continue;
+		}
+		if (cur->state == TRANSFER_OFFERED) {
+			// the client forgets offers it didn't answer, it is offered again when it is back
+			detach_transfer(cur);
+		} else if (cur->state == TRANSFER_ACTIVE || cur->state == TRANSFER_RESUMING) {
+			if (client->conn != NULL) {
+				conn_abort_stream(client->conn, cur->id);
+			}
+			cur->state = TRANSFER_PAUSED;
+		}
+	}
+}
+
+// the client joined or resumed its session: an unfinished upload carries on from what the spool
+// already has, a paused delivery from where the receiver got to (it is asked first, see
+// handle_file_reply) and files spooled for it are offered. guarded by rooms_mutex
+void attach_transfers(ROOM* room, USR* client) {
+	UPLOAD* up = upload_head;
+	while (up != NULL) {
+		UPLOAD* next = up->next;
+		if (up->sender == client && up->manifest == NULL) {
+			// the rest of the chunk list was lost with the connection
+			remove_upload(up, "connection lost");
+		} else if (up->sender == client && !upload_complete(up)) {
+			// the accept (and which chunks to send) may have been lost too
+			queue_chunk_needs(up);
+			queue_file_progress(client, FRAME_FILE_RESUME, up->sender_stream_id, up->available, FILE_WINDOW);
+			LOG_INFO("Upload resumed: %s %s at %lu bytes", up->sender_name, up->file_name,
+			(unsigned long) up->available);
+		}
+		up = next;
 	}
 
-	pthread_exit(NULL);
+	TRANSFER* cur = transfer_head;
+	while (cur != NULL) {
+		TRANSFER* next = cur->next;
+		if (cur->receiver == client && cur->state == TRANSFER_PAUSED) {
+			if (open_transfer_stream(cur) < 0) {
+				UPLOAD* upload = cur->upload;
+				cancel_transfer(cur, "server out of resources");
+				release_upload_if_unused(upload, "server out of resources");
+			} else {
+				cur->state = TRANSFER_RESUMING;
+				send_to_client(client, FRAME_FILE_RESUME, cur->id, NULL, 0);
+			}
+		} else if (cur->state == TRANSFER_WAITING && cur->upload->room_number == room->room_number
+		&& strncmp(cur->receiver_name, client->username, MAX_USERNAME_LEN) == 0) {
+			offer_transfer(cur, client);
+		}
+		cur = next;
+	}
 }
 
-int transfer_file(char* buffer, ROOM* room, USR* send_user) {
-	// create copy of message in buffer (needed for strtok_r)
-	char message[BUFFER_SIZE];
-	strncpy(message, buffer, strlen(buffer));
-	
-	char* saveptr;
-	char* send_token = strtok_r(message, " ", &saveptr);
-	if (send_token == NULL) {
+// the upload or one of its deliveries made progress, it is kept SPOOL_EXPIRY from now on.
+// guarded by rooms_mutex
+void touch_upload(UPLOAD* upload) {
+	upload->expires_at = time(NULL) + SPOOL_EXPIRY;
+}
+
+// a receiver is part way through the file, or will carry on with it once it resumes its session.
+// guarded by rooms_mutex
+int upload_delivering(UPLOAD* upload) {
+	for (TRANSFER* cur = transfer_head; cur != NULL; cur = cur->next) {
+		if (cur->upload == upload && (cur->state == TRANSFER_ACTIVE || cur->state == TRANSFER_PAUSED
+		|| cur->state == TRANSFER_RESUMING)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// drops spooled files nobody did anything with in SPOOL_EXPIRY, called by the reaper. a delivery
+// under way is never cut off, a paused one becomes waiting when its receiver's session expires
+void expire_uploads(time_t now) {
+	UPLOAD* cur = upload_head;
+	while (cur != NULL) {
+		UPLOAD* next = cur->next;
+		if (cur->expires_at <= now && !upload_delivering(cur)) {
+			for (TRANSFER* t = transfer_head; t != NULL; t = t->next) {
+				if (t->upload == cur && t->state == TRANSFER_WAITING) {
+					notify_sender(cur, "%s never picked up %s, it expired\n", t->receiver_name);
+				}
+			}
+			LOG_INFO("Spool expired: %s %s", cur->sender_name, cur->file_name);
+			remove_upload(cur, "file expired");
+		}
+		cur = next;
+	}
+}
+
+// tells the sender what became of its file after the upload, as a line of chat.
+// format takes the receiver's name and the file name, in that order
+void notify_sender(UPLOAD* upload, char* format, char* receiver_name) {
+	if (upload->sender == NULL) {
+		return;
+	}
+	char buffer[512];
+	snprintf(buffer, sizeof(buffer), format, receiver_name, upload->file_name);
+	send_to_client(upload->sender, FRAME_CHAT, CHAT_STREAM_ID, buffer, strlen(buffer));
+}
+
+// queues a frame on a client's connection, its writer thread sends it. detached clients are skipped.
+// guarded by rooms_mutex
+int enqueue_to_client(USR* client, OutFrame* frame) {
+	if (client->conn == NULL) {
 		return -1;
 	}
-	char* recv_user = strtok_r(NULL, " ", &saveptr);
-	if (recv_user == NULL) {
+	return conn_enqueue_frame(client->conn, frame);
+}
+
+// same, for a one-off frame
+int send_to_client(USR* client, FrameType type, uint32_t stream_id, const void* payload, uint32_t length) {
+	OutFrame* frame = outframe_create(type, stream_id, payload, length);
+	int status = enqueue_to_client(client, frame);
+	outframe_release(frame);
+	return status;
+}
+
+// same, for a frame carrying a FileProgress
+int queue_file_progress(USR* client, FrameType type, uint32_t stream_id, uint64_t offset, uint32_t window) {
+	FileProgress progress = { offset, window };
+	unsigned char data[sizeof(FileProgress)];
+	Buffer fp_buffer = { data, sizeof(data) };
+	serialize_file_progress(&fp_buffer, &progress);
+	return send_to_client(client, type, stream_id, fp_buffer.data, fp_buffer.size);
+}
+
+// sender wants to give a file to someone. its chunk list follows, once that is in the chunks the
+// server doesn't have yet are uploaded into the spool and the file is offered to the receiver,
+// now or when they join the room if they aren't here
+int handle_file_offer(FrameHeader* header, ROOM* room, int clisockfd) {
+	if (header->length != sizeof(FileOffer)) {
+		return discard_payload(clisockfd, header->length);
+	}
+
+	FileOffer offer;
+	unsigned char data[sizeof(FileOffer)];
+	Buffer fo_buffer = { data, sizeof(data) };
+	if (recv_all(clisockfd, fo_buffer.data, fo_buffer.size) < 0) {
 		return -1;
 	}
-	char* file_name = strtok_r(NULL, " ", &saveptr);
-	if (file_name == NULL) {
+	deserialize_file_offer(&offer, &fo_buffer);
+
+	pthread_mutex_lock(&server_state.rooms_mutex);
+	USR* sender = find_client(room, clisockfd);
+	if (sender == NULL) {
+		pthread_mutex_unlock(&server_state.rooms_mutex);
+		return 0;
+	}
+	char* reason = NULL;
+	if (strncmp(offer.peer, sender->username, MAX_USERNAME_LEN) == 0) {
+		reason = "user not found";
+	} else if (offer.chunk_count > MAX_MANIFEST_CHUNKS || (offer.chunk_count == 0) != (offer.file_size == 0)
+	|| offer.chunk_count > offer.file_size / CDC_MIN_CHUNK + 1) {
+		// only the last chunk may be shorter than CDC_MIN_CHUNK
+		reason = "bad chunk list";
+	}
+	if (reason != NULL) {
+		send_to_client(sender, FRAME_FILE_REJECT, header->stream_id, reason, strlen(reason));
+		pthread_mutex_unlock(&server_state.rooms_mutex);
+		return 0;
+	}
+
+	UPLOAD* upload = create_upload(sender, header->stream_id, room, &offer);
+	if (upload->num_entries == 0) {
+		finish_manifest(upload, room);
+	}
+	pthread_mutex_unlock(&server_state.rooms_mutex);
+
+	return 0;
+}
+
+// the next records of a sender's chunk list, the last of them completes the offer
+int handle_file_manifest(FrameHeader* header, ROOM* room, int clisockfd) {
+	uint32_t num_entries = header->length / sizeof(ManifestEntry);
+	if (header->length % sizeof(ManifestEntry) != 0 || num_entries > MAX_MANIFEST_BATCH) {
+		return discard_payload(clisockfd, header->length);
+	}
+
+	unsigned char* data = (unsigned char*) malloc(header->length + 1);
+	if (data == NULL) error("ERROR allocating chunk list");
+	if (recv_all(clisockfd, data, header->length) < 0) {
+		free(data);
 		return -1;
 	}
-	
-	// initialize file transfer thread arguments
-	FileTransferThreadArgs* args = init_FTthread_args(recv_user, file_name, room, send_user);
 
-	// create file transferring thread
-	pthread_t file_tid;
-	if (pthread_create(&file_tid, NULL, thread_file_transfer, (void*) args) != 0) {
-		error("ERROR creating a file transfer thread");
+	pthread_mutex_lock(&server_state.rooms_mutex);
+	USR* sender = find_client(room, clisockfd);
+	UPLOAD* upload = (sender != NULL) ? find_upload(sender, header->stream_id) : NULL;
+	if (upload != NULL && upload->manifest == NULL
+	&& upload->entries_received + num_entries <= upload->num_entries) {
+		touch_upload(upload);
+		if (upload->entries_received + num_entries > upload->entries_capacity) {
+			// doubling, so a long list is copied a few times rather than once per batch
+			uint32_t capacity = upload->entries_capacity > 0 ? upload->entries_capacity * 2 : MAX_MANIFEST_BATCH;
+			if (capacity < upload->entries_received + num_entries) {
+				capacity = upload->entries_received + num_entries;
+			}
+			if (capacity > upload->num_entries) {
+				capacity = upload->num_entries;
+			}
+			upload->entries = (ManifestEntry*) realloc(upload->entries, capacity * sizeof(ManifestEntry));
+			if (upload->entries == NULL) error("ERROR allocating chunk list");
+			upload->entries_capacity = capacity;
+		}
+		for (uint32_t i = 0; i < num_entries; i++) {
+			Buffer me_buffer = { data + i * sizeof(ManifestEntry), sizeof(ManifestEntry) };
+			deserialize_manifest_entry(&upload->entries[upload->entries_received++], &me_buffer);
+		}
+		if (upload->entries_received == upload->num_entries) {
+			finish_manifest(upload, room);
+		}
+	}
+	pthread_mutex_unlock(&server_state.rooms_mutex);
+
+	free(data);
+	return 0;
+}
+
+// stores one chunk of an upload straight into the spool mapping and acknowledges it.
+// only bytes that carry on where the upload left off are kept, anything else was sent before a
+// drop and is stored already. a frame stored whole is checked against its CRC right away, the
+// chunk's SHA-256 covers the rest. the socket is read without rooms_mutex held, the spool
+// reference keeps the mapping alive even if the upload is cancelled meanwhile
+int handle_file_chunk(FrameHeader* header, ROOM* room, int clisockfd) {
+	uint64_t offset;
+	uint32_t crc;
+	if (header->length < CHUNK_PREFIX_LEN) {
+		return discard_payload(clisockfd, header->length);
+	}
+	if (recv_chunk_prefix(clisockfd, &offset, &crc) < 0) {
+		return -1;
+	}
+	uint64_t began = metrics_now();
+	uint32_t length = header->length - CHUNK_PREFIX_LEN;
+
+	pthread_mutex_lock(&server_state.rooms_mutex);
+	USR* sender = find_client(room, clisockfd);
+	UPLOAD* upload = (sender != NULL) ? find_upload(sender, header->stream_id) : NULL;
+	MANIFEST* manifest = (upload != NULL) ? upload->manifest : NULL;
+	if (manifest == NULL || length > FILE_CHUNK_SIZE
+	|| offset > upload->available || offset + length <= upload->available
+	|| offset + length > upload->file_size) {
+		// cancelled upload (or a misbehaving sender), drop the bytes
+		pthread_mutex_unlock(&server_state.rooms_mutex);
+		return discard_payload(clisockfd, length);
+	}
+	// the upload always stops in a chunk only it has (see advance_upload). bytes past its end
+	// are dropped, the sender never sends across chunks
+	CHUNK* chunk = manifest->chunks[upload->cursor];
+	uint64_t chunk_start = manifest->offsets[upload->cursor];
+	uint64_t chunk_end = manifest->offsets[upload->cursor + 1];
+	uint64_t start = upload->available;
+	uint32_t skip = start - offset;
+	uint32_t take = (offset + length < chunk_end ? offset + length : chunk_end) - start;
+	SPOOL* spool = chunk->spool;
+	uint64_t spool_offset = chunk->offset + (start - chunk_start);
+	spool_retain(spool);
+	pthread_mutex_unlock(&server_state.rooms_mutex);
+
+	int status = discard_payload(clisockfd, skip);
+	if (status == 0) {
+		status = spool_recv(spool, clisockfd, spool_offset, take);
+	}
+	if (status == 0) {
+		status = discard_payload(clisockfd, length - skip - take);
+	}
+	int intact = (skip > 0 || take < length || crc32c(0, spool->map + spool_offset, take) == crc);
+
+	pthread_mutex_lock(&server_state.rooms_mutex);
+	// looked up again, the slot may have been resumed by a new connection meanwhile
+	sender = find_client(room, clisockfd);
+	upload = (sender != NULL) ? find_upload(sender, header->stream_id) : NULL;
+	if (status == 0 && upload != NULL && upload->manifest == manifest && upload->available == start) {
+		upload->received += take;
+		if (!intact) {
+			LOG_WARN("Upload rejected: %s %s (chunk checksum mismatch)", upload->sender_name, upload->file_name);
+			remove_upload(upload, "chunk checksum mismatch");
+		} else if (start + take == chunk_end && chunk_verify(chunk) < 0) {
+			LOG_WARN("Upload rejected: %s %s (chunk hash mismatch)", upload->sender_name, upload->file_name);
+			remove_upload(upload, "chunk hash mismatch");
+		} else {
+			advance_upload(upload);
+			touch_upload(upload);
+			PROBE3(file__chunk, upload->sender_name, start, take);
+			queue_file_progress(sender, FRAME_FILE_ACK, header->stream_id, upload->available, FILE_WINDOW);
+			if (upload_complete(upload)) {
+				LOG_INFO("File spooled: %s %s (%lu bytes)", upload->sender_name, upload->file_name,
+				(unsigned long) upload->file_size);
+				PROBE3(file__spooled, upload->sender_name, upload->file_name, upload->file_size);
+				metrics_since(METRIC_FILE_UPLOAD, upload->offered_at);
+			}
+			pump_upload(upload);
+			metrics_since(METRIC_FILE_CHUNK, began);
+		}
+	}
+	spool_release(spool);
+	pthread_mutex_unlock(&server_state.rooms_mutex);
+
+	return status;
+}
+
+// sender says it has sent every byte. nothing to do, the upload is complete once the spool holds them
+int handle_file_complete(FrameHeader* header, ROOM* room, int clisockfd) {
+	(void) room;
+	return discard_payload(clisockfd, header->length);
+}
+
+// the receiver has every byte, let the sender know and drop the delivery. guarded by rooms_mutex
+void transfer_delivered(TRANSFER* transfer) {
+	UPLOAD* upload = transfer->upload;
+	LOG_INFO("File delivered: %s -> %s %s", upload->sender_name, transfer->receiver->username, upload->file_name);
+	PROBE2(file__deliver, transfer->receiver->username, upload->file_name);
+	if (transfer->accepted_at != 0) {
+		metrics_since(METRIC_FILE_DELIVERY, transfer->accepted_at);
+	}
+	notify_sender(upload, "%s received %s\n", transfer->receiver->username);
+	remove_transfer(transfer);
+	release_upload_if_unused(upload, "delivered");
+}
+
+// receiver answered an offer, acknowledged bytes or said where to resume from
+int handle_file_reply(FrameHeader* header, ROOM* room, int clisockfd) {
+	unsigned char payload[sizeof(FileProgress) + MAX_REJECT_REASON_LEN];
+	uint32_t nkeep = header->length < sizeof(payload) ? header->length : sizeof(payload);
+	if (recv_all(clisockfd, payload, nkeep) < 0 || discard_payload(clisockfd, header->length - nkeep) < 0) {
+		return -1;
 	}
-	
-	// wait for file transferring thread to finish
-	pthread_join(file_tid, NULL);
+
+	pthread_mutex_lock(&server_state.rooms_mutex);
+	USR* receiver = find_client(room, clisockfd);
+	TRANSFER* transfer = find_transfer(header->stream_id);
+	if (transfer == NULL || receiver == NULL || transfer->receiver != receiver) {
+		pthread_mutex_unlock(&server_state.rooms_mutex);
+		return 0;
+	}
+	UPLOAD* upload = transfer->upload;
+	touch_upload(upload);
+
+	FileProgress progress;
+	Buffer fp_buffer = { payload, sizeof(FileProgress) };
+	int has_progress = (header->type != FRAME_FILE_REJECT && nkeep == sizeof(FileProgress));
+	if (has_progress) {
+		deserialize_file_progress(&progress, &fp_buffer);
+		if (progress.offset > upload->file_size) {
+			progress.offset = upload->file_size;
+		}
+	}
+
+	if (header->type == FRAME_FILE_REJECT && transfer->state == TRANSFER_RESUMING && transfer->complete_sent) {
+		// it got FILE_COMPLETE and forgot the stream before its last ack made it through the drop
+		transfer_delivered(transfer);
+	} else if (header->type == FRAME_FILE_REJECT && transfer->state != TRANSFER_OFFERED) {
+		// the receiver gave up on a running delivery, say a checksum didn't match or it lost the file
+		char reason[MAX_REJECT_REASON_LEN + 1];
+		memset(reason, 0, sizeof(reason));
+		memcpy(reason, payload, nkeep < MAX_REJECT_REASON_LEN ? nkeep : MAX_REJECT_REASON_LEN);
+		LOG_WARN("File failed: %s -> %s %s (%s)", upload->sender_name, receiver->username, upload->file_name, reason);
+		PROBE3(file__fail, receiver->username, upload->file_name, reason);
+		if (upload->sender != NULL) {
+			char buffer[512];
+			snprintf(buffer, sizeof(buffer), "%s did not get %s: %s\n", receiver->username, upload->file_name, reason);
+			send_to_client(upload->sender, FRAME_CHAT, CHAT_STREAM_ID, buffer, strlen(buffer));
+		}
+		conn_abort_stream(receiver->conn, transfer->id);
+		remove_transfer(transfer);
+		release_upload_if_unused(upload, reason);
+	} else if (header->type == FRAME_FILE_REJECT) {
+		LOG_INFO("File declined: %s -> %s %s", upload->sender_name, receiver->username, upload->file_name);
+		PROBE3(file__fail, receiver->username, upload->file_name, "receiver declined");
+		conn_abort_stream(receiver->conn, transfer->id);
+		remove_transfer(transfer);
+		// a sender still uploading to nobody else just gets the reject
+		if (upload_in_use(upload) || upload_complete(upload)) {
+			notify_sender(upload, "%s declined %s\n", receiver->username);
+		}
+		release_upload_if_unused(upload, "receiver declined");
+	} else if (!has_progress) {
+		// malformed, ignore
+	} else if (header->type == FRAME_FILE_ACCEPT && transfer->state == TRANSFER_OFFERED) {
+		if (open_transfer_stream(transfer) < 0) {
+			cancel_transfer(transfer, "server out of resources");
+			release_upload_if_unused(upload, "server out of resources");
+		} else {
+			transfer->state = TRANSFER_ACTIVE;
+			transfer->queued_offset = progress.offset;
+			transfer->acked_offset = progress.offset;
+			transfer->window = progress.window;
+			transfer->accepted_at = metrics_now();
+			PROBE3(file__accept, receiver->username, upload->file_name, progress.offset);
+			pump_transfer(transfer);
+		}
+	} else if (header->type == FRAME_FILE_ACK && transfer->state == TRANSFER_ACTIVE) {
+		if (progress.offset > transfer->acked_offset) {
+			transfer->acked_offset = progress.offset;
+		}
+		transfer->window = progress.window;
+		if (transfer->acked_offset == upload->file_size) {
+			// the last ack closes the delivery
+			transfer_delivered(transfer);
+		} else {
+			pump_transfer(transfer);
+		}
+	} else if (header->type == FRAME_FILE_RESUME && transfer->state == TRANSFER_RESUMING) {
+		// queue from the receiver's offset on, whatever was queued before the drop is gone
+		transfer->queued_offset = progress.offset;
+		transfer->acked_offset = progress.offset;
+		transfer->window = progress.window;
+		transfer->complete_sent = 0;
+		transfer->state = TRANSFER_ACTIVE;
+		LOG_INFO("File resumed: %s -> %s %s at %lu bytes", upload->sender_name, receiver->username,
+		upload->file_name, (unsigned long) progress.offset);
+		pump_transfer(transfer);
+	}
+	pthread_mutex_unlock(&server_state.rooms_mutex);
 
 	return 0;
 }
 
+// routes a non-chat frame. returns -1 if the client's connection died
+int handle_file_frame(FrameHeader* header, ROOM* room, int clisockfd) {
+	switch (header->type) {
+		case FRAME_FILE_OFFER:
+			return handle_file_offer(header, room, clisockfd);
+		case FRAME_FILE_MANIFEST:
+			return handle_file_manifest(header, room, clisockfd);
+		case FRAME_FILE_CHUNK:
+			return handle_file_chunk(header, room, clisockfd);
+		case FRAME_FILE_COMPLETE:
+			return handle_file_complete(header, room, clisockfd);
+		case FRAME_FILE_ACCEPT:
+		case FRAME_FILE_REJECT:
+		case FRAME_FILE_ACK:
+		case FRAME_FILE_RESUME:
+			return handle_file_reply(header, room, clisockfd);
+		default:
+			return discard_payload(clisockfd, header->length);
+	}
+}
+
 void* thread_main(void* args)
 {
 	// make sure thread resources are deallocated upon return
@@ -734,8 +1210,10 @@ void* thread_main(void* args)
 	int clisockfd = ((ThreadArgs*) args)->clisockfd;
 	free(args);
 
+	PROBE1(handshake__start, clisockfd);
 	HandshakeResult handshake_result = execute_handshake(clisockfd);
 	ConfirmationStatus status = handshake_result.status;
+	ConfirmationStatus final_status = status;
 	char username[MAX_USERNAME_LEN];
 	strncpy(username, handshake_result.username, MAX_USERNAME_LEN);
 	int room_number = handshake_result.room_number;
@@ -760,7 +1238,7 @@ void* thread_main(void* args)
 			memset(&cr, 0, sizeof(ConnectionRequest));
 
 			// receive the new request from the client
-			recv(clisockfd, cr_buffer.data, cr_buffer.size, 0);
+			transport->recv(clisockfd, cr_buffer.data, cr_buffer.size, MSG_WAITALL);
 			deserialize_connection_request(&cr, &cr_buffer);
 			print_connection_request_struct(&cr);
 
@@ -768,80 +1246,159 @@ void* thread_main(void* args)
 			init_connection_confirmation(&cc, &cr, clisockfd);
 			serialize_connection_confirmation(&cc_buffer, &cc);
 			// send the confirmation to the client
-			send(clisockfd, cc_buffer.data, cc_buffer.size, 0);
+			send_all(clisockfd, cc_buffer.data, cc_buffer.size, 0);
 		}
 		room_number = cc.connected_room.room_number;
+		final_status = cc.status;
 
 		cleanup_buffer(&cr_buffer);
 		cleanup_buffer(&cc_buffer);
 	}
+	PROBE3(handshake__done, clisockfd, final_status, room_number);
+	// for the admin socket's thread list, cut short by name_thread()
+	char thread_name[MAX_USERNAME_LEN + 3];
+	snprintf(thread_name, sizeof(thread_name), "s:%s", username);
+	name_thread(thread_name);
 	if (status == CONFIRMATION_FAILURE) {
 		// printf("Server says confirmation failure\n");
-		close(clisockfd);
+		transport->close(clisockfd);
 		pthread_exit(NULL);
 	}
 	// printf("Server says confirmation success\n");
 
-	// get room node
-	ROOM* room = find_room(room_number);
-	// get client node
-	USR* client = find_client(room, clisockfd);
-	// get color code
-	int color_code = get_color_code(room, client);
-	
+	int resumed = (status == CONFIRMATION_RESUMED);
+
 	// get peername (ip & other info) of client socket
 	struct sockaddr_in addr;
 	socklen_t len = sizeof(addr);
-	if (getpeername(clisockfd, (struct sockaddr*)&addr, &len) < 0) {
-		printf("thread main top error\n");
-		error("ERROR Unknown sender!");
+	if (transport->getpeername(clisockfd, (struct sockaddr*)&addr, &len) < 0) {
+		// gone again right after the handshake, before the room heard of it
+		pthread_mutex_lock(&server_state.rooms_mutex);
+		ROOM* room = find_room(room_number);
+		USR* client = room != NULL ? find_client(room, clisockfd) : NULL;
+		if (client != NULL && resumed) {
+			client->clisockfd = -1;
+			client->detached_until = time(NULL) + RESUME_GRACE_PERIOD;
+		} else if (client != NULL) {
+			remove_client(room, clisockfd);
+		}
+		pthread_mutex_unlock(&server_state.rooms_mutex);
+		transport->close(clisockfd);
+		return NULL;
 	}
 
-	// print log in server that user has connected
-	printf("Connected: %s (%s)\n", username, inet_ntoa(addr.sin_addr));
-	
-	// print the updated list of clients
-	print_client_list(room);
-	
-	// announce to room that client joined
-	announce_status(room, clisockfd, username, JOINED);
-	//-------------------------------
-	// Now, we receive/send messages
-	char buffer[256];
-	int nrcv;
+	capture_room(clisockfd, room_number);
 
-	memset(buffer, 0, 256);
+	// from here on only the connection's writer thread writes to the socket
+	CONNECTION* conn = conn_create(clisockfd);
 
-	nrcv = recv(clisockfd, buffer, 255, 0);
-	if (nrcv < 0) error("ERROR recv() failed first recv");
-	
-	while (nrcv > 0 && buffer[0] != '\n') {
-		if (is_filetransfer(buffer)) {
-			// transfer file
-			if (transfer_file(buffer, room, client) == -1) {
-				// send invalid format message to sending user
-				printf("File transfer failed.\n");
+	pthread_mutex_lock(&server_state.rooms_mutex);
+	// get room node
+	ROOM* room = find_room(room_number);
+	// get client node
+	USR* client = find_client(room, clisockfd);
+	strncpy(client->ip, inet_ntoa(addr.sin_addr), INET_ADDRSTRLEN);
+	conn_retain(conn);
+	client->conn = conn;
+	int color_code;
+
+	if (resumed) {
+		// the room already knows this client, so no new color and no announcement
+		color_code = client->color_code;
+		LOG_INFO("Resumed: %s (%s)", username, client->ip);
+	} else {
+		// get color code
+		color_code = get_color_code(room, client);
+
+		// print log in server that user has connected
+		LOG_INFO("Connected: %s (%s)", username, client->ip);
+		
+		// print the updated list of clients
+		print_client_list(room);
+		
+		// announce to room that client joined
+		announce_status(room, clisockfd, username, client->ip, JOINED);
+	}
+	// carry on with its uploads and deliveries, and offer it files spooled while it was away
+	attach_transfers(room, client);
+	pthread_mutex_unlock(&server_state.rooms_mutex);
+	//-------------------------------
+	// Now, we receive/send messages
+	char buffer[BUFFER_SIZE];
+	FrameHeader header;
+	int left = 0;
+
+	while (recv_frame_header(clisockfd, &header) == 0) {
+		metrics_count(COUNTER_BYTES_IN, FRAME_HEADER_LEN + header.length);
+		if (header.type != FRAME_CHAT) {
+			if (handle_file_frame(&header, room, clisockfd) < 0) {
+				break;
 			}
-		} else {
-			// we send the message to everyone except the sender
-			broadcast(room, clisockfd, username, color_code, buffer);
+			continue;
+		}
+
+		// keep what fits in the buffer, drop the rest of an oversized message
+		memset(buffer, 0, BUFFER_SIZE);
+		uint32_t nkeep = header.length < BUFFER_SIZE - 1 ? header.length : BUFFER_SIZE - 1;
+		if (recv_all(clisockfd, buffer, nkeep) < 0 || discard_payload(clisockfd, header.length - nkeep) < 0) {
+			break;
+		}
+		uint64_t received_at = metrics_now();
+		if (nkeep == 0) {
+			continue;
 		}
-		memset(buffer, 0, 256);
-		nrcv = recv(clisockfd, buffer, 255, 0);
-		if (nrcv < 0) error("ERROR recv() failed in while loop");
+		if (buffer[0] == '\n') {
+			left = 1;
+			break;
+		}
+
+		// we send the message to everyone except the sender
+		metrics_count(COUNTER_MESSAGES_IN, 1);
+		uint64_t trace_id = trace_sample();
+		PROBE3(message__receive, clisockfd, room_number, nkeep);
+		pthread_mutex_lock(&server_state.rooms_mutex);
+		broadcast(room, clisockfd, username, color_code, buffer, received_at, trace_id);
+		pthread_mutex_unlock(&server_state.rooms_mutex);
+	}
+
+	pthread_mutex_lock(&server_state.rooms_mutex);
+	// NOTE: looked up by socket rather than reusing client, the slot may have been
+	// resumed by a new connection (and even freed) while we were blocked in recv()
+	client = find_client(room, clisockfd);
+	if (client == NULL) {
+		// superseded by a resumed connection, that thread owns the slot now
+		LOG_INFO("Superseded: %s (%s)", username, inet_ntoa(addr.sin_addr));
+	}
+	else if (!left) {
+		// connection dropped without an exit command, hold the slot for a resume
+		suspend_transfers(client);
+		client->clisockfd = -1;
+		client->conn = NULL;
+		conn_abort(conn);
+		conn_release(conn);
+		client->detached_until = time(NULL) + RESUME_GRACE_PERIOD;
+		LOG_INFO("Detached: %s (%s)", username, client->ip);
 	}
+	else {
+		char ip[INET_ADDRSTRLEN];
+		strncpy(ip, client->ip, INET_ADDRSTRLEN);
 
-	remove_client(room, clisockfd);
+		abandon_transfers(client, "user left");
+		remove_client(room, clisockfd);
 
-	// send message to all users that user has left
-	announce_status(room, clisockfd, username, LEFT);
-	
-	// print log in server that user has disconnected
-	printf("Disconnected: %s (%s)\n", username, inet_ntoa(addr.sin_addr));
+		// send message to all users that user has left
+		announce_status(room, clisockfd, username, ip, LEFT);
+		
+		// print log in server that user has disconnected
+		LOG_INFO("Disconnected: %s (%s)", username, ip);
 
-	print_client_list(room);
+		print_client_list(room);
+	}
+	pthread_mutex_unlock(&server_state.rooms_mutex);
 	
-	close(clisockfd);
+	// let the writer flush (a goodbye still reaches the room), the last reference closes the socket
+	conn_close(conn);
+	conn_release(conn);
 	
 	room = NULL;
 
@@ -850,6 +1407,52 @@ void* thread_main(void* args)
 	return NULL;
 }
 
+// removes detached clients whose resume grace window ran out and announces that they left
+void* thread_session_reaper(void* args)
+{
+	pthread_detach(pthread_self());
+	(void) args;
+	name_thread("reaper");
+
+	while (1) {
+		sleep(REAPER_INTERVAL);
+		time_t now = time(NULL);
+
+		if (metrics_requested) {
+			metrics_requested = 0;
+			metrics_print(stdout);
+		}
+
+		pthread_mutex_lock(&server_state.rooms_mutex);
+		ROOM* cur_room = room_head;
+		while (cur_room != NULL) {
+			USR* cur = cur_room->usr_head;
+			while (cur != NULL) {
+				USR* next = cur->next;
+				if (cur->clisockfd < 0 && cur->detached_until <= now) {
+					char username[MAX_USERNAME_LEN];
+					char ip[INET_ADDRSTRLEN];
+					strncpy(username, cur->username, MAX_USERNAME_LEN);
+					strncpy(ip, cur->ip, INET_ADDRSTRLEN);
+
+					abandon_transfers(cur, "user disconnected");
+					remove_client_node(cur_room, cur);
+					announce_status(cur_room, -1, username, ip, LEFT);
+					LOG_INFO("Disconnected: %s (%s) [resume window expired]", username, ip);
+					print_client_list(cur_room);
+				}
+				cur = next;
+			}
+			cur_room = cur_room->next;
+		}
+		expire_uploads(now);
+		publish_room_stats();
+		pthread_mutex_unlock(&server_state.rooms_mutex);
+	}
+
+	return NULL;
+}
+
 ThreadArgs* init_thread_args(int newsockfd) {
 	ThreadArgs* args = (ThreadArgs*) malloc(sizeof(ThreadArgs));
 	if (args == NULL) error("ERROR creating thread arguments");
@@ -873,14 +1476,20 @@ HandshakeResult execute_handshake(int clisockfd) {
 	int handshake_complete = 0;
 	while (handshake_complete == 0) {
 		// client sends connection request server processes it into a ConnectionRequest struct
-		int nrcv = recv(clisockfd, cr_buffer.data, cr_buffer.size, 0);
-		if (nrcv < 0) error("ERROR recv() failed");
+		int nrcv = transport->recv(clisockfd, cr_buffer.data, cr_buffer.size, MSG_WAITALL);
+		uint64_t start = metrics_now();
 		deserialize_connection_request(&cr, &cr_buffer);
+		if (nrcv <= 0) {
+			// client went away mid-handshake, treat it like a cancel
+			cr.type = CANCEL_HANDSHAKE;
+		}
 		// print_connection_request_struct(&cr);
 
 		// Process the connection request and generate a connection confirmation in response
 		// generate connection confirmation from connection request
+		pthread_mutex_lock(&server_state.rooms_mutex);
 		init_connection_confirmation(&cc, &cr, clisockfd);
+		pthread_mutex_unlock(&server_state.rooms_mutex);
 		// serialize connection confirmation
 		serialize_connection_confirmation(&cc_buffer, &cc);
 
@@ -888,8 +1497,12 @@ HandshakeResult execute_handshake(int clisockfd) {
 			handshake_complete = 1;
 		}
 
-		// send the confirmation to the client
-		send(clisockfd, cc_buffer.data, cc_buffer.size, 0);
+		// send the confirmation to the client, all of it: a short write would leave the client waiting
+		send_all(clisockfd, cc_buffer.data, cc_buffer.size, 0);
+		if (nrcv > 0) {
+			metrics_since(METRIC_HANDSHAKE, start);
+			metrics_count(COUNTER_HANDSHAKES + cc.status, 1);
+		}
 	}
 
 	// Make sure to clean up the buffer
@@ -904,9 +1517,14 @@ HandshakeResult execute_handshake(int clisockfd) {
 	return handshake_result;
 }
 
-int main()
+void request_metrics(int sig) {
+	(void) sig;
+	metrics_requested = 1;
+}
+
+// the TCP socket clients connect to
+int open_listener()
 {
-	init_server_state();
 	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 	if (sockfd < 0) error("ERROR opening socket");
 
@@ -927,18 +1545,74 @@ int main()
 			(struct sockaddr*) &serv_addr, slen);
 	if (status < 0) error("ERROR on binding");
 
-	listen(sockfd, BACKLOG); // maximum number of connections = 5
+	listen(sockfd, BACKLOG);
+
+	return sockfd;
+}
+
+int main(int argc, char* argv[])
+{
+	// before anything logs, lines go out on their own thread
+	logger_start();
+	init_server_state();
+	spool_init();
+	srand(time(NULL));
+
+	// a peer dropping mid-send must not take the whole server down
+	signal(SIGPIPE, SIG_IGN);
+	// kill -USR1 prints the latency histograms
+	signal(SIGUSR1, request_metrics);
+
+	pthread_t reaper_tid;
+	if (pthread_create(&reaper_tid, NULL, thread_session_reaper, NULL) != 0) {
+		error("ERROR creating session reaper thread");
+	}
+
+	int sockfd;
+	if (argc > 1 && strcmp(argv[1], "-S") == 0) {
+		// no sockets at all, virtual clients on a simulated network
+		sockfd = net_sim_start(argc, argv);
+	} else {
+		int opt;
+		while ((opt = getopt(argc, argv, "C:M:L:T:A:")) != -1) {
+			switch (opt) {
+				case 'C': capture_start(optarg); break;
+				case 'M': exporter_start(atoi(optarg)); break;
+				case 'T': tracer_start(optarg); break;
+				case 'A': admin_start(optarg); break;
+				case 'L':
+					if (logger_parse_level(optarg) >= 0) {
+						log_level = (LogLevel) logger_parse_level(optarg);
+						break;
+					}
+					// fall through
+				default:
+					fprintf(stderr, "usage: %s [-C capture-file] [-M metrics-port] [-L debug|info|warn|error]\n"
+					"       [-T trace-file[:every]] [-A admin-socket]\n"
+					"       %s -S [simulation options, see net_sim.c]\n", argv[0], argv[0]);
+					exit(1);
+			}
+		}
+		sockfd = open_listener();
+	}
 	
 	while(1) {
 		
 		struct sockaddr_in cli_addr;
 		socklen_t clen = sizeof(cli_addr);
 
-		int newsockfd = accept(sockfd, 
+		int newsockfd = transport->accept(sockfd, 
 			(struct sockaddr *) &cli_addr, &clen);
 		if (newsockfd < 0) {
-			error("ERROR on accept");
+			// the client gave up while queued, or we are out of descriptors until some close
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				LOG_ERROR("ERROR on accept: %s", strerror(errno));
+				usleep(10000);
+			}
+			continue;
 		}
+		metrics_count(COUNTER_ACCEPTED, 1);
+		PROBE1(accept, newsockfd);
 		
 		/*=================SET THREAD ARGS=============================*/
 		// ThreadArgs* args = init_thread_args(&cc, cr.username, newsockfd);
@@ -949,7 +1623,7 @@ int main()
 			error("ERROR creating a new thread");
 		}
 	}
-	close(sockfd);
+	transport->close(sockfd);
 
 	return 0; 
 }
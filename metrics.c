@@ -0,0 +1,130 @@
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "metrics.h"
+#include "util.h"
+
+const char* const metric_names[NUM_METRICS] = {
+	"handshake", "broadcast", "announce", "file_chunk", "file_upload", "file_delivery"
+};
+
+// the histograms and counters of one running thread
+typedef struct _MetricsSlot {
+	Histogram hists[NUM_METRICS];
+	int initialized[NUM_METRICS];
+	uint64_t counters[NUM_COUNTERS];
+	struct _MetricsSlot* next; // every slot, never freed
+	struct _MetricsSlot* next_free;
+} MetricsSlot;
+
+static MetricsSlot* slots_head; // pushed with a release store, walked by readers without the lock
+static MetricsSlot* free_slots;
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread MetricsSlot* self;
+
+uint64_t metrics_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the thread is exiting, the next one to start takes its slot over
+static void release_slot(void* arg) {
+	MetricsSlot* slot = (MetricsSlot*) arg;
+	pthread_mutex_lock(&slots_mutex);
+	slot->next_free = free_slots;
+	free_slots = slot;
+	pthread_mutex_unlock(&slots_mutex);
+}
+
+static void create_key() {
+	if (pthread_key_create(&slot_key, release_slot) != 0) error("ERROR creating metrics key");
+}
+
+// once per thread
+static MetricsSlot* acquire_slot() {
+	pthread_once(&key_once, create_key);
+	pthread_mutex_lock(&slots_mutex);
+	MetricsSlot* slot = free_slots;
+	if (slot != NULL) {
+		free_slots = slot->next_free;
+	} else {
+		// fresh pages are zero, and only the ones a thread records into are ever touched
+		slot = (MetricsSlot*) mmap(NULL, sizeof(MetricsSlot), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slot == MAP_FAILED) error("ERROR allocating metrics");
+		slot->next = slots_head;
+		__atomic_store_n(&slots_head, slot, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&slots_mutex);
+	pthread_setspecific(slot_key, slot);
+	return slot;
+}
+
+void metrics_count(Counter counter, uint64_t n) {
+	if (self == NULL) {
+		self = acquire_slot();
+	}
+	// only this thread writes it
+	__atomic_store_n(&self->counters[counter], self->counters[counter] + n, __ATOMIC_RELAXED);
+}
+
+void metrics_record(Metric metric, uint64_t ns) {
+	if (self == NULL) {
+		self = acquire_slot();
+	}
+	Histogram* hist = &self->hists[metric];
+	if (!self->initialized[metric]) {
+		// hist_init() without the memset, the counts are zero already
+		__atomic_store_n(&hist->min, UINT64_MAX, __ATOMIC_RELAXED);
+		__atomic_store_n(&self->initialized[metric], 1, __ATOMIC_RELEASE);
+	}
+	hist_record(hist, ns);
+}
+
+void metrics_since(Metric metric, uint64_t start) {
+	metrics_record(metric, metrics_now() - start);
+}
+
+void metrics_snapshot(Histogram* snapshot) {
+	for (int m = 0; m < NUM_METRICS; m++) {
+		hist_init(&snapshot[m]);
+	}
+	MetricsSlot* slot = __atomic_load_n(&slots_head, __ATOMIC_ACQUIRE);
+	for (; slot != NULL; slot = slot->next) {
+		for (int m = 0; m < NUM_METRICS; m++) {
+			if (__atomic_load_n(&slot->initialized[m], __ATOMIC_ACQUIRE)) {
+				hist_merge(&snapshot[m], &slot->hists[m]);
+			}
+		}
+	}
+}
+
+void metrics_counters(uint64_t* counters) {
+	memset(counters, 0, NUM_COUNTERS * sizeof(uint64_t));
+	MetricsSlot* slot = __atomic_load_n(&slots_head, __ATOMIC_ACQUIRE);
+	for (; slot != NULL; slot = slot->next) {
+		for (int c = 0; c < NUM_COUNTERS; c++) {
+			counters[c] += __atomic_load_n(&slot->counters[c], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void metrics_print(FILE* out) {
+	static Histogram snapshot[NUM_METRICS]; // too big for a stack
+	static pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+	pthread_mutex_lock(&print_mutex);
+	metrics_snapshot(snapshot);
+	for (int m = 0; m < NUM_METRICS; m++) {
+		Histogram* hist = &snapshot[m];
+		fprintf(out, "%-14s count %-10llu p50 %10.1fus  p99 %10.1fus  p99.9 %10.1fus  max %10.1fus\n", metric_names[m],
+		(unsigned long long) hist->total, hist_percentile(hist, 50) / 1e3, hist_percentile(hist, 99) / 1e3,
+		hist_percentile(hist, 99.9) / 1e3, hist->max / 1e3);
+	}
+	fflush(out);
+	pthread_mutex_unlock(&print_mutex);
+}
@@ -0,0 +1,63 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "histogram.h"
+
+/* Latency histograms and counters for the server's hot paths. Every thread
+ * records into histograms and counters of its own, so recording is a clock read
+ * and a few stores with no lock and no atomic read-modify-write. Readers merge
+ * every thread's into a snapshot (histogram.h allows merging while they are
+ * being written). A thread's set is handed to the next thread to start when it
+ * exits, so there are only ever as many as threads running at once, and nothing
+ * recorded is lost.
+ */
+
+typedef enum _Metric {
+	METRIC_HANDSHAKE, // one handshake request, from the whole of it read to the confirmation sent
+	METRIC_BROADCAST, // a chat line, from read off the sender's socket to written to the last member's
+	METRIC_ANNOUNCE, // announce_status(), queueing a join or leave for the room
+	METRIC_FILE_CHUNK, // a FILE_CHUNK frame, from its prefix read to its bytes stored, checked and acked
+	METRIC_FILE_UPLOAD, // a file, from offered to every byte spooled
+	METRIC_FILE_DELIVERY, // a file to one receiver, from accepted to delivered
+	NUM_METRICS
+} Metric;
+
+#define NUM_HANDSHAKE_STATUSES 5 // ConfirmationStatus values
+
+typedef enum _Counter {
+	COUNTER_ACCEPTED, // connections accepted
+	COUNTER_MESSAGES_IN, // chat lines broadcast
+	COUNTER_BYTES_IN, // frames read from clients after the handshake, headers included
+	COUNTER_FRAMES_OUT, // frames and file chunks written to clients
+	COUNTER_BYTES_OUT,
+	COUNTER_HANDSHAKES, // + the ConfirmationStatus of a handshake's last confirmation
+	NUM_COUNTERS = COUNTER_HANDSHAKES + NUM_HANDSHAKE_STATUSES
+} Counter;
+
+extern const char* const metric_names[NUM_METRICS];
+
+// CLOCK_MONOTONIC in nanoseconds
+uint64_t metrics_now();
+
+// records a duration in nanoseconds, wait-free
+void metrics_record(Metric metric, uint64_t ns);
+
+// records how long ago start (a metrics_now()) was
+void metrics_since(Metric metric, uint64_t start);
+
+// adds n to a counter, wait-free
+void metrics_count(Counter counter, uint64_t n);
+
+// every thread's histograms merged, snapshot has NUM_METRICS entries
+void metrics_snapshot(Histogram* snapshot);
+
+// every thread's counters summed, counters has NUM_COUNTERS entries
+void metrics_counters(uint64_t* counters);
+
+// percentiles of every metric, one line each
+void metrics_print(FILE* out);
+
+#endif
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "handshake.h"
+#include "room.h"
+#include "util.h"
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+/* Microbenchmarks of the server's hot paths, one function at a time: the handshake
+ * serializers, the room and member lookups, picking a member's color, the chat
+ * line checks and the formatting of what gets broadcast. The lookups run over
+ * rooms and member lists of growing sizes. Each line gives the time, CPU cycles
+ * and heap allocations per call.
+ *
+ * Cycles come from the hardware counter when perf events are allowed, otherwise
+ * from the time stamp counter (which ticks at a fixed rate, not the core's).
+ * Allocations are counted by wrapping malloc, calloc and realloc at link time, so
+ * only the calls made from our own objects count. Built with the same CFLAGS as
+ * the server, so the numbers are for the code as it ships.
+ *
+ * usage: make bench-micro, or ./micro_bench [milliseconds per benchmark]
+ */
+
+#define DEFAULT_RUN_MS 200
+#define MAX_SIZE 1000 // largest room list and member list
+
+static uint64_t allocations = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+	allocations++;
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+	allocations++;
+	return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+/*========================================= MEASURING ==========================================*/
+
+static int cycles_fd = -1; // perf event counting this thread's cycles, -1 for the TSC
+static double run_seconds = DEFAULT_RUN_MS / 1000.0;
+static volatile uint64_t sink; // results go here so the calls aren't optimized away
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void open_cycle_counter() {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	cycles_fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cycles() {
+	if (cycles_fd >= 0) {
+		uint64_t count;
+		if (read(cycles_fd, &count, sizeof(count)) == sizeof(count)) {
+			return count;
+		}
+	}
+#if defined(__x86_64__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+// runs fn with more and more iterations until a run takes run_seconds, then prints the per call numbers
+static void run(const char* name, const char* size, void (*fn)(uint64_t)) {
+	fn(1000); // warm the caches
+	uint64_t iterations = 1000;
+	while (1) {
+		allocations = 0;
+		uint64_t start_cycles = cycles();
+		double start = now();
+		fn(iterations);
+		double elapsed = now() - start;
+		uint64_t spent_cycles = cycles() - start_cycles;
+		if (elapsed >= run_seconds || iterations >= (1ULL << 32)) {
+			printf("%-40s %8s %10.1f %11.1f %10.2f\n", name, size, elapsed * 1e9 / iterations,
+			(double) spent_cycles / iterations, (double) allocations / iterations);
+			return;
+		}
+		// aim past the target so the next run is usually the last
+		double scale = elapsed > 0 ? run_seconds * 1.2 / elapsed : 100;
+		iterations = (uint64_t) (iterations * (scale < 100 ? scale : 100)) + 1;
+	}
+}
+
+/*========================================= HANDSHAKE ==========================================*/
+
+static ConnectionRequest request;
+static ConnectionConfirmation confirmation;
+static unsigned char request_data[sizeof(ConnectionRequest)];
+static unsigned char confirmation_data[sizeof(ConnectionConfirmation)];
+
+static void bench_serialize_request(uint64_t n) {
+	Buffer buffer = { request_data, sizeof(request_data) };
+	for (uint64_t i = 0; i < n; i++) {
+		sink += serialize_connection_request(&buffer, &request);
+	}
+}
+
+static void bench_deserialize_request(uint64_t n) {
+	Buffer buffer = { request_data, sizeof(request_data) };
+	ConnectionRequest cr;
+	for (uint64_t i = 0; i < n; i++) {
+		sink += deserialize_connection_request(&cr, &buffer);
+	}
+}
+
+static void bench_serialize_confirmation(uint64_t n) {
+	Buffer buffer = { confirmation_data, sizeof(confirmation_data) };
+	for (uint64_t i = 0; i < n; i++) {
+		sink += serialize_connection_confirmation(&buffer, &confirmation);
+	}
+}
+
+static void bench_deserialize_confirmation(uint64_t n) {
+	Buffer buffer = { confirmation_data, sizeof(confirmation_data) };
+	ConnectionConfirmation cc;
+	for (uint64_t i = 0; i < n; i++) {
+		sink += deserialize_connection_confirmation(&cc, &buffer);
+	}
+}
+
+// the way execute_handshake() does it, with a buffer from the heap every time
+static void bench_confirmation_roundtrip(uint64_t n) {
+	for (uint64_t i = 0; i < n; i++) {
+		Buffer buffer;
+		init_buffer(&buffer, sizeof(ConnectionConfirmation));
+		sink += serialize_connection_confirmation(&buffer, &confirmation);
+		cleanup_buffer(&buffer);
+	}
+}
+
+static void run_handshake() {
+	init_connection_request_struct(JOIN_ROOM, 1, &request, "micro_bench");
+	Buffer buffer = { request_data, sizeof(request_data) };
+	serialize_connection_request(&buffer, &request);
+	run("serialize_connection_request", "-", bench_serialize_request);
+	run("deserialize_connection_request", "-", bench_deserialize_request);
+
+	int room_counts[] = { 0, 1, MAX_ROOMS };
+	for (size_t i = 0; i < sizeof(room_counts) / sizeof(room_counts[0]); i++) {
+		memset(&confirmation, 0, sizeof(confirmation));
+		confirmation.status = CONFIRMATION_PENDING;
+		confirmation.available_rooms.num_rooms = room_counts[i];
+		for (int r = 0; r < room_counts[i]; r++) {
+			confirmation.available_rooms.rooms[r].room_number = r + 1;
+			confirmation.available_rooms.rooms[r].num_connected_clients = r;
+		}
+		Buffer cc_buffer = { confirmation_data, sizeof(confirmation_data) };
+		serialize_connection_confirmation(&cc_buffer, &confirmation);
+
+		char size[16];
+		snprintf(size, sizeof(size), "%d", room_counts[i]);
+		run("serialize_connection_confirmation", size, bench_serialize_confirmation);
+		run("deserialize_connection_confirmation", size, bench_deserialize_confirmation);
+		run("serialize_confirmation+heap buffer", size, bench_confirmation_roundtrip);
+	}
+}
+
+/*========================================= ROOMS ==========================================*/
+
+static ROOM* room = NULL; // the room the member lookups search
+static USR* members[MAX_SIZE];
+static int num_members = 0;
+static int num_rooms = 0;
+
+// every lookup hits, and they cycle through the list so the average is over every position
+static void bench_find_room(uint64_t n) {
+	for (uint64_t i = 0; i < n; i++) {
+		sink += (uintptr_t) find_room((int) (i % num_rooms) + 1);
+	}
+}
+
+static void bench_find_room_missing(uint64_t n) {
+	for (uint64_t i = 0; i < n; i++) {
+		sink += (uintptr_t) find_room(-1);
+	}
+}
+
+static void bench_find_client(uint64_t n) {
+	for (uint64_t i = 0; i < n; i++) {
+		sink += (uintptr_t) find_client(room, members[i % num_members]->clisockfd);
+	}
+}
+
+static void bench_find_client_by_username(uint64_t n) {
+	for (uint64_t i = 0; i < n; i++) {
+		sink += (uintptr_t) find_client_by_username(room, members[i % num_members]->username);
+	}
+}
+
+static void bench_get_color_code(uint64_t n) {
+	for (uint64_t i = 0; i < n; i++) {
+		sink += get_color_code(room, members[i % num_members]);
+	}
+}
+
+static void run_rooms() {
+	init_server_state();
+	int sizes[] = { 1, 10, 100, MAX_SIZE };
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		// rooms are never removed, so the list only grows to the next size
+		while (num_rooms < sizes[s]) {
+			create_room();
+			num_rooms++;
+		}
+		char size[16];
+		snprintf(size, sizeof(size), "%d", sizes[s]);
+		run("find_room", size, bench_find_room);
+		run("find_room (missing)", size, bench_find_room_missing);
+	}
+
+	// the members all go in the first room, it is searched from the head like any other
+	room = find_room(1);
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		while (num_members < sizes[s]) {
+			char username[MAX_USERNAME_LEN];
+			snprintf(username, sizeof(username), "member%d", num_members);
+			members[num_members] = add_client(room, 1000 + num_members, username);
+			get_color_code(room, members[num_members]);
+			num_members++;
+		}
+		char size[16];
+		snprintf(size, sizeof(size), "%d", sizes[s]);
+		run("find_client", size, bench_find_client);
+		run("find_client_by_username", size, bench_find_client_by_username);
+		run("get_color_code", size, bench_get_color_code);
+	}
+}
+
+/*========================================= CHAT LINES ==========================================*/
+
+static char line[LINE_BUFFER_SIZE];
+static size_t line_end; // index of the byte trim_whitespace() overwrites with '\0'
+static char message[256];
+
+static void bench_is_filetransfer(uint64_t n) {
+	for (uint64_t i = 0; i < n; i++) {
+		sink += is_filetransfer(line);
+	}
+}
+
+static void bench_trim_whitespace(uint64_t n) {
+	for (uint64_t i = 0; i < n; i++) {
+		sink += (uintptr_t) trim_whitespace(line);
+		line[line_end] = ' '; // undo it for the next call
+	}
+}
+
+static void bench_format_chat_line(uint64_t n) {
+	char buffer[CHAT_LINE_LEN];
+	for (uint64_t i = 0; i < n; i++) {
+		sink += format_chat_line(buffer, sizeof(buffer), FIRST_COLOR_CODE, "member123", "192.168.100.200", message);
+	}
+}
+
+static void bench_format_status_line(uint64_t n) {
+	char buffer[CHAT_LINE_LEN];
+	for (uint64_t i = 0; i < n; i++) {
+		sink += format_status_line(buffer, sizeof(buffer), "member123", "192.168.100.200", (int) (i & 1), 42);
+	}
+}
+
+static void run_chat_lines() {
+	const char* commands[] = { "hello everyone", "SEND member12 /home/user/report.pdf" };
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		strcpy(line, commands[i]);
+		run("is_filetransfer", i == 0 ? "chat" : "SEND", bench_is_filetransfer);
+	}
+	memset(line, 'x', sizeof(line) - 1);
+	line[sizeof(line) - 1] = '\0';
+	run("is_filetransfer", "511", bench_is_filetransfer);
+
+	// a word padded with spaces on both sides to the total length
+	int lengths[] = { 16, 64, 256, LINE_BUFFER_SIZE - 1 };
+	for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		memset(line, ' ', lengths[i]);
+		line[lengths[i]] = '\0';
+		size_t start = lengths[i] / 2 - 2;
+		memcpy(line + start, "word", 4);
+		line_end = start + 4;
+		char size[16];
+		snprintf(size, sizeof(size), "%d", lengths[i]);
+		run("trim_whitespace", size, bench_trim_whitespace);
+	}
+
+	// the server keeps at most 255 bytes of a message
+	int message_lengths[] = { 16, 128, 255 };
+	for (size_t i = 0; i < sizeof(message_lengths) / sizeof(message_lengths[0]); i++) {
+		memset(message, 'm', message_lengths[i]);
+		message[message_lengths[i]] = '\0';
+		char size[16];
+		snprintf(size, sizeof(size), "%d", message_lengths[i]);
+		run("format_chat_line (broadcast)", size, bench_format_chat_line);
+	}
+	run("format_status_line (announce_status)", "-", bench_format_status_line);
+}
+
+int main(int argc, char* argv[]) {
+	if (argc > 1) {
+		run_seconds = atoi(argv[1]) / 1000.0;
+	}
+	open_cycle_counter();
+	printf("cycles: %s\n", cycles_fd >= 0 ? "cpu cycles (perf)" : "time stamp counter");
+	printf("%-40s %8s %10s %11s %10s\n", "benchmark", "size", "ns/op", "cycles/op", "allocs/op");
+	run_handshake();
+	run_rooms();
+	run_chat_lines();
+	return 0;
+}
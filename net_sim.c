@@ -0,0 +1,394 @@
+#define _GNU_SOURCE // for memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "net_sim.h"
+#include "sim_transport.h"
+#include "connection.h"
+#include "handshake.h"
+#include "frame.h"
+#include "histogram.h"
+#include "util.h"
+
+/* Runs the server's own code against N virtual clients spread over M rooms,
+ * with no sockets: the clients live on sim_transport (see sim_transport.h) and
+ * one thread plays all of them. The first client of each room creates it and
+ * the others join it by number. Once everyone is in, every client chats at a set
+ * rate for a set number of virtual seconds, then they all leave.
+ *
+ * Everything happens in virtual time, in ticks of NET_SIM_TICK_NS. Each tick the
+ * clients whose turn it is send, the server handles what reached it one event
+ * at a time, and the clients read what reached them. The server sees the same
+ * events in the same order on every run with the same seed, so the digest of
+ * everything the clients received comes out the same too: a different digest
+ * for the same seed is a race, and the seed reproduces it.
+ *
+ * Latencies in the report are virtual (the modelled link and tick, not the
+ * server's speed); wall_s and the rates per wall second are what the server's
+ * logic costs without the kernel's networking in the way. The report is one
+ * JSON object on stderr, stdout is the server's own log.
+ *
+ * usage: ./main_server -S [-n clients] [-m rooms] [-r messages/s per client] [-s payload bytes]
+ *        [-d virtual seconds] [-l latency ms] [-p partial read/write chance] [-x seed]
+ */
+
+#define NET_SIM_MARKER "~sim " // starts every payload: "~sim <sender> <virtual ns> " and padding
+#define NET_SIM_MAX_PAYLOAD 255 // the server keeps this much of a chat line and drops the rest
+#define NET_SIM_TICK_NS 1000000ULL
+#define NET_SIM_SETUP_LIMIT_NS 60000000000ULL // virtual time for everyone to get in
+#define NET_SIM_RX 2048 // per client, a chat line frame fits with room to spare
+#define NET_SIM_EXIT_MESSAGE "\n" // a chat message that starts with a newline leaves the room
+
+typedef struct _NetSimConfig {
+	int clients;
+	int rooms;
+	double rate;
+	int payload;
+	double duration;
+	double latency_ms;
+	double partial;
+	uint64_t seed;
+} NetSimConfig;
+
+typedef enum _NetSimState {
+	NET_SIM_IDLE,
+	NET_SIM_HANDSHAKE,
+	NET_SIM_JOINED,
+	NET_SIM_GONE
+} NetSimState;
+
+typedef struct _NetSimClient {
+	int id;
+	int handle; // sim_connect()'s
+	int room; // which of the workload's rooms
+	NetSimState state;
+	uint64_t next_send; // virtual ns
+	uint64_t digest; // of every frame received after the handshake
+	size_t in_len;
+	unsigned char in[NET_SIM_RX];
+} NetSimClient;
+
+static NetSimConfig config = { 1000, 10, 1.0, 64, 10.0, 1.0, 0.1, 1 };
+static NetSimClient* clients;
+static int* owners; // client by handle
+static int32_t* room_numbers; // the server's, -1 until the room's creator is in
+static int* room_sizes;
+static int joined;
+static uint64_t sent, expected, delivered, delivered_bytes, failed;
+static Histogram latency;
+
+/*========================================= CLIENTS ==========================================*/
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t len) {
+	const unsigned char* bytes = (const unsigned char*) data;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+static void send_request(NetSimClient* client) {
+	char username[MAX_USERNAME_LEN];
+	snprintf(username, sizeof(username), "sim%d", client->id);
+	ConnectionRequest cr;
+	if (client->id < config.rooms) {
+		init_connection_request_struct(CREATE_NEW_ROOM, UNINITIALIZED_ROOM_NUMBER, &cr, username);
+	} else {
+		init_connection_request_struct(JOIN_ROOM, room_numbers[client->room], &cr, username);
+	}
+	unsigned char data[sizeof(ConnectionRequest)];
+	Buffer cr_buffer = { data, sizeof(data) };
+	serialize_connection_request(&cr_buffer, &cr);
+
+	client->handle = sim_connect();
+	owners[client->handle] = client->id;
+	sim_send(client->handle, cr_buffer.data, cr_buffer.size);
+	client->state = NET_SIM_HANDSHAKE;
+}
+
+static void send_chat(NetSimClient* client, const char* text, size_t len) {
+	unsigned char data[FRAME_HEADER_LEN + NET_SIM_MAX_PAYLOAD];
+	Buffer fh_buffer = { data, FRAME_HEADER_LEN };
+	FrameHeader fh = { FRAME_CHAT, CHAT_STREAM_ID, len };
+	serialize_frame_header(&fh_buffer, &fh);
+	memcpy(data + FRAME_HEADER_LEN, text, len);
+	sim_send(client->handle, data, FRAME_HEADER_LEN + len);
+}
+
+static void send_message(NetSimClient* client, uint64_t now) {
+	char payload[NET_SIM_MAX_PAYLOAD + 1];
+	int len = snprintf(payload, sizeof(payload), NET_SIM_MARKER "%d %llu ", client->id, (unsigned long long) now);
+	while (len < config.payload) {
+		payload[len++] = 'x';
+	}
+	send_chat(client, payload, len);
+	sent++;
+	expected += room_sizes[client->room] - 1;
+}
+
+static void handle_frame(NetSimClient* client, FrameHeader* fh, const unsigned char* payload, uint64_t now) {
+	client->digest = fnv1a(client->digest, &fh->type, sizeof(fh->type));
+	client->digest = fnv1a(client->digest, payload, fh->length);
+	if (fh->type != FRAME_CHAT) {
+		return;
+	}
+	const char* marker = (const char*) memmem(payload, fh->length, NET_SIM_MARKER, strlen(NET_SIM_MARKER));
+	if (marker == NULL) {
+		return; // a join or leave announcement
+	}
+	char fields[64];
+	size_t n = fh->length - ((const unsigned char*) marker - payload) - strlen(NET_SIM_MARKER);
+	if (n > sizeof(fields) - 1) {
+		n = sizeof(fields) - 1;
+	}
+	memcpy(fields, marker + strlen(NET_SIM_MARKER), n);
+	fields[n] = '\0';
+	int sender;
+	unsigned long long stamp;
+	if (sscanf(fields, "%d %llu", &sender, &stamp) == 2) {
+		delivered++;
+		delivered_bytes += fh->length;
+		hist_record(&latency, now - stamp);
+	}
+}
+
+// takes what the handshake or the frames need off the front of the client's buffer
+static void parse_input(NetSimClient* client, uint64_t now) {
+	size_t used = 0;
+	while (1) {
+		unsigned char* cur = client->in + used;
+		size_t avail = client->in_len - used;
+
+		if (client->state == NET_SIM_HANDSHAKE) {
+			if (avail < sizeof(ConnectionConfirmation)) {
+				break;
+			}
+			ConnectionConfirmation cc;
+			Buffer cc_buffer = { cur, sizeof(ConnectionConfirmation) };
+			deserialize_connection_confirmation(&cc, &cc_buffer);
+			used += sizeof(ConnectionConfirmation);
+			if (cc.status != CONFIRMATION_SUCCESS && cc.status != CONFIRMATION_SUCCESS_NEW) {
+				failed++;
+				client->state = NET_SIM_GONE;
+				sim_close(client->handle);
+				break;
+			}
+			if (client->id < config.rooms) {
+				room_numbers[client->room] = cc.connected_room.room_number;
+			}
+			client->state = NET_SIM_JOINED;
+			room_sizes[client->room]++;
+			joined++;
+			continue;
+		}
+
+		if (client->state != NET_SIM_JOINED || avail < FRAME_HEADER_LEN) {
+			break;
+		}
+		FrameHeader fh;
+		Buffer fh_buffer = { cur, FRAME_HEADER_LEN };
+		deserialize_frame_header(&fh, &fh_buffer);
+		if (FRAME_HEADER_LEN + fh.length > NET_SIM_RX) {
+			fprintf(stderr, "client %d got a %u byte frame, more than it can hold\n", client->id, fh.length);
+			exit(1);
+		}
+		if (avail < FRAME_HEADER_LEN + fh.length) {
+			break;
+		}
+		handle_frame(client, &fh, cur + FRAME_HEADER_LEN, now);
+		used += FRAME_HEADER_LEN + fh.length;
+	}
+
+	memmove(client->in, client->in + used, client->in_len - used);
+	client->in_len -= used;
+}
+
+// every client something reached reads all of it
+static void read_all(uint64_t now) {
+	int handle;
+	while ((handle = sim_next_readable()) >= 0) {
+		NetSimClient* client = &clients[owners[handle]];
+		while (client->state != NET_SIM_GONE) {
+			ssize_t n = sim_recv(handle, client->in + client->in_len, NET_SIM_RX - client->in_len);
+			if (n <= 0) {
+				if (n == 0) {
+					client->state = NET_SIM_GONE;
+				}
+				break;
+			}
+			client->in_len += n;
+			parse_input(client, now);
+		}
+	}
+}
+
+/*========================================= REPORT ==========================================*/
+
+static double elapsed_s(const struct timespec* from) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) + (now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void print_report(double setup_s, double chat_s) {
+	uint64_t digest = 0xCBF29CE484222325ULL;
+	for (int i = 0; i < config.clients; i++) {
+		digest = fnv1a(digest, &clients[i].digest, sizeof(clients[i].digest));
+	}
+
+	fprintf(stderr, "{\n");
+	fprintf(stderr, "  \"mode\": \"sim\",\n");
+	fprintf(stderr, "  \"clients\": %d,\n  \"rooms\": %d,\n  \"joined\": %d,\n  \"failed\": %llu,\n", config.clients,
+	config.rooms, joined, (unsigned long long) failed);
+	fprintf(stderr, "  \"rate\": %.2f,\n  \"payload\": %d,\n  \"virtual_s\": %.1f,\n", config.rate, config.payload,
+	config.duration);
+	fprintf(stderr, "  \"latency_ms\": %.3f,\n  \"partial\": %.3f,\n  \"seed\": %llu,\n", config.latency_ms, config.partial,
+	(unsigned long long) config.seed);
+	fprintf(stderr, "  \"setup_wall_s\": %.3f,\n  \"chat_wall_s\": %.3f,\n", setup_s, chat_s);
+	fprintf(stderr, "  \"sent\": %llu,\n  \"expected\": %llu,\n  \"delivered\": %llu,\n", (unsigned long long) sent,
+	(unsigned long long) expected, (unsigned long long) delivered);
+	fprintf(stderr, "  \"messages_per_wall_s\": %.1f,\n  \"deliveries_per_wall_s\": %.1f,\n", chat_s > 0 ? sent / chat_s : 0,
+	chat_s > 0 ? delivered / chat_s : 0);
+	fprintf(stderr, "  \"digest\": \"%016llx\",\n", (unsigned long long) digest);
+	fprintf(stderr, "  \"virtual_latency_us\": { \"count\": %llu, \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f }\n",
+	(unsigned long long) latency.total, hist_percentile(&latency, 50) / 1e3, hist_percentile(&latency, 99) / 1e3,
+	latency.max / 1e3);
+	fprintf(stderr, "}\n");
+}
+
+/*========================================= DRIVER ==========================================*/
+
+static void* net_sim_main(void* args) {
+	(void) args;
+	uint64_t now = 0;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// everyone in: creators first, the rest once their room has a number
+	while (joined + (int) failed < config.clients) {
+		sim_run(now);
+		for (int i = 0; i < config.clients; i++) {
+			NetSimClient* client = &clients[i];
+			if (client->state == NET_SIM_IDLE && (i < config.rooms || room_numbers[client->room] >= 0)) {
+				send_request(client);
+			}
+		}
+		sim_run(now);
+		read_all(now);
+		now += NET_SIM_TICK_NS;
+		if (now > NET_SIM_SETUP_LIMIT_NS) {
+			fprintf(stderr, "only %d of %d clients got in\n", joined, config.clients);
+			exit(1);
+		}
+	}
+	double setup_s = elapsed_s(&start);
+
+	// spread the first messages over a period so the rooms don't all go at once
+	uint64_t period = (uint64_t) (1e9 / config.rate);
+	uint64_t spread = config.seed;
+	for (int i = 0; i < config.clients; i++) {
+		uint64_t z = (spread += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 31)) * 0xBF58476D1CE4E5B9ULL;
+		clients[i].next_send = now + (z ^ (z >> 29)) % period;
+	}
+	uint64_t stop_at = now + (uint64_t) (config.duration * 1e9);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (now < stop_at) {
+		sim_run(now);
+		for (int i = 0; i < config.clients; i++) {
+			NetSimClient* client = &clients[i];
+			while (client->state == NET_SIM_JOINED && client->next_send <= now) {
+				send_message(client, now);
+				client->next_send += period;
+			}
+		}
+		sim_run(now);
+		read_all(now);
+		now += NET_SIM_TICK_NS;
+	}
+	// the last messages there and back, then everyone leaves
+	uint64_t drain_until = now + (uint64_t) (config.latency_ms * 2e6);
+	while (now <= drain_until) {
+		sim_run(now);
+		read_all(now);
+		now += NET_SIM_TICK_NS;
+	}
+	double chat_s = elapsed_s(&start);
+
+	for (int i = 0; i < config.clients; i++) {
+		if (clients[i].state == NET_SIM_JOINED) {
+			send_chat(&clients[i], NET_SIM_EXIT_MESSAGE, strlen(NET_SIM_EXIT_MESSAGE));
+			sim_close(clients[i].handle);
+		}
+	}
+	now += (uint64_t) (config.latency_ms * 1e6);
+	sim_run(now);
+
+	print_report(setup_s, chat_s);
+	fflush(stdout);
+	exit(0);
+	return NULL;
+}
+
+int net_sim_start(int argc, char* argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "Sn:m:r:s:d:l:p:x:")) != -1) {
+		switch (opt) {
+			case 'S': break;
+			case 'n': config.clients = atoi(optarg); break;
+			case 'm': config.rooms = atoi(optarg); break;
+			case 'r': config.rate = atof(optarg); break;
+			case 's': config.payload = atoi(optarg); break;
+			case 'd': config.duration = atof(optarg); break;
+			case 'l': config.latency_ms = atof(optarg); break;
+			case 'p': config.partial = atof(optarg); break;
+			case 'x': config.seed = strtoull(optarg, NULL, 10); break;
+			default: config.clients = 0; // usage below
+		}
+	}
+	if (config.clients < 1 || config.rooms < 1 || config.rooms > config.clients || config.rate <= 0 ||
+	config.payload < 32 || config.payload > NET_SIM_MAX_PAYLOAD || config.duration <= 0 || config.latency_ms < 0 ||
+	config.partial < 0 || config.partial > 1) {
+		fprintf(stderr, "usage: %s -S [-n clients] [-m rooms] [-r messages/s per client] [-s payload bytes (32-%d)]\n"
+		"       [-d virtual seconds] [-l latency ms] [-p partial read/write chance] [-x seed]\n", argv[0],
+		NET_SIM_MAX_PAYLOAD);
+		exit(1);
+	}
+
+	clients = (NetSimClient*) calloc(config.clients, sizeof(NetSimClient));
+	owners = (int*) calloc(config.clients, sizeof(int));
+	room_numbers = (int32_t*) malloc(config.rooms * sizeof(int32_t));
+	room_sizes = (int*) calloc(config.rooms, sizeof(int));
+	if (clients == NULL || owners == NULL || room_numbers == NULL || room_sizes == NULL) {
+		error("ERROR allocating virtual clients");
+	}
+	for (int i = 0; i < config.clients; i++) {
+		clients[i].id = i;
+		clients[i].room = i % config.rooms;
+		clients[i].digest = 0xCBF29CE484222325ULL;
+	}
+	for (int r = 0; r < config.rooms; r++) {
+		room_numbers[r] = -1;
+	}
+	hist_init(&latency);
+
+	SimConfig sim_config = { config.seed, config.partial, (uint64_t) (config.latency_ms * 1e6), conn_backlog };
+	sim_init(&sim_config);
+	transport = &sim_transport;
+	// colors are picked with rand(), the same seed picks the same ones
+	srand(config.seed);
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, net_sim_main, NULL) != 0) {
+		error("ERROR creating simulation driver thread");
+	}
+	pthread_detach(tid);
+
+	return sim_listen();
+}
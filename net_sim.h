@@ -0,0 +1,12 @@
+#ifndef NET_SIM_H
+#define NET_SIM_H
+
+/* main_server -S: the server against virtual clients on the simulated
+ * transport instead of TCP, see net_sim.c. Switches the server over to
+ * sim_transport, starts the thread that drives the clients and returns the
+ * descriptor to accept() on. The driver exits the process when the run is over.
+ */
+
+int net_sim_start(int argc, char* argv[]);
+
+#endif
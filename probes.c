@@ -0,0 +1,33 @@
+#include "probes.h"
+
+#ifdef HAVE_PROBES
+
+// perf, bpftrace and systemtap find these through the probe notes and bump them while attached
+#define DEFINE_SEMAPHORE(name) unsigned short PROBE_SEMAPHORE(name) __attribute__((section(".probes"))) = 0
+
+// SERVER
+DEFINE_SEMAPHORE(accept);
+DEFINE_SEMAPHORE(handshake__start);
+DEFINE_SEMAPHORE(handshake__done);
+DEFINE_SEMAPHORE(room__create);
+DEFINE_SEMAPHORE(room__remove);
+DEFINE_SEMAPHORE(member__add);
+DEFINE_SEMAPHORE(member__remove);
+DEFINE_SEMAPHORE(message__receive);
+DEFINE_SEMAPHORE(message__send);
+DEFINE_SEMAPHORE(frame__write);
+DEFINE_SEMAPHORE(file__upload);
+DEFINE_SEMAPHORE(file__chunk);
+DEFINE_SEMAPHORE(file__spooled);
+DEFINE_SEMAPHORE(file__offer);
+DEFINE_SEMAPHORE(file__accept);
+DEFINE_SEMAPHORE(file__deliver);
+DEFINE_SEMAPHORE(file__fail);
+
+// CLIENT
+DEFINE_SEMAPHORE(file__chunk__send);
+DEFINE_SEMAPHORE(file__receive);
+DEFINE_SEMAPHORE(file__chunk__receive);
+DEFINE_SEMAPHORE(file__done);
+
+#endif
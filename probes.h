@@ -0,0 +1,91 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/* USDT probes (provider "chat") for perf, bpftrace or systemtap to attach to a
+ * running server or client, e.g.
+ *   bpftrace -e 'usdt:./main_server:chat:message__receive { @[arg1] = count(); }'
+ *   perf buildid-cache --add ./main_server && perf record -e sdt_chat:accept ...
+ * A probe is a nop instruction plus a note in the ELF file, its arguments are
+ * left wherever the compiler had them. Nothing happens until a tracer attaches.
+ * Every probe also has a semaphore (probes.c) that the tracer bumps while it is
+ * attached, and the arguments are only worked out while it is non-zero, so a
+ * strlen() in a probe costs nothing on a server nobody is tracing.
+ *
+ * Built without them (plain no-ops) when <sys/sdt.h> isn't there, which is
+ * systemtap-sdt-dev or systemtap-sdt-devel, or with -DNO_PROBES.
+ *
+ * Server probes (fd is the client's socket, room a room number):
+ *   accept(fd)
+ *   handshake__start(fd)                         handshake__done(fd, status, room)
+ *   room__create(room)                           room__remove(room)
+ *   member__add(room, fd, username)              member__remove(room, fd, username)
+ *   message__receive(fd, room, len)              message__send(to_fd, from_fd, len) queued for one member
+ *   frame__write(fd, traffic_class, len)         written to the socket by the connection's writer
+ *   file__upload(sender, file_name, new_bytes)   the chunk list is in, new_bytes are to be uploaded
+ *   file__chunk(sender, offset, len)             stored in the spool
+ *   file__spooled(sender, file_name, size)       file__offer(receiver, file_name, size)
+ *   file__accept(receiver, file_name, offset)    file__deliver(receiver, file_name)
+ *   file__fail(receiver, file_name, reason)      declined, or given up on by the receiver
+ * Client probes:
+ *   handshake__start(attempt)                    0 for the first connect, then each reconnect
+ *   handshake__done(fd, status, room)
+ *   message__send(len)                           message__receive(len)
+ *   file__offer(file_name, size)                 file__chunk__send(stream, offset, len)
+ *   file__receive(file_name, size)               file__chunk__receive(stream, offset, len)
+ *   file__done(stream, received)
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(NO_PROBES)
+#define HAVE_PROBES
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+
+// the notes carry each probe's semaphore address, so every probe in a file including this needs one
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PROBE_SEMAPHORE(name) chat_##name##_semaphore
+#define PROBE_ENABLED(name) __builtin_expect(PROBE_SEMAPHORE(name) != 0, 0)
+
+#define PROBE1(name, a) do { if (PROBE_ENABLED(name)) DTRACE_PROBE1(chat, name, a); } while (0)
+#define PROBE2(name, a, b) do { if (PROBE_ENABLED(name)) DTRACE_PROBE2(chat, name, a, b); } while (0)
+#define PROBE3(name, a, b, c) do { if (PROBE_ENABLED(name)) DTRACE_PROBE3(chat, name, a, b, c); } while (0)
+
+// SERVER
+extern unsigned short chat_accept_semaphore;
+extern unsigned short chat_handshake__start_semaphore;
+extern unsigned short chat_handshake__done_semaphore;
+extern unsigned short chat_room__create_semaphore;
+extern unsigned short chat_room__remove_semaphore;
+extern unsigned short chat_member__add_semaphore;
+extern unsigned short chat_member__remove_semaphore;
+extern unsigned short chat_message__receive_semaphore;
+extern unsigned short chat_message__send_semaphore;
+extern unsigned short chat_frame__write_semaphore;
+extern unsigned short chat_file__upload_semaphore;
+extern unsigned short chat_file__chunk_semaphore;
+extern unsigned short chat_file__spooled_semaphore;
+extern unsigned short chat_file__offer_semaphore;
+extern unsigned short chat_file__accept_semaphore;
+extern unsigned short chat_file__deliver_semaphore;
+extern unsigned short chat_file__fail_semaphore;
+
+// CLIENT (the ones the server doesn't have too)
+extern unsigned short chat_file__chunk__send_semaphore;
+extern unsigned short chat_file__receive_semaphore;
+extern unsigned short chat_file__chunk__receive_semaphore;
+extern unsigned short chat_file__done_semaphore;
+
+#else
+
+// the arguments are compiled, so they don't become unused variables, but never evaluated
+#define PROBE1(name, a) do { if (0) { (void) (a); } } while (0)
+#define PROBE2(name, a, b) do { if (0) { (void) (a); (void) (b); } } while (0)
+#define PROBE3(name, a, b, c) do { if (0) { (void) (a); (void) (b); (void) (c); } } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "render.h"
+#include "util.h"
+
+#define FRAME_NS (1000000000L / RENDER_HZ)
+
+// output waiting for the next frame. the renderer swaps it with spare before writing,
+// so messages keep coming in while the terminal is busy
+typedef struct _Renderer {
+	char* data;
+	size_t len;
+	size_t capacity;
+	char* spare;
+	size_t spare_capacity;
+	unsigned int shown; // chat lines in this frame
+	size_t shown_bytes;
+	unsigned int collapsed; // chat lines past the limit, waiting to be counted on one line
+	struct timespec next_frame; // a frame written now would come too soon before this
+	int threaded;
+	int stopping;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_mutex_t write_mutex; // frames reach stdout whole and in order
+} Renderer;
+
+Renderer renderer = {
+	NULL, 0, 0, NULL, 0, 0, 0, 0, { 0, 0 }, 0, 0, 0,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+};
+
+static void* thread_main_render(void* args);
+
+static void append(const char* data, size_t len) {
+	if (renderer.len + len > renderer.capacity) {
+		size_t capacity = renderer.capacity > 0 ? renderer.capacity : RENDER_MAX_BYTES;
+		while (capacity < renderer.len + len) {
+			capacity *= 2;
+		}
+		renderer.data = (char*) realloc(renderer.data, capacity);
+		if (renderer.data == NULL) error("ERROR allocating render buffer");
+		renderer.capacity = capacity;
+	}
+	memcpy(renderer.data + renderer.len, data, len);
+	renderer.len += len;
+}
+
+// the chat lines that didn't fit get their line where they would have been
+static void append_collapsed() {
+	if (renderer.collapsed == 0) {
+		return;
+	}
+	char line[64];
+	int n = snprintf(line, sizeof(line), "\n... %u more message%s\n", renderer.collapsed,
+	renderer.collapsed == 1 ? "" : "s");
+	append(line, n);
+	renderer.collapsed = 0;
+}
+
+static void wake_renderer() {
+	if (renderer.threaded) {
+		pthread_cond_signal(&renderer.cond);
+	}
+}
+
+void render_start(int threaded) {
+	// whatever was printed before the session goes out ahead of the first frame
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &renderer.next_frame);
+	renderer.threaded = threaded;
+	if (threaded) {
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&renderer.cond, &attr);
+		pthread_condattr_destroy(&attr);
+		pthread_create(&renderer.thread, NULL, thread_main_render, NULL);
+	}
+}
+
+// writes what is still pending and stops the renderer thread
+void render_stop() {
+	if (renderer.threaded) {
+		pthread_mutex_lock(&renderer.mutex);
+		renderer.stopping = 1;
+		pthread_cond_signal(&renderer.cond);
+		pthread_mutex_unlock(&renderer.mutex);
+		pthread_join(renderer.thread, NULL);
+		renderer.threaded = 0;
+	}
+	render_frame();
+}
+
+// a chat line from the room
+void render_message(const char* text, size_t len) {
+	pthread_mutex_lock(&renderer.mutex);
+	if (renderer.shown >= RENDER_MAX_MESSAGES || renderer.shown_bytes + len > RENDER_MAX_BYTES) {
+		renderer.collapsed++;
+	} else {
+		append("\n", 1);
+		append(text, len);
+		append("\n", 1);
+		renderer.shown++;
+		renderer.shown_bytes += len;
+	}
+	wake_renderer();
+	pthread_mutex_unlock(&renderer.mutex);
+}
+
+// printf for everything that isn't chat (prompts, transfers, the connection), always shown
+void render_notice(const char* format, ...) {
+	char line[1024];
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (n < 0) {
+		return;
+	}
+	if ((size_t) n >= sizeof(line)) {
+		n = sizeof(line) - 1;
+	}
+
+	pthread_mutex_lock(&renderer.mutex);
+	append_collapsed();
+	append(line, n);
+	wake_renderer();
+	pthread_mutex_unlock(&renderer.mutex);
+}
+
+static long ms_until(struct timespec* when) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long ns = (when->tv_sec - now.tv_sec) * 1000000000L + (when->tv_nsec - now.tv_nsec);
+	return ns <= 0 ? 0 : (ns + 999999) / 1000000;
+}
+
+// milliseconds until the pending output may be written, -1 if there is none. for callers
+// without the renderer thread, to poll() with
+int render_due_ms() {
+	pthread_mutex_lock(&renderer.mutex);
+	int due = renderer.len == 0 && renderer.collapsed == 0 ? -1 : (int) ms_until(&renderer.next_frame);
+	pthread_mutex_unlock(&renderer.mutex);
+	return due;
+}
+
+// writes the pending output now, as one write
+void render_frame() {
+	pthread_mutex_lock(&renderer.write_mutex);
+	pthread_mutex_lock(&renderer.mutex);
+	append_collapsed();
+	char* data = renderer.data;
+	size_t capacity = renderer.capacity;
+	size_t len = renderer.len;
+	renderer.data = renderer.spare;
+	renderer.capacity = renderer.spare_capacity;
+	renderer.len = 0;
+	renderer.spare = data;
+	renderer.spare_capacity = capacity;
+	renderer.shown = 0;
+	renderer.shown_bytes = 0;
+	pthread_mutex_unlock(&renderer.mutex);
+
+	// stray printf()s (the handshake when rejoining) come before the frame
+	fflush(stdout);
+	size_t written = 0;
+	while (written < len) {
+		ssize_t n = write(STDOUT_FILENO, data + written, len - written);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			// the terminal went away, there is nobody to show it to
+			break;
+		}
+		written += n;
+	}
+
+	// the next frame waits out the interval from when this one was done
+	pthread_mutex_lock(&renderer.mutex);
+	clock_gettime(CLOCK_MONOTONIC, &renderer.next_frame);
+	renderer.next_frame.tv_nsec += FRAME_NS;
+	if (renderer.next_frame.tv_nsec >= 1000000000L) {
+		renderer.next_frame.tv_sec++;
+		renderer.next_frame.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_unlock(&renderer.mutex);
+	pthread_mutex_unlock(&renderer.write_mutex);
+}
+
+// writes a frame whenever there is output and the interval since the last one has passed
+static void* thread_main_render(void* args) {
+	(void) args;
+	pthread_mutex_lock(&renderer.mutex);
+	while (!renderer.stopping) {
+		if (renderer.len == 0 && renderer.collapsed == 0) {
+			pthread_cond_wait(&renderer.cond, &renderer.mutex);
+			continue;
+		}
+		if (ms_until(&renderer.next_frame) > 0) {
+			struct timespec next_frame = renderer.next_frame;
+			pthread_cond_timedwait(&renderer.cond, &renderer.mutex, &next_frame);
+			continue;
+		}
+		pthread_mutex_unlock(&renderer.mutex);
+		render_frame();
+		pthread_mutex_lock(&renderer.mutex);
+	}
+	pthread_mutex_unlock(&renderer.mutex);
+	return NULL;
+}
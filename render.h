@@ -0,0 +1,29 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stddef.h>
+
+/* Terminal output of a running session. Chat lines from the room and the
+ * client's own notices are collected into one buffer that goes to stdout in a
+ * single write() per frame, at most RENDER_HZ frames a second. When more chat
+ * piles up for one frame than a screen can show (the room is that busy, or the
+ * last write to a slow terminal took that long) the rest of it collapses into one
+ * "N more messages" line. Notices are never collapsed and keep their place
+ * between the chat lines.
+ */
+
+#define RENDER_HZ 60
+#define RENDER_MAX_MESSAGES 100 // chat lines one frame shows before the rest are only counted
+#define RENDER_MAX_BYTES (64 * 1024) // or chat bytes, whichever runs out first
+
+// threaded: a renderer thread writes the frames. otherwise the caller does, see render_due_ms()
+void render_start(int threaded);
+void render_stop();
+
+void render_message(const char* text, size_t len);
+void render_notice(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+int render_due_ms();
+void render_frame();
+
+#endif
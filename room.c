@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "room.h"
+#include "util.h"
+#include "logger.h"
+#include "probes.h"
+#include "metrics.h"
+
+ServerState server_state;
+
+ROOM* room_head = NULL;
+ROOM* room_tail = NULL;
+
+void init_server_state() {
+	pthread_mutex_init(&server_state.server_state_mutex, NULL);
+	pthread_mutex_init(&server_state.rooms_mutex, NULL);
+	server_state.num_rooms = 0;
+}
+
+
+ROOM* create_room()
+{
+	if (room_head == NULL) { // No rooms exist yet
+		room_head = (ROOM*) malloc(sizeof(ROOM));
+		room_head->room_number = 1;
+		room_head->num_connected_clients = 0;
+		room_head->usr_head = NULL;
+		room_head->usr_tail = NULL;
+		room_head->next = NULL;
+		room_tail = room_head;
+	} else { // At least one room exists
+		room_tail->next = (ROOM*) malloc(sizeof(ROOM));
+		room_tail->next->room_number = room_tail->room_number + 1;
+		room_tail->next->num_connected_clients = 0;
+		room_tail->next->usr_head = NULL;
+		room_tail->next->usr_tail = NULL;
+		room_tail->next->next = NULL;
+		room_tail = room_tail->next;
+	}
+
+	pthread_mutex_lock(&server_state.server_state_mutex);
+	server_state.num_rooms++;
+	pthread_mutex_unlock(&server_state.server_state_mutex);
+
+	PROBE1(room__create, room_tail->room_number);
+	return room_tail;
+}
+
+void remove_room(int room_number) {
+	ROOM* cur = room_head;
+	ROOM* prev;
+	
+	/* find room in room list, track previous */
+	while (cur != NULL) {
+		if (cur->room_number == room_number) {
+			break;
+		}
+		else {
+			prev = cur;
+			cur = cur->next;
+		}
+	}
+
+	// TODO: proper error handling
+	assert(cur != NULL);
+
+	/* remove room from room list */
+	// if room is head of list
+	if (cur == room_head) {
+		if (room_head == room_tail) {
+			room_head = NULL;
+			room_tail = NULL;
+		}
+		else {
+			room_head = cur->next;
+			cur->next = NULL;
+		}
+	}
+	// if room is tail of list
+	else if (cur == room_tail) {
+		prev->next = NULL;
+		room_tail = prev;
+	}
+	// if room is neither head or tail of list
+	else {
+		prev->next = cur->next;
+		cur->next = NULL;
+	}
+
+	PROBE1(room__remove, room_number);
+	free(cur);
+
+	pthread_mutex_lock(&server_state.server_state_mutex);
+	server_state.num_rooms--;
+	pthread_mutex_unlock(&server_state.server_state_mutex);
+}
+
+ROOM* find_room(int room_number) {
+
+	ROOM* cur_room = room_head;
+	
+	while(cur_room != NULL) {
+		// if room found, return cur_room
+		if (cur_room->room_number == room_number) {
+			return cur_room;
+		}
+		else {
+			cur_room = cur_room->next;
+		}
+	}
+	// if cur_room not found, return NULL;
+	return NULL;
+}
+
+USR* add_client(ROOM* room, int newclisockfd, char* username)
+{
+	/* add client to room */
+	// if room is empty, add client to head of user list
+	if (room->usr_head == NULL) {
+		room->usr_head = (USR*) malloc(sizeof(USR));
+		memset(room->usr_head, 0, sizeof(USR));
+		room->usr_head->clisockfd = newclisockfd;
+		strncpy(room->usr_head->username, username, MAX_USERNAME_LEN);
+		room->usr_head->next = NULL;
+		room->usr_tail = room->usr_head;
+	} 
+	// if room is not empty, add client to tail of list
+	else {
+		room->usr_tail->next = (USR*) malloc(sizeof(USR));
+		memset(room->usr_tail->next, 0, sizeof(USR));
+		room->usr_tail->next->clisockfd = newclisockfd;
+		strncpy(room->usr_tail->next->username, username, MAX_USERNAME_LEN);
+		room->usr_tail->next->next = NULL;
+		room->usr_tail = room->usr_tail->next;
+	}
+	room->num_connected_clients++;
+	PROBE3(member__add, room->room_number, newclisockfd, room->usr_tail->username);
+
+	// every slot gets a token so its owner can reclaim it after a drop
+	if (fill_random_bytes(room->usr_tail->resumption_token, RESUMPTION_TOKEN_LEN) < 0) {
+		error("ERROR generating resumption token");
+	}
+
+	return room->usr_tail;
+}
+
+void remove_client(ROOM* room, int sockfd) {
+	remove_client_node(room, find_client(room, sockfd));
+}
+
+// removes a specific client node (detached clients all share clisockfd -1, so they can't be found by socket)
+void remove_client_node(ROOM* room, USR* client) {
+	
+	USR *cur = room->usr_head;
+	USR *prev;
+	
+	/* find client in client list, track previous */
+	while (cur != NULL) {
+		if (cur == client) {
+			break;
+		}
+		else {
+			prev = cur;
+			cur = cur->next;
+		}
+	}
+
+	// TODO: proper error handling
+	assert(cur != NULL);
+
+	/* remove client from client list */
+	// if client is head of list
+	if (cur == room->usr_head) {
+		if (room->usr_head == room->usr_tail) {
+			room->usr_head = NULL;
+			room->usr_tail = NULL;
+		}
+		else {
+			room->usr_head = cur->next;
+			cur->next = NULL;
+		}
+	}
+	// if client is tail of list
+	else if (cur == room->usr_tail) {
+		prev->next = NULL;
+		room->usr_tail = prev;
+	}
+	// if client is neither head or tail of list
+	else {
+		prev->next = cur->next;
+		cur->next = NULL;
+	}
+
+	PROBE3(member__remove, room->room_number, cur->clisockfd, cur->username);
+	// whatever is already queued still goes out, the session thread closes the connection
+	if (cur->conn != NULL) {
+		conn_release(cur->conn);
+	}
+
+	free(cur);
+	room->num_connected_clients--;
+}
+
+USR* find_client(ROOM* room, int sockfd) {
+	
+	USR* cur_client = room->usr_head;
+	
+	while (cur_client != NULL) {
+		// if client found, return cur_client
+		if (cur_client->clisockfd == sockfd) {
+			return cur_client;
+		}
+		cur_client = cur_client->next;
+	}
+	// if client not found, return NULL
+	return NULL;
+}
+
+// finds the client holding a resumption token across all rooms, returns its room and sets *client
+ROOM* find_client_by_token(uint8_t* token, USR** client) {
+	ROOM* cur_room = room_head;
+
+	while (cur_room != NULL) {
+		USR* cur_client = cur_room->usr_head;
+		while (cur_client != NULL) {
+			if (memcmp(cur_client->resumption_token, token, RESUMPTION_TOKEN_LEN) == 0) {
+				*client = cur_client;
+				return cur_room;
+			}
+			cur_client = cur_client->next;
+		}
+		cur_room = cur_room->next;
+	}
+	*client = NULL;
+	return NULL;
+}
+
+static RoomStats* published_stats; // holds a reference of its own
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER; // only for swapping and taking it
+
+void publish_room_stats() {
+	int num_members = 0;
+	for (ROOM* room = room_head; room != NULL; room = room->next) {
+		num_members += room->num_connected_clients;
+	}
+	RoomStats* stats = (RoomStats*) malloc(sizeof(RoomStats) + server_state.num_rooms * sizeof(struct _RoomCount));
+	MemberStats* members = (MemberStats*) calloc(num_members > 0 ? num_members : 1, sizeof(MemberStats));
+	if (stats == NULL || members == NULL) error("ERROR allocating room stats");
+	stats->refs = 1;
+	stats->taken_at = metrics_now();
+	stats->num_rooms = 0;
+	stats->detached = 0;
+	stats->num_members = 0;
+	stats->members = members;
+	for (ROOM* room = room_head; room != NULL && stats->num_rooms < server_state.num_rooms; room = room->next) {
+		struct _RoomCount* count = &stats->rooms[stats->num_rooms++];
+		count->room_number = room->room_number;
+		count->members = 0;
+		count->first_member = stats->num_members;
+		for (USR* cur = room->usr_head; cur != NULL && stats->num_members < num_members; cur = cur->next) {
+			MemberStats* member = &members[stats->num_members++];
+			count->members++;
+			memcpy(member->username, cur->username, MAX_USERNAME_LEN);
+			memcpy(member->ip, cur->ip, INET_ADDRSTRLEN);
+			member->fd = cur->clisockfd;
+			if (cur->clisockfd < 0) {
+				stats->detached++;
+			}
+			if (cur->conn != NULL) {
+				ConnQueueStats queue;
+				conn_queue_stats(cur->conn, &queue);
+				member->queued_frames = queue.frames;
+				member->queued_bytes = queue.bytes;
+				if (queue.backlogged_since != 0 && queue.backlogged_since < stats->taken_at) {
+					member->behind_ns = stats->taken_at - queue.backlogged_since;
+				}
+			}
+			member->messages = cur->messages;
+			member->message_bytes = cur->message_bytes;
+			member->recent_messages = (uint32_t) (cur->messages - cur->published_messages);
+			cur->published_messages = cur->messages;
+		}
+	}
+
+	pthread_mutex_lock(&stats_mutex);
+	RoomStats* old = published_stats;
+	published_stats = stats;
+	pthread_mutex_unlock(&stats_mutex);
+	room_stats_release(old);
+}
+
+RoomStats* room_stats_acquire() {
+	pthread_mutex_lock(&stats_mutex);
+	RoomStats* stats = published_stats;
+	if (stats != NULL) {
+		__atomic_add_fetch(&stats->refs, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&stats_mutex);
+	return stats;
+}
+
+void room_stats_release(RoomStats* stats) {
+	if (stats != NULL && __atomic_sub_fetch(&stats->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(stats->members);
+		free(stats);
+	}
+}
+
+// a line for the room, and one per member at debug level only: a big room's join or leave
+// shouldn't cost a log line per member
+void print_client_list(ROOM* room) {
+	LOG_INFO("Room %d: %d members", room->room_number, room->num_connected_clients);
+	if (log_level > LOG_LEVEL_DEBUG) {
+		return;
+	}
+
+	for (USR* cur = room->usr_head; cur != NULL; cur = cur->next) {
+		// the address cached at connect, the socket isn't asked
+		LOG_DEBUG("  %s (%s)%s", cur->username, cur->ip, cur->clisockfd < 0 ? " [detached]" : "");
+	}
+}
+
+void print_room_list() {
+	ROOM* cur_room = room_head;
+	while (cur_room != NULL) {
+		printf("Room %d:\n", cur_room->room_number);
+		cur_room = cur_room->next;
+	}
+}
+
+
+
+// TODO: potential refactor
+// CREATE ROOM
+// MAX_CLIENTS 
+// colors = [0, 0, 0, 0, 0]
+// colors = [91, 92, 93, 94, 95]
+// colors = [93, 91, 92, 94, 95]
+// client->color = colors[client->client_id]
+// client_id increments and decrements on join and leave
+// picks the color the fewest other members of the room have, at random among those. it used to
+// retry random colors until a free one came up, which spun with rooms_mutex held (rand() was
+// reseeded with the same second every try) and never ended once all the colors were taken
+int get_color_code(ROOM* room, USR* client) {
+	int used[NUM_COLOR_CODES] = { 0 };
+	for (USR* cur = room->usr_head; cur != NULL; cur = cur->next) {
+		int index = cur->color_code - FIRST_COLOR_CODE;
+		if (cur != client && index >= 0 && index < NUM_COLOR_CODES) {
+			used[index]++;
+		}
+	}
+
+	int least = used[0];
+	for (int i = 1; i < NUM_COLOR_CODES; i++) {
+		if (used[i] < least) {
+			least = used[i];
+		}
+	}
+	int candidates = 0;
+	for (int i = 0; i < NUM_COLOR_CODES; i++) {
+		candidates += used[i] == least;
+	}
+	int pick = rand() % candidates;
+	int random_color_code = FIRST_COLOR_CODE;
+	for (int i = 0; i < NUM_COLOR_CODES; i++) {
+		if (used[i] == least && pick-- == 0) {
+			random_color_code = FIRST_COLOR_CODE + i;
+			break;
+		}
+	}
+	
+	client->color_code = random_color_code;
+
+	return random_color_code;
+}
+
+
+// lists the first MAX_ROOMS rooms, that is all a confirmation has space for
+int cc_set_available_rooms(ConnectionConfirmation* cc) {
+	ROOM* cur_room = room_head;
+	int i = 0;
+	while (cur_room != NULL && i < MAX_ROOMS) {
+		cc->available_rooms.rooms[i].room_number = cur_room->room_number;
+		cc->available_rooms.rooms[i].num_connected_clients = cur_room->num_connected_clients;
+		i++;
+		cur_room = cur_room->next;
+	}
+	cc->available_rooms.num_rooms = i;
+	return 0;
+}
+
+
+void mock_server_state() {
+	server_state.num_rooms = 3;
+	ROOM* room_1 = create_room();
+	ROOM* room_2 = create_room();
+	ROOM* room_3 = create_room();
+
+	add_client(room_1, 1, "user_1");
+	add_client(room_1, 2, "user_2");
+	add_client(room_1, 3, "user_3");
+
+	add_client(room_2, 4, "user_4");
+	add_client(room_2, 5, "user_5");
+	add_client(room_2, 6, "user_6");
+
+	add_client(room_3, 7, "user_7");
+	add_client(room_3, 8, "user_8");
+	add_client(room_3, 9, "user_9");
+}
+
+void print_rooms_with_clients() {
+	ROOM* cur_room = room_head;
+	while (cur_room != NULL) {
+		printf("Room %d: %d clients\n", cur_room->room_number, cur_room->num_connected_clients);
+		USR* cur_client = cur_room->usr_head;
+		while (cur_client != NULL) {
+			printf("  %s\n", cur_client->username);
+			cur_client = cur_client->next;
+		}
+		cur_room = cur_room->next;
+	}
+}
+
+USR* find_client_by_username(ROOM* room, char* username) {
+	USR* cur = room->usr_head;
+
+	while (cur != NULL) {
+		if (strncmp(cur->username, username, MAX_USERNAME_LEN) == 0) {
+			break;
+		}
+		cur = cur->next;
+	}
+	// if client does not exist, NULL is returned
+	return cur;
+}
+
+// snprintf's count is what it wanted to write, the caller wants what it did
+static int written(int n, size_t size) {
+	if (n < 0) {
+		return 0;
+	}
+	return (size_t) n < size ? n : (int) size - 1;
+}
+
+int format_chat_line(char* buffer, size_t size, int color_code, const char* username, const char* ip,
+const char* message) {
+	return written(snprintf(buffer, size, "\033[%dm[%s (%s)]:%s\033[0m", color_code, username, ip, message), size);
+}
+
+int format_status_line(char* buffer, size_t size, const char* username, const char* ip, int joined, int room_number) {
+	return written(snprintf(buffer, size, "%s (%s) has %s chat room %d!\n", username, ip,
+	joined ? "joined" : "left", room_number), size);
+}
@@ -0,0 +1,122 @@
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "handshake.h"
+#include "connection.h"
+
+/* The server's rooms and their members. Rooms are kept in a list in the order they
+ * were created, the members of each in the order they joined. Everything here is
+ * guarded by server_state.rooms_mutex, which the callers hold.
+ */
+
+#define FIRST_COLOR_CODE 91 // members are told apart by the bright ANSI colors 91..96
+#define NUM_COLOR_CODES 6
+#define CHAT_LINE_LEN 512 // a chat line or announcement as the members get it
+
+typedef struct _ServerState {
+	int num_rooms;
+	pthread_mutex_t server_state_mutex;
+	pthread_mutex_t rooms_mutex; // guards the room list and every room's client list
+} ServerState;
+
+// NOTE: clisockfd and conn only change while holding rooms_mutex. the slot holds its own
+// reference on conn, so anything that took one under the lock can keep queueing after
+typedef struct _USR {
+	int clisockfd;						// socket file descriptor (-1 while detached)
+	CONNECTION* conn;					// outbound queues and writer thread (NULL while detached)
+	char username[MAX_USERNAME_LEN];	// client username
+	char ip[INET_ADDRSTRLEN];			// client address, cached when the connection is attached
+	int color_code;						// user color
+	uint8_t resumption_token[RESUMPTION_TOKEN_LEN]; // lets a dropped client reclaim this slot
+	time_t detached_until;				// end of the resume grace window while detached
+	uint64_t messages;					// chat lines it sent
+	uint64_t message_bytes;
+	uint64_t published_messages;		// messages as of the last publish_room_stats()
+	struct _USR* next;					// for linked list queue
+} USR;
+
+typedef struct _ROOM {
+	int room_number;
+	int num_connected_clients;
+	USR* usr_head;
+	USR* usr_tail;
+	struct _ROOM* next;
+} ROOM;
+
+extern ServerState server_state;
+extern ROOM* room_head;
+extern ROOM* room_tail;
+
+void init_server_state();
+
+// ROOMS
+
+ROOM* create_room();
+void remove_room(int room_number);
+ROOM* find_room(int room_number);
+int cc_set_available_rooms(ConnectionConfirmation* cc);
+
+// MEMBERS
+
+USR* add_client(ROOM* room, int newclisockfd, char* username);
+void remove_client(ROOM* room, int sockfd);
+void remove_client_node(ROOM* room, USR* client);
+USR* find_client(ROOM* room, int sockfd);
+USR* find_client_by_username(ROOM* room, char* username);
+ROOM* find_client_by_token(uint8_t* token, USR** client);
+int get_color_code(ROOM* room, USR* client);
+
+// what members see of each other, the lengths written (without the \0) are returned
+int format_chat_line(char* buffer, size_t size, int color_code, const char* username, const char* ip,
+const char* message);
+int format_status_line(char* buffer, size_t size, const char* username, const char* ip, int joined, int room_number);
+
+// STATS
+
+typedef struct _MemberStats {
+	char username[MAX_USERNAME_LEN];
+	char ip[INET_ADDRSTRLEN];
+	int fd; // -1 while detached
+	size_t queued_frames; // frames waiting for its writer, see conn_queue_stats()
+	size_t queued_bytes;
+	uint64_t behind_ns; // how long its queues have not been empty, 0 if they are
+	uint64_t messages; // chat lines it sent
+	uint64_t message_bytes;
+	uint32_t recent_messages; // of them since the copy before
+} MemberStats;
+
+// what the metrics endpoint and the admin socket see of the rooms, a copy they read without rooms_mutex
+typedef struct _RoomStats {
+	int refs;
+	uint64_t taken_at; // metrics_now()
+	int num_rooms;
+	int detached; // members whose slot is held for a resume
+	int num_members;
+	MemberStats* members; // every room's, in room order
+	struct _RoomCount {
+		int32_t room_number;
+		int32_t members;
+		int32_t first_member; // its members are members[first_member .. first_member + members - 1]
+	} rooms[];
+} RoomStats;
+
+// copies the rooms, every REAPER_INTERVAL by the reaper thread. rooms_mutex held
+void publish_room_stats();
+// the newest copy, NULL before the first. it stays valid until the caller releases it
+RoomStats* room_stats_acquire();
+void room_stats_release(RoomStats* stats);
+
+// LOGGING
+
+void print_client_list(ROOM* room);
+void print_room_list();
+void print_rooms_with_clients();
+void mock_server_state();
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* SHA-256 (FIPS 180-4), used to name file chunks by their content. Chunks are
+ * shared between users' uploads, so the name has to be one nobody can forge.
+ */
+
+#define SHA256_DIGEST_LEN 32
+
+typedef struct _Sha256 {
+	uint32_t state[8];
+	uint64_t length; // bytes hashed so far
+	unsigned char block[64];
+	size_t used; // bytes waiting in block
+} Sha256;
+
+void sha256_init(Sha256* ctx);
+void sha256_update(Sha256* ctx, const void* data, size_t len);
+void sha256_final(Sha256* ctx, unsigned char digest[SHA256_DIGEST_LEN]);
+void sha256(const void* data, size_t len, unsigned char digest[SHA256_DIGEST_LEN]);
+
+#endif
@@ -0,0 +1,608 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+
+#include "sim_transport.h"
+#include "util.h"
+
+// bytes sent one way, readable once the clock reaches ready_at
+typedef struct _SimSegment {
+	struct _SimSegment* next;
+	uint64_t ready_at;
+	size_t len;
+	size_t read;
+	unsigned char data[];
+} SimSegment;
+
+typedef struct _SimPipe {
+	SimSegment* head;
+	SimSegment* tail;
+	size_t bytes; // unread
+	int eof; // the writing side is done, reads return 0 once the bytes are gone
+} SimPipe;
+
+typedef struct _SimSocket {
+	int id;
+	struct sockaddr_in peer; // the client's made-up address
+	SimPipe in; // delivered to the server
+	SimPipe out; // sent to the client
+	int accepted;
+	int parked; // the server's reader is blocked in recv() with nothing to read
+	int shut; // the server shut it down
+	int closed; // the server closed its descriptor
+	int client_closed;
+	int listed; // on the readable list
+	uint64_t rng_in; // the server's reads and writes come from different threads, each has its own
+	uint64_t rng_out;
+	pthread_cond_t cond;
+	struct _SimSocket* next_accept;
+	struct _SimSocket* next_readable;
+} SimSocket;
+
+typedef enum _SimEventType {
+	SIM_CONNECT,
+	SIM_DATA,
+	SIM_FIN
+} SimEventType;
+
+// a client's connect, bytes or close on the way to the server
+typedef struct _SimEvent {
+	SimEventType type;
+	SimSocket* socket;
+	uint64_t ready_at;
+	SimSegment* segment; // SIM_DATA
+	struct _SimEvent* next;
+} SimEvent;
+
+// the server sent something or hung up, the client finds out at ready_at
+typedef struct _SimArrival {
+	SimSocket* socket;
+	uint64_t ready_at;
+	struct _SimArrival* next;
+} SimArrival;
+
+typedef struct _SimState {
+	SimConfig config;
+	pthread_mutex_t mutex;
+	pthread_cond_t idle; // the server may have settled
+	pthread_cond_t accept_cond;
+	uint64_t now;
+	SimSocket** sockets;
+	int num_sockets;
+	int cap_sockets;
+	SimSocket* accept_head;
+	SimSocket* accept_tail;
+	int accept_parked;
+	int busy; // accepted sockets whose reader isn't parked, and that aren't closed
+	// the latency is the same for everyone, so both of these are in ready_at order
+	SimEvent* transit_head;
+	SimEvent* transit_tail;
+	SimArrival* arrivals_head;
+	SimArrival* arrivals_tail;
+	SimSocket* readable_head;
+	SimSocket* readable_tail;
+} SimState;
+
+static SimState sim;
+
+/*========================================= HELPERS ==========================================*/
+
+static uint64_t splitmix64(uint64_t* state) {
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+// how much of len an operation moves: all of it, or with probability config.partial a random part
+static size_t partial_len(uint64_t* rng, size_t len) {
+	if (len <= 1 || sim.config.partial <= 0) {
+		return len;
+	}
+	uint64_t roll = splitmix64(rng);
+	if ((roll >> 11) * (1.0 / 9007199254740992.0) >= sim.config.partial) {
+		return len;
+	}
+	return 1 + splitmix64(rng) % (len - 1);
+}
+
+static SimSegment* create_segment(const void* data, size_t len) {
+	SimSegment* segment = (SimSegment*) malloc(sizeof(SimSegment) + len);
+	if (segment == NULL) error("ERROR allocating simulated segment");
+	segment->next = NULL;
+	segment->ready_at = 0;
+	segment->len = len;
+	segment->read = 0;
+	if (len > 0) {
+		memcpy(segment->data, data, len);
+	}
+	return segment;
+}
+
+static void pipe_append(SimPipe* pipe, SimSegment* segment) {
+	if (pipe->tail == NULL) {
+		pipe->head = segment;
+	} else {
+		pipe->tail->next = segment;
+	}
+	pipe->tail = segment;
+	pipe->bytes += segment->len;
+}
+
+// reads up to len bytes that are ready by now
+static size_t pipe_read(SimPipe* pipe, void* buf, size_t len, uint64_t now) {
+	size_t n = 0;
+	while (n < len && pipe->head != NULL && pipe->head->ready_at <= now) {
+		SimSegment* segment = pipe->head;
+		size_t take = segment->len - segment->read;
+		if (take > len - n) {
+			take = len - n;
+		}
+		memcpy((unsigned char*) buf + n, segment->data + segment->read, take);
+		segment->read += take;
+		n += take;
+		if (segment->read == segment->len) {
+			pipe->head = segment->next;
+			if (pipe->head == NULL) {
+				pipe->tail = NULL;
+			}
+			free(segment);
+		}
+	}
+	pipe->bytes -= n;
+	return n;
+}
+
+static void pipe_clear(SimPipe* pipe) {
+	while (pipe->head != NULL) {
+		SimSegment* next = pipe->head->next;
+		free(pipe->head);
+		pipe->head = next;
+	}
+	pipe->tail = NULL;
+	pipe->bytes = 0;
+}
+
+// the server's descriptor for a socket, NULL with errno set if it isn't one. called with sim.mutex held
+static SimSocket* lookup(int fd) {
+	int id = fd - SIM_FD_BASE - 1;
+	if (id < 0 || id >= sim.num_sockets || !sim.sockets[id]->accepted || sim.sockets[id]->closed) {
+		errno = EBADF;
+		return NULL;
+	}
+	return sim.sockets[id];
+}
+
+static SimSocket* client_socket(int client) {
+	if (client < 0 || client >= sim.num_sockets) {
+		return NULL;
+	}
+	return sim.sockets[client];
+}
+
+// wakes a parked reader and counts it busy again. called with sim.mutex held
+static void unpark(SimSocket* socket) {
+	if (socket->parked) {
+		socket->parked = 0;
+		sim.busy++;
+	}
+	pthread_cond_signal(&socket->cond);
+}
+
+static void push_event(SimEventType type, SimSocket* socket, SimSegment* segment) {
+	SimEvent* event = (SimEvent*) malloc(sizeof(SimEvent));
+	if (event == NULL) error("ERROR allocating simulated event");
+	event->type = type;
+	event->socket = socket;
+	event->ready_at = sim.now + sim.config.latency_ns;
+	event->segment = segment;
+	event->next = NULL;
+	if (sim.transit_tail == NULL) {
+		sim.transit_head = event;
+	} else {
+		sim.transit_tail->next = event;
+	}
+	sim.transit_tail = event;
+}
+
+static void push_arrival(SimSocket* socket, uint64_t ready_at) {
+	SimArrival* arrival = (SimArrival*) malloc(sizeof(SimArrival));
+	if (arrival == NULL) error("ERROR allocating simulated arrival");
+	arrival->socket = socket;
+	arrival->ready_at = ready_at;
+	arrival->next = NULL;
+	if (sim.arrivals_tail == NULL) {
+		sim.arrivals_head = arrival;
+	} else {
+		sim.arrivals_tail->next = arrival;
+	}
+	sim.arrivals_tail = arrival;
+}
+
+/*========================================= SERVER SIDE ==========================================*/
+
+static int sim_accept(int listenfd, struct sockaddr* addr, socklen_t* addrlen) {
+	if (listenfd != SIM_FD_BASE) {
+		errno = EBADF;
+		return -1;
+	}
+
+	pthread_mutex_lock(&sim.mutex);
+	while (sim.accept_head == NULL) {
+		sim.accept_parked = 1;
+		pthread_cond_signal(&sim.idle);
+		pthread_cond_wait(&sim.accept_cond, &sim.mutex);
+	}
+	SimSocket* socket = sim.accept_head;
+	sim.accept_head = socket->next_accept;
+	if (sim.accept_head == NULL) {
+		sim.accept_tail = NULL;
+	}
+	socket->accepted = 1;
+	sim.busy++; // until its session thread is blocked reading
+
+	if (addr != NULL && addrlen != NULL) {
+		socklen_t len = *addrlen < sizeof(socket->peer) ? *addrlen : sizeof(socket->peer);
+		memcpy(addr, &socket->peer, len);
+		*addrlen = sizeof(socket->peer);
+	}
+	pthread_mutex_unlock(&sim.mutex);
+
+	return SIM_FD_BASE + 1 + socket->id;
+}
+
+static ssize_t sim_server_recv(int fd, void* buf, size_t len, int flags) {
+	pthread_mutex_lock(&sim.mutex);
+	SimSocket* socket = lookup(fd);
+	if (socket == NULL) {
+		pthread_mutex_unlock(&sim.mutex);
+		return -1;
+	}
+
+	// everything in the pipe has been delivered, so only the amount matters
+	size_t want = (flags & MSG_WAITALL) ? len : 1;
+	while (!socket->shut && !socket->in.eof && socket->in.bytes < want) {
+		if (!socket->parked) {
+			socket->parked = 1;
+			if (--sim.busy == 0) {
+				pthread_cond_signal(&sim.idle);
+			}
+		}
+		pthread_cond_wait(&socket->cond, &sim.mutex);
+	}
+	size_t n = 0;
+	if (!socket->shut) {
+		n = pipe_read(&socket->in, buf, (flags & MSG_WAITALL) ? len : partial_len(&socket->rng_in, len), UINT64_MAX);
+	}
+	pthread_mutex_unlock(&sim.mutex);
+
+	return n;
+}
+
+static ssize_t sim_server_send(int fd, const void* buf, size_t len, int flags) {
+	(void) flags;
+
+	pthread_mutex_lock(&sim.mutex);
+	SimSocket* socket = lookup(fd);
+	if (socket == NULL) {
+		pthread_mutex_unlock(&sim.mutex);
+		return -1;
+	}
+	if (socket->shut) {
+		pthread_mutex_unlock(&sim.mutex);
+		errno = EPIPE;
+		return -1;
+	}
+
+	size_t n = partial_len(&socket->rng_out, len);
+	// a client that closed never reads it, but the server can't know that yet
+	if (!socket->client_closed) {
+		SimSegment* segment = create_segment(buf, n);
+		segment->ready_at = sim.now + sim.config.latency_ns;
+		pipe_append(&socket->out, segment);
+		push_arrival(socket, segment->ready_at);
+	}
+	pthread_mutex_unlock(&sim.mutex);
+
+	return n;
+}
+
+static ssize_t sim_server_sendfile(int fd, int filefd, off_t* offset, size_t count) {
+	unsigned char buffer[SIM_SENDFILE_MAX];
+	if (count > sizeof(buffer)) {
+		count = sizeof(buffer);
+	}
+	ssize_t nread = pread(filefd, buffer, count, *offset);
+	if (nread <= 0) {
+		return nread;
+	}
+	ssize_t n = sim_server_send(fd, buffer, nread, 0);
+	if (n > 0) {
+		*offset += n;
+	}
+	return n;
+}
+
+static int sim_getpeername(int fd, struct sockaddr* addr, socklen_t* addrlen) {
+	pthread_mutex_lock(&sim.mutex);
+	SimSocket* socket = lookup(fd);
+	if (socket == NULL) {
+		pthread_mutex_unlock(&sim.mutex);
+		return -1;
+	}
+	socklen_t len = *addrlen < sizeof(socket->peer) ? *addrlen : sizeof(socket->peer);
+	memcpy(addr, &socket->peer, len);
+	*addrlen = sizeof(socket->peer);
+	pthread_mutex_unlock(&sim.mutex);
+
+	return 0;
+}
+
+// either direction shuts both, the server only ever uses SHUT_RDWR
+static int sim_shutdown(int fd, int how) {
+	(void) how;
+
+	pthread_mutex_lock(&sim.mutex);
+	SimSocket* socket = lookup(fd);
+	if (socket == NULL) {
+		pthread_mutex_unlock(&sim.mutex);
+		return -1;
+	}
+	if (!socket->shut) {
+		socket->shut = 1;
+		push_arrival(socket, sim.now + sim.config.latency_ns);
+	}
+	unpark(socket);
+	pthread_mutex_unlock(&sim.mutex);
+
+	return 0;
+}
+
+static int sim_server_close(int fd) {
+	pthread_mutex_lock(&sim.mutex);
+	SimSocket* socket = lookup(fd);
+	if (socket == NULL) {
+		pthread_mutex_unlock(&sim.mutex);
+		return -1;
+	}
+	if (socket->parked) {
+		socket->parked = 0;
+	} else if (--sim.busy == 0) {
+		pthread_cond_signal(&sim.idle);
+	}
+	socket->closed = 1;
+	pipe_clear(&socket->in);
+	push_arrival(socket, sim.now + sim.config.latency_ns);
+	pthread_mutex_unlock(&sim.mutex);
+
+	return 0;
+}
+
+const Transport sim_transport = {
+	.accept = sim_accept,
+	.recv = sim_server_recv,
+	.send = sim_server_send,
+	.sendfile = sim_server_sendfile,
+	.getpeername = sim_getpeername,
+	.shutdown = sim_shutdown,
+	.close = sim_server_close,
+};
+
+void sim_init(const SimConfig* config) {
+	memset(&sim, 0, sizeof(sim));
+	sim.config = *config;
+	pthread_mutex_init(&sim.mutex, NULL);
+	pthread_cond_init(&sim.accept_cond, NULL);
+	// the settle wait gives up on the monotonic clock
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sim.idle, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+int sim_listen() {
+	return SIM_FD_BASE;
+}
+
+/*========================================= CLIENT SIDE ==========================================*/
+
+int sim_connect() {
+	SimSocket* socket = (SimSocket*) malloc(sizeof(SimSocket));
+	if (socket == NULL) error("ERROR allocating simulated socket");
+	memset(socket, 0, sizeof(SimSocket));
+	pthread_cond_init(&socket->cond, NULL);
+
+	pthread_mutex_lock(&sim.mutex);
+	if (sim.num_sockets == sim.cap_sockets) {
+		sim.cap_sockets = sim.cap_sockets > 0 ? sim.cap_sockets * 2 : 1024;
+		sim.sockets = (SimSocket**) realloc(sim.sockets, sim.cap_sockets * sizeof(SimSocket*));
+		if (sim.sockets == NULL) error("ERROR allocating simulated sockets");
+	}
+	socket->id = sim.num_sockets;
+	sim.sockets[sim.num_sockets++] = socket;
+
+	// 10.0.0.0/8, one address per client
+	socket->peer.sin_family = AF_INET;
+	socket->peer.sin_addr.s_addr = htonl((10u << 24) | (uint32_t) (socket->id + 1));
+	socket->peer.sin_port = htons(40000 + socket->id % 20000);
+
+	uint64_t seed = sim.config.seed ^ ((uint64_t) socket->id << 32);
+	socket->rng_in = splitmix64(&seed);
+	socket->rng_out = splitmix64(&seed);
+
+	push_event(SIM_CONNECT, socket, NULL);
+	pthread_mutex_unlock(&sim.mutex);
+
+	return socket->id;
+}
+
+void sim_send(int client, const void* data, size_t len) {
+	pthread_mutex_lock(&sim.mutex);
+	SimSocket* socket = client_socket(client);
+	if (socket != NULL && !socket->client_closed && len > 0) {
+		push_event(SIM_DATA, socket, create_segment(data, len));
+	}
+	pthread_mutex_unlock(&sim.mutex);
+}
+
+ssize_t sim_recv(int client, void* buf, size_t len) {
+	pthread_mutex_lock(&sim.mutex);
+	SimSocket* socket = client_socket(client);
+	if (socket == NULL) {
+		pthread_mutex_unlock(&sim.mutex);
+		errno = EBADF;
+		return -1;
+	}
+	ssize_t n = pipe_read(&socket->out, buf, len, sim.now);
+	if (n == 0 && (socket->out.head != NULL || !(socket->closed || socket->shut))) {
+		errno = EAGAIN;
+		n = -1;
+	}
+	pthread_mutex_unlock(&sim.mutex);
+
+	return n;
+}
+
+void sim_close(int client) {
+	pthread_mutex_lock(&sim.mutex);
+	SimSocket* socket = client_socket(client);
+	if (socket != NULL && !socket->client_closed) {
+		socket->client_closed = 1;
+		pipe_clear(&socket->out);
+		push_event(SIM_FIN, socket, NULL);
+	}
+	pthread_mutex_unlock(&sim.mutex);
+}
+
+int sim_next_readable() {
+	pthread_mutex_lock(&sim.mutex);
+	SimSocket* socket = sim.readable_head;
+	if (socket != NULL) {
+		sim.readable_head = socket->next_readable;
+		if (sim.readable_head == NULL) {
+			sim.readable_tail = NULL;
+		}
+		socket->listed = 0;
+	}
+	pthread_mutex_unlock(&sim.mutex);
+
+	return socket != NULL ? socket->id : -1;
+}
+
+/*========================================= VIRTUAL TIME ==========================================*/
+
+uint64_t sim_now() {
+	pthread_mutex_lock(&sim.mutex);
+	uint64_t now = sim.now;
+	pthread_mutex_unlock(&sim.mutex);
+	return now;
+}
+
+static int expired(const struct timespec* deadline) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+// waits for the server to settle. called with sim.mutex held
+static void settle() {
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += SIM_SETTLE_TIMEOUT_MS / 1000;
+
+	while (1) {
+		if (!sim.accept_parked || sim.busy > 0) {
+			// the last thread to block signals
+			pthread_cond_timedwait(&sim.idle, &sim.mutex, &deadline);
+		} else if (sim.config.backlog != NULL && sim.config.backlog() > 0) {
+			// the writers don't go through us when they run dry, so they are polled, and given the CPU meanwhile
+			pthread_mutex_unlock(&sim.mutex);
+			sched_yield();
+			pthread_mutex_lock(&sim.mutex);
+		} else {
+			return;
+		}
+		if (expired(&deadline)) {
+			fprintf(stderr, "simulated server still busy after %d ms (%d sockets)\n", SIM_SETTLE_TIMEOUT_MS, sim.busy);
+			exit(1);
+		}
+	}
+}
+
+// hands one client event to the server. called with sim.mutex held
+static void deliver(SimEvent* event) {
+	SimSocket* socket = event->socket;
+	switch (event->type) {
+		case SIM_CONNECT:
+			if (sim.accept_tail == NULL) {
+				sim.accept_head = socket;
+			} else {
+				sim.accept_tail->next_accept = socket;
+			}
+			sim.accept_tail = socket;
+			sim.accept_parked = 0;
+			pthread_cond_signal(&sim.accept_cond);
+			break;
+		case SIM_DATA:
+			if (socket->closed || socket->shut) {
+				free(event->segment);
+				break;
+			}
+			pipe_append(&socket->in, event->segment);
+			unpark(socket);
+			break;
+		case SIM_FIN:
+			socket->in.eof = 1;
+			if (socket->accepted && !socket->closed) {
+				unpark(socket);
+			}
+			break;
+	}
+}
+
+// moves the clock to now and lets the server handle everything that reached it by then, one event at a time
+void sim_run(uint64_t now) {
+	pthread_mutex_lock(&sim.mutex);
+	if (now > sim.now) {
+		sim.now = now;
+	}
+	settle();
+	while (sim.transit_head != NULL && sim.transit_head->ready_at <= sim.now) {
+		SimEvent* event = sim.transit_head;
+		sim.transit_head = event->next;
+		if (sim.transit_head == NULL) {
+			sim.transit_tail = NULL;
+		}
+		deliver(event);
+		free(event);
+		settle();
+	}
+
+	while (sim.arrivals_head != NULL && sim.arrivals_head->ready_at <= sim.now) {
+		SimArrival* arrival = sim.arrivals_head;
+		sim.arrivals_head = arrival->next;
+		if (sim.arrivals_head == NULL) {
+			sim.arrivals_tail = NULL;
+		}
+		SimSocket* socket = arrival->socket;
+		if (!socket->listed && !socket->client_closed) {
+			socket->listed = 1;
+			socket->next_readable = NULL;
+			if (sim.readable_tail == NULL) {
+				sim.readable_head = socket;
+			} else {
+				sim.readable_tail->next_readable = socket;
+			}
+			sim.readable_tail = socket;
+		}
+		free(arrival);
+	}
+	pthread_mutex_unlock(&sim.mutex);
+}
@@ -0,0 +1,55 @@
+#ifndef SIM_TRANSPORT_H
+#define SIM_TRANSPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "transport.h"
+
+/* A transport with no kernel under it: connections are pairs of in-memory byte
+ * queues between the server's threads and virtual clients, which are all driven
+ * from one thread through the sim_* calls below.
+ *
+ * Time is virtual, sim_now() only moves when the driver calls sim_run(). Bytes
+ * and connects from a client reach the server latency_ns of virtual time after
+ * they were sent, and sim_run() hands them over one at a time in the order they
+ * were sent, waiting after each for the server to settle: every session thread
+ * blocked in recv() with nothing to read, the accept loop blocked in accept(),
+ * and config.backlog() at 0. So the server sees the same events in the same
+ * order on every run, however its threads get scheduled.
+ *
+ * The server's recv() and send() move fewer bytes than they could with
+ * probability config.partial, a random amount. Every connection has its own
+ * generators, seeded from config.seed, so a run is reproduced by its seed.
+ */
+
+#define SIM_FD_BASE (1 << 24) // far past any real descriptor, a real syscall on a simulated one fails with EBADF
+#define SIM_SETTLE_TIMEOUT_MS 10000 // wall clock, a server that doesn't settle in this long is stuck
+#define SIM_SENDFILE_MAX (64 * 1024) // file bytes one sendfile() moves at most
+
+typedef struct _SimConfig {
+	uint64_t seed;
+	double partial; // chance a server recv() or send() comes up short
+	uint64_t latency_ns; // one way, the same both ways
+	size_t (*backlog)(); // work the server queued that the transport doesn't see yet, NULL for none
+} SimConfig;
+
+extern const Transport sim_transport;
+
+void sim_init(const SimConfig* config);
+int sim_listen();
+
+// THE CLIENTS' SIDE, from the driver thread
+
+int sim_connect();
+void sim_send(int client, const void* data, size_t len);
+ssize_t sim_recv(int client, void* buf, size_t len); // -1 with EAGAIN when nothing has arrived, 0 once the server closed
+void sim_close(int client);
+int sim_next_readable(); // a client something arrived for since it was last returned, -1 if none
+
+// VIRTUAL TIME
+
+uint64_t sim_now();
+void sim_run(uint64_t now);
+
+#endif
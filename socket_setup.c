@@ -4,6 +4,17 @@ void set_server_addr(char* hostname, struct sockaddr_in* serv_addr)
 {
 	memset((char*) serv_addr, 0, sizeof(*serv_addr));
 	serv_addr->sin_family = AF_INET;
-	serv_addr->sin_addr.s_addr = inet_addr(hostname);
 	serv_addr->sin_port = htons(PORT_NUM);
-}
\ No newline at end of file
+
+	// "<ip>:<port>" for a server (or a chat_proxy) that isn't on PORT_NUM
+	char host[INET_ADDRSTRLEN];
+	const char* colon = strchr(hostname, ':');
+	if (colon != NULL && (size_t) (colon - hostname) < sizeof(host)) {
+		memcpy(host, hostname, colon - hostname);
+		host[colon - hostname] = '\0';
+		serv_addr->sin_addr.s_addr = inet_addr(host);
+		serv_addr->sin_port = htons((uint16_t) atoi(colon + 1));
+	} else {
+		serv_addr->sin_addr.s_addr = inet_addr(hostname);
+	}
+}
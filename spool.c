@@ -0,0 +1,145 @@
+#define _GNU_SOURCE // for FALLOC_FL_PUNCH_HOLE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spool.h"
+#include "util.h"
+
+SPOOL* spool_head = NULL;
+uint32_t next_spool_id = 1;
+
+// creates the spool directory and clears out anything a previous run left behind
+void spool_init() {
+	if (mkdir(SPOOL_DIR, 0700) < 0 && errno != EEXIST) {
+		error("ERROR creating spool directory");
+	}
+
+	DIR* dir = opendir(SPOOL_DIR);
+	if (dir == NULL) {
+		error("ERROR opening spool directory");
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		char path[300];
+		snprintf(path, sizeof(path), "%s/%s", SPOOL_DIR, entry->d_name);
+		unlink(path);
+	}
+	closedir(dir);
+}
+
+// bytes currently spooled, in total and for one owner
+static void spool_usage(const char* owner, uint64_t* total, uint64_t* owned) {
+	*total = 0;
+	*owned = 0;
+	for (SPOOL* cur = spool_head; cur != NULL; cur = cur->next) {
+		*total += cur->live;
+		if (strncmp(cur->owner, owner, MAX_USERNAME_LEN) == 0) {
+			*owned += cur->live;
+		}
+	}
+}
+
+// makes room for a size byte upload. the disk space is allocated up front so writing to the
+// mapping can't hit a full disk (which would be a SIGBUS, not an error).
+// returns NULL with reason set if the quota is exceeded or the server can't store it
+SPOOL* spool_create(const char* owner, uint64_t size, char** reason) {
+	uint64_t total, owned;
+	spool_usage(owner, &total, &owned);
+	if (owned + size > SPOOL_USER_QUOTA || total + size > SPOOL_TOTAL_QUOTA) {
+		*reason = "spool quota exceeded";
+		return NULL;
+	}
+
+	SPOOL* spool = (SPOOL*) malloc(sizeof(SPOOL));
+	if (spool == NULL) error("ERROR allocating spool");
+	memset(spool, 0, sizeof(SPOOL));
+	spool->id = next_spool_id++;
+	spool->size = size;
+	spool->live = size;
+	spool->refs = 1;
+	strncpy(spool->owner, owner, MAX_USERNAME_LEN - 1);
+
+	// the name is only needed to create it, the file goes away with the last descriptor
+	char path[64];
+	snprintf(path, sizeof(path), "%s/%u", SPOOL_DIR, spool->id);
+	spool->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (spool->fd < 0) {
+		free(spool);
+		*reason = "server could not store the file";
+		return NULL;
+	}
+	unlink(path);
+
+	if (size > 0) {
+		if (posix_fallocate(spool->fd, 0, size) != 0) {
+			close(spool->fd);
+			free(spool);
+			*reason = "server out of disk space";
+			return NULL;
+		}
+		spool->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spool->fd, 0);
+		if (spool->map == MAP_FAILED) {
+			close(spool->fd);
+			free(spool);
+			*reason = "server could not store the file";
+			return NULL;
+		}
+		// written front to back, read front to back
+		madvise(spool->map, size, MADV_SEQUENTIAL);
+	}
+
+	spool->next = spool_head;
+	spool_head = spool;
+	return spool;
+}
+
+void spool_retain(SPOOL* spool) {
+	spool->refs++;
+}
+
+// the last reference unmaps and closes the file, which frees its disk space and quota
+void spool_release(SPOOL* spool) {
+	if (--spool->refs > 0) {
+		return;
+	}
+
+	SPOOL** link = &spool_head;
+	while (*link != spool) {
+		link = &(*link)->next;
+	}
+	*link = spool->next;
+
+	if (spool->map != NULL) {
+		munmap(spool->map, spool->size);
+	}
+	close(spool->fd);
+	free(spool);
+}
+
+// gives back the disk space of a range nothing uses any more, the rest of the file stays
+void spool_discard(SPOOL* spool, uint64_t offset, uint64_t length) {
+	if (length == 0) {
+		return;
+	}
+	fallocate(spool->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+	spool->live -= length;
+}
+
+// receives length bytes of the file at offset from the socket straight into the mapping.
+// NOTE: called without rooms_mutex held, the caller keeps a reference for the duration
+int spool_recv(SPOOL* spool, int sockfd, uint64_t offset, uint32_t length) {
+	if (offset + length > spool->size) {
+		return -1;
+	}
+	return recv_all(sockfd, spool->map + offset, length);
+}
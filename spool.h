@@ -0,0 +1,41 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdint.h>
+
+#include "handshake.h"
+
+/* Uploaded files are stored on the server before they are delivered, so a sender
+ * finishes at its own speed and receivers that are slow (or not there yet) are
+ * served later at theirs. Each upload gets a spool file for the chunks the chunk
+ * store didn't have yet (see chunk_store.h), allocated up front and mapped:
+ * chunks are received straight into the mapping and deliveries sendfile() out of
+ * the same page cache pages.
+ */
+
+#define SPOOL_DIR "spool"
+#define SPOOL_USER_QUOTA (1024ULL * 1024 * 1024) // bytes one user may have spooled at once
+#define SPOOL_TOTAL_QUOTA (4ULL * 1024 * 1024 * 1024) // bytes spooled across all users
+#define SPOOL_EXPIRY (60 * 60) // seconds a spooled file is kept after the last activity on it
+
+typedef struct _SPOOL {
+	uint32_t id;
+	int fd;
+	unsigned char* map; // whole file mapped read/write, NULL for an empty file
+	uint64_t size;
+	uint64_t live; // bytes not discarded yet, what the quota counts
+	int refs; // the chunks stored in it, plus the upload filling it and any chunk being received
+	char owner[MAX_USERNAME_LEN]; // charged for the quota
+	struct _SPOOL* next;
+} SPOOL;
+
+// NOTE: none of these lock, callers hold rooms_mutex (spool_recv only needs a reference)
+
+void spool_init();
+SPOOL* spool_create(const char* owner, uint64_t size, char** reason);
+void spool_retain(SPOOL* spool);
+void spool_release(SPOOL* spool);
+void spool_discard(SPOOL* spool, uint64_t offset, uint64_t length);
+int spool_recv(SPOOL* spool, int sockfd, uint64_t offset, uint32_t length);
+
+#endif
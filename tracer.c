@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "tracer.h"
+#include "metrics.h"
+#include "logger.h"
+#include "util.h"
+
+typedef struct _TraceState {
+	int active;
+	int fd;
+	uint64_t every;
+	uint64_t lines; // chat lines seen
+	uint64_t last_id;
+	int pid;
+	pthread_mutex_t mutex;
+	char* pending; // events waiting for the writer
+	size_t pending_len;
+	uint64_t dropped;
+} TraceState;
+
+static TraceState tracer = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+static __thread int tid;
+
+/*========================================= EVENTS ==========================================*/
+
+// an event, or several, appended whole or not at all
+static void append(const char* events, size_t len) {
+	pthread_mutex_lock(&tracer.mutex);
+	if (tracer.pending_len + len > TRACE_BUFFER_MAX) {
+		tracer.dropped++;
+	} else {
+		memcpy(tracer.pending + tracer.pending_len, events, len);
+		tracer.pending_len += len;
+	}
+	pthread_mutex_unlock(&tracer.mutex);
+}
+
+// the calling thread's id, named for the viewer the first time it has an event
+static int thread_id(const char* role) {
+	if (tid == 0) {
+		tid = (int) syscall(SYS_gettid);
+		char event[256];
+		int len = snprintf(event, sizeof(event), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+		"\"args\":{\"name\":\"%s %d\"}},\n", tracer.pid, tid, role, tid);
+		append(event, len);
+	}
+	return tid;
+}
+
+static double micros(uint64_t ns) {
+	return ns / 1e3;
+}
+
+uint64_t trace_sample() {
+	if (!tracer.active || __atomic_add_fetch(&tracer.lines, 1, __ATOMIC_RELAXED) % tracer.every != 0) {
+		return 0;
+	}
+	return __atomic_add_fetch(&tracer.last_id, 1, __ATOMIC_RELAXED);
+}
+
+void trace_message(uint64_t trace_id, uint64_t received_at, uint64_t fanout_at, int room_number, int recipients) {
+	uint64_t now = metrics_now();
+	int self = thread_id("session");
+	char events[512];
+	int len = snprintf(events, sizeof(events),
+	"{\"name\":\"message\",\"cat\":\"chat\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+	"\"args\":{\"trace\":%llu,\"room\":%d}},\n"
+	"{\"name\":\"fanout\",\"cat\":\"chat\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+	"\"args\":{\"trace\":%llu,\"recipients\":%d}},\n",
+	micros(received_at), micros(now - received_at), tracer.pid, self, (unsigned long long) trace_id, room_number,
+	micros(fanout_at), micros(now - fanout_at), tracer.pid, self, (unsigned long long) trace_id, recipients);
+	append(events, len);
+}
+
+void trace_enqueue(uint64_t trace_id, int fd, uint64_t enqueued_at) {
+	char event[256];
+	int len = snprintf(event, sizeof(event),
+	"{\"name\":\"queued\",\"cat\":\"chat\",\"ph\":\"s\",\"id\":\"%llu.%d\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d},\n",
+	(unsigned long long) trace_id, fd, micros(enqueued_at), tracer.pid, thread_id("session"));
+	append(event, len);
+}
+
+void trace_write(uint64_t trace_id, int fd, uint64_t enqueued_at, uint64_t write_at) {
+	uint64_t now = metrics_now();
+	int self = thread_id("writer");
+	char events[512];
+	int len = snprintf(events, sizeof(events),
+	"{\"name\":\"write\",\"cat\":\"chat\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+	"\"args\":{\"trace\":%llu,\"fd\":%d,\"queued_us\":%.3f}},\n"
+	"{\"name\":\"queued\",\"cat\":\"chat\",\"ph\":\"f\",\"bp\":\"e\",\"id\":\"%llu.%d\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d},\n",
+	micros(write_at), micros(now - write_at), tracer.pid, self, (unsigned long long) trace_id, fd,
+	micros(write_at - enqueued_at), (unsigned long long) trace_id, fd, micros(write_at), tracer.pid, self);
+	append(events, len);
+}
+
+/*========================================= WRITER ==========================================*/
+
+static void* trace_writer(void* args) {
+	(void) args;
+	name_thread("tracer");
+	char* out = (char*) malloc(TRACE_BUFFER_MAX);
+	if (out == NULL) error("ERROR allocating trace buffer");
+	uint64_t reported = 0;
+
+	while (1) {
+		struct timespec nap = { 0, TRACE_FLUSH_MS * 1000000L };
+		nanosleep(&nap, NULL);
+
+		// take what there is, the threads fill the other buffer meanwhile
+		pthread_mutex_lock(&tracer.mutex);
+		char* full = tracer.pending;
+		size_t len = tracer.pending_len;
+		tracer.pending = out;
+		tracer.pending_len = 0;
+		uint64_t dropped = tracer.dropped;
+		pthread_mutex_unlock(&tracer.mutex);
+		out = full;
+
+		size_t written = 0;
+		while (written < len) {
+			ssize_t n = write(tracer.fd, out + written, len - written);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				LOG_ERROR("ERROR writing trace: %s", strerror(errno));
+				break;
+			}
+			written += n;
+		}
+		if (dropped > reported) {
+			LOG_WARN("Trace: %llu events dropped, the disk is behind", (unsigned long long) (dropped - reported));
+			reported = dropped;
+		}
+	}
+
+	return NULL;
+}
+
+void tracer_start(const char* spec) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s", spec);
+	tracer.every = TRACE_SAMPLE_EVERY;
+	char* every = strrchr(path, ':');
+	if (every != NULL) {
+		*every = '\0';
+		tracer.every = strtoull(every + 1, NULL, 10);
+		if (tracer.every == 0) {
+			tracer.every = 1;
+		}
+	}
+
+	tracer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (tracer.fd < 0) error("ERROR opening trace file");
+	if (write(tracer.fd, "[\n", 2) != 2) error("ERROR writing trace file");
+	tracer.pid = (int) getpid();
+	tracer.pending = (char*) malloc(TRACE_BUFFER_MAX);
+	if (tracer.pending == NULL) error("ERROR allocating trace buffer");
+
+	pthread_t writer_tid;
+	if (pthread_create(&writer_tid, NULL, trace_writer, NULL) != 0) {
+		error("ERROR creating trace writer thread");
+	}
+	pthread_detach(writer_tid);
+	tracer.active = 1;
+}
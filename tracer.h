@@ -0,0 +1,40 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <stdint.h>
+
+/* Message tracing (main_server -T <file>[:every]): one chat line in every
+ * `every` gets a trace id when it is read, and its way through the server is
+ * written to file as Chrome trace events (load it in chrome://tracing or
+ * Perfetto). The session thread that read it gets a "message" slice from the
+ * recv() to the end of its broadcast, with the time spent queueing it for the
+ * room as a "fanout" slice inside. Each recipient's writer thread gets a "write"
+ * slice for the send(), and a flow arrow runs from where the line was queued for
+ * that recipient to it, so the arrow's length is the time it sat in the queue.
+ *
+ * Timestamps are metrics_now()'s. Events are formatted by the thread that has
+ * them and appended to a shared buffer; a background thread writes it out. When
+ * the disk falls TRACE_BUFFER_MAX behind, events are dropped. The file is a JSON
+ * array that is never closed, which the trace viewers accept.
+ */
+
+#define TRACE_SAMPLE_EVERY 100 // default 1 in this many chat lines
+#define TRACE_BUFFER_MAX (4 * 1024 * 1024) // bytes of events waiting for the disk
+#define TRACE_FLUSH_MS 100
+
+// starts tracing into spec, "path" or "path:every". call before the first accept()
+void tracer_start(const char* spec);
+
+// a trace id for a chat line just read, 0 when it isn't sampled
+uint64_t trace_sample();
+
+// the session thread's slices: the line was read at received_at, queueing it for its recipients began at fanout_at
+void trace_message(uint64_t trace_id, uint64_t received_at, uint64_t fanout_at, int room_number, int recipients);
+
+// it was queued for the client on fd at enqueued_at
+void trace_enqueue(uint64_t trace_id, int fd, uint64_t enqueued_at);
+
+// the writer of fd wrote it from write_at to now
+void trace_write(uint64_t trace_id, int fd, uint64_t enqueued_at, uint64_t write_at);
+
+#endif
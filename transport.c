@@ -0,0 +1,16 @@
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+#include "transport.h"
+
+const Transport tcp_transport = {
+	.accept = accept,
+	.recv = recv,
+	.send = send,
+	.sendfile = sendfile,
+	.getpeername = getpeername,
+	.shutdown = shutdown,
+	.close = close,
+};
+
+const Transport* transport = &tcp_transport;
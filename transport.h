@@ -0,0 +1,32 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* The socket calls the server makes on its client connections, behind a table
+ * of functions so the same server code can run over something other than the
+ * kernel's TCP. tcp_transport is the real thing. sim_transport.h has an
+ * in-process one where the clients are virtual.
+ *
+ * A descriptor is whatever the transport's accept() handed out, the server only
+ * ever passes it back. send_all()/recv_all() in util.c go through here too, so
+ * everything framed on a client connection does.
+ */
+
+typedef struct _Transport {
+	int (*accept)(int listenfd, struct sockaddr* addr, socklen_t* addrlen);
+	ssize_t (*recv)(int fd, void* buf, size_t len, int flags);
+	ssize_t (*send)(int fd, const void* buf, size_t len, int flags);
+	ssize_t (*sendfile)(int fd, int filefd, off_t* offset, size_t count);
+	int (*getpeername)(int fd, struct sockaddr* addr, socklen_t* addrlen);
+	int (*shutdown)(int fd, int how);
+	int (*close)(int fd);
+} Transport;
+
+extern const Transport tcp_transport;
+
+// what the server uses, tcp_transport unless it is switched before the first connection
+extern const Transport* transport;
+
+#endif
@@ -1,4 +1,10 @@
 #include "util.h"
+#include "transport.h"
+
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <errno.h>
 
 
 /* NOTE: The username is modified in place and the char * just gets moved
@@ -32,6 +38,30 @@ char* trim_whitespace(char *str_start) {
     return str_start;
 }
 
+// NOTE: only used on typed input now, incoming offers arrive as FRAME_FILE_OFFER
+int is_filetransfer(char* buffer) {
+	// create copy of message in buffer (needed for strtok_r)
+	char message[LINE_BUFFER_SIZE];
+	strncpy(message, buffer, LINE_BUFFER_SIZE);
+	message[LINE_BUFFER_SIZE - 1] = '\0';
+
+	// determine if first token in message is "SEND"
+	char* saveptr;
+	char* send_token = strtok_r(message, " ", &saveptr);
+	// if there are no more tokens, return false (0)
+	if (send_token == NULL) {
+		return 0;
+	}
+	// if yes, return true (1)
+	else if (strcmp(send_token, "SEND") == 0) {
+		return 1;
+	}
+	// if no, return false (0)
+	else {
+		return 0;
+	}
+}
+
 // checks if a string is a number
 int is_number(char* str) {
 	for (size_t i = 0; i < strlen(str); i++) {
@@ -50,6 +80,59 @@ void error(const char *msg)
 	exit(EXIT_FAILURE);
 }
 
+void name_thread(const char* name) {
+	prctl(PR_SET_NAME, name, 0, 0, 0);
+}
+
+
+// fills dest with len bytes from the kernel CSPRNG (used for session tokens)
+int fill_random_bytes(unsigned char* dest, size_t len) {
+	size_t filled = 0;
+	while (filled < len) {
+		ssize_t n = getrandom(dest + filled, len - filled, 0);
+		if (n < 0) {
+			return -1;
+		}
+		filled += n;
+	}
+	return 0;
+}
+
+
+// keeps calling send() until all len bytes are out. returns 0, or -1 if the peer is gone
+int send_all(int sockfd, const void* data, size_t len, int flags) {
+	const unsigned char* cur = (const unsigned char*) data;
+	while (len > 0) {
+		ssize_t n = transport->send(sockfd, cur, len, flags | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		cur += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// keeps calling recv() until all len bytes are in. returns 0, or -1 on error or orderly shutdown
+int recv_all(int sockfd, void* data, size_t len) {
+	unsigned char* cur = (unsigned char*) data;
+	while (len > 0) {
+		ssize_t n = transport->recv(sockfd, cur, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		cur += n;
+		len -= n;
+	}
+	return 0;
+}
+
 
 void print_hex(const unsigned char* buffer, size_t len) {
 	for (size_t i = 0; i < len; i++) {
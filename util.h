@@ -16,13 +16,23 @@ typedef struct _Buffer {
 } Buffer;
 
 
+#define LINE_BUFFER_SIZE 512 // longest typed line is_filetransfer() looks at
+
 char* trim_whitespace(char *str);
 int is_number(char* str);
+int is_filetransfer(char* buffer);
 
 void error(const char *msg);
+// the calling thread's name in /proc, ps and top, cut to 15 characters
+void name_thread(const char* name);
 void print_server_addr(struct sockaddr_in* serv_addr);
 void print_hex(const unsigned char* buffer, size_t len);
 
+int fill_random_bytes(unsigned char* dest, size_t len);
+
+int send_all(int sockfd, const void* data, size_t len, int flags);
+int recv_all(int sockfd, void* data, size_t len);
+
 void init_buffer(Buffer* buffer, size_t size);
 void cleanup_buffer(Buffer* buffer);
 